@@ -27,6 +27,12 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <poll.h>
+#endif
+#include <zlib.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #endif
 #include "config.h"
 #include "monitor.h"
@@ -41,6 +47,12 @@
 #include "net.h"
 #include "gdbstub.h"
 #include "hw/smbios.h"
+#include "qemu-thread.h"
+#include "qemu-char.h"
+#include "qemu-error.h"
+#include "xbzrle.h"
+#include "page_cache.h"
+#include "qemu_socket.h"
 
 #ifdef TARGET_SPARC
 int graphic_width = 1024;
@@ -89,6 +101,10 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_PAGE     0x08
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x40
+#define RAM_SAVE_FLAG_XBZRLE   0x80
+#define RAM_SAVE_FLAG_POSTCOPY 0x100
+#define RAM_SAVE_FLAG_STREAMS  0x200
 
 static int is_dup_page(uint8_t *page, uint8_t ch)
 {
@@ -96,6 +112,11 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
     uint32_t *array = (uint32_t *)page;
     int i;
 
+    /* zero pages are by far the most common duplicate pages */
+    if (ch == 0) {
+        return buffer_is_zero(page, TARGET_PAGE_SIZE);
+    }
+
     for (i = 0; i < (TARGET_PAGE_SIZE / 4); i++) {
         if (array[i] != val) {
             return 0;
@@ -107,287 +128,1788 @@ static int is_dup_page(uint8_t *page, uint8_t ch)
 
 static RAMBlock *last_block;
 static ram_addr_t last_offset;
+static RAMBlock *last_sent_block;
+static uint64_t bytes_transferred;
+static int ram_postcopy;
+static uint64_t postcopy_requested, postcopy_pushed;
 
-static int ram_save_block(QEMUFile *f)
+/* Starts the record of a page, naming the block unless it was the last one */
+static void ram_save_page_header(QEMUFile *f, RAMBlock *block,
+                                 ram_addr_t offset, int flags)
 {
-    RAMBlock *block = last_block;
-    ram_addr_t offset = last_offset;
-    ram_addr_t current_addr;
-    int bytes_sent = 0;
-
-    if (!block)
-        block = QLIST_FIRST(&ram_list.blocks);
-
-    current_addr = block->offset + offset;
-
-    do {
-        if (cpu_physical_memory_get_dirty(current_addr, MIGRATION_DIRTY_FLAG)) {
-            uint8_t *p;
-            int cont = (block == last_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    if (block == last_sent_block) {
+        flags |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    qemu_put_be64(f, offset | flags);
+    if (block != last_sent_block) {
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        last_sent_block = block;
+    }
+}
 
-            cpu_physical_memory_reset_dirty(current_addr,
-                                            current_addr + TARGET_PAGE_SIZE,
-                                            MIGRATION_DIRTY_FLAG);
+/*
+ * Page compression.  The migration thread keeps scanning for dirty pages
+ * and hands a copy of each one to an idle compression thread; it writes
+ * the compressed pages to the stream itself, whatever their order, as
+ * each record names its own page.
+ */
 
-            p = block->host + offset;
+enum {
+    COMPRESS_IDLE,
+    COMPRESS_BUSY,              /* owned by its compression thread */
+    COMPRESS_DONE,              /* waiting to be written out */
+};
 
-            if (is_dup_page(p, *p)) {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_COMPRESS);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_byte(f, *p);
-                bytes_sent = 1;
-            } else {
-                qemu_put_be64(f, offset | cont | RAM_SAVE_FLAG_PAGE);
-                if (!cont) {
-                    qemu_put_byte(f, strlen(block->idstr));
-                    qemu_put_buffer(f, (uint8_t *)block->idstr,
-                                    strlen(block->idstr));
-                }
-                qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
-                bytes_sent = TARGET_PAGE_SIZE;
-            }
+typedef struct CompressParam {
+    QemuThread thread;
+    int state;
+    RAMBlock *block;
+    ram_addr_t offset;
+    uint8_t page[TARGET_PAGE_SIZE];
+    uint8_t *out;
+    unsigned long out_len;      /* 0 if the page didn't compress */
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_threads;
+static int comp_level;
+static int comp_quit;
+static QemuMutex comp_lock;
+static QemuCond comp_cond;      /* work for the compression threads */
+static QemuCond comp_done_cond; /* a page has been compressed */
+
+/* totals, and the same for the last call of ram_save_live; comp_pages
+   only counts the pages that went out compressed */
+static uint64_t comp_pages, comp_bytes_in, comp_bytes_out;
+static uint64_t comp_iter_in, comp_iter_out, comp_iter_ns;
+
+static void *compress_thread(void *opaque)
+{
+    CompressParam *param = opaque;
+    uLongf len;
 
+    qemu_mutex_lock(&comp_lock);
+    for (;;) {
+        while (param->state != COMPRESS_BUSY && !comp_quit) {
+            qemu_cond_wait(&comp_cond, &comp_lock);
+        }
+        if (comp_quit) {
             break;
         }
+        qemu_mutex_unlock(&comp_lock);
 
-        offset += TARGET_PAGE_SIZE;
-        if (offset >= block->length) {
-            offset = 0;
-            block = QLIST_NEXT(block, next);
-            if (!block)
-                block = QLIST_FIRST(&ram_list.blocks);
+        len = compressBound(TARGET_PAGE_SIZE);
+        if (compress2(param->out, &len, param->page, TARGET_PAGE_SIZE,
+                      comp_level) != Z_OK || len >= TARGET_PAGE_SIZE) {
+            len = 0;
         }
 
-        current_addr = block->offset + offset;
+        qemu_mutex_lock(&comp_lock);
+        param->out_len = len;
+        param->state = COMPRESS_DONE;
+        qemu_cond_signal(&comp_done_cond);
+    }
+    qemu_mutex_unlock(&comp_lock);
+    return NULL;
+}
+
+static void compress_threads_start(void)
+{
+    int i;
+
+    comp_threads = migrate_compress_threads();
+    comp_level = migrate_compress_level();
+    if (!comp_threads) {
+        return;
+    }
 
-    } while (current_addr != last_block->offset + last_offset);
+    comp_quit = 0;
+    qemu_mutex_init(&comp_lock);
+    qemu_cond_init(&comp_cond);
+    qemu_cond_init(&comp_done_cond);
+    comp_param = qemu_mallocz(comp_threads * sizeof(*comp_param));
+    for (i = 0; i < comp_threads; i++) {
+        comp_param[i].out = qemu_malloc(compressBound(TARGET_PAGE_SIZE));
+        qemu_thread_create(&comp_param[i].thread, compress_thread,
+                           &comp_param[i]);
+    }
+}
 
-    last_block = block;
-    last_offset = offset;
+/* Pages that are still being compressed are dropped */
+static void compress_threads_stop(void)
+{
+    int i;
+
+    if (!comp_threads) {
+        return;
+    }
+
+    qemu_mutex_lock(&comp_lock);
+    comp_quit = 1;
+    qemu_cond_broadcast(&comp_cond);
+    qemu_mutex_unlock(&comp_lock);
 
-    return bytes_sent;
+    for (i = 0; i < comp_threads; i++) {
+        qemu_thread_join(&comp_param[i].thread);
+        qemu_free(comp_param[i].out);
+    }
+    qemu_free(comp_param);
+    comp_param = NULL;
+    qemu_cond_destroy(&comp_done_cond);
+    qemu_cond_destroy(&comp_cond);
+    qemu_mutex_destroy(&comp_lock);
+    comp_threads = 0;
 }
 
-static uint64_t bytes_transferred;
+/* Writes out a compressed page, or the copy if it didn't compress */
+static void compress_put_page(QEMUFile *f, CompressParam *param)
+{
+    int bytes;
+
+    if (param->out_len) {
+        ram_save_page_header(f, param->block, param->offset,
+                             RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->out_len);
+        qemu_put_buffer(f, param->out, param->out_len);
+        bytes = param->out_len + 4;
+        comp_pages++;
+    } else {
+        ram_save_page_header(f, param->block, param->offset,
+                             RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, param->page, TARGET_PAGE_SIZE);
+        bytes = TARGET_PAGE_SIZE;
+    }
 
-static ram_addr_t ram_save_remaining(void)
+    bytes_transferred += bytes;
+    comp_bytes_in += TARGET_PAGE_SIZE;
+    comp_bytes_out += bytes;
+}
+
+/* Hands a copy of src to the first compression thread that is free */
+static void compress_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                          const uint8_t *src)
 {
-    RAMBlock *block;
-    ram_addr_t count = 0;
+    CompressParam *param = NULL;
+    int i;
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ram_addr_t addr;
-        for (addr = block->offset; addr < block->offset + block->length;
-             addr += TARGET_PAGE_SIZE) {
-            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
-                count++;
+    qemu_mutex_lock(&comp_lock);
+    while (!param) {
+        for (i = 0; i < comp_threads; i++) {
+            if (comp_param[i].state != COMPRESS_BUSY) {
+                param = &comp_param[i];
+                break;
             }
         }
+        if (!param) {
+            qemu_cond_wait(&comp_done_cond, &comp_lock);
+        }
     }
+    qemu_mutex_unlock(&comp_lock);
 
-    return count;
+    if (param->state == COMPRESS_DONE) {
+        compress_put_page(f, param);
+    }
+    param->block = block;
+    param->offset = offset;
+    memcpy(param->page, src, TARGET_PAGE_SIZE);
+
+    qemu_mutex_lock(&comp_lock);
+    param->state = COMPRESS_BUSY;
+    qemu_cond_broadcast(&comp_cond);
+    qemu_mutex_unlock(&comp_lock);
 }
 
-uint64_t ram_bytes_remaining(void)
+/* Waits for a page being compressed and writes it out */
+static void compress_flush_param(QEMUFile *f, CompressParam *param)
 {
-    return ram_save_remaining() * TARGET_PAGE_SIZE;
+    qemu_mutex_lock(&comp_lock);
+    while (param->state == COMPRESS_BUSY) {
+        qemu_cond_wait(&comp_done_cond, &comp_lock);
+    }
+    qemu_mutex_unlock(&comp_lock);
+
+    if (param->state == COMPRESS_DONE) {
+        compress_put_page(f, param);
+        param->state = COMPRESS_IDLE;
+    }
 }
 
-uint64_t ram_bytes_transferred(void)
+static void compress_flush(QEMUFile *f)
 {
-    return bytes_transferred;
+    int i;
+
+    for (i = 0; i < comp_threads; i++) {
+        compress_flush_param(f, &comp_param[i]);
+    }
 }
 
-uint64_t ram_bytes_total(void)
+/*
+ * An older copy of a page that is sent again must be in the stream
+ * first, or it would overwrite the new one on the destination.
+ */
+static void compress_flush_page(QEMUFile *f, RAMBlock *block,
+                                ram_addr_t offset)
 {
-    RAMBlock *block;
-    uint64_t total = 0;
-
-    QLIST_FOREACH(block, &ram_list.blocks, next)
-        total += block->length;
+    int i;
 
-    return total;
+    for (i = 0; i < comp_threads; i++) {
+        if (comp_param[i].state != COMPRESS_IDLE &&
+            comp_param[i].block == block && comp_param[i].offset == offset) {
+            compress_flush_param(f, &comp_param[i]);
+        }
+    }
 }
 
-static int block_compar(const void *a, const void *b)
+void ram_compress_stats(uint64_t *pages, uint64_t *ratio,
+                        uint64_t *throughput)
 {
-    RAMBlock * const *ablock = a;
-    RAMBlock * const *bblock = b;
-    if ((*ablock)->offset < (*bblock)->offset) {
-        return -1;
-    } else if ((*ablock)->offset > (*bblock)->offset) {
-        return 1;
-    }
-    return 0;
+    *pages = comp_pages;
+    *ratio = comp_iter_in ? comp_iter_out * 100 / comp_iter_in : 0;
+    *throughput = comp_iter_ns ? comp_iter_in * 1000000000 / comp_iter_ns : 0;
 }
 
-static void sort_ram_list(void)
+/*
+ * Delta encoding.  The last copy sent of recently sent pages is kept in an
+ * LRU cache; a page found there is sent as its differences with that copy
+ * if they are small enough.  The page is copied first, so that the cache
+ * holds exactly what was sent while the guest keeps writing to it.
+ */
+
+#define XBZRLE_MAX_LEN (TARGET_PAGE_SIZE * 3 / 4)
+
+static PageCache *xbzrle_cache;
+static uint8_t *xbzrle_page;        /* copy of the page being sent */
+static uint8_t *xbzrle_buf;         /* its encoding */
+static uint64_t xbzrle_pages, xbzrle_hits, xbzrle_misses, xbzrle_overflows;
+static uint64_t xbzrle_saved;
+
+static void xbzrle_start(void)
 {
-    RAMBlock *block, *nblock, **blocks;
-    int n;
-    n = 0;
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        ++n;
-    }
-    blocks = qemu_malloc(n * sizeof *blocks);
-    n = 0;
-    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
-        blocks[n++] = block;
-        QLIST_REMOVE(block, next);
+    int64_t pages = migrate_xbzrle_cache_size() / TARGET_PAGE_SIZE;
+
+    xbzrle_pages = xbzrle_hits = xbzrle_misses = xbzrle_overflows = 0;
+    xbzrle_saved = 0;
+    if (!pages) {
+        return;
     }
-    qsort(blocks, n, sizeof *blocks, block_compar);
-    while (--n >= 0) {
-        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+
+    xbzrle_cache = cache_init(pages, TARGET_PAGE_SIZE);
+    if (!xbzrle_cache) {
+        fprintf(stderr, "Can't allocate the page cache, "
+                "pages won't be delta encoded\n");
+        return;
     }
-    qemu_free(blocks);
+    xbzrle_page = qemu_malloc(TARGET_PAGE_SIZE);
+    xbzrle_buf = qemu_malloc(XBZRLE_MAX_LEN);
 }
 
-int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+static void xbzrle_stop(void)
 {
-    ram_addr_t addr;
-    uint64_t bytes_transferred_last;
-    double bwidth = 0;
-    uint64_t expected_time = 0;
+    cache_fini(xbzrle_cache);
+    xbzrle_cache = NULL;
+    qemu_free(xbzrle_page);
+    xbzrle_page = NULL;
+    qemu_free(xbzrle_buf);
+    xbzrle_buf = NULL;
+}
 
-    if (stage < 0) {
-        cpu_physical_memory_set_dirty_tracking(0);
+/*
+ * Sends the copy of a page in xbzrle_page as a delta, or nothing at all if
+ * it didn't change.  Returns 0 if it must be sent in full, the cache
+ * having been updated either way.
+ */
+static int xbzrle_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    uint64_t addr = block->offset + offset;
+    uint8_t *old;
+    int len;
+
+    old = cache_get(xbzrle_cache, addr);
+    if (!old) {
+        xbzrle_misses++;
+        memcpy(cache_insert(xbzrle_cache, addr), xbzrle_page,
+               TARGET_PAGE_SIZE);
         return 0;
     }
 
-    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
-        qemu_file_set_error(f);
+    xbzrle_hits++;
+    len = xbzrle_encode(old, xbzrle_page, TARGET_PAGE_SIZE, xbzrle_buf,
+                        XBZRLE_MAX_LEN);
+    memcpy(old, xbzrle_page, TARGET_PAGE_SIZE);
+    if (len < 0) {
+        xbzrle_overflows++;
         return 0;
     }
 
-    if (stage == 1) {
+    if (len > 0) {
+        ram_save_page_header(f, block, offset, RAM_SAVE_FLAG_XBZRLE);
+        qemu_put_be32(f, len);
+        qemu_put_buffer(f, xbzrle_buf, len);
+        bytes_transferred += len + 4;
+        xbzrle_saved += TARGET_PAGE_SIZE - len - 4;
+    } else {
+        xbzrle_saved += TARGET_PAGE_SIZE;
+    }
+    xbzrle_pages++;
+    return 1;
+}
+
+void ram_xbzrle_stats(uint64_t *pages, uint64_t *hits, uint64_t *misses,
+                      uint64_t *overflows, uint64_t *saved)
+{
+    *pages = xbzrle_pages;
+    *hits = xbzrle_hits;
+    *misses = xbzrle_misses;
+    *overflows = xbzrle_overflows;
+    *saved = xbzrle_saved;
+}
+
+/*
+ * Parallel streams.  The pages can go over more connections of their own,
+ * each with a thread that reads the pages from guest memory and writes
+ * them out, the migration stream only keeping the rest.  Guest memory is
+ * cut in chunks that each belong to one stream, so that the copies of a
+ * page arrive in the order they were sent.  The bandwidth limit is shared
+ * evenly between the streams.
+ *
+ * A stream starts with its index as a be32, then carries page records
+ * like the migration stream, and ends with RAM_SAVE_FLAG_EOS after the
+ * last stage.  In the migration stream, RAM_SAVE_FLAG_STREAMS followed by
+ * the number of streams as a be32 announces them in the first stage, and
+ * followed by 0 marks the point where they have all ended.
+ */
+
+#define STREAM_CHUNK_BITS   20              /* 1 MB of guest memory */
+#define STREAM_QUEUE_LEN    256             /* pages */
+#define STREAM_BUF_SIZE     (64 * 1024)
+#define STREAM_SLICE_NS     (100 * 1000 * 1000)
+
+enum {
+    STREAMS_RUN,
+    STREAMS_END,                /* send what is queued, then EOS */
+    STREAMS_ABORT,
+};
+
+typedef struct RamStream {
+    QemuThread thread;
+    QemuCond cond;              /* pages queued, or the end */
+    int index;
+    int fd;
+    struct {
         RAMBlock *block;
-        bytes_transferred = 0;
-        last_block = NULL;
-        last_offset = 0;
-        sort_ram_list();
+        ram_addr_t offset;
+    } queue[STREAM_QUEUE_LEN];
+    int head, count;
+    RAMBlock *last_block;       /* named last on this stream */
+    uint8_t *buf;               /* records not written yet */
+    int buf_len;
+    int64_t slice_start;
+    int64_t slice_bytes;
+} RamStream;
+
+static RamStream *streams;
+static int nb_streams;
+static int streams_state;
+static int streams_error;
+static int64_t streams_rate;    /* bytes per stream and slice, 0 for none */
+static int64_t streams_budget;  /* bytes that may still be queued */
+static int64_t streams_budget_time;
+static QemuMutex streams_lock;
+static QemuCond streams_space_cond;
+static struct sockaddr_storage streams_addr;
+static int streams_addrlen;
+static int streams_abort_fds[2];    /* readable once the streams abort */
+
+static RamStream *ram_stream_of(RAMBlock *block, ram_addr_t offset)
+{
+    return &streams[((block->offset + offset) >> STREAM_CHUNK_BITS) %
+                    nb_streams];
+}
 
-        /* Make sure all dirty bits are set */
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            for (addr = block->offset; addr < block->offset + block->length;
-                 addr += TARGET_PAGE_SIZE) {
-                if (!cpu_physical_memory_get_dirty(addr,
-                                                   MIGRATION_DIRTY_FLAG)) {
-                    cpu_physical_memory_set_dirty(addr);
-                }
-            }
+static int ram_stream_flush(RamStream *st)
+{
+    int64_t now;
+    ssize_t ret;
+    int done;
+
+    if (streams_rate) {
+        now = qemu_get_clock_ns(rt_clock);
+        if (now >= st->slice_start + STREAM_SLICE_NS) {
+            st->slice_start = now;
+            st->slice_bytes = 0;
+        } else if (st->slice_bytes >= streams_rate) {
+            struct timespec ts;
+
+            ts.tv_sec = 0;
+            ts.tv_nsec = st->slice_start + STREAM_SLICE_NS - now;
+            nanosleep(&ts, NULL);
+            st->slice_start += STREAM_SLICE_NS;
+            st->slice_bytes = 0;
         }
+    }
 
-        /* Enable dirty memory tracking */
-        cpu_physical_memory_set_dirty_tracking(1);
+    for (done = 0; done < st->buf_len; done += ret) {
+        ret = send(st->fd, st->buf + done, st->buf_len - done, 0);
+        if (ret == -1 && socket_error() == EINTR) {
+            ret = 0;
+        } else if (ret <= 0) {
+            return -1;
+        }
+    }
 
-        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+    __sync_fetch_and_add(&bytes_transferred, st->buf_len);
+    st->slice_bytes += st->buf_len;
+    st->buf_len = 0;
+    return 0;
+}
 
-        QLIST_FOREACH(block, &ram_list.blocks, next) {
-            qemu_put_byte(f, strlen(block->idstr));
-            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
-            qemu_put_be64(f, block->length);
-        }
+static int ram_stream_put(RamStream *st, const void *data, int len)
+{
+    if (st->buf_len + len > STREAM_BUF_SIZE && ram_stream_flush(st) < 0) {
+        return -1;
     }
+    memcpy(st->buf + st->buf_len, data, len);
+    st->buf_len += len;
+    return 0;
+}
 
-    bytes_transferred_last = bytes_transferred;
-    bwidth = qemu_get_clock_ns(rt_clock);
+static int ram_stream_put_be64(RamStream *st, uint64_t v)
+{
+    uint8_t buf[8];
 
-    while (!qemu_file_rate_limit(f)) {
-        int bytes_sent;
+    stq_be_p(buf, v);
+    return ram_stream_put(st, buf, sizeof(buf));
+}
 
-        bytes_sent = ram_save_block(f);
-        bytes_transferred += bytes_sent;
-        if (bytes_sent == 0) { /* no more blocks */
-            break;
+/* Same records as ram_save_page, without compression or delta encoding */
+static int ram_stream_put_page(RamStream *st, RAMBlock *block,
+                               ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+    int flags = is_dup_page(p, *p) ? RAM_SAVE_FLAG_COMPRESS :
+                                     RAM_SAVE_FLAG_PAGE;
+    uint8_t len = strlen(block->idstr);
+
+    if (block == st->last_block) {
+        flags |= RAM_SAVE_FLAG_CONTINUE;
+    }
+    if (ram_stream_put_be64(st, offset | flags) < 0) {
+        return -1;
+    }
+    if (block != st->last_block) {
+        if (ram_stream_put(st, &len, 1) < 0 ||
+            ram_stream_put(st, block->idstr, len) < 0) {
+            return -1;
         }
+        st->last_block = block;
     }
 
-    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
-    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
-
-    /* if we haven't transferred anything this round, force expected_time to a
-     * a very high value, but without crashing */
-    if (bwidth == 0) {
-        bwidth = 0.000001;
+    if (flags & RAM_SAVE_FLAG_COMPRESS) {
+        return ram_stream_put(st, p, 1);
     }
+    return ram_stream_put(st, p, TARGET_PAGE_SIZE);
+}
 
-    /* try transferring iterative blocks of memory */
-    if (stage == 3) {
-        int bytes_sent;
+/*
+ * Connects without blocking, so that ram_streams_stop can abort through
+ * streams_abort_fds while the destination doesn't answer.
+ */
+static int ram_stream_connect(RamStream *st)
+{
+    struct pollfd pfd[2];
+    uint8_t buf[4];
+    socklen_t len;
+    int fd, ret, err;
 
-        /* flush all remaining blocks regardless of rate limiting */
-        while ((bytes_sent = ram_save_block(f)) != 0) {
-            bytes_transferred += bytes_sent;
+    fd = qemu_socket(streams_addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1) {
+        return -1;
+    }
+    socket_set_nonblock(fd);
+    do {
+        ret = connect(fd, (struct sockaddr *)&streams_addr, streams_addrlen);
+    } while (ret == -1 && socket_error() == EINTR);
+
+    if (ret == -1 && socket_error() == EINPROGRESS) {
+        pfd[0].fd = fd;
+        pfd[0].events = POLLOUT;
+        pfd[1].fd = streams_abort_fds[0];
+        pfd[1].events = POLLIN;
+        do {
+            ret = poll(pfd, 2, -1);
+        } while (ret == -1 && errno == EINTR);
+
+        len = sizeof(err);
+        if (ret > 0 && !pfd[1].revents &&
+            getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) == 0 &&
+            err == 0) {
+            ret = 0;
+        } else {
+            ret = -1;
         }
-        cpu_physical_memory_set_dirty_tracking(0);
     }
+    if (ret == -1) {
+        closesocket(fd);
+        return -1;
+    }
+    /* the thread blocks in send, shutdown wakes it up */
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
 
-    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
-
-    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+    qemu_mutex_lock(&streams_lock);
+    st->fd = fd;
+    if (streams_state == STREAMS_ABORT) {
+        shutdown(fd, SHUT_RDWR);
+    }
+    qemu_mutex_unlock(&streams_lock);
 
-    return (stage == 2) && (expected_time <= migrate_max_downtime());
+    stl_be_p(buf, st->index);
+    return ram_stream_put(st, buf, sizeof(buf));
 }
 
-static inline void *host_from_stream_offset(QEMUFile *f,
-                                            ram_addr_t offset,
-                                            int flags)
+static void *ram_stream_thread(void *opaque)
 {
-    static RAMBlock *block = NULL;
-    char id[256];
-    uint8_t len;
+    RamStream *st = opaque;
+    RAMBlock *block;
+    ram_addr_t offset;
+    int ret;
 
-    if (flags & RAM_SAVE_FLAG_CONTINUE) {
-        if (!block) {
-            fprintf(stderr, "Ack, bad migration stream!\n");
-            return NULL;
+    ret = ram_stream_connect(st);
+
+    qemu_mutex_lock(&streams_lock);
+    while (ret == 0) {
+        if (!st->count && st->buf_len && streams_state == STREAMS_RUN) {
+            /* nothing else to send for now */
+            qemu_mutex_unlock(&streams_lock);
+            ret = ram_stream_flush(st);
+            qemu_mutex_lock(&streams_lock);
+            continue;
+        }
+        while (!st->count && streams_state == STREAMS_RUN) {
+            qemu_cond_wait(&st->cond, &streams_lock);
+        }
+        if (streams_state == STREAMS_ABORT || !st->count) {
+            break;
         }
 
-        return block->host + offset;
-    }
+        block = st->queue[st->head].block;
+        offset = st->queue[st->head].offset;
+        st->head = (st->head + 1) % STREAM_QUEUE_LEN;
+        st->count--;
+        qemu_cond_signal(&streams_space_cond);
+        qemu_mutex_unlock(&streams_lock);
 
-    len = qemu_get_byte(f);
-    qemu_get_buffer(f, (uint8_t *)id, len);
-    id[len] = 0;
+        ret = ram_stream_put_page(st, block, offset);
 
-    QLIST_FOREACH(block, &ram_list.blocks, next) {
-        if (!strncmp(id, block->idstr, sizeof(id)))
-            return block->host + offset;
+        qemu_mutex_lock(&streams_lock);
     }
 
-    fprintf(stderr, "Can't find block %s!\n", id);
+    if (ret == 0 && streams_state == STREAMS_END) {
+        qemu_mutex_unlock(&streams_lock);
+        ret = ram_stream_put_be64(st, RAM_SAVE_FLAG_EOS);
+        if (ret == 0) {
+            ret = ram_stream_flush(st);
+        }
+        qemu_mutex_lock(&streams_lock);
+    }
+    if (ret < 0) {
+        streams_error = 1;
+        qemu_cond_signal(&streams_space_cond);
+    }
+    qemu_mutex_unlock(&streams_lock);
     return NULL;
 }
 
-int ram_load(QEMUFile *f, void *opaque, int version_id)
+/*
+ * Opens the streams if more than one is wanted and the migration goes
+ * over a socket.  Returns the number of streams, 0 for none.
+ */
+static int ram_streams_start(QEMUFile *f)
 {
-    ram_addr_t addr;
-    int flags;
+    int n = migrate_streams();
+    int i;
 
-    if (version_id < 3 || version_id > 4) {
-        return -EINVAL;
+    nb_streams = 0;
+    streams_error = 0;
+    if (n <= 1) {
+        return 0;
     }
 
-    do {
-        addr = qemu_get_be64(f);
+    streams_addrlen = sizeof(streams_addr);
+    if (migrate_stream_address(f, &streams_addr, &streams_addrlen) < 0) {
+        fprintf(stderr, "Parallel streams need a tcp or unix migration, "
+                "using a single stream\n");
+        return 0;
+    }
 
-        flags = addr & ~TARGET_PAGE_MASK;
-        addr &= TARGET_PAGE_MASK;
+    if (qemu_pipe(streams_abort_fds) < 0) {
+        fprintf(stderr, "Can't open the parallel streams, "
+                "using a single stream\n");
+        return 0;
+    }
 
-        if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
-            if (version_id == 3) {
-                if (addr != ram_bytes_total()) {
-                    return -EINVAL;
-                }
-            } else {
-                /* Synchronize RAM block list */
-                char id[256];
-                ram_addr_t length;
-                ram_addr_t total_ram_bytes = addr;
+    qemu_put_be64(f, RAM_SAVE_FLAG_STREAMS);
+    qemu_put_be32(f, n);
+
+    nb_streams = n;
+    streams_state = STREAMS_RUN;
+    streams_rate = 0;
+    streams_budget = 0;
+    streams_budget_time = qemu_get_clock_ns(rt_clock);
+    qemu_mutex_init(&streams_lock);
+    qemu_cond_init(&streams_space_cond);
+    streams = qemu_mallocz(nb_streams * sizeof(*streams));
+    for (i = 0; i < nb_streams; i++) {
+        RamStream *st = &streams[i];
+
+        st->index = i;
+        st->fd = -1;
+        st->buf = qemu_malloc(STREAM_BUF_SIZE);
+        st->slice_start = qemu_get_clock_ns(rt_clock);
+        qemu_cond_init(&st->cond);
+        qemu_thread_create(&st->thread, ram_stream_thread, st);
+    }
+    return nb_streams;
+}
+
+/*
+ * With state STREAMS_END, waits for the queued pages to be sent and marks
+ * the end of the streams in f.  With STREAMS_ABORT, drops them.
+ */
+static void ram_streams_stop(QEMUFile *f, int state)
+{
+    int i;
+
+    if (!nb_streams) {
+        return;
+    }
+
+    qemu_mutex_lock(&streams_lock);
+    streams_state = state;
+    if (state == STREAMS_ABORT) {
+        /* wakes up the threads still connecting */
+        ssize_t ret;
+
+        do {
+            ret = write(streams_abort_fds[1], "", 1);
+        } while (ret == -1 && errno == EINTR);
+    }
+    for (i = 0; i < nb_streams; i++) {
+        if (state == STREAMS_ABORT && streams[i].fd != -1) {
+            /* wakes up a thread blocked in send */
+            shutdown(streams[i].fd, SHUT_RDWR);
+        }
+        qemu_cond_signal(&streams[i].cond);
+    }
+    qemu_mutex_unlock(&streams_lock);
+
+    for (i = 0; i < nb_streams; i++) {
+        qemu_thread_join(&streams[i].thread);
+        if (streams[i].fd != -1) {
+            closesocket(streams[i].fd);
+        }
+        qemu_cond_destroy(&streams[i].cond);
+        qemu_free(streams[i].buf);
+    }
+
+    if (state == STREAMS_END) {
+        if (streams_error) {
+            qemu_file_set_error(f);
+        } else {
+            qemu_put_be64(f, RAM_SAVE_FLAG_STREAMS);
+            qemu_put_be32(f, 0);
+        }
+    }
+
+    qemu_free(streams);
+    streams = NULL;
+    close(streams_abort_fds[0]);
+    close(streams_abort_fds[1]);
+    qemu_cond_destroy(&streams_space_cond);
+    qemu_mutex_destroy(&streams_lock);
+    nb_streams = 0;
+}
+
+/*
+ * Whether the streams have no bandwidth left for more pages, or failed.
+ * The I/O thread earns the streams' share of the limit as time goes, up to
+ * one slice of it, and stops queueing once it is spent rather than on full
+ * queues, which would leave the streams idle most of the time.
+ */
+static int ram_streams_budget_spent(void)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t elapsed = MIN(now - streams_budget_time, STREAM_SLICE_NS);
+    int64_t slice = streams_rate * nb_streams;
+
+    streams_budget = MIN(streams_budget +
+                         (int64_t)muldiv64(slice, elapsed, STREAM_SLICE_NS),
+                         slice);
+    streams_budget_time = now;
+    return streams_error || (streams_rate && streams_budget <= 0);
+}
+
+/* Queues a page on its stream, waiting for room if there is none */
+static void ram_streams_queue(RamStream *st, RAMBlock *block,
+                              ram_addr_t offset)
+{
+    int i;
+
+    qemu_mutex_lock(&streams_lock);
+    while (st->count == STREAM_QUEUE_LEN && !streams_error) {
+        qemu_cond_wait(&streams_space_cond, &streams_lock);
+    }
+    if (!streams_error) {
+        i = (st->head + st->count) % STREAM_QUEUE_LEN;
+        st->queue[i].block = block;
+        st->queue[i].offset = offset;
+        st->count++;
+        qemu_cond_signal(&st->cond);
+    }
+    qemu_mutex_unlock(&streams_lock);
+    streams_budget -= TARGET_PAGE_SIZE;
+}
+
+static void ram_save_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset)
+{
+    uint8_t *p = block->host + offset;
+
+    if (nb_streams) {
+        ram_streams_queue(ram_stream_of(block, offset), block, offset);
+        return;
+    }
+
+    if (comp_threads) {
+        compress_flush_page(f, block, offset);
+    }
+    if (xbzrle_cache) {
+        memcpy(xbzrle_page, p, TARGET_PAGE_SIZE);
+        p = xbzrle_page;
+    }
+
+    if (is_dup_page(p, *p)) {
+        if (xbzrle_cache) {
+            cache_remove(xbzrle_cache, block->offset + offset);
+        }
+        ram_save_page_header(f, block, offset, RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, *p);
+        bytes_transferred += 1;
+    } else if (xbzrle_cache && xbzrle_save_page(f, block, offset)) {
+        /* sent as a delta */
+    } else if (comp_threads) {
+        compress_page(f, block, offset, p);
+    } else {
+        ram_save_page_header(f, block, offset, RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_transferred += TARGET_PAGE_SIZE;
+    }
+}
+
+/*
+ * Sends the next dirty page, going round the blocks from where the last
+ * call stopped.  Clean runs are skipped a bitmap word at a time.  Returns
+ * 0 if there was no dirty page left.
+ */
+static int ram_save_block(QEMUFile *f)
+{
+    RAMBlock *block = last_block, *start_block;
+    ram_addr_t offset = last_offset, start_offset;
+    ram_addr_t current_addr, end;
+    int found = 0, wrapped = 0;
+
+    if (!block)
+        block = QLIST_FIRST(&ram_list.blocks);
+    start_block = block;
+    start_offset = offset;
+
+    for (;;) {
+        /* back in the first block, only the part before the start is left */
+        end = block->offset + (wrapped && block == start_block ?
+                               start_offset : block->length);
+        current_addr = cpu_physical_memory_find_dirty(block->offset + offset,
+                                                      end,
+                                                      MIGRATION_DIRTY_FLAG);
+        if (current_addr < end) {
+            offset = current_addr - block->offset;
+            cpu_physical_memory_reset_dirty(current_addr,
+                                            current_addr + TARGET_PAGE_SIZE,
+                                            MIGRATION_DIRTY_FLAG);
+            ram_save_page(f, block, offset);
+            found = 1;
+            break;
+        }
+
+        if (wrapped && block == start_block) {
+            break;
+        }
+        offset = 0;
+        block = QLIST_NEXT(block, next);
+        if (!block)
+            block = QLIST_FIRST(&ram_list.blocks);
+        if (block == start_block) {
+            wrapped = 1;
+        }
+    }
+
+    last_block = block;
+    last_offset = offset;
+
+    return found;
+}
+
+static ram_addr_t ram_save_remaining(void)
+{
+    RAMBlock *block;
+    ram_addr_t count = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        count += cpu_physical_memory_count_dirty(block->offset, block->length,
+                                                 MIGRATION_DIRTY_FLAG);
+    }
+
+    return count;
+}
+
+uint64_t ram_bytes_remaining(void)
+{
+    return ram_save_remaining() * TARGET_PAGE_SIZE;
+}
+
+uint64_t ram_bytes_transferred(void)
+{
+    return bytes_transferred;
+}
+
+uint64_t ram_bytes_total(void)
+{
+    RAMBlock *block;
+    uint64_t total = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next)
+        total += block->length;
+
+    return total;
+}
+
+static int block_compar(const void *a, const void *b)
+{
+    RAMBlock * const *ablock = a;
+    RAMBlock * const *bblock = b;
+    if ((*ablock)->offset < (*bblock)->offset) {
+        return -1;
+    } else if ((*ablock)->offset > (*bblock)->offset) {
+        return 1;
+    }
+    return 0;
+}
+
+static void sort_ram_list(void)
+{
+    RAMBlock *block, *nblock, **blocks;
+    int n;
+    n = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        ++n;
+    }
+    blocks = qemu_malloc(n * sizeof *blocks);
+    n = 0;
+    QLIST_FOREACH_SAFE(block, &ram_list.blocks, next, nblock) {
+        blocks[n++] = block;
+        QLIST_REMOVE(block, next);
+    }
+    qsort(blocks, n, sizeof *blocks, block_compar);
+    while (--n >= 0) {
+        QLIST_INSERT_HEAD(&ram_list.blocks, blocks[n], next);
+    }
+    qemu_free(blocks);
+}
+
+int ram_save_live(Monitor *mon, QEMUFile *f, int stage, void *opaque)
+{
+    uint64_t bytes_transferred_last, comp_in_last, comp_out_last;
+    double bwidth = 0;
+    uint64_t expected_time = 0;
+
+    if (stage < 0) {
+        ram_streams_stop(f, STREAMS_ABORT);
+        compress_threads_stop();
+        xbzrle_stop();
+        cpu_physical_memory_set_dirty_tracking(0);
+        return 0;
+    }
+
+    if (cpu_physical_sync_dirty_bitmap(0, TARGET_PHYS_ADDR_MAX) != 0) {
+        qemu_file_set_error(f);
+        return 0;
+    }
+
+    if (stage == 1) {
+        RAMBlock *block;
+        bytes_transferred = 0;
+        last_block = NULL;
+        last_offset = 0;
+        last_sent_block = NULL;
+        comp_pages = comp_bytes_in = comp_bytes_out = 0;
+        comp_iter_in = comp_iter_out = comp_iter_ns = 0;
+        postcopy_requested = postcopy_pushed = 0;
+        sort_ram_list();
+        /* each page is sent once in post-copy, from a stopped guest */
+        ram_postcopy = migrate_postcopy();
+
+        /* Make sure all dirty bits are set */
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            cpu_physical_memory_set_dirty_range(block->offset, block->length,
+                                                MIGRATION_DIRTY_FLAG);
+        }
+
+        /* Enable dirty memory tracking */
+        cpu_physical_memory_set_dirty_tracking(1);
+
+        qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            qemu_put_byte(f, strlen(block->idstr));
+            qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+            qemu_put_be64(f, block->length);
+        }
+
+        if (!ram_postcopy && !ram_streams_start(f)) {
+            compress_threads_start();
+            xbzrle_start();
+        }
+    }
+
+    if (nb_streams) {
+        /* the last stage goes as fast as it can */
+        streams_rate = stage == 3 ? 0 :
+                       qemu_file_get_rate_limit(f) / nb_streams;
+        if (streams_error) {
+            qemu_file_set_error(f);
+            return 0;
+        }
+    }
+
+    bytes_transferred_last = bytes_transferred;
+    comp_in_last = comp_bytes_in;
+    comp_out_last = comp_bytes_out;
+    bwidth = qemu_get_clock_ns(rt_clock);
+
+    while (!ram_postcopy && !qemu_file_rate_limit(f) &&
+           !(nb_streams && ram_streams_budget_spent())) {
+        if (ram_save_block(f) == 0) { /* no more blocks */
+            break;
+        }
+    }
+    /* the pages of this call must be in before the end of section */
+    compress_flush(f);
+
+    bwidth = qemu_get_clock_ns(rt_clock) - bwidth;
+    if (comp_bytes_in != comp_in_last) {
+        comp_iter_in = comp_bytes_in - comp_in_last;
+        comp_iter_out = comp_bytes_out - comp_out_last;
+        comp_iter_ns = bwidth;
+    }
+    bwidth = (bytes_transferred - bytes_transferred_last) / bwidth;
+
+    /* if we haven't transferred anything this round, force expected_time to a
+     * a very high value, but without crashing */
+    if (bwidth == 0) {
+        bwidth = 0.000001;
+    }
+
+    /* try transferring iterative blocks of memory */
+    if (stage == 3 && ram_postcopy) {
+        /* the pages go once the destination runs, see ram_postcopy_push */
+        qemu_put_be64(f, RAM_SAVE_FLAG_POSTCOPY);
+        cpu_physical_memory_set_dirty_tracking(0);
+    } else if (stage == 3) {
+        /* flush all remaining blocks regardless of rate limiting */
+        while (ram_save_block(f) != 0) {
+        }
+        ram_streams_stop(f, STREAMS_END);
+        compress_flush(f);
+        compress_threads_stop();
+        xbzrle_stop();
+        cpu_physical_memory_set_dirty_tracking(0);
+    }
+
+    qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+
+    expected_time = ram_save_remaining() * TARGET_PAGE_SIZE / bwidth;
+
+    return (stage == 2) && (expected_time <= migrate_max_downtime());
+}
+
+/*
+ * Post-copy migration.  The guest is stopped right after the first stage
+ * and its devices restarted on the destination with none of its memory.
+ * The source then sends the pages that the destination asks for as soon
+ * as the requests come in, and pushes the others in the background, each
+ * page once, with the same records as pre-copy.  The end of the pages is
+ * marked with RAM_SAVE_FLAG_EOS.
+ *
+ * A request names a range of a block:
+ *
+ *     <offset:be64> <length:be32> <idstr length:8> <idstr>
+ */
+
+#define POSTCOPY_REQ_HDR 13
+
+/*
+ * Sends the pages that are asked for in buf and haven't gone yet.
+ * Returns the number of bytes used, a request that is cut short being
+ * left for the next call, or -1 if a request is invalid.
+ */
+int ram_postcopy_handle_requests(QEMUFile *f, const uint8_t *buf, int len)
+{
+    int used = 0;
+
+    while (len - used >= POSTCOPY_REQ_HDR &&
+           len - used >= POSTCOPY_REQ_HDR + buf[used + 12]) {
+        const uint8_t *req = buf + used;
+        uint64_t offset = ldq_be_p(req) & TARGET_PAGE_MASK;
+        uint32_t length = ldl_be_p(req + 8);
+        RAMBlock *block;
+
+        QLIST_FOREACH(block, &ram_list.blocks, next) {
+            if (strlen(block->idstr) == req[12] &&
+                !memcmp(block->idstr, req + POSTCOPY_REQ_HDR, req[12])) {
+                break;
+            }
+        }
+        if (!block || offset >= block->length ||
+            length > block->length - offset) {
+            return -1;
+        }
+
+        for (; length > 0 && offset < block->length;
+             offset += TARGET_PAGE_SIZE) {
+            ram_addr_t addr = block->offset + offset;
+
+            if (cpu_physical_memory_get_dirty(addr, MIGRATION_DIRTY_FLAG)) {
+                cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                                MIGRATION_DIRTY_FLAG);
+                ram_save_page(f, block, offset);
+                postcopy_requested++;
+            }
+            length -= MIN(length, TARGET_PAGE_SIZE);
+        }
+        used += POSTCOPY_REQ_HDR + req[12];
+    }
+    return used;
+}
+
+/*
+ * Sends the pages that nobody asked for within the rate limit.  Returns 1
+ * once all of them have gone.
+ */
+int ram_postcopy_push(QEMUFile *f)
+{
+    while (!qemu_file_rate_limit(f)) {
+        if (ram_save_block(f) == 0) {
+            qemu_put_be64(f, RAM_SAVE_FLAG_EOS);
+            return 1;
+        }
+        postcopy_pushed++;
+    }
+    return 0;
+}
+
+void ram_postcopy_stats(uint64_t *requested, uint64_t *pushed)
+{
+    *requested = postcopy_requested;
+    *pushed = postcopy_pushed;
+}
+
+/* Reads the block of a page record, *last being that of the record before */
+static RAMBlock *ram_stream_block(QEMUFile *f, int flags, RAMBlock **last)
+{
+    RAMBlock *block;
+    char id[256];
+    uint8_t len;
+
+    if (flags & RAM_SAVE_FLAG_CONTINUE) {
+        if (!*last) {
+            fprintf(stderr, "Ack, bad migration stream!\n");
+            return NULL;
+        }
+
+        return *last;
+    }
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            *last = block;
+            return block;
+        }
+    }
+
+    *last = NULL;
+    fprintf(stderr, "Can't find block %s!\n", id);
+    return NULL;
+}
+
+static RAMBlock *ram_block_from_stream(QEMUFile *f, int flags)
+{
+    static RAMBlock *block = NULL;
+
+    return ram_stream_block(f, flags, &block);
+}
+
+static inline void *host_from_stream_offset(QEMUFile *f,
+                                            ram_addr_t offset,
+                                            int flags)
+{
+    RAMBlock *block = ram_block_from_stream(f, flags);
+
+    return block ? block->host + offset : NULL;
+}
+
+/*
+ * Post-copy, destination side.  Guest RAM is mapped again as shared
+ * memory, with a second view of it that only the receive thread uses:
+ * the guest view stays inaccessible until a page has been written through
+ * the other one, so whatever thread touches a missing page faults.  The
+ * SIGSEGV handler has the request thread ask the source for the page and
+ * waits for it to be opened; the receive thread fills pages as they come,
+ * asked for or pushed, and opens them.  Syscalls on missing pages fail
+ * instead of faulting, so memory mapped for DMA is faulted in first, see
+ * cpu_physical_memory_map.
+ *
+ * Pages are opened by units of a host page, or of a target page if that
+ * is larger.  A page that is received twice is only written the first
+ * time, the guest may have changed it since.
+ */
+
+int ram_postcopy_active;
+static int postcopy_pending;
+
+#ifdef __linux__
+
+typedef struct PostcopyBlock {
+    RAMBlock *block;
+    uint8_t *alias;                 /* writable view of the block */
+    uint8_t *view;                  /* guest view, until it replaces host */
+    uint8_t *saved;                 /* the memory it replaced */
+} PostcopyBlock;
+
+typedef struct PostcopyRequest {
+    int block;
+    ram_addr_t offset;
+} PostcopyRequest;
+
+typedef struct PostcopyIncoming {
+    QEMUFile *file;
+    int fd;
+    int req_pipe[2];                /* from the faulting threads */
+    int done_pipe[2];               /* from the receive thread */
+    const char *error;              /* why the receive thread stopped */
+    QemuThread recv_thread;
+    QemuThread req_thread;
+    PostcopyBlock *blocks;
+    int nb_blocks;
+    ram_addr_t unit;
+    unsigned long *received;        /* per target page */
+    unsigned long *requested;       /* per unit */
+    unsigned long *ready;           /* per unit, open to the guest */
+    int ready_seq;                  /* futex, bumped when a unit opens */
+    int faulting;                   /* futex, threads in the SIGSEGV handler */
+    struct sigaction old_sigsegv;
+} PostcopyIncoming;
+
+static PostcopyIncoming *postcopy_in;
+
+static void postcopy_futex_wait(int *addr, int val)
+{
+    syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+}
+
+static void postcopy_futex_wake(int *addr)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+static void postcopy_sigsegv(int sig, siginfo_t *info, void *ctx)
+{
+    PostcopyIncoming *pc = postcopy_in;
+    uint8_t *addr = info->si_addr;
+    PostcopyRequest req;
+    unsigned long unit, old;
+    int i, seq;
+
+    __sync_fetch_and_add(&pc->faulting, 1);
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        RAMBlock *block = pc->blocks[i].block;
+
+        if (addr >= block->host && addr < block->host + block->length) {
+            break;
+        }
+    }
+    if (i == pc->nb_blocks) {
+        /* not guest memory, let the fault happen again with the old action */
+        sigaction(SIGSEGV, &pc->old_sigsegv, NULL);
+        goto out;
+    }
+
+    req.block = i;
+    req.offset = (addr - pc->blocks[i].block->host) & ~(pc->unit - 1);
+    unit = (pc->blocks[i].block->offset + req.offset) / pc->unit;
+
+    old = __sync_fetch_and_or(&pc->requested[BIT_WORD(unit)], BIT_MASK(unit));
+    if (!(old & BIT_MASK(unit)) && !test_bit(unit, pc->ready)) {
+        /* atomic, as it is smaller than PIPE_BUF; the pipe only breaks
+           once the stream is over, and the page then is in already */
+        if (write(pc->req_pipe[1], &req, sizeof(req)) != sizeof(req)) {
+            goto out;
+        }
+    }
+
+    /* the receive thread bumps ready_seq after opening a unit */
+    for (;;) {
+        seq = pc->ready_seq;
+        __sync_synchronize();
+        if (test_bit(unit, pc->ready)) {
+            break;
+        }
+        postcopy_futex_wait(&pc->ready_seq, seq);
+    }
+
+out:
+    __sync_fetch_and_sub(&pc->faulting, 1);
+    postcopy_futex_wake(&pc->faulting);
+}
+
+static void *postcopy_req_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    PostcopyRequest req;
+    uint8_t msg[POSTCOPY_REQ_HDR + 256];
+    int len, done;
+    ssize_t ret;
+
+    for (;;) {
+        do {
+            ret = read(pc->req_pipe[0], &req, sizeof(req));
+        } while (ret == -1 && errno == EINTR);
+        if (ret != sizeof(req)) {
+            /* closed by postcopy_incoming_finish */
+            break;
+        }
+
+        len = strlen(pc->blocks[req.block].block->idstr);
+        stq_be_p(msg, req.offset);
+        stl_be_p(msg + 8, pc->unit);
+        msg[12] = len;
+        memcpy(msg + POSTCOPY_REQ_HDR, pc->blocks[req.block].block->idstr, len);
+        len += POSTCOPY_REQ_HDR;
+
+        /* a broken stream is noticed by the receive thread */
+        for (done = 0; done < len; done += ret) {
+            ret = send(pc->fd, msg + done, len - done, 0);
+            if (ret == -1 && errno == EINTR) {
+                ret = 0;
+            } else if (ret <= 0) {
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static void postcopy_close_pipe(int *fds)
+{
+    if (fds[0] != -1) {
+        close(fds[0]);
+        close(fds[1]);
+        fds[0] = fds[1] = -1;
+    }
+}
+
+/* Frees what ram_postcopy_incoming_start() set up, but for guest memory */
+static void postcopy_incoming_free(PostcopyIncoming *pc)
+{
+    int i;
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        PostcopyBlock *pb = &pc->blocks[i];
+
+        if (pb->alias != MAP_FAILED) {
+            munmap(pb->alias, pb->block->length);
+        }
+        if (pb->view != MAP_FAILED) {
+            munmap(pb->view, pb->block->length);
+        }
+        if (pb->saved != MAP_FAILED) {
+            munmap(pb->saved, pb->block->length);
+        }
+    }
+    postcopy_close_pipe(pc->req_pipe);
+    if (pc->done_pipe[0] != -1) {
+        qemu_set_fd_handler(pc->done_pipe[0], NULL, NULL, NULL);
+    }
+    postcopy_close_pipe(pc->done_pipe);
+
+    qemu_free(pc->received);
+    qemu_free(pc->requested);
+    qemu_free(pc->ready);
+    qemu_free(pc->blocks);
+    qemu_free(pc);
+}
+
+/*
+ * Called in the I/O thread once the receive thread is done.  If the stream
+ * broke, the guest can't run without the missing pages: it is stopped, and
+ * the faulting threads keep waiting.
+ */
+static void postcopy_done_read(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    char c;
+    int n;
+
+    if (read(pc->done_pipe[0], &c, 1) != 1) {
+        return;
+    }
+    qemu_set_fd_handler(pc->done_pipe[0], NULL, NULL, NULL);
+    qemu_thread_join(&pc->recv_thread);
+
+    if (pc->error) {
+        error_report("post-copy migration: %s; the guest is missing pages "
+                     "and has been stopped", pc->error);
+        vm_stop(0);
+        return;
+    }
+
+    /* every page is in, no fault on guest memory can come any more */
+    sigaction(SIGSEGV, &pc->old_sigsegv, NULL);
+    while ((n = pc->faulting) != 0) {
+        postcopy_futex_wait(&pc->faulting, n);
+    }
+    ram_postcopy_active = 0;
+
+    /* the request thread sees the end of the pipe */
+    close(pc->req_pipe[1]);
+    qemu_thread_join(&pc->req_thread);
+    close(pc->req_pipe[0]);
+    pc->req_pipe[0] = pc->req_pipe[1] = -1;
+
+    qemu_fclose(pc->file);
+    close(pc->fd);
+
+    postcopy_in = NULL;
+    postcopy_incoming_free(pc);
+}
+
+static void *postcopy_recv_thread(void *opaque)
+{
+    PostcopyIncoming *pc = opaque;
+    QEMUFile *f = pc->file;
+    uint8_t *scratch = qemu_malloc(TARGET_PAGE_SIZE);
+    ram_addr_t pages = 0, total = 0;
+    const char *error = NULL;
+    char c = 0;
+    int i;
+
+    for (i = 0; i < pc->nb_blocks; i++) {
+        total += pc->blocks[i].block->length >> TARGET_PAGE_BITS;
+    }
+
+    for (;;) {
+        ram_addr_t addr = qemu_get_be64(f);
+        int flags = addr & ~TARGET_PAGE_MASK;
+        unsigned long page, unit;
+        RAMBlock *block;
+        uint8_t *dst;
+
+        addr &= TARGET_PAGE_MASK;
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+
+        block = ram_block_from_stream(f, flags);
+        if (!block || addr >= block->length || qemu_file_has_error(f)) {
+            error = "migration stream broken";
+            break;
+        }
+        for (i = 0; pc->blocks[i].block != block; i++) {
+        }
+
+        page = (block->offset + addr) >> TARGET_PAGE_BITS;
+        dst = test_bit(page, pc->received) ? scratch : pc->blocks[i].alias + addr;
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            memset(dst, qemu_get_byte(f), TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, dst, TARGET_PAGE_SIZE);
+        } else {
+            error = "unexpected page record";
+            break;
+        }
+        if (qemu_file_has_error(f)) {
+            error = "migration stream broken";
+            break;
+        }
+        if (dst == scratch) {
+            continue;
+        }
+
+        set_bit_atomic(page, pc->received);
+        pages++;
+
+        /* open the unit once all of its pages are in */
+        addr &= ~(pc->unit - 1);
+        unit = (block->offset + addr) / pc->unit;
+        if (bitmap_count(pc->received, (block->offset + addr) >> TARGET_PAGE_BITS,
+                         pc->unit >> TARGET_PAGE_BITS) ==
+            pc->unit >> TARGET_PAGE_BITS) {
+            if (mprotect(block->host + addr, pc->unit,
+                         PROT_READ | PROT_WRITE) < 0) {
+                error = "can't open a page to the guest";
+                break;
+            }
+            set_bit_atomic(unit, pc->ready);
+            __sync_fetch_and_add(&pc->ready_seq, 1);
+            if (pc->faulting) {
+                postcopy_futex_wake(&pc->ready_seq);
+            }
+        }
+    }
+
+    if (!error && pages != total) {
+        error = "pages are missing at the end of the stream";
+    }
+    qemu_free(scratch);
+
+    /* the rest is up to the I/O thread, see postcopy_done_read */
+    pc->error = error;
+    if (write(pc->done_pipe[1], &c, 1) != 1) {
+        abort();
+    }
+    return NULL;
+}
+
+/*
+ * Takes over the stream, and the socket it comes from, once the devices
+ * have been read.  The devices are loaded and the guest started on return.
+ * On failure guest memory is left as it was.
+ */
+int ram_postcopy_incoming_start(QEMUFile *f, int fd)
+{
+    PostcopyIncoming *pc;
+    RAMBlock *block;
+    ram_addr_t end = 0;
+    struct sigaction act;
+    int i;
+
+    postcopy_pending = 0;
+    if (fd < 0) {
+        fprintf(stderr, "post-copy migration needs a socket\n");
+        return -1;
+    }
+    if (kvm_enabled()) {
+        fprintf(stderr, "post-copy migration is not supported with KVM\n");
+        return -1;
+    }
+
+    pc = qemu_mallocz(sizeof(*pc));
+    pc->file = f;
+    pc->fd = fd;
+    pc->unit = MAX(TARGET_PAGE_SIZE, qemu_real_host_page_size);
+    pc->req_pipe[0] = pc->req_pipe[1] = -1;
+    pc->done_pipe[0] = pc->done_pipe[1] = -1;
+
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        if (block->offset % pc->unit || block->length % pc->unit ||
+            (unsigned long)block->host % pc->unit) {
+            fprintf(stderr, "post-copy migration: block %s is not aligned "
+                    "on host pages\n", block->idstr);
+            qemu_free(pc);
+            return -1;
+        }
+        end = MAX(end, block->offset + block->length);
+        pc->nb_blocks++;
+    }
+
+    pc->blocks = qemu_mallocz(pc->nb_blocks * sizeof(PostcopyBlock));
+    pc->received = qemu_mallocz(BITS_TO_LONGS(end >> TARGET_PAGE_BITS) *
+                                sizeof(unsigned long));
+    pc->requested = qemu_mallocz(BITS_TO_LONGS(end / pc->unit) *
+                                 sizeof(unsigned long));
+    pc->ready = qemu_mallocz(BITS_TO_LONGS(end / pc->unit) *
+                             sizeof(unsigned long));
+
+    i = 0;
+    QLIST_FOREACH(block, &ram_list.blocks, next) {
+        PostcopyBlock *pb = &pc->blocks[i++];
+
+        pb->block = block;
+        pb->alias = pb->view = pb->saved = MAP_FAILED;
+    }
+
+    if (pipe(pc->req_pipe) < 0 || pipe(pc->done_pipe) < 0) {
+        perror("post-copy migration: pipe");
+        goto fail;
+    }
+
+    /*
+     * Both views of the new memory are made aside first.  mremap makes a
+     * second mapping of shared memory if asked for 0 bytes.
+     */
+    for (i = 0; i < pc->nb_blocks; i++) {
+        PostcopyBlock *pb = &pc->blocks[i];
+        ram_addr_t len = pb->block->length;
+
+        pb->view = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (pb->view == MAP_FAILED ||
+            (pb->alias = mremap(pb->view, 0, len,
+                                MREMAP_MAYMOVE)) == MAP_FAILED ||
+            mprotect(pb->view, len, PROT_NONE) < 0) {
+            perror("post-copy migration: can't map guest memory");
+            goto fail;
+        }
+    }
+
+    /* then put in place of guest memory, which is kept until it's done */
+    for (i = 0; i < pc->nb_blocks; i++) {
+        PostcopyBlock *pb = &pc->blocks[i];
+        ram_addr_t len = pb->block->length;
+
+        pb->saved = mremap(pb->block->host, len, len, MREMAP_MAYMOVE);
+        if (pb->saved == MAP_FAILED) {
+            perror("post-copy migration: can't map guest memory");
+            goto undo;
+        }
+        if (mremap(pb->view, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   pb->block->host) == MAP_FAILED) {
+            perror("post-copy migration: can't map guest memory");
+            i++;
+            goto undo;
+        }
+        pb->view = MAP_FAILED;
+    }
+    for (i = 0; i < pc->nb_blocks; i++) {
+        munmap(pc->blocks[i].saved, pc->blocks[i].block->length);
+        pc->blocks[i].saved = MAP_FAILED;
+    }
+
+    postcopy_in = pc;
+    ram_postcopy_active = 1;
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = postcopy_sigsegv;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, &pc->old_sigsegv);
+
+    qemu_set_fd_handler(pc->done_pipe[0], postcopy_done_read, NULL, pc);
+    qemu_thread_create(&pc->req_thread, postcopy_req_thread, pc);
+    qemu_thread_create(&pc->recv_thread, postcopy_recv_thread, pc);
+    return 0;
+
+undo:
+    /* move back the memory of the blocks [0, i) that were replaced */
+    while (--i >= 0) {
+        PostcopyBlock *pb = &pc->blocks[i];
+        ram_addr_t len = pb->block->length;
+
+        if (pb->saved == MAP_FAILED) {
+            continue;
+        }
+        if (mremap(pb->saved, len, len, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   pb->block->host) == MAP_FAILED) {
+            perror("post-copy migration: can't restore guest memory");
+            abort();
+        }
+        pb->saved = MAP_FAILED;
+    }
+fail:
+    postcopy_incoming_free(pc);
+    return -1;
+}
+
+#else
+
+int ram_postcopy_incoming_start(QEMUFile *f, int fd)
+{
+    postcopy_pending = 0;
+    fprintf(stderr, "post-copy migration is not supported on this host\n");
+    return -1;
+}
+
+#endif
+
+/* Whether the stream loaded last was a post-copy migration */
+int ram_postcopy_incoming(void)
+{
+    return postcopy_pending;
+}
+
+/* Parallel streams, destination side: a thread reads each of them */
+
+typedef struct RamStreamIn {
+    QemuThread thread;
+    QEMUFile *file;
+    int fd;
+    int ret;
+} RamStreamIn;
+
+static RamStreamIn *streams_in;
+static int nb_streams_in;
+
+static void *ram_stream_load_thread(void *opaque)
+{
+    RamStreamIn *in = opaque;
+    QEMUFile *f = in->file;
+    RAMBlock *block = NULL;
+    ram_addr_t addr;
+    uint8_t *host;
+    int flags;
+
+    for (;;) {
+        addr = qemu_get_be64(f);
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (qemu_file_has_error(f)) {
+            in->ret = -EIO;
+            break;
+        }
+        if (flags & RAM_SAVE_FLAG_EOS) {
+            break;
+        }
+
+        if (!ram_stream_block(f, flags, &block) || addr >= block->length) {
+            in->ret = -EINVAL;
+            break;
+        }
+        host = block->host + addr;
+
+        if (flags & RAM_SAVE_FLAG_COMPRESS) {
+            uint8_t ch = qemu_get_byte(f);
+
+            memset(host, ch, TARGET_PAGE_SIZE);
+#ifndef _WIN32
+            if (ch == 0 &&
+                (!kvm_enabled() || kvm_has_sync_mmu())) {
+                qemu_madvise(host, TARGET_PAGE_SIZE, QEMU_MADV_DONTNEED);
+            }
+#endif
+        } else if (flags & RAM_SAVE_FLAG_PAGE) {
+            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else {
+            in->ret = -EINVAL;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Waits for the load threads and frees the streams.  With abort set, their
+ * sockets are shut down first, so that threads still reading give up.
+ */
+static int ram_streams_close_in(int abort)
+{
+    int i, ret = 0;
+
+    for (i = 0; i < nb_streams_in; i++) {
+        RamStreamIn *in = &streams_in[i];
+
+        if (!in->file) {
+            continue;
+        }
+        if (abort) {
+            shutdown(in->fd, SHUT_RDWR);
+        }
+        qemu_thread_join(&in->thread);
+        qemu_fclose(in->file);
+        closesocket(in->fd);
+        if (in->ret < 0) {
+            ret = in->ret;
+        }
+    }
+    qemu_free(streams_in);
+    streams_in = NULL;
+    nb_streams_in = 0;
+    return ret;
+}
+
+/* Accepts the n streams announced by the source, whatever their order */
+static int ram_streams_accept(int n)
+{
+    int i, index, fd;
+    QEMUFile *f;
+
+    if (n > MIGRATE_MAX_STREAMS || streams_in) {
+        return -EINVAL;
+    }
+
+    streams_in = qemu_mallocz(n * sizeof(*streams_in));
+    nb_streams_in = n;
+    for (i = 0; i < n; i++) {
+        fd = migrate_incoming_accept_stream();
+        if (fd == -1) {
+            fprintf(stderr, "Can't accept a migration stream\n");
+            ram_streams_close_in(1);
+            return -EIO;
+        }
+        f = qemu_fopen_socket(fd);
+        index = qemu_get_be32(f);
+        if (qemu_file_has_error(f) || index < 0 || index >= n ||
+            streams_in[index].file) {
+            fprintf(stderr, "Invalid migration stream\n");
+            qemu_fclose(f);
+            closesocket(fd);
+            ram_streams_close_in(1);
+            return -EINVAL;
+        }
+
+        streams_in[index].file = f;
+        streams_in[index].fd = fd;
+        qemu_thread_create(&streams_in[index].thread, ram_stream_load_thread,
+                           &streams_in[index]);
+    }
+    return 0;
+}
+
+/* Waits for all streams to end */
+static int ram_streams_join(void)
+{
+    if (!streams_in) {
+        return -EINVAL;
+    }
+    return ram_streams_close_in(0);
+}
+
+static int ram_load_pages(QEMUFile *f, int version_id)
+{
+    ram_addr_t addr;
+    int flags;
+
+    if (version_id < 3 || version_id > 4) {
+        return -EINVAL;
+    }
+
+    do {
+        addr = qemu_get_be64(f);
+
+        flags = addr & ~TARGET_PAGE_MASK;
+        addr &= TARGET_PAGE_MASK;
+
+        if (flags & RAM_SAVE_FLAG_MEM_SIZE) {
+            if (version_id == 3) {
+                if (addr != ram_bytes_total()) {
+                    return -EINVAL;
+                }
+            } else {
+                /* Synchronize RAM block list */
+                char id[256];
+                ram_addr_t length;
+                ram_addr_t total_ram_bytes = addr;
 
                 while (total_ram_bytes) {
                     RAMBlock *block;
@@ -417,6 +1939,20 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
         }
 
+        if (flags & RAM_SAVE_FLAG_POSTCOPY) {
+            /* the pages will come once the devices are loaded */
+            postcopy_pending = 1;
+        }
+
+        if (flags & RAM_SAVE_FLAG_STREAMS) {
+            uint32_t n = qemu_get_be32(f);
+            int ret = n ? ram_streams_accept(n) : ram_streams_join();
+
+            if (ret < 0) {
+                return ret;
+            }
+        }
+
         if (flags & RAM_SAVE_FLAG_COMPRESS) {
             void *host;
             uint8_t ch;
@@ -446,6 +1982,51 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
                 host = host_from_stream_offset(f, addr, flags);
 
             qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            static uint8_t *buf;
+            uLongf destlen = TARGET_PAGE_SIZE;
+            void *host;
+            uint32_t len;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            if (!buf) {
+                buf = qemu_malloc(compressBound(TARGET_PAGE_SIZE));
+            }
+            len = qemu_get_be32(f);
+            if (len > compressBound(TARGET_PAGE_SIZE)) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, buf, len);
+            if (uncompress(host, &destlen, buf, len) != Z_OK ||
+                destlen != TARGET_PAGE_SIZE) {
+                fprintf(stderr, "Corrupted compressed page at 0x%" PRIx64
+                        "\n", (uint64_t)addr);
+                return -EINVAL;
+            }
+        } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
+            static uint8_t buf[TARGET_PAGE_SIZE];
+            void *host;
+            uint32_t len;
+
+            host = host_from_stream_offset(f, addr, flags);
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len > TARGET_PAGE_SIZE) {
+                return -EINVAL;
+            }
+            qemu_get_buffer(f, buf, len);
+            if (xbzrle_decode(buf, len, host, TARGET_PAGE_SIZE) < 0) {
+                fprintf(stderr, "Corrupted delta encoded page at 0x%" PRIx64
+                        "\n", (uint64_t)addr);
+                return -EINVAL;
+            }
         }
         if (qemu_file_has_error(f)) {
             return -EIO;
@@ -455,6 +2036,17 @@ int ram_load(QEMUFile *f, void *opaque, int version_id)
     return 0;
 }
 
+int ram_load(QEMUFile *f, void *opaque, int version_id)
+{
+    int ret = ram_load_pages(f, version_id);
+
+    if (ret < 0 && streams_in) {
+        /* the migration failed, the streams may never end */
+        ram_streams_close_in(1);
+    }
+    return ret;
+}
+
 void qemu_service_io(void)
 {
     qemu_notify_event();
@@ -0,0 +1,101 @@
+#ifndef __QEMU_BITOPS_H
+#define __QEMU_BITOPS_H 1
+
+/*
+ * Bitmaps of unsigned longs.  The _atomic updates may race with each
+ * other from any thread; they only write a word when some of its bits
+ * actually change, so that setting bits that are already set doesn't
+ * bounce the cache line between cores.
+ */
+
+#define BITS_PER_LONG       (sizeof(unsigned long) * 8)
+#define BITS_TO_LONGS(nr)   (((nr) + BITS_PER_LONG - 1) / BITS_PER_LONG)
+#define BIT_WORD(nr)        ((nr) / BITS_PER_LONG)
+#define BIT_MASK(nr)        (1UL << ((nr) % BITS_PER_LONG))
+
+/* Bits [start, end) of the word that holds bit 'start' */
+#define BITMAP_WORD_MASK(start, end)                                    \
+    ((~0UL << ((start) % BITS_PER_LONG)) &                             \
+     (BIT_WORD(start) == BIT_WORD((end) - 1) ?                         \
+      ~0UL >> (BITS_PER_LONG - 1 - ((end) - 1) % BITS_PER_LONG) : ~0UL))
+
+static inline int test_bit(unsigned long nr, const unsigned long *addr)
+{
+    return (addr[BIT_WORD(nr)] & BIT_MASK(nr)) != 0;
+}
+
+static inline void set_bit_atomic(unsigned long nr, unsigned long *addr)
+{
+    unsigned long *p = addr + BIT_WORD(nr);
+    unsigned long mask = BIT_MASK(nr);
+
+    if (!(*p & mask)) {
+        __sync_fetch_and_or(p, mask);
+    }
+}
+
+static inline void bitmap_set_atomic(unsigned long *map, unsigned long start,
+                                     unsigned long nr)
+{
+    unsigned long end = start + nr, mask, *p = map + BIT_WORD(start);
+
+    for (; start < end; start = (BIT_WORD(start) + 1) * BITS_PER_LONG, p++) {
+        mask = BITMAP_WORD_MASK(start, end);
+        if ((*p & mask) != mask) {
+            __sync_fetch_and_or(p, mask);
+        }
+    }
+}
+
+static inline void bitmap_clear_atomic(unsigned long *map, unsigned long start,
+                                       unsigned long nr)
+{
+    unsigned long end = start + nr, mask, *p = map + BIT_WORD(start);
+
+    for (; start < end; start = (BIT_WORD(start) + 1) * BITS_PER_LONG, p++) {
+        mask = BITMAP_WORD_MASK(start, end);
+        if (*p & mask) {
+            __sync_fetch_and_and(p, ~mask);
+        }
+    }
+}
+
+/* Number of bits set in [start, start + nr) */
+static inline unsigned long bitmap_count(const unsigned long *map,
+                                         unsigned long start, unsigned long nr)
+{
+    unsigned long end = start + nr, count = 0;
+    const unsigned long *p = map + BIT_WORD(start);
+
+    for (; start < end; start = (BIT_WORD(start) + 1) * BITS_PER_LONG, p++) {
+        count += __builtin_popcountl(*p & BITMAP_WORD_MASK(start, end));
+    }
+    return count;
+}
+
+/* Returns the first bit set in [offset, size), or size if there is none */
+static inline unsigned long find_next_bit(const unsigned long *addr,
+                                          unsigned long size,
+                                          unsigned long offset)
+{
+    const unsigned long *p;
+    unsigned long tmp;
+
+    if (offset >= size) {
+        return size;
+    }
+    p = addr + BIT_WORD(offset);
+    tmp = *p & (~0UL << (offset % BITS_PER_LONG));
+    offset -= offset % BITS_PER_LONG;
+    while (!tmp) {
+        offset += BITS_PER_LONG;
+        if (offset >= size) {
+            return size;
+        }
+        tmp = *++p;
+    }
+    offset += __builtin_ctzl(tmp);
+    return offset < size ? offset : size;
+}
+
+#endif
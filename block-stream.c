@@ -0,0 +1,351 @@
+/*
+ * Background streaming of backing file data into an image
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A stream walks an image from start to end and copies every range that the
+ * image doesn't have, but one of its backing files does, using the same path
+ * as copy-on-read.  One chunk is in flight at a time.  Once the whole image
+ * has been copied, the backing file link is removed from the image header
+ * and the backing file is closed.
+ *
+ * Guest writes racing with a chunk only cut the copy short; the chunk is
+ * looked at again before the stream moves on.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "blockdev.h"
+#include "monitor.h"
+#include "qerror.h"
+#include "qjson.h"
+#include "qemu-objects.h"
+#include "qemu-timer.h"
+
+#define STREAM_CHUNK_SECTORS    ((1024 * 1024) >> BDRV_SECTOR_BITS)
+#define STREAM_SLICE_NS         (100 * 1000 * 1000)
+
+typedef struct BlockStream {
+    BlockDriverState *bs;
+    int64_t sector_num;             /* next sector to look at */
+    int64_t total_sectors;
+    int in_flight;
+    int cancelled;
+    QEMUBH *bh;                     /* completes the stream */
+
+    /* rate limiting */
+    int64_t speed;                  /* bytes per second, 0 for no limit */
+    int64_t slice_start;
+    int64_t slice_bytes;
+    QEMUTimer *timer;
+
+    QLIST_ENTRY(BlockStream) list;
+} BlockStream;
+
+static QLIST_HEAD(, BlockStream) block_streams =
+    QLIST_HEAD_INITIALIZER(block_streams);
+
+static void block_stream_run(void *opaque);
+
+static BlockStream *block_stream_find(BlockDriverState *bs)
+{
+    BlockStream *s;
+
+    QLIST_FOREACH(s, &block_streams, list) {
+        if (s->bs == bs) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Returns whether the first *pnum sectors of [sector_num, sector_num +
+ * nb_sectors) are allocated in one of the backing files of bs, with *pnum
+ * set to the length of the run with the same answer.
+ */
+static int block_stream_is_allocated_below(BlockDriverState *bs,
+                                           int64_t sector_num, int nb_sectors,
+                                           int *pnum)
+{
+    BlockDriverState *base;
+    int n = nb_sectors;
+
+    for (base = bs->backing_hd; base; base = base->backing_hd) {
+        int run;
+
+        if (sector_num >= bdrv_getlength(base) / BDRV_SECTOR_SIZE) {
+            continue;
+        }
+        if (bdrv_is_allocated(base, sector_num, n, &run)) {
+            *pnum = MAX(run, 1);
+            return 1;
+        }
+        if (run > 0) {
+            n = MIN(n, run);
+        }
+    }
+
+    *pnum = n;
+    return 0;
+}
+
+static void block_stream_event(BlockStream *s, int ret)
+{
+    QObject *data;
+
+    data = qobject_from_jsonf("{ 'device': %s, 'offset': %" PRId64 ","
+                              " 'len': %" PRId64 " }",
+                              bdrv_get_device_name(s->bs),
+                              (int64_t)(s->sector_num * BDRV_SECTOR_SIZE),
+                              (int64_t)(s->total_sectors * BDRV_SECTOR_SIZE));
+    if (ret < 0) {
+        qdict_put(qobject_to_qdict(data), "error",
+                  qstring_from_str(strerror(-ret)));
+    }
+    if (s->cancelled) {
+        qdict_put(qobject_to_qdict(data), "cancelled", qbool_from_int(1));
+    }
+    monitor_protocol_event(QEVENT_BLOCK_STREAM_COMPLETED, data);
+    qobject_decref(data);
+}
+
+/* Removes the backing file once everything has been copied */
+static int block_stream_drop_backing(BlockDriverState *bs)
+{
+    int ret;
+
+    /* requests in flight may still be reading from the backing file */
+    qemu_aio_flush();
+
+    ret = bdrv_change_backing_file(bs, NULL, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    bdrv_delete(bs->backing_hd);
+    bs->backing_hd = NULL;
+    bs->backing_file[0] = '\0';
+    bs->backing_format[0] = '\0';
+    return 0;
+}
+
+static void block_stream_complete(BlockStream *s, int ret)
+{
+    if (ret == 0 && !s->cancelled) {
+        ret = block_stream_drop_backing(s->bs);
+    }
+
+    block_stream_event(s, ret);
+
+    QLIST_REMOVE(s, list);
+    qemu_bh_delete(s->bh);
+    qemu_del_timer(s->timer);
+    qemu_free_timer(s->timer);
+    qemu_free(s);
+}
+
+static void block_stream_bh(void *opaque)
+{
+    block_stream_complete(opaque, 0);
+}
+
+static void block_stream_cb(void *opaque, int ret)
+{
+    BlockStream *s = opaque;
+
+    s->in_flight = 0;
+    if (ret < 0 || s->cancelled) {
+        block_stream_complete(s, ret);
+        return;
+    }
+    block_stream_run(s);
+}
+
+/* Returns true if the current time slice has used up its share of bytes */
+static int block_stream_rate_limit(BlockStream *s)
+{
+    int64_t now;
+
+    if (!s->speed) {
+        return 0;
+    }
+
+    now = qemu_get_clock_ns(rt_clock);
+    if (now >= s->slice_start + STREAM_SLICE_NS) {
+        s->slice_start = now;
+        s->slice_bytes = 0;
+        return 0;
+    }
+    if (s->slice_bytes < s->speed * STREAM_SLICE_NS / 1000000000) {
+        return 0;
+    }
+
+    qemu_mod_timer(s->timer, (s->slice_start + STREAM_SLICE_NS) / 1000000);
+    return 1;
+}
+
+static void block_stream_run(void *opaque)
+{
+    BlockStream *s = opaque;
+    BlockDriverState *bs = s->bs;
+    int nb_sectors, n, ret;
+
+    while (s->sector_num < s->total_sectors) {
+        if (block_stream_rate_limit(s)) {
+            return;
+        }
+
+        nb_sectors = MIN(STREAM_CHUNK_SECTORS,
+                         s->total_sectors - s->sector_num);
+        if (bdrv_is_allocated(bs, s->sector_num, nb_sectors, &n) ||
+            !block_stream_is_allocated_below(bs, s->sector_num, n, &n)) {
+            /* in the image already, or zero in all backing files */
+            s->sector_num += MAX(n, 1);
+            continue;
+        }
+
+        ret = bdrv_aio_copy_backing(bs, s->sector_num, n, block_stream_cb, s);
+        if (ret < 0) {
+            block_stream_complete(s, ret);
+            return;
+        }
+        if (ret == 0) {
+            s->in_flight = 1;
+            s->slice_bytes += n * BDRV_SECTOR_SIZE;
+            return;
+        }
+        /* allocated since it was checked, e.g. by copy-on-read */
+        s->sector_num += n;
+    }
+
+    /* outside of AIO callbacks, dropping the backing file waits for I/O */
+    qemu_bh_schedule(s->bh);
+}
+
+/*
+ * Stops the stream of a device, waiting for the chunk in flight.  Must be
+ * called before the image is closed.
+ */
+void block_stream_cancel(BlockDriverState *bs)
+{
+    BlockStream *s = block_stream_find(bs);
+
+    if (!s) {
+        return;
+    }
+
+    if (s->sector_num >= s->total_sectors) {
+        /* everything has been copied, only the completion is left */
+        block_stream_complete(s, 0);
+        return;
+    }
+
+    s->cancelled = 1;
+    if (!s->in_flight) {
+        block_stream_complete(s, 0);
+        return;
+    }
+    while (block_stream_find(bs) == s) {
+        qemu_aio_wait();
+    }
+}
+
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+    BlockStream *s;
+
+    bs = bdrv_find(device);
+    if (!bs) {
+        qerror_report(QERR_DEVICE_NOT_FOUND, device);
+        return -1;
+    }
+    if (!bs->backing_hd || bdrv_is_read_only(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+    if (block_stream_find(bs)) {
+        qerror_report(QERR_DEVICE_IN_USE, device);
+        return -1;
+    }
+
+    s = qemu_mallocz(sizeof(*s));
+    s->bs = bs;
+    s->total_sectors = bdrv_getlength(bs) / BDRV_SECTOR_SIZE;
+    s->speed = qdict_get_try_int(qdict, "speed", 0);
+    s->slice_start = qemu_get_clock_ns(rt_clock);
+    s->timer = qemu_new_timer(rt_clock, block_stream_run, s);
+    s->bh = qemu_bh_new(block_stream_bh, s);
+    QLIST_INSERT_HEAD(&block_streams, s, list);
+
+    block_stream_run(s);
+    return 0;
+}
+
+int do_block_stream_cancel(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    BlockDriverState *bs;
+
+    bs = bdrv_find(device);
+    if (!bs || !block_stream_find(bs)) {
+        qerror_report(QERR_DEVICE_NOT_ACTIVE, device);
+        return -1;
+    }
+
+    block_stream_cancel(bs);
+    return 0;
+}
+
+static void block_stream_print_iter(QObject *data, void *opaque)
+{
+    QDict *qdict = qobject_to_qdict(data);
+    Monitor *mon = opaque;
+
+    monitor_printf(mon, "%s: streamed %" PRId64 " of %" PRId64 " bytes"
+                        " (speed limit %" PRId64 " bytes/s)\n",
+                   qdict_get_str(qdict, "device"),
+                   qdict_get_int(qdict, "offset"),
+                   qdict_get_int(qdict, "len"),
+                   qdict_get_int(qdict, "speed"));
+}
+
+void do_info_block_stream_print(Monitor *mon, const QObject *data)
+{
+    QList *list = qobject_to_qlist(data);
+
+    if (qlist_empty(list)) {
+        monitor_printf(mon, "No active stream\n");
+        return;
+    }
+    qlist_iter(list, block_stream_print_iter, mon);
+}
+
+void do_info_block_stream(Monitor *mon, QObject **ret_data)
+{
+    QList *list = qlist_new();
+    BlockStream *s;
+
+    QLIST_FOREACH(s, &block_streams, list) {
+        QObject *obj;
+
+        obj = qobject_from_jsonf("{ 'device': %s, 'offset': %" PRId64 ","
+                                 " 'len': %" PRId64 ", 'speed': %" PRId64 " }",
+                                 bdrv_get_device_name(s->bs),
+                                 (int64_t)(s->sector_num * BDRV_SECTOR_SIZE),
+                                 (int64_t)(s->total_sectors *
+                                           BDRV_SECTOR_SIZE),
+                                 s->speed);
+        qlist_append_obj(list, obj);
+    }
+
+    *ret_data = QOBJECT(list);
+}
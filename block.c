@@ -28,6 +28,7 @@
 #include "block_int.h"
 #include "module.h"
 #include "qemu-objects.h"
+#include "bitops.h"
 #include <assert.h>
 
 #ifdef CONFIG_BSD
@@ -58,6 +59,10 @@ static int bdrv_read_em(BlockDriverState *bs, int64_t sector_num,
                         uint8_t *buf, int nb_sectors);
 static int bdrv_write_em(BlockDriverState *bs, int64_t sector_num,
                          const uint8_t *buf, int nb_sectors);
+static int bdrv_open_file(BlockDriverState **pbs, const char *filename,
+                          int flags, BlockDriverState *parent);
+static void bdrv_cor_invalidate(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors);
 
 static QTAILQ_HEAD(, BlockDriverState) bdrv_states =
     QTAILQ_HEAD_INITIALIZER(bdrv_states);
@@ -466,7 +471,7 @@ static int bdrv_open_common(BlockDriverState *bs, const char *filename,
     if (drv->bdrv_file_open) {
         ret = drv->bdrv_file_open(bs, filename, open_flags);
     } else {
-        ret = bdrv_file_open(&bs->file, filename, open_flags);
+        ret = bdrv_open_file(&bs->file, filename, open_flags, bs);
         if (ret >= 0) {
             ret = drv->bdrv_open(bs, open_flags);
         }
@@ -502,9 +507,11 @@ free_and_fail:
 }
 
 /*
- * Opens a file using a protocol (file, host_device, nbd, ...)
+ * Opens a protocol (the file of an image), which inherits the AIO settings
+ * of the image.
  */
-int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+static int bdrv_open_file(BlockDriverState **pbs, const char *filename,
+                          int flags, BlockDriverState *parent)
 {
     BlockDriverState *bs;
     BlockDriver *drv;
@@ -516,6 +523,10 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     }
 
     bs = bdrv_new("");
+    if (parent) {
+        bs->aio_queue_depth = parent->aio_queue_depth;
+        bs->aio_threads = parent->aio_threads;
+    }
     ret = bdrv_open_common(bs, filename, flags, drv);
     if (ret < 0) {
         bdrv_delete(bs);
@@ -526,6 +537,14 @@ int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
     return 0;
 }
 
+/*
+ * Opens a file using a protocol (file, host_device, nbd, ...)
+ */
+int bdrv_file_open(BlockDriverState **pbs, const char *filename, int flags)
+{
+    return bdrv_open_file(pbs, filename, flags, NULL);
+}
+
 /*
  * Opens a disk image (raw, qcow2, vmdk, ...)
  */
@@ -981,6 +1000,7 @@ int bdrv_write(BlockDriverState *bs, int64_t sector_num,
     if (bs->dirty_bitmap) {
         set_dirty_bitmap(bs, sector_num, nb_sectors, 1);
     }
+    bdrv_cor_invalidate(bs, sector_num, nb_sectors);
 
     if (bs->wr_highest_sector < sector_num + nb_sectors - 1) {
         bs->wr_highest_sector = sector_num + nb_sectors - 1;
@@ -1295,6 +1315,26 @@ void bdrv_set_geometry_hint(BlockDriverState *bs,
     bs->secs = secs;
 }
 
+void bdrv_set_metadata_cache_size(BlockDriverState *bs, uint64_t size)
+{
+    bs->metadata_cache_size = size;
+}
+
+void bdrv_set_aio_queue_depth(BlockDriverState *bs, int depth)
+{
+    bs->aio_queue_depth = depth;
+}
+
+void bdrv_set_aio_threads(BlockDriverState *bs, int threads)
+{
+    bs->aio_threads = threads;
+}
+
+void bdrv_set_copy_on_read(BlockDriverState *bs, int enable)
+{
+    bs->copy_on_read = enable;
+}
+
 void bdrv_set_type_hint(BlockDriverState *bs, int type)
 {
     bs->type = type;
@@ -1524,6 +1564,7 @@ int bdrv_discard(BlockDriverState *bs, int64_t sector_num, int nb_sectors)
     if (!bs->drv->bdrv_discard) {
         return 0;
     }
+    bdrv_cor_invalidate(bs, sector_num, nb_sectors);
     return bs->drv->bdrv_discard(bs, sector_num, nb_sectors);
 }
 
@@ -1677,22 +1718,77 @@ void bdrv_info(Monitor *mon, QObject **ret_data)
 
 static void bdrv_stats_iter(QObject *data, void *opaque)
 {
-    QDict *qdict;
+    QDict *qdict, *stats;
     Monitor *mon = opaque;
 
     qdict = qobject_to_qdict(data);
     monitor_printf(mon, "%s:", qdict_get_str(qdict, "device"));
 
-    qdict = qobject_to_qdict(qdict_get(qdict, "stats"));
+    stats = qobject_to_qdict(qdict_get(qdict, "stats"));
     monitor_printf(mon, " rd_bytes=%" PRId64
                         " wr_bytes=%" PRId64
                         " rd_operations=%" PRId64
                         " wr_operations=%" PRId64
                         "\n",
-                        qdict_get_int(qdict, "rd_bytes"),
-                        qdict_get_int(qdict, "wr_bytes"),
-                        qdict_get_int(qdict, "rd_operations"),
-                        qdict_get_int(qdict, "wr_operations"));
+                        qdict_get_int(stats, "rd_bytes"),
+                        qdict_get_int(stats, "wr_bytes"),
+                        qdict_get_int(stats, "rd_operations"),
+                        qdict_get_int(stats, "wr_operations"));
+
+    if (qdict_haskey(stats, "metadata_cache_hits")) {
+        monitor_printf(mon, "    metadata_cache_hits=%" PRId64
+                            " metadata_cache_misses=%" PRId64
+                            " metadata_cache_writes=%" PRId64
+                            "\n",
+                            qdict_get_int(stats, "metadata_cache_hits"),
+                            qdict_get_int(stats, "metadata_cache_misses"),
+                            qdict_get_int(stats, "metadata_cache_writes"));
+    }
+
+    if (qdict_haskey(stats, "copy_on_read_bytes")) {
+        monitor_printf(mon, "    copy_on_read_bytes=%" PRId64 "\n",
+                       qdict_get_int(stats, "copy_on_read_bytes"));
+    }
+
+    /* AIO requests are submitted by the protocol below the format driver */
+    while (!qdict_haskey(stats, "aio_submits") &&
+           !qdict_haskey(stats, "aio_latency_us") &&
+           !qdict_haskey(stats, "bounce_bytes") &&
+           qdict_haskey(qdict, "parent")) {
+        qdict = qobject_to_qdict(qdict_get(qdict, "parent"));
+        stats = qobject_to_qdict(qdict_get(qdict, "stats"));
+    }
+    if (qdict_haskey(stats, "aio_submits")) {
+        monitor_printf(mon, "    aio_submits=%" PRId64
+                            " aio_submitted_requests=%" PRId64
+                            " aio_max_batch=%" PRId64
+                            "\n",
+                            qdict_get_int(stats, "aio_submits"),
+                            qdict_get_int(stats, "aio_submitted_requests"),
+                            qdict_get_int(stats, "aio_max_batch"));
+    }
+    if (qdict_haskey(stats, "aio_latency_us")) {
+        QList *latency = qobject_to_qlist(qdict_get(stats, "aio_latency_us"));
+        QListEntry *entry;
+        int i = 0;
+
+        monitor_printf(mon, "    aio_latency_us:");
+        QLIST_FOREACH_ENTRY(latency, entry) {
+            int64_t count = qint_get_int(qobject_to_qint(entry->value));
+
+            if (count && i == BDRV_AIO_LATENCY_BUCKETS - 1) {
+                monitor_printf(mon, " >=%d:%" PRId64, 1 << i, count);
+            } else if (count) {
+                monitor_printf(mon, " <%d:%" PRId64, 2 << i, count);
+            }
+            i++;
+        }
+        monitor_printf(mon, "\n");
+    }
+    if (qdict_haskey(stats, "bounce_bytes")) {
+        monitor_printf(mon, "    bounce_bytes=%" PRId64 "\n",
+                       qdict_get_int(stats, "bounce_bytes"));
+    }
 }
 
 void bdrv_stats_print(Monitor *mon, const QObject *data)
@@ -1703,7 +1799,8 @@ void bdrv_stats_print(Monitor *mon, const QObject *data)
 static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
 {
     QObject *res;
-    QDict *dict;
+    QDict *dict, *stats;
+    int i;
 
     res = qobject_from_jsonf("{ 'stats': {"
                              "'rd_bytes': %" PRId64 ","
@@ -1718,6 +1815,50 @@ static QObject* bdrv_info_stats_bs(BlockDriverState *bs)
                              (uint64_t)BDRV_SECTOR_SIZE);
     dict  = qobject_to_qdict(res);
 
+    if (bs->metadata_cache_hits || bs->metadata_cache_misses) {
+        stats = qobject_to_qdict(qdict_get(dict, "stats"));
+        qdict_put(stats, "metadata_cache_hits",
+                  qint_from_int(bs->metadata_cache_hits));
+        qdict_put(stats, "metadata_cache_misses",
+                  qint_from_int(bs->metadata_cache_misses));
+        qdict_put(stats, "metadata_cache_writes",
+                  qint_from_int(bs->metadata_cache_writes));
+    }
+
+    if (bs->copy_on_read_sectors) {
+        stats = qobject_to_qdict(qdict_get(dict, "stats"));
+        qdict_put(stats, "copy_on_read_bytes",
+                  qint_from_int(bs->copy_on_read_sectors * BDRV_SECTOR_SIZE));
+    }
+
+    if (bs->bounce_bytes) {
+        stats = qobject_to_qdict(qdict_get(dict, "stats"));
+        qdict_put(stats, "bounce_bytes", qint_from_int(bs->bounce_bytes));
+    }
+
+    if (bs->aio_submits) {
+        stats = qobject_to_qdict(qdict_get(dict, "stats"));
+        qdict_put(stats, "aio_submits", qint_from_int(bs->aio_submits));
+        qdict_put(stats, "aio_submitted_requests",
+                  qint_from_int(bs->aio_submitted_reqs));
+        qdict_put(stats, "aio_max_batch", qint_from_int(bs->aio_max_batch));
+    }
+
+    for (i = 0; i < BDRV_AIO_LATENCY_BUCKETS; i++) {
+        if (bs->aio_latency[i]) {
+            break;
+        }
+    }
+    if (i < BDRV_AIO_LATENCY_BUCKETS) {
+        QList *latency = qlist_new();
+
+        for (i = 0; i < BDRV_AIO_LATENCY_BUCKETS; i++) {
+            qlist_append(latency, qint_from_int(bs->aio_latency[i]));
+        }
+        stats = qobject_to_qdict(qdict_get(dict, "stats"));
+        qdict_put(stats, "aio_latency_us", latency);
+    }
+
     if (*bs->device_name) {
         qdict_put(dict, "device", qstring_from_str(bs->device_name));
     }
@@ -2030,6 +2171,380 @@ char *bdrv_snapshot_dump(char *buf, int buf_size, QEMUSnapshotInfo *sn)
 }
 
 
+/**************************************************************/
+/* copy-on-read */
+
+/* An AIO write in flight to an image with a backing file */
+typedef struct BdrvTrackedWrite {
+    BlockDriverState *bs;
+    int64_t sector_num;
+    int nb_sectors;
+    BlockDriverAIOCB *acb;          /* of the format driver */
+    BlockDriverCompletionFunc *cb;
+    void *opaque;
+    QLIST_ENTRY(BdrvTrackedWrite) list;
+} BdrvTrackedWrite;
+
+/*
+ * With copy-on-read, a read of sectors that the image doesn't have yet is
+ * widened to whole clusters and read into a bounce buffer.  The guest's part
+ * is copied out and the request completes; the sectors that are still not
+ * allocated are then written back into the image, so that later reads don't
+ * reach the backing file again.
+ *
+ * The read waits for the AIO writes in flight to the same range, which may
+ * not have linked their clusters into the image yet.  Guest writes that come
+ * while a copy is in progress mark their sectors as touched, and those are
+ * never written back since the data read before the write is out of date.
+ * Writes issued after a write back has been submitted are ordered behind it
+ * by the format driver, which serializes allocating writes to the same
+ * cluster.
+ */
+typedef struct BdrvCopyOnRead {
+    BlockDriverState *bs;
+    int64_t sector_num;             /* range read from the image */
+    int nb_sectors;
+    int64_t next_sector;            /* write back progress */
+    int waiting;                    /* for writes in flight to finish */
+    unsigned long *touched;         /* sectors written by the guest since */
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    struct iovec write_iov;
+    QEMUIOVector write_qiov;
+    int write_sectors;
+
+    /* guest request, NULL once completed or cancelled */
+    struct BdrvCopyOnReadAIOCB *acb;
+    int64_t guest_sector_num;
+
+    /* called when the write back is done, for bdrv_aio_copy_backing() */
+    BlockDriverCompletionFunc *done_cb;
+    void *done_opaque;
+
+    QLIST_ENTRY(BdrvCopyOnRead) list;
+} BdrvCopyOnRead;
+
+typedef struct BdrvCopyOnReadAIOCB {
+    BlockDriverAIOCB common;
+    BdrvCopyOnRead *cor;
+    QEMUIOVector *qiov;
+} BdrvCopyOnReadAIOCB;
+
+static void bdrv_cor_cancel(BlockDriverAIOCB *blockacb)
+{
+    BdrvCopyOnReadAIOCB *acb = (BdrvCopyOnReadAIOCB *)blockacb;
+
+    /* the read goes on into our buffer, the guest just won't hear of it */
+    acb->cor->acb = NULL;
+    qemu_aio_release(acb);
+}
+
+static AIOPool bdrv_cor_aio_pool = {
+    .aiocb_size         = sizeof(BdrvCopyOnReadAIOCB),
+    .cancel             = bdrv_cor_cancel,
+};
+
+/* Marks the sectors of the copies overlapping a guest write as touched */
+static void bdrv_cor_invalidate(BlockDriverState *bs, int64_t sector_num,
+                                int nb_sectors)
+{
+    BdrvCopyOnRead *cor;
+    int64_t start, end;
+
+    QLIST_FOREACH(cor, &bs->cor_requests, list) {
+        start = MAX(sector_num, cor->sector_num);
+        end = MIN(sector_num + nb_sectors, cor->sector_num + cor->nb_sectors);
+        if (start < end) {
+            bitmap_set_atomic(cor->touched, start - cor->sector_num,
+                              end - start);
+        }
+    }
+}
+
+static int bdrv_cor_overlaps_write(BdrvCopyOnRead *cor)
+{
+    BdrvTrackedWrite *tw;
+
+    QLIST_FOREACH(tw, &cor->bs->tracked_writes, list) {
+        if (tw->sector_num < cor->sector_num + cor->nb_sectors &&
+            cor->sector_num < tw->sector_num + tw->nb_sectors) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void bdrv_cor_finish(BdrvCopyOnRead *cor, int ret)
+{
+    QLIST_REMOVE(cor, list);
+    qemu_vfree(cor->buf);
+    qemu_free(cor->touched);
+    if (cor->done_cb) {
+        cor->done_cb(cor->done_opaque, ret);
+    }
+    qemu_free(cor);
+}
+
+static void bdrv_cor_write_cb(void *opaque, int ret);
+
+/*
+ * Writes the next run of sectors that the image still doesn't have and that
+ * the guest hasn't written to
+ */
+static void bdrv_cor_write_next(BdrvCopyOnRead *cor)
+{
+    BlockDriverState *bs = cor->bs;
+    int64_t end = cor->sector_num + cor->nb_sectors;
+    BlockDriverAIOCB *acb;
+    int64_t offset;
+    int i, n;
+
+    while (cor->next_sector < end) {
+        if (test_bit(cor->next_sector - cor->sector_num, cor->touched)) {
+            cor->next_sector++;
+            continue;
+        }
+        if (bdrv_is_allocated(bs, cor->next_sector, end - cor->next_sector,
+                              &n)) {
+            cor->next_sector += n;
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        for (i = 1; i < n; i++) {
+            if (test_bit(cor->next_sector - cor->sector_num + i,
+                         cor->touched)) {
+                break;
+            }
+        }
+        n = i;
+
+        offset = (cor->next_sector - cor->sector_num) * BDRV_SECTOR_SIZE;
+        cor->write_iov.iov_base = cor->buf + offset;
+        cor->write_iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&cor->write_qiov, &cor->write_iov, 1);
+        cor->write_sectors = n;
+
+        acb = bs->drv->bdrv_aio_writev(bs, cor->next_sector, &cor->write_qiov,
+                                       n, bdrv_cor_write_cb, cor);
+        if (!acb) {
+            bdrv_cor_finish(cor, -EIO);
+            return;
+        }
+        cor->next_sector += n;
+        return;
+    }
+
+    bdrv_cor_finish(cor, 0);
+}
+
+static void bdrv_cor_write_cb(void *opaque, int ret)
+{
+    BdrvCopyOnRead *cor = opaque;
+
+    if (ret < 0) {
+        bdrv_cor_finish(cor, ret);
+        return;
+    }
+    cor->bs->copy_on_read_sectors += cor->write_sectors;
+    bdrv_cor_write_next(cor);
+}
+
+static void bdrv_cor_read_cb(void *opaque, int ret)
+{
+    BdrvCopyOnRead *cor = opaque;
+    BdrvCopyOnReadAIOCB *acb = cor->acb;
+
+    if (acb) {
+        if (ret == 0) {
+            int64_t offset = cor->guest_sector_num - cor->sector_num;
+
+            qemu_iovec_from_buffer(acb->qiov,
+                                   cor->buf + offset * BDRV_SECTOR_SIZE,
+                                   acb->qiov->size);
+        }
+        cor->acb = NULL;
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+    }
+
+    if (ret < 0) {
+        bdrv_cor_finish(cor, ret);
+        return;
+    }
+    bdrv_cor_write_next(cor);
+}
+
+/*
+ * Starts a copy of [sector_num, sector_num + nb_sectors) widened to cluster
+ * boundaries, or returns NULL if the image already has all of it.
+ */
+static BdrvCopyOnRead *bdrv_cor_start(BlockDriverState *bs, int64_t sector_num,
+                                      int nb_sectors)
+{
+    BlockDriverInfo bdi;
+    BdrvCopyOnRead *cor;
+    int64_t start, end, sector;
+    int cluster_sectors = 1;
+    int n;
+
+    if (bdrv_get_info(bs, &bdi) == 0 && bdi.cluster_size > 0) {
+        cluster_sectors = bdi.cluster_size >> BDRV_SECTOR_BITS;
+    }
+    start = sector_num - sector_num % cluster_sectors;
+    end = sector_num + nb_sectors + cluster_sectors - 1;
+    end = MIN(end - end % cluster_sectors, bs->total_sectors);
+
+    for (sector = start; sector < end; sector += n) {
+        if (!bdrv_is_allocated(bs, sector, end - sector, &n)) {
+            break;
+        }
+        if (n <= 0) {
+            return NULL;
+        }
+    }
+    if (sector >= end) {
+        return NULL;
+    }
+
+    cor = qemu_mallocz(sizeof(*cor));
+    cor->bs = bs;
+    cor->sector_num = start;
+    cor->nb_sectors = end - start;
+    cor->next_sector = start;
+    cor->guest_sector_num = sector_num;
+    cor->buf = qemu_blockalign(bs, cor->nb_sectors * BDRV_SECTOR_SIZE);
+    cor->touched = qemu_mallocz(BITS_TO_LONGS(cor->nb_sectors) *
+                                sizeof(unsigned long));
+    cor->iov.iov_base = cor->buf;
+    cor->iov.iov_len = cor->nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&cor->qiov, &cor->iov, 1);
+    QLIST_INSERT_HEAD(&bs->cor_requests, cor, list);
+
+    return cor;
+}
+
+static BlockDriverAIOCB *bdrv_cor_read(BdrvCopyOnRead *cor)
+{
+    BlockDriverState *bs = cor->bs;
+
+    return bs->drv->bdrv_aio_readv(bs, cor->sector_num, &cor->qiov,
+                                   cor->nb_sectors, bdrv_cor_read_cb, cor);
+}
+
+/* Reads the range, or waits for the writes in flight to it to complete */
+static int bdrv_cor_submit(BdrvCopyOnRead *cor)
+{
+    if (bdrv_cor_overlaps_write(cor)) {
+        cor->waiting = 1;
+        return 0;
+    }
+
+    if (!bdrv_cor_read(cor)) {
+        cor->done_cb = NULL;
+        if (cor->acb) {
+            qemu_aio_release(cor->acb);
+        }
+        bdrv_cor_finish(cor, -EIO);
+        return -EIO;
+    }
+    return 0;
+}
+
+/* Starts the copies that were waiting for a write that has completed */
+static void bdrv_cor_kick(BlockDriverState *bs)
+{
+    BdrvCopyOnRead *cor;
+
+again:
+    QLIST_FOREACH(cor, &bs->cor_requests, list) {
+        if (!cor->waiting || bdrv_cor_overlaps_write(cor)) {
+            continue;
+        }
+        cor->waiting = 0;
+        if (!bdrv_cor_read(cor)) {
+            /* too late to fail the submission, complete with an error */
+            bdrv_cor_read_cb(cor, -EIO);
+            goto again;
+        }
+    }
+}
+
+static void bdrv_tracked_write_end(BdrvTrackedWrite *tw)
+{
+    BlockDriverState *bs = tw->bs;
+
+    QLIST_REMOVE(tw, list);
+    qemu_free(tw);
+    bdrv_cor_kick(bs);
+}
+
+static void bdrv_tracked_write_cb(void *opaque, int ret)
+{
+    BdrvTrackedWrite *tw = opaque;
+
+    tw->cb(tw->opaque, ret);
+    bdrv_tracked_write_end(tw);
+}
+
+static BlockDriverAIOCB *bdrv_aio_copy_on_read(BlockDriverState *bs,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque)
+{
+    BdrvCopyOnReadAIOCB *acb;
+    BdrvCopyOnRead *cor;
+
+    cor = bdrv_cor_start(bs, sector_num, nb_sectors);
+    if (!cor) {
+        return bs->drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                       cb, opaque);
+    }
+
+    acb = qemu_aio_get(&bdrv_cor_aio_pool, bs, cb, opaque);
+    acb->cor = cor;
+    acb->qiov = qiov;
+    cor->acb = acb;
+
+    if (bdrv_cor_submit(cor) < 0) {
+        return NULL;
+    }
+    return &acb->common;
+}
+
+/*
+ * Copies the part of [sector_num, sector_num + nb_sectors) that the image
+ * doesn't have from its backing file.  cb is called once the data has been
+ * written; sectors that the guest writes to meanwhile are left alone.
+ * Returns 0 if the copy was started, 1 if there is nothing to copy (cb is
+ * not called) and -errno on failure.
+ */
+int bdrv_aio_copy_backing(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, BlockDriverCompletionFunc *cb,
+                          void *opaque)
+{
+    BdrvCopyOnRead *cor;
+
+    if (!bs->drv) {
+        return -ENOMEDIUM;
+    }
+    if (bs->read_only) {
+        return -EACCES;
+    }
+    if (bdrv_check_request(bs, sector_num, nb_sectors)) {
+        return -EIO;
+    }
+
+    cor = bdrv_cor_start(bs, sector_num, nb_sectors);
+    if (!cor) {
+        return 1;
+    }
+    cor->done_cb = cb;
+    cor->done_opaque = opaque;
+    return bdrv_cor_submit(cor);
+}
+
 /**************************************************************/
 /* async I/Os */
 
@@ -2047,8 +2562,13 @@ BlockDriverAIOCB *bdrv_aio_readv(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
-    ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
-                              cb, opaque);
+    if (bs->copy_on_read && bs->backing_hd && !bs->read_only) {
+        ret = bdrv_aio_copy_on_read(bs, sector_num, qiov, nb_sectors,
+                                    cb, opaque);
+    } else {
+        ret = drv->bdrv_aio_readv(bs, sector_num, qiov, nb_sectors,
+                                  cb, opaque);
+    }
 
     if (ret) {
 	/* Update stats even though technically transfer has not happened. */
@@ -2102,6 +2622,7 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     BlockDriver *drv = bs->drv;
     BlockDriverAIOCB *ret;
     BlockCompleteData *blk_cb_data;
+    BdrvTrackedWrite *tw = NULL;
 
     trace_bdrv_aio_writev(bs, sector_num, nb_sectors, opaque);
 
@@ -2112,6 +2633,8 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
     if (bdrv_check_request(bs, sector_num, nb_sectors))
         return NULL;
 
+    bdrv_cor_invalidate(bs, sector_num, nb_sectors);
+
     if (bs->dirty_bitmap) {
         blk_cb_data = blk_dirty_cb_alloc(bs, sector_num, nb_sectors, cb,
                                          opaque);
@@ -2119,9 +2642,30 @@ BlockDriverAIOCB *bdrv_aio_writev(BlockDriverState *bs, int64_t sector_num,
         opaque = blk_cb_data;
     }
 
+    if (bs->backing_hd) {
+        /* copy-on-read must not read under it until it completes */
+        tw = qemu_mallocz(sizeof(*tw));
+        tw->bs = bs;
+        tw->sector_num = sector_num;
+        tw->nb_sectors = nb_sectors;
+        tw->cb = cb;
+        tw->opaque = opaque;
+        QLIST_INSERT_HEAD(&bs->tracked_writes, tw, list);
+        cb = bdrv_tracked_write_cb;
+        opaque = tw;
+    }
+
     ret = drv->bdrv_aio_writev(bs, sector_num, qiov, nb_sectors,
                                cb, opaque);
 
+    if (tw) {
+        if (ret) {
+            tw->acb = ret;
+        } else {
+            bdrv_tracked_write_end(tw);
+        }
+    }
+
     if (ret) {
         /* Update stats even though technically transfer has not happened. */
         bs->wr_bytes += (unsigned) nb_sectors * BDRV_SECTOR_SIZE;
@@ -2270,6 +2814,32 @@ static int multiwrite_merge(BlockDriverState *bs, BlockRequest *reqs,
     return outidx + 1;
 }
 
+/*
+ * Requests submitted between bdrv_io_plug() and bdrv_io_unplug() may be held
+ * back by the protocol and passed to the host in a single batch. Calls nest.
+ */
+void bdrv_io_plug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_plug) {
+        drv->bdrv_io_plug(bs);
+    } else if (bs->file) {
+        bdrv_io_plug(bs->file);
+    }
+}
+
+void bdrv_io_unplug(BlockDriverState *bs)
+{
+    BlockDriver *drv = bs->drv;
+
+    if (drv && drv->bdrv_io_unplug) {
+        drv->bdrv_io_unplug(bs);
+    } else if (bs->file) {
+        bdrv_io_unplug(bs->file);
+    }
+}
+
 /*
  * Submit multiple AIO write requests at once.
  *
@@ -2331,6 +2901,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
     mcb->num_requests = 1;
 
     // Run the aio requests
+    bdrv_io_plug(bs);
     for (i = 0; i < num_reqs; i++) {
         mcb->num_requests++;
         acb = bdrv_aio_writev(bs, reqs[i].sector, reqs[i].qiov,
@@ -2341,6 +2912,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
             // submitted yet. Otherwise we'll wait for the submitted AIOs to
             // complete and report the error in the callback.
             if (i == 0) {
+                bdrv_io_unplug(bs);
                 trace_bdrv_aio_multiwrite_earlyfail(mcb);
                 goto fail;
             } else {
@@ -2350,6 +2922,7 @@ int bdrv_aio_multiwrite(BlockDriverState *bs, BlockRequest *reqs, int num_reqs)
             }
         }
     }
+    bdrv_io_unplug(bs);
 
     /* Complete the dummy request */
     multiwrite_cb(mcb, 0);
@@ -2380,7 +2953,20 @@ BlockDriverAIOCB *bdrv_aio_flush(BlockDriverState *bs,
 
 void bdrv_aio_cancel(BlockDriverAIOCB *acb)
 {
+    BlockDriverState *bs = acb->bs;
+    BdrvTrackedWrite *tw;
+
     acb->pool->cancel(acb);
+
+    /* the acb may be reused now, only compare the pointer */
+    if (bs) {
+        QLIST_FOREACH(tw, &bs->tracked_writes, list) {
+            if (tw->acb == acb) {
+                bdrv_tracked_write_end(tw);
+                break;
+            }
+        }
+    }
 }
 
 
@@ -2632,6 +3218,23 @@ void qemu_aio_release(void *p)
     pool->free_aiocb = acb;
 }
 
+/*
+ * Records the completion of a host AIO request that took ns nanoseconds.
+ * Bucket i counts the requests that took [2^i, 2^(i+1)) microseconds; the
+ * first and the last bucket are open-ended.
+ */
+void bdrv_aio_account_latency(BlockDriverState *bs, int64_t ns)
+{
+    int64_t us = ns / 1000;
+    int i = 0;
+
+    while (us > 1 && i < BDRV_AIO_LATENCY_BUCKETS - 1) {
+        us >>= 1;
+        i++;
+    }
+    bs->aio_latency[i]++;
+}
+
 /**************************************************************/
 /* removable device support */
 
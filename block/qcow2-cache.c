@@ -0,0 +1,481 @@
+/*
+ * Metadata cache for the QCOW version 2 format
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * L2 tables and refcount blocks are both exactly one cluster, so they share a
+ * single pool of cluster sized tables. Tables are looked up by their offset in
+ * the image file through a hash table and replaced in LRU order. A table that
+ * is in use (between qcow2_cache_get and qcow2_cache_put) is never evicted.
+ *
+ * Modifications are tracked per table as a dirty byte range. In writethrough
+ * mode the dirty sectors are written when the table is released; otherwise
+ * they stay in memory until the table is evicted or the cache is flushed.
+ * Refcount blocks are always written (and flushed to the disk) before any L2
+ * table, so that an L2 entry never points to a cluster whose refcount is not
+ * yet stable. A batch of writeback therefore costs a single fdatasync between
+ * the refcount blocks and the L2 tables, however many allocations it covers.
+ */
+
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+
+typedef struct Qcow2CacheEntry {
+    uint64_t offset;    /* 0 if the entry is unused */
+    int type;
+    int ref;
+    int dirty_start;
+    int dirty_end;      /* dirty_start == dirty_end if clean */
+    QLIST_ENTRY(Qcow2CacheEntry) hash_next;
+    QTAILQ_ENTRY(Qcow2CacheEntry) lru_next;
+} Qcow2CacheEntry;
+
+struct Qcow2Cache {
+    int size;
+    int cluster_bits;
+    bool writethrough;
+    /* data written since the last flush must be stable before any L2 table */
+    bool depends_on_flush;
+    int nb_dirty[QCOW2_CACHE_TYPES];
+    uint8_t *tables;
+    Qcow2CacheEntry *entries;
+    unsigned int hash_mask;
+    QLIST_HEAD(, Qcow2CacheEntry) *hash;
+    /* least recently used first */
+    QTAILQ_HEAD(, Qcow2CacheEntry) lru;
+};
+
+static inline unsigned int qcow2_cache_hash(Qcow2Cache *c, uint64_t offset)
+{
+    uint64_t n = offset >> c->cluster_bits;
+    return (n ^ (n >> 16)) & c->hash_mask;
+}
+
+static inline int qcow2_cache_index(Qcow2Cache *c, Qcow2CacheEntry *e)
+{
+    return e - c->entries;
+}
+
+static inline void *qcow2_cache_table(Qcow2Cache *c, Qcow2CacheEntry *e)
+{
+    return c->tables + ((size_t)qcow2_cache_index(c, e) << c->cluster_bits);
+}
+
+static Qcow2CacheEntry *qcow2_cache_entry(Qcow2Cache *c, void *table)
+{
+    ptrdiff_t diff = (uint8_t *)table - c->tables;
+    int i = diff >> c->cluster_bits;
+
+    assert(diff >= 0 && i < c->size &&
+           (diff & ((1 << c->cluster_bits) - 1)) == 0);
+    return &c->entries[i];
+}
+
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    bool writethrough)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Cache *c;
+    int i, hash_size;
+
+    if (num_tables < QCOW2_CACHE_MIN_TABLES) {
+        num_tables = QCOW2_CACHE_MIN_TABLES;
+    }
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = num_tables;
+    c->cluster_bits = s->cluster_bits;
+    c->writethrough = writethrough;
+    c->tables = qemu_blockalign(bs, (size_t)num_tables << s->cluster_bits);
+    c->entries = qemu_mallocz(num_tables * sizeof(*c->entries));
+
+    for (hash_size = 1; hash_size < num_tables; hash_size <<= 1) {
+        /* nothing */
+    }
+    c->hash_mask = hash_size - 1;
+    c->hash = qemu_mallocz(hash_size * sizeof(*c->hash));
+
+    QTAILQ_INIT(&c->lru);
+    for (i = 0; i < num_tables; i++) {
+        QTAILQ_INSERT_TAIL(&c->lru, &c->entries[i], lru_next);
+    }
+
+    return c;
+}
+
+int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        assert(c->entries[i].ref == 0);
+    }
+
+    qemu_vfree(c->tables);
+    qemu_free(c->entries);
+    qemu_free(c->hash);
+    qemu_free(c);
+
+    return 0;
+}
+
+bool qcow2_cache_set_writethrough(Qcow2Cache *c, bool enable)
+{
+    bool old = c->writethrough;
+
+    c->writethrough = enable;
+    return old;
+}
+
+static int qcow2_cache_entry_flush(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2CacheEntry *e)
+{
+    int start, end;
+    int ret;
+
+    if (e->dirty_start == e->dirty_end) {
+        return 0;
+    }
+
+    /* write whole sectors to avoid a read-modify-write in bdrv_pwrite */
+    start = e->dirty_start & ~511;
+    end = (e->dirty_end + 511) & ~511;
+
+    if (e->type == QCOW2_CACHE_L2) {
+        BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
+    } else {
+        BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_UPDATE_PART);
+    }
+
+    ret = bdrv_pwrite(bs->file, e->offset + start,
+        (uint8_t *)qcow2_cache_table(c, e) + start, end - start);
+    if (ret < 0) {
+        return ret;
+    }
+
+    e->dirty_start = e->dirty_end = 0;
+    c->nb_dirty[e->type]--;
+    bs->metadata_cache_writes++;
+
+    return 0;
+}
+
+static int compare_entry_offsets(const void *a, const void *b)
+{
+    const Qcow2CacheEntry *ea = *(Qcow2CacheEntry * const *)a;
+    const Qcow2CacheEntry *eb = *(Qcow2CacheEntry * const *)b;
+
+    if (ea->offset < eb->offset) {
+        return -1;
+    }
+    return ea->offset > eb->offset;
+}
+
+/* Writes all dirty tables of the given type, in ascending file offset */
+static int qcow2_cache_flush_type(BlockDriverState *bs, Qcow2Cache *c,
+    int type)
+{
+    Qcow2CacheEntry **dirty;
+    int i, n, ret, result = 0;
+
+    if (c->nb_dirty[type] == 0) {
+        return 0;
+    }
+
+    dirty = qemu_malloc(c->nb_dirty[type] * sizeof(*dirty));
+    for (i = 0, n = 0; i < c->size; i++) {
+        Qcow2CacheEntry *e = &c->entries[i];
+        if (e->type == type && e->dirty_start != e->dirty_end) {
+            dirty[n++] = e;
+        }
+    }
+    assert(n == c->nb_dirty[type]);
+    qsort(dirty, n, sizeof(*dirty), compare_entry_offsets);
+
+    for (i = 0; i < n; i++) {
+        ret = qcow2_cache_entry_flush(bs, c, dirty[i]);
+        if (ret < 0 && result == 0) {
+            result = ret;
+        }
+    }
+
+    qemu_free(dirty);
+    return result;
+}
+
+/*
+ * Writes all dirty refcount blocks and makes them stable on disk. Used before
+ * newly allocated clusters are hooked into the image (L1 table, refcount
+ * table, snapshot table) and before any L2 table is written.
+ */
+int qcow2_cache_flush_refcounts(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    ret = qcow2_cache_flush_type(bs, c, QCOW2_CACHE_REFCOUNT);
+    if (ret < 0) {
+        return ret;
+    }
+
+    c->depends_on_flush = false;
+    return bdrv_flush(bs->file);
+}
+
+/*
+ * Makes sure that no L2 table can reach the disk before the refcount blocks
+ * that were modified together with it, nor before the data it points to.
+ */
+static int qcow2_cache_l2_barrier(BlockDriverState *bs, Qcow2Cache *c)
+{
+    if (c->nb_dirty[QCOW2_CACHE_REFCOUNT] == 0 && !c->depends_on_flush) {
+        return 0;
+    }
+
+    return qcow2_cache_flush_refcounts(bs, c);
+}
+
+/*
+ * Requests a flush of the image file before the next L2 table is written,
+ * e.g. because the L2 update points to clusters whose data was just written.
+ */
+void qcow2_cache_depends_on_flush(Qcow2Cache *c)
+{
+    c->depends_on_flush = true;
+}
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c)
+{
+    int ret;
+
+    if (c->nb_dirty[QCOW2_CACHE_L2] == 0) {
+        return qcow2_cache_flush_type(bs, c, QCOW2_CACHE_REFCOUNT);
+    }
+
+    ret = qcow2_cache_l2_barrier(bs, c);
+    if (ret < 0) {
+        return ret;
+    }
+
+    return qcow2_cache_flush_type(bs, c, QCOW2_CACHE_L2);
+}
+
+static Qcow2CacheEntry *qcow2_cache_lookup(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CacheEntry *e;
+
+    QLIST_FOREACH(e, &c->hash[qcow2_cache_hash(c, offset)], hash_next) {
+        if (e->offset == offset) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Detaches the least recently used table that is not in use */
+static int qcow2_cache_evict(BlockDriverState *bs, Qcow2Cache *c,
+    Qcow2CacheEntry **entry)
+{
+    Qcow2CacheEntry *e;
+    int ret;
+
+    QTAILQ_FOREACH(e, &c->lru, lru_next) {
+        if (e->ref == 0) {
+            break;
+        }
+    }
+
+    if (e == NULL) {
+        /* Every table is referenced; callers only hold a handful of them */
+        abort();
+    }
+
+    if (e->dirty_start != e->dirty_end) {
+        if (e->type == QCOW2_CACHE_L2) {
+            ret = qcow2_cache_l2_barrier(bs, c);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        ret = qcow2_cache_entry_flush(bs, c, e);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    if (e->offset) {
+        QLIST_REMOVE(e, hash_next);
+        e->offset = 0;
+    }
+
+    *entry = e;
+    return 0;
+}
+
+static int qcow2_cache_do_get(BlockDriverState *bs, Qcow2Cache *c, int type,
+    uint64_t offset, void **table, bool read_from_disk)
+{
+    Qcow2CacheEntry *e;
+    int ret;
+
+    assert(offset != 0);
+
+    e = qcow2_cache_lookup(c, offset);
+    if (e != NULL) {
+        if (e->type != type) {
+            /* The cluster was freed and reused for the other kind of table */
+            assert(e->ref == 0);
+            if (e->dirty_start != e->dirty_end) {
+                e->dirty_start = e->dirty_end = 0;
+                c->nb_dirty[e->type]--;
+            }
+            e->type = type;
+            if (read_from_disk) {
+                bs->metadata_cache_misses++;
+                goto load;
+            }
+        }
+        bs->metadata_cache_hits++;
+        goto found;
+    }
+
+    bs->metadata_cache_misses++;
+
+    ret = qcow2_cache_evict(bs, c, &e);
+    if (ret < 0) {
+        return ret;
+    }
+
+    e->type = type;
+    if (read_from_disk) {
+load:
+        if (type == QCOW2_CACHE_L2) {
+            BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_REFBLOCK_LOAD);
+        }
+        ret = bdrv_pread(bs->file, offset, qcow2_cache_table(c, e),
+            1 << c->cluster_bits);
+        if (ret < 0) {
+            if (e->offset) {
+                QLIST_REMOVE(e, hash_next);
+                e->offset = 0;
+            }
+            return ret;
+        }
+    }
+
+    if (e->offset == 0) {
+        e->offset = offset;
+        QLIST_INSERT_HEAD(&c->hash[qcow2_cache_hash(c, offset)], e, hash_next);
+    }
+
+found:
+    e->ref++;
+    QTAILQ_REMOVE(&c->lru, e, lru_next);
+    QTAILQ_INSERT_TAIL(&c->lru, e, lru_next);
+    *table = qcow2_cache_table(c, e);
+    return 0;
+}
+
+/*
+ * Returns a reference to the table at 'offset', reading it from the image
+ * file if it is not cached. The table stays valid until qcow2_cache_put().
+ */
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int type,
+    uint64_t offset, void **table)
+{
+    return qcow2_cache_do_get(bs, c, type, offset, table, true);
+}
+
+/*
+ * Like qcow2_cache_get(), but for a newly allocated table: the contents are
+ * undefined and must be completely initialised by the caller.
+ */
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int type,
+    uint64_t offset, void **table)
+{
+    return qcow2_cache_do_get(bs, c, type, offset, table, false);
+}
+
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table)
+{
+    Qcow2CacheEntry *e = qcow2_cache_entry(c, *table);
+    int ret = 0;
+
+    assert(e->ref > 0);
+    e->ref--;
+    *table = NULL;
+
+    if (c->writethrough && e->ref == 0 && e->dirty_start != e->dirty_end) {
+        if (e->type == QCOW2_CACHE_L2) {
+            ret = qcow2_cache_l2_barrier(bs, c);
+        }
+        if (ret == 0) {
+            ret = qcow2_cache_entry_flush(bs, c, e);
+        }
+    }
+
+    return ret;
+}
+
+/* Records that bytes [start, end) of a referenced table were modified */
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table, int start,
+    int end)
+{
+    Qcow2CacheEntry *e = qcow2_cache_entry(c, table);
+
+    assert(e->ref > 0 && start < end && end <= (1 << c->cluster_bits));
+
+    if (e->dirty_start == e->dirty_end) {
+        e->dirty_start = start;
+        e->dirty_end = end;
+        c->nb_dirty[e->type]++;
+    } else {
+        e->dirty_start = MIN(e->dirty_start, start);
+        e->dirty_end = MAX(e->dirty_end, end);
+    }
+}
+
+/*
+ * Forgets the table at 'offset' without writing it back. Called when the
+ * cluster is freed, so that stale metadata can't overwrite whatever the
+ * cluster is reused for.
+ */
+void qcow2_cache_discard(Qcow2Cache *c, uint64_t offset)
+{
+    Qcow2CacheEntry *e = qcow2_cache_lookup(c, offset);
+
+    if (e == NULL || e->ref) {
+        return;
+    }
+
+    if (e->dirty_start != e->dirty_end) {
+        e->dirty_start = e->dirty_end = 0;
+        c->nb_dirty[e->type]--;
+    }
+    QLIST_REMOVE(e, hash_next);
+    e->offset = 0;
+    QTAILQ_REMOVE(&c->lru, e, lru_next);
+    QTAILQ_INSERT_HEAD(&c->lru, e, lru_next);
+}
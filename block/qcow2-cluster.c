@@ -22,8 +22,6 @@
  * THE SOFTWARE.
  */
 
-#include <zlib.h>
-
 #include "qemu-common.h"
 #include "block_int.h"
 #include "block/qcow2.h"
@@ -67,7 +65,11 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
         qemu_free(new_l1_table);
         return new_l1_table_offset;
     }
-    bdrv_flush(bs->file);
+
+    ret = qcow2_cache_flush_refcounts(bs, s->metadata_cache);
+    if (ret < 0) {
+        goto fail;
+    }
 
     BLKDBG_EVENT(bs->file, BLKDBG_L1_GROW_WRITE_TABLE);
     for(i = 0; i < s->l1_size; i++)
@@ -98,104 +100,23 @@ int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size)
     return ret;
 }
 
-void qcow2_l2_cache_reset(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-
-    memset(s->l2_cache, 0, s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_offsets, 0, L2_CACHE_SIZE * sizeof(uint64_t));
-    memset(s->l2_cache_counts, 0, L2_CACHE_SIZE * sizeof(uint32_t));
-}
-
-static inline int l2_cache_new_entry(BlockDriverState *bs)
-{
-    BDRVQcowState *s = bs->opaque;
-    uint32_t min_count;
-    int min_index, i;
-
-    /* find a new entry in the least used one */
-    min_index = 0;
-    min_count = 0xffffffff;
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (s->l2_cache_counts[i] < min_count) {
-            min_count = s->l2_cache_counts[i];
-            min_index = i;
-        }
-    }
-    return min_index;
-}
-
-/*
- * seek_l2_table
- *
- * seek l2_offset in the l2_cache table
- * if not found, return NULL,
- * if found,
- *   increments the l2 cache hit count of the entry,
- *   if counter overflow, divide by two all counters
- *   return the pointer to the l2 cache entry
- *
- */
-
-static uint64_t *seek_l2_table(BDRVQcowState *s, uint64_t l2_offset)
-{
-    int i, j;
-
-    for(i = 0; i < L2_CACHE_SIZE; i++) {
-        if (l2_offset == s->l2_cache_offsets[i]) {
-            /* increment the hit count */
-            if (++s->l2_cache_counts[i] == 0xffffffff) {
-                for(j = 0; j < L2_CACHE_SIZE; j++) {
-                    s->l2_cache_counts[j] >>= 1;
-                }
-            }
-            return s->l2_cache + (i << s->l2_bits);
-        }
-    }
-    return NULL;
-}
-
 /*
  * l2_load
  *
  * Loads a L2 table into memory. If the table is in the cache, the cache
  * is used; otherwise the L2 table is loaded from the image file.
  *
- * Returns a pointer to the L2 table on success, or NULL if the read from
- * the image file failed.
+ * On success the table is referenced and must be released with
+ * qcow2_cache_put().
  */
 
 static int l2_load(BlockDriverState *bs, uint64_t l2_offset,
     uint64_t **l2_table)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
-    int ret;
-
-    /* seek if the table for the given offset is in the cache */
-
-    *l2_table = seek_l2_table(s, l2_offset);
-    if (*l2_table != NULL) {
-        return 0;
-    }
-
-    /* not found: load a new entry in the least used one */
-
-    min_index = l2_cache_new_entry(bs);
-    *l2_table = s->l2_cache + (min_index << s->l2_bits);
-
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_LOAD);
-    ret = bdrv_pread(bs->file, l2_offset, *l2_table,
-        s->l2_size * sizeof(uint64_t));
-    if (ret < 0) {
-        qcow2_l2_cache_reset(bs);
-        return ret;
-    }
 
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
-    return 0;
+    return qcow2_cache_get(bs, s->metadata_cache, QCOW2_CACHE_L2, l2_offset,
+        (void **) l2_table);
 }
 
 /*
@@ -238,9 +159,8 @@ static int write_l1_entry(BlockDriverState *bs, int l1_index)
 static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 {
     BDRVQcowState *s = bs->opaque;
-    int min_index;
     uint64_t old_l2_offset;
-    uint64_t *l2_table;
+    uint64_t *l2_table, *old_table;
     int64_t l2_offset;
     int ret;
 
@@ -252,21 +172,34 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
     if (l2_offset < 0) {
         return l2_offset;
     }
-    bdrv_flush(bs->file);
+
+    /* the L1 table must not point to the new table before its refcount */
+    ret = qcow2_cache_flush_refcounts(bs, s->metadata_cache);
+    if (ret < 0) {
+        return ret;
+    }
 
     /* allocate a new entry in the l2 cache */
 
-    min_index = l2_cache_new_entry(bs);
-    l2_table = s->l2_cache + (min_index << s->l2_bits);
+    ret = qcow2_cache_get_empty(bs, s->metadata_cache, QCOW2_CACHE_L2,
+        l2_offset, (void **) table);
+    if (ret < 0) {
+        return ret;
+    }
+    l2_table = *table;
 
     if (old_l2_offset == 0) {
         /* if there was no old l2 table, clear the new table */
         memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
     } else {
-        /* if there was an old l2 table, read it from the disk */
+        /* if there was an old l2 table, copy it from the cache or the disk */
         BLKDBG_EVENT(bs->file, BLKDBG_L2_ALLOC_COW_READ);
-        ret = bdrv_pread(bs->file, old_l2_offset, l2_table,
-            s->l2_size * sizeof(uint64_t));
+        ret = l2_load(bs, old_l2_offset, &old_table);
+        if (ret < 0) {
+            goto fail;
+        }
+        memcpy(l2_table, old_table, s->cluster_size);
+        ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &old_table);
         if (ret < 0) {
             goto fail;
         }
@@ -286,17 +219,12 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
         goto fail;
     }
 
-    /* update the l2 cache entry */
-
-    s->l2_cache_offsets[min_index] = l2_offset;
-    s->l2_cache_counts[min_index] = 1;
-
-    *table = l2_table;
     return 0;
 
 fail:
+    qcow2_cache_put(bs, s->metadata_cache, (void **) table);
+    qcow2_cache_discard(s->metadata_cache, l2_offset);
     s->l1_table[l1_index] = old_l2_offset;
-    qcow2_l2_cache_reset(bs);
     return ret;
 }
 
@@ -389,9 +317,11 @@ static int qcow2_read(BlockDriverState *bs, int64_t sector_num,
                 memset(buf, 0, 512 * n);
             }
         } else if (cluster_offset & QCOW_OFLAG_COMPRESSED) {
-            if (qcow2_decompress_cluster(bs, cluster_offset) < 0)
+            uint8_t *data;
+            if (qcow2_decompress_cluster(bs, sector_num << 9, cluster_offset,
+                                         &data) < 0)
                 return -1;
-            memcpy(buf, s->cluster_cache + index_in_cluster * 512, 512 * n);
+            memcpy(buf, data + index_in_cluster * 512, 512 * n);
         } else {
             BLKDBG_EVENT(bs->file, BLKDBG_READ);
             ret = bdrv_pread(bs->file, cluster_offset + index_in_cluster * 512, buf, n * 512);
@@ -521,6 +451,11 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
                 &l2_table[l2_index], 0, QCOW_OFLAG_COPIED);
     }
 
+    ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
    nb_available = (c * s->cluster_sectors);
 out:
     if (nb_available > nb_needed)
@@ -539,7 +474,8 @@ out:
  * the l2 table.
  *
  * the l2 table offset in the qcow2 file and the cluster index
- * in the l2 table are given to the caller.
+ * in the l2 table are given to the caller. The l2 table is referenced in
+ * the metadata cache and must be released with qcow2_cache_put().
  *
  * Returns 0 on success, -errno in failure case
  */
@@ -624,14 +560,17 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
     }
 
     cluster_offset = be64_to_cpu(l2_table[l2_index]);
-    if (cluster_offset & QCOW_OFLAG_COPIED)
+    if (cluster_offset & QCOW_OFLAG_COPIED) {
+        qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
         return cluster_offset & ~QCOW_OFLAG_COPIED;
+    }
 
     if (cluster_offset)
         qcow2_free_any_clusters(bs, cluster_offset, 1);
 
     cluster_offset = qcow2_alloc_bytes(bs, compressed_size);
     if (cluster_offset < 0) {
+        qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
         return 0;
     }
 
@@ -647,44 +586,21 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     l2_table[l2_index] = cpu_to_be64(cluster_offset);
-    if (bdrv_pwrite_sync(bs->file,
-                    l2_offset + l2_index * sizeof(uint64_t),
-                    l2_table + l2_index,
-                    sizeof(uint64_t)) < 0)
-        return 0;
-
-    return cluster_offset;
-}
-
-/*
- * Write L2 table updates to disk, writing whole sectors to avoid a
- * read-modify-write in bdrv_pwrite
- */
-#define L2_ENTRIES_PER_SECTOR (512 / 8)
-static int write_l2_entries(BlockDriverState *bs, uint64_t *l2_table,
-    uint64_t l2_offset, int l2_index, int num)
-{
-    int l2_start_index = l2_index & ~(L1_ENTRIES_PER_SECTOR - 1);
-    int start_offset = (8 * l2_index) & ~511;
-    int end_offset = (8 * (l2_index + num) + 511) & ~511;
-    size_t len = end_offset - start_offset;
-    int ret;
-
-    BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE);
-    ret = bdrv_pwrite(bs->file, l2_offset + start_offset,
-        &l2_table[l2_start_index], len);
+    qcow2_cache_entry_mark_dirty(s->metadata_cache, l2_table,
+        l2_index * sizeof(uint64_t), (l2_index + 1) * sizeof(uint64_t));
+    ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
     if (ret < 0) {
-        return ret;
+        return 0;
     }
 
-    return 0;
+    return cluster_offset;
 }
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 {
     BDRVQcowState *s = bs->opaque;
     int i, j = 0, l2_index, ret;
-    uint64_t *old_cluster, start_sect, l2_offset, *l2_table;
+    uint64_t *old_cluster, start_sect, l2_offset, *l2_table = NULL;
     uint64_t cluster_offset = m->cluster_offset;
 
     if (m->nb_clusters == 0)
@@ -731,13 +647,16 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     /*
      * Before we update the L2 table to actually point to the new cluster, we
      * need to be sure that the refcounts have been increased and COW was
-     * handled.
+     * handled. The metadata cache flushes the image file before it writes
+     * the L2 table, so several allocations share one flush in writeback mode.
      */
-    bdrv_flush(bs->file);
+    qcow2_cache_depends_on_flush(s->metadata_cache);
 
-    ret = write_l2_entries(bs, l2_table, l2_offset, l2_index, m->nb_clusters);
+    qcow2_cache_entry_mark_dirty(s->metadata_cache, l2_table,
+        l2_index * sizeof(uint64_t),
+        (l2_index + m->nb_clusters) * sizeof(uint64_t));
+    ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
     if (ret < 0) {
-        qcow2_l2_cache_reset(bs);
         goto err;
     }
 
@@ -746,6 +665,10 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      * Also flush bs->file to get the right order for L2 and refcount update.
      */
     if (j != 0) {
+        ret = qcow2_cache_flush(bs, s->metadata_cache);
+        if (ret < 0) {
+            goto err;
+        }
         bdrv_flush(bs->file);
         for (i = 0; i < j; i++) {
             qcow2_free_any_clusters(bs,
@@ -809,6 +732,11 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
         m->nb_clusters = 0;
         m->depends_on = NULL;
 
+        ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
+        if (ret < 0) {
+            return ret;
+        }
+
         goto out;
     }
 
@@ -841,6 +769,11 @@ int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     assert(i <= nb_clusters);
     nb_clusters = i;
 
+    ret = qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
+    if (ret < 0) {
+        return ret;
+    }
+
     /*
      * Check if there already is an AIO write request in flight which allocates
      * the same cluster. In this case we need to wait until the previous
@@ -900,55 +833,3 @@ out:
 
     return 0;
 }
-
-static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
-                             const uint8_t *buf, int buf_size)
-{
-    z_stream strm1, *strm = &strm1;
-    int ret, out_len;
-
-    memset(strm, 0, sizeof(*strm));
-
-    strm->next_in = (uint8_t *)buf;
-    strm->avail_in = buf_size;
-    strm->next_out = out_buf;
-    strm->avail_out = out_buf_size;
-
-    ret = inflateInit2(strm, -12);
-    if (ret != Z_OK)
-        return -1;
-    ret = inflate(strm, Z_FINISH);
-    out_len = strm->next_out - out_buf;
-    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
-        out_len != out_buf_size) {
-        inflateEnd(strm);
-        return -1;
-    }
-    inflateEnd(strm);
-    return 0;
-}
-
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset)
-{
-    BDRVQcowState *s = bs->opaque;
-    int ret, csize, nb_csectors, sector_offset;
-    uint64_t coffset;
-
-    coffset = cluster_offset & s->cluster_offset_mask;
-    if (s->cluster_cache_offset != coffset) {
-        nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
-        sector_offset = coffset & 511;
-        csize = nb_csectors * 512 - sector_offset;
-        BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
-        ret = bdrv_read(bs->file, coffset >> 9, s->cluster_data, nb_csectors);
-        if (ret < 0) {
-            return -1;
-        }
-        if (decompress_buffer(s->cluster_cache, s->cluster_size,
-                              s->cluster_data + sector_offset, csize) < 0) {
-            return -1;
-        }
-        s->cluster_cache_offset = coffset;
-    }
-    return 0;
-}
@@ -0,0 +1,634 @@
+/*
+ * Compressed clusters for the QCOW version 2 format
+ *
+ * Copyright (c) 2004-2006 Fabrice Bellard
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+/*
+ * Reading: decompressed clusters are kept in a small LRU cache indexed by
+ * their offset in the image file. Compressed data is never modified in place,
+ * so an entry stays valid until its clusters are freed. On a miss, the
+ * following guest clusters of the same L2 table are looked at too: if their
+ * compressed data directly follows (which is how qemu-img convert -c lays
+ * them out), the whole run is read with a single request and decompressed
+ * into the cache.
+ *
+ * Writing: deflate runs in a pool of worker threads. The block layer is not
+ * thread safe, so the workers only compress; allocation, the write and the L2
+ * update are done by the caller in submission order, on a later call or when
+ * the queue is drained. Any other request on the image drains the queue
+ * first, so pending clusters are never observed.
+ */
+
+#include <zlib.h>
+#include "qemu-common.h"
+#include "block_int.h"
+#include "block/qcow2.h"
+#ifndef _WIN32
+#include "qemu-thread.h"
+#endif
+
+/* Number of decompressed clusters kept in memory */
+#define QCOW2_DECOMPRESS_CACHE_SIZE     32
+/* Number of following compressed clusters read along with a missing one */
+#define QCOW2_DECOMPRESS_READAHEAD      8
+
+#define QCOW2_COMPRESS_MAX_THREADS      16
+/* Clusters queued per worker before the caller has to wait */
+#define QCOW2_COMPRESS_JOBS_PER_THREAD  4
+
+typedef struct Qcow2DecompressEntry {
+    uint64_t coffset;   /* 0 if the entry is unused */
+    uint64_t cend;      /* end of the compressed data */
+    uint64_t lru_counter;
+    uint8_t *data;
+} Qcow2DecompressEntry;
+
+struct Qcow2DecompressCache {
+    int size;
+    uint64_t lru_counter;
+    uint8_t *buf;       /* compressed data of one read-ahead window */
+    int buf_size;
+    Qcow2DecompressEntry *entries;
+};
+
+typedef struct Qcow2CompressJob {
+    int64_t sector_num;
+    uint8_t *buf;
+    uint8_t *out_buf;
+    int out_len;        /* -1 if the cluster does not compress */
+    int ret;
+    bool done;
+    QTAILQ_ENTRY(Qcow2CompressJob) next;
+    QTAILQ_ENTRY(Qcow2CompressJob) todo_next;
+} Qcow2CompressJob;
+
+#ifndef _WIN32
+struct Qcow2CompressPool {
+    QemuMutex lock;
+    QemuCond work_cond;
+    QemuCond done_cond;
+    QemuThread *threads;
+    int nb_threads;
+    int cluster_size;
+    bool quit;
+
+    /* Only touched by the caller thread */
+    int nb_jobs;
+    int max_jobs;
+    bool committing;
+    int ret;            /* first error not reported yet */
+    QTAILQ_HEAD(, Qcow2CompressJob) jobs;   /* in submission order */
+
+    /* Protected by lock */
+    QTAILQ_HEAD(, Qcow2CompressJob) todo;
+};
+#endif
+
+static void compress_cluster_info(BDRVQcowState *s, uint64_t cluster_offset,
+                                  uint64_t *coffset, int *nb_csectors)
+{
+    *coffset = cluster_offset & s->cluster_offset_mask;
+    *nb_csectors = ((cluster_offset >> s->csize_shift) & s->csize_mask) + 1;
+}
+
+static int decompress_buffer(uint8_t *out_buf, int out_buf_size,
+                             const uint8_t *buf, int buf_size)
+{
+    z_stream strm1, *strm = &strm1;
+    int ret, out_len;
+
+    memset(strm, 0, sizeof(*strm));
+
+    strm->next_in = (uint8_t *)buf;
+    strm->avail_in = buf_size;
+    strm->next_out = out_buf;
+    strm->avail_out = out_buf_size;
+
+    ret = inflateInit2(strm, -12);
+    if (ret != Z_OK)
+        return -1;
+    ret = inflate(strm, Z_FINISH);
+    out_len = strm->next_out - out_buf;
+    if ((ret != Z_STREAM_END && ret != Z_BUF_ERROR) ||
+        out_len != out_buf_size) {
+        inflateEnd(strm);
+        return -1;
+    }
+    inflateEnd(strm);
+    return 0;
+}
+
+static Qcow2DecompressEntry *decompress_cache_lookup(Qcow2DecompressCache *c,
+                                                     uint64_t coffset)
+{
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        if (c->entries[i].coffset == coffset) {
+            return &c->entries[i];
+        }
+    }
+    return NULL;
+}
+
+static Qcow2DecompressEntry *decompress_cache_victim(Qcow2DecompressCache *c)
+{
+    Qcow2DecompressEntry *e = &c->entries[0];
+    int i;
+
+    for (i = 1; i < c->size; i++) {
+        if (c->entries[i].lru_counter < e->lru_counter) {
+            e = &c->entries[i];
+        }
+    }
+    return e;
+}
+
+/*
+ * Decompresses the cluster whose compressed data starts at 'coffset' from
+ * the read-ahead buffer (which starts at file offset 'buf_start') into a
+ * cache entry.
+ */
+static Qcow2DecompressEntry *decompress_cache_fill(BDRVQcowState *s,
+    uint64_t buf_start, uint64_t coffset, int nb_csectors)
+{
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2DecompressEntry *e;
+    int sector_offset, csize;
+
+    sector_offset = coffset & 511;
+    csize = nb_csectors * 512 - sector_offset;
+
+    e = decompress_cache_victim(c);
+    e->coffset = 0;
+    e->lru_counter = 0;
+    if (decompress_buffer(e->data, s->cluster_size,
+                          c->buf + (coffset - buf_start), csize) < 0) {
+        return NULL;
+    }
+    e->coffset = coffset;
+    e->cend = (coffset & ~511ULL) + nb_csectors * 512;
+    e->lru_counter = ++c->lru_counter;
+    return e;
+}
+
+/*
+ * Returns in *data the decompressed contents of the compressed cluster
+ * described by the L2 entry 'cluster_offset', which maps the guest offset
+ * 'offset'. The buffer stays valid until the next call.
+ */
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t offset,
+                             uint64_t cluster_offset, uint8_t **data)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    Qcow2DecompressEntry *e;
+    uint64_t coffset, start, end, l2_offset;
+    uint64_t ra_offset[QCOW2_DECOMPRESS_READAHEAD];
+    int ra_csectors[QCOW2_DECOMPRESS_READAHEAD];
+    uint64_t *l2_table;
+    int nb_csectors, nb_ra, l1_index, l2_index, i, ret;
+
+    compress_cluster_info(s, cluster_offset, &coffset, &nb_csectors);
+
+    e = decompress_cache_lookup(c, coffset);
+    if (e) {
+        e->lru_counter = ++c->lru_counter;
+        *data = e->data;
+        return 0;
+    }
+
+    start = coffset & ~511ULL;
+    end = start + nb_csectors * 512;
+
+    /* Collect the following clusters whose compressed data is contiguous */
+    nb_ra = 0;
+    l1_index = offset >> (s->l2_bits + s->cluster_bits);
+    l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
+    l2_offset = l1_index < s->l1_size ?
+        s->l1_table[l1_index] & ~QCOW_OFLAG_COPIED : 0;
+
+    if (l2_offset && qcow2_cache_get(bs, s->metadata_cache, QCOW2_CACHE_L2,
+                                     l2_offset, (void **) &l2_table) == 0) {
+        for (i = l2_index + 1; i < s->l2_size &&
+             nb_ra < QCOW2_DECOMPRESS_READAHEAD; i++) {
+            uint64_t entry = be64_to_cpu(l2_table[i]);
+            uint64_t next_start;
+            int next_csectors;
+
+            if (!(entry & QCOW_OFLAG_COMPRESSED)) {
+                break;
+            }
+            compress_cluster_info(s, entry, &ra_offset[nb_ra], &next_csectors);
+            next_start = ra_offset[nb_ra] & ~511ULL;
+            if (next_start < start || next_start > end ||
+                next_start + next_csectors * 512 - start > c->buf_size) {
+                break;
+            }
+            ra_csectors[nb_ra++] = next_csectors;
+            end = MAX(end, next_start + next_csectors * 512);
+        }
+        qcow2_cache_put(bs, s->metadata_cache, (void **) &l2_table);
+    }
+
+    BLKDBG_EVENT(bs->file, BLKDBG_READ_COMPRESSED);
+    ret = bdrv_read(bs->file, start >> 9, c->buf, (end - start) >> 9);
+    if (ret < 0) {
+        /* The read-ahead may have run past the end of the file */
+        if (nb_ra == 0) {
+            return -1;
+        }
+        nb_ra = 0;
+        end = start + nb_csectors * 512;
+        ret = bdrv_read(bs->file, start >> 9, c->buf, nb_csectors);
+        if (ret < 0) {
+            return -1;
+        }
+    }
+
+    for (i = 0; i < nb_ra; i++) {
+        if (ra_offset[i] != coffset &&
+            !decompress_cache_lookup(c, ra_offset[i])) {
+            /* a corrupt neighbour is only reported when it is accessed */
+            decompress_cache_fill(s, start, ra_offset[i], ra_csectors[i]);
+        }
+    }
+
+    e = decompress_cache_fill(s, start, coffset, nb_csectors);
+    if (!e) {
+        return -1;
+    }
+    *data = e->data;
+    return 0;
+}
+
+/* Drops the clusters whose compressed data overlaps a freed host cluster */
+void qcow2_decompress_discard(BlockDriverState *bs, uint64_t offset)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    int i;
+
+    for (i = 0; i < c->size; i++) {
+        Qcow2DecompressEntry *e = &c->entries[i];
+        if (e->coffset && e->coffset < offset + s->cluster_size &&
+            e->cend > offset) {
+            e->coffset = 0;
+            e->lru_counter = 0;
+        }
+    }
+}
+
+static int compress_buffer(uint8_t *out_buf, int *out_len,
+                           const uint8_t *buf, int size)
+{
+    z_stream strm;
+    int ret;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -1;
+    }
+
+    strm.avail_in = size;
+    strm.next_in = (uint8_t *)buf;
+    strm.avail_out = size;
+    strm.next_out = out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -1;
+    }
+    *out_len = strm.next_out - out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || *out_len >= size) {
+        *out_len = -1;
+    }
+    return 0;
+}
+
+static int compress_write(BlockDriverState *bs, Qcow2CompressJob *job)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t cluster_offset;
+    int ret;
+
+    if (job->out_len < 0) {
+        /* could not compress: write normal cluster */
+        return bdrv_write(bs, job->sector_num, job->buf, s->cluster_sectors);
+    }
+
+    cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
+        job->sector_num << 9, job->out_len);
+    if (!cluster_offset) {
+        return -EIO;
+    }
+    cluster_offset &= s->cluster_offset_mask;
+    BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+    ret = bdrv_pwrite(bs->file, cluster_offset, job->out_buf, job->out_len);
+    if (ret < 0) {
+        return ret;
+    }
+    return 0;
+}
+
+static Qcow2CompressJob *compress_job_new(BDRVQcowState *s,
+                                          int64_t sector_num,
+                                          const uint8_t *buf)
+{
+    Qcow2CompressJob *job;
+
+    job = qemu_mallocz(sizeof(*job));
+    job->sector_num = sector_num;
+    job->buf = qemu_malloc(s->cluster_size);
+    memcpy(job->buf, buf, s->cluster_size);
+    job->out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000)
+                               + 128);
+    return job;
+}
+
+static void compress_job_free(Qcow2CompressJob *job)
+{
+    qemu_free(job->buf);
+    qemu_free(job->out_buf);
+    qemu_free(job);
+}
+
+#ifndef _WIN32
+static void *compress_thread(void *opaque)
+{
+    Qcow2CompressPool *pool = opaque;
+    Qcow2CompressJob *job;
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && QTAILQ_EMPTY(&pool->todo)) {
+            qemu_cond_wait(&pool->work_cond, &pool->lock);
+        }
+        if (pool->quit) {
+            break;
+        }
+        job = QTAILQ_FIRST(&pool->todo);
+        QTAILQ_REMOVE(&pool->todo, job, todo_next);
+        qemu_mutex_unlock(&pool->lock);
+
+        ret = compress_buffer(job->out_buf, &job->out_len, job->buf,
+                              pool->cluster_size);
+
+        qemu_mutex_lock(&pool->lock);
+        job->ret = ret;
+        job->done = true;
+        qemu_cond_signal(&pool->done_cond);
+    }
+    qemu_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+static Qcow2CompressPool *compress_pool_create(BDRVQcowState *s)
+{
+    Qcow2CompressPool *pool;
+    long nb_cpus;
+    int i;
+
+    nb_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (nb_cpus <= 1) {
+        return NULL;
+    }
+
+    pool = qemu_mallocz(sizeof(*pool));
+    pool->nb_threads = MIN(nb_cpus, QCOW2_COMPRESS_MAX_THREADS);
+    pool->max_jobs = pool->nb_threads * QCOW2_COMPRESS_JOBS_PER_THREAD;
+    pool->cluster_size = s->cluster_size;
+    QTAILQ_INIT(&pool->jobs);
+    QTAILQ_INIT(&pool->todo);
+    qemu_mutex_init(&pool->lock);
+    qemu_cond_init(&pool->work_cond);
+    qemu_cond_init(&pool->done_cond);
+
+    pool->threads = qemu_mallocz(pool->nb_threads * sizeof(QemuThread));
+    for (i = 0; i < pool->nb_threads; i++) {
+        qemu_thread_create(&pool->threads[i], compress_thread, pool);
+    }
+    return pool;
+}
+
+static void compress_pool_destroy(Qcow2CompressPool *pool)
+{
+    int i;
+
+    qemu_mutex_lock(&pool->lock);
+    pool->quit = true;
+    qemu_cond_broadcast(&pool->work_cond);
+    qemu_mutex_unlock(&pool->lock);
+
+    for (i = 0; i < pool->nb_threads; i++) {
+        qemu_thread_join(&pool->threads[i]);
+    }
+
+    qemu_cond_destroy(&pool->done_cond);
+    qemu_cond_destroy(&pool->work_cond);
+    qemu_mutex_destroy(&pool->lock);
+    qemu_free(pool->threads);
+    qemu_free(pool);
+}
+
+/*
+ * Waits for the oldest queued cluster and writes it to the image. An error is
+ * kept until a compressed write or a flush picks it up.
+ */
+static void compress_commit_one(BlockDriverState *bs, Qcow2CompressPool *pool)
+{
+    Qcow2CompressJob *job = QTAILQ_FIRST(&pool->jobs);
+    int ret;
+
+    qemu_mutex_lock(&pool->lock);
+    while (!job->done) {
+        qemu_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    qemu_mutex_unlock(&pool->lock);
+
+    QTAILQ_REMOVE(&pool->jobs, job, next);
+    pool->nb_jobs--;
+
+    ret = job->ret;
+    if (ret == 0) {
+        pool->committing = true;
+        ret = compress_write(bs, job);
+        pool->committing = false;
+    }
+    compress_job_free(job);
+
+    if (ret < 0 && pool->ret == 0) {
+        pool->ret = ret;
+    }
+}
+
+/* Returns the first error not reported yet, and forgets it */
+static int compress_take_error(Qcow2CompressPool *pool)
+{
+    int ret = pool->ret;
+
+    pool->ret = 0;
+    return ret;
+}
+#endif
+
+/*
+ * Writes all queued compressed clusters, so that other requests see them.
+ * Errors are left for qcow2_compress_drain().
+ */
+void qcow2_compress_flush(BlockDriverState *bs)
+{
+#ifndef _WIN32
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressPool *pool = s->compress_pool;
+
+    /* The writes of a committed cluster come back here */
+    if (!pool || pool->committing) {
+        return;
+    }
+
+    while (pool->nb_jobs > 0) {
+        compress_commit_one(bs, pool);
+    }
+#endif
+}
+
+/*
+ * Writes all queued compressed clusters. Returns the first compressed write
+ * error that hasn't been returned yet; the remaining clusters are written
+ * nevertheless.
+ */
+int qcow2_compress_drain(BlockDriverState *bs)
+{
+#ifndef _WIN32
+    BDRVQcowState *s = bs->opaque;
+
+    qcow2_compress_flush(bs);
+    if (s->compress_pool && !s->compress_pool->committing) {
+        return compress_take_error(s->compress_pool);
+    }
+#endif
+    return 0;
+}
+
+/*
+ * Compresses one full cluster of guest data at 'sector_num'. The write may
+ * complete asynchronously, in which case an error is returned once, by a later
+ * call or by qcow2_compress_drain().
+ */
+int qcow2_compress_cluster(BlockDriverState *bs, int64_t sector_num,
+                           const uint8_t *buf)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2CompressJob *job;
+    int ret;
+
+#ifndef _WIN32
+    Qcow2CompressPool *pool;
+
+    if (!s->compress_pool) {
+        s->compress_pool = compress_pool_create(s);
+    }
+    pool = s->compress_pool;
+
+    if (pool) {
+        if (pool->nb_jobs >= pool->max_jobs) {
+            compress_commit_one(bs, pool);
+        }
+
+        job = compress_job_new(s, sector_num, buf);
+        QTAILQ_INSERT_TAIL(&pool->jobs, job, next);
+        pool->nb_jobs++;
+
+        qemu_mutex_lock(&pool->lock);
+        QTAILQ_INSERT_TAIL(&pool->todo, job, todo_next);
+        qemu_cond_signal(&pool->work_cond);
+        qemu_mutex_unlock(&pool->lock);
+        return compress_take_error(pool);
+    }
+#endif
+
+    job = compress_job_new(s, sector_num, buf);
+    ret = compress_buffer(job->out_buf, &job->out_len, job->buf,
+                          s->cluster_size);
+    if (ret == 0) {
+        ret = compress_write(bs, job);
+    }
+    compress_job_free(job);
+    return ret;
+}
+
+void qcow2_compress_init(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressCache *c;
+    int i;
+
+    c = qemu_mallocz(sizeof(*c));
+    c->size = QCOW2_DECOMPRESS_CACHE_SIZE;
+    c->entries = qemu_mallocz(c->size * sizeof(*c->entries));
+    for (i = 0; i < c->size; i++) {
+        c->entries[i].data = qemu_malloc(s->cluster_size);
+    }
+    /* one more sector for the alignment of the first cluster */
+    c->buf_size = (QCOW2_DECOMPRESS_READAHEAD + 1) * s->cluster_size + 512;
+    c->buf = qemu_blockalign(bs, c->buf_size);
+
+    s->decompress_cache = c;
+    s->compress_pool = NULL;
+}
+
+int qcow2_compress_close(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2DecompressCache *c = s->decompress_cache;
+    int ret, i;
+
+    ret = qcow2_compress_drain(bs);
+#ifndef _WIN32
+    if (s->compress_pool) {
+        compress_pool_destroy(s->compress_pool);
+        s->compress_pool = NULL;
+    }
+#endif
+
+    if (c) {
+        for (i = 0; i < c->size; i++) {
+            qemu_free(c->entries[i].data);
+        }
+        qemu_free(c->entries);
+        qemu_vfree(c->buf);
+        qemu_free(c);
+        s->decompress_cache = NULL;
+    }
+    return ret;
+}
@@ -121,7 +121,7 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     BDRVQcowState *s = bs->opaque;
     QCowSnapshot *sn;
     QCowSnapshotHeader h;
-    int i, name_size, id_str_size, snapshots_size;
+    int i, name_size, id_str_size, snapshots_size, ret;
     uint64_t data64;
     uint32_t data32;
     int64_t offset, snapshots_offset;
@@ -138,11 +138,16 @@ static int qcow2_write_snapshots(BlockDriverState *bs)
     snapshots_size = offset;
 
     snapshots_offset = qcow2_alloc_clusters(bs, snapshots_size);
-    bdrv_flush(bs->file);
     offset = snapshots_offset;
     if (offset < 0) {
         return offset;
     }
+    /* the refcounts of the new table must be stable before the header
+       points to it */
+    ret = qcow2_cache_flush_refcounts(bs, s->metadata_cache);
+    if (ret < 0) {
+        goto fail;
+    }
 
     for(i = 0; i < s->nb_snapshots; i++) {
         sn = s->snapshots + i;
@@ -243,6 +248,12 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
 
     memset(sn, 0, sizeof(*sn));
 
+    /* queued compressed clusters belong to the current state */
+    ret = qcow2_compress_drain(bs);
+    if (ret < 0) {
+        return ret;
+    }
+
     if (sn_info->id_str[0] == '\0') {
         /* compute a new id */
         find_new_snapshot_id(bs, sn_info->id_str, sizeof(sn_info->id_str));
@@ -272,7 +283,10 @@ int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info)
     if (l1_table_offset < 0) {
         goto fail;
     }
-    bdrv_flush(bs->file);
+    ret = qcow2_cache_flush_refcounts(bs, s->metadata_cache);
+    if (ret < 0) {
+        goto fail;
+    }
 
     sn->l1_table_offset = l1_table_offset;
     sn->l1_size = s->l1_size;
@@ -319,6 +333,9 @@ int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id)
     QCowSnapshot *sn;
     int i, snapshot_index, l1_size2;
 
+    if (qcow2_compress_drain(bs) < 0)
+        return -EIO;
+
     snapshot_index = find_snapshot_by_id_or_name(bs, snapshot_id);
     if (snapshot_index < 0)
         return -ENOENT;
@@ -24,7 +24,6 @@
 #include "qemu-common.h"
 #include "block_int.h"
 #include "module.h"
-#include <zlib.h>
 #include "aes.h"
 #include "block/qcow2.h"
 #include "qemu-error.h"
@@ -143,6 +142,7 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     int len, i, ret = 0;
     QCowHeader header;
     uint64_t ext_end;
+    uint64_t cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -217,13 +217,16 @@ static int qcow2_open(BlockDriverState *bs, int flags)
             be64_to_cpus(&s->l1_table[i]);
         }
     }
-    /* alloc L2 cache */
-    s->l2_cache = qemu_malloc(s->l2_size * L2_CACHE_SIZE * sizeof(uint64_t));
-    s->cluster_cache = qemu_malloc(s->cluster_size);
-    /* one more sector for decompressed data alignment */
-    s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size
-                                  + 512);
-    s->cluster_cache_offset = -1;
+    /* alloc L2 table and refcount block cache */
+    cache_size = bs->metadata_cache_size;
+    if (cache_size == 0) {
+        cache_size = QCOW2_DEFAULT_METADATA_CACHE_SIZE;
+    }
+    /* metadata updates may only be delayed if the guest may lose data, too */
+    s->metadata_cache = qcow2_cache_create(bs, cache_size >> s->cluster_bits,
+        !(flags & BDRV_O_CACHE_WB));
+    qcow2_compress_init(bs);
+    s->cluster_data = qemu_malloc(QCOW_MAX_CRYPT_CLUSTERS * s->cluster_size);
 
     ret = qcow2_refcount_init(bs);
     if (ret != 0) {
@@ -270,8 +273,10 @@ static int qcow2_open(BlockDriverState *bs, int flags)
     qcow2_free_snapshots(bs);
     qcow2_refcount_close(bs);
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
-    qemu_free(s->cluster_cache);
+    if (s->metadata_cache) {
+        qcow2_cache_destroy(bs, s->metadata_cache);
+    }
+    qcow2_compress_close(bs);
     qemu_free(s->cluster_data);
     return ret;
 }
@@ -325,6 +330,7 @@ static int qcow2_is_allocated(BlockDriverState *bs, int64_t sector_num,
     int ret;
 
     *pnum = nb_sectors;
+    qcow2_compress_flush(bs);
     /* FIXME We can get errors here, but the bdrv_is_allocated interface can't
      * pass them on today */
     ret = qcow2_get_cluster_offset(bs, sector_num << 9, pnum, &cluster_offset);
@@ -504,12 +510,15 @@ begin:
                 goto done;
         }
     } else if (acb->cluster_offset & QCOW_OFLAG_COMPRESSED) {
+        uint8_t *data;
+
         /* add AIO support for compressed blocks ? */
-        if (qcow2_decompress_cluster(bs, acb->cluster_offset) < 0)
+        if (qcow2_decompress_cluster(bs, acb->sector_num << 9,
+                                     acb->cluster_offset, &data) < 0)
             goto done;
 
         qemu_iovec_from_buffer(&acb->hd_qiov,
-            s->cluster_cache + index_in_cluster * 512,
+            data + index_in_cluster * 512,
             512 * acb->cur_nr_sectors);
 
         ret = qcow2_schedule_bh(qcow2_aio_read_bh, acb);
@@ -597,6 +606,9 @@ static BlockDriverAIOCB *qcow2_aio_readv(BlockDriverState *bs,
 {
     QCowAIOCB *acb;
 
+    /* errors go to the compressed writes or flushes they belong to */
+    qcow2_compress_flush(bs);
+
     acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 0);
     if (!acb)
         return NULL;
@@ -626,6 +638,31 @@ static void run_dependent_requests(QCowL2Meta *m)
     QLIST_INIT(&m->dependent_requests);
 }
 
+/*
+ * Without a backing file, unallocated clusters read as zeroes, so writing
+ * zeroes to them is a no-op. Returns the number of sectors at the start of
+ * the remaining request that can be skipped.
+ */
+static int qcow2_skip_zero_sectors(QCowAIOCB *acb)
+{
+    BlockDriverState *bs = acb->common.bs;
+    uint64_t cluster_offset;
+    int n, ret;
+
+    if (bs->backing_hd) {
+        return 0;
+    }
+
+    n = acb->remaining_sectors;
+    ret = qcow2_get_cluster_offset(bs, acb->sector_num << 9, &n,
+                                   &cluster_offset);
+    if (ret < 0 || cluster_offset != 0) {
+        return 0;
+    }
+
+    return qemu_iovec_find_nonzero(acb->qiov, acb->bytes_done, n * 512) / 512;
+}
+
 static void qcow2_aio_write_cb(void *opaque, int ret)
 {
     QCowAIOCB *acb = opaque;
@@ -644,9 +681,7 @@ static void qcow2_aio_write_cb(void *opaque, int ret)
 
     if (ret < 0)
         goto done;
-#ifdef CONFIG_COREMU
 begin:
-#endif
     acb->remaining_sectors -= acb->cur_nr_sectors;
     acb->sector_num += acb->cur_nr_sectors;
     acb->bytes_done += acb->cur_nr_sectors * 512;
@@ -663,6 +698,12 @@ begin:
         n_end > QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors)
         n_end = QCOW_MAX_CRYPT_CLUSTERS * s->cluster_sectors;
 
+    acb->cur_nr_sectors = qcow2_skip_zero_sectors(acb);
+    if (acb->cur_nr_sectors > 0) {
+        acb->l2meta.nb_clusters = 0;
+        goto begin;
+    }
+
     ret = qcow2_alloc_cluster_offset(bs, acb->sector_num << 9,
         index_in_cluster, n_end, &acb->cur_nr_sectors, &acb->l2meta);
     if (ret < 0) {
@@ -736,10 +777,10 @@ static BlockDriverAIOCB *qcow2_aio_writev(BlockDriverState *bs,
                                           BlockDriverCompletionFunc *cb,
                                           void *opaque)
 {
-    BDRVQcowState *s = bs->opaque;
     QCowAIOCB *acb;
 
-    s->cluster_cache_offset = -1; /* disable compressed cache */
+    /* errors go to the compressed writes or flushes they belong to */
+    qcow2_compress_flush(bs);
 
     acb = qcow2_aio_setup(bs, sector_num, qiov, nb_sectors, cb, opaque, 1);
     if (!acb)
@@ -753,8 +794,10 @@ static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
     qemu_free(s->l1_table);
-    qemu_free(s->l2_cache);
-    qemu_free(s->cluster_cache);
+
+    qcow2_compress_close(bs);
+    qcow2_cache_flush(bs, s->metadata_cache);
+    qcow2_cache_destroy(bs, s->metadata_cache);
     qemu_free(s->cluster_data);
     qcow2_refcount_close(bs);
 }
@@ -1147,72 +1190,40 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
                                   const uint8_t *buf, int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
-    int ret, out_len;
-    uint8_t *out_buf;
     uint64_t cluster_offset;
+    int ret;
 
     if (nb_sectors == 0) {
+        ret = qcow2_compress_drain(bs);
         /* align end of file to a sector boundary to ease reading with
            sector based I/Os */
         cluster_offset = bdrv_getlength(bs->file);
         cluster_offset = (cluster_offset + 511) & ~511;
         bdrv_truncate(bs->file, cluster_offset);
-        return 0;
+        return ret;
     }
 
     if (nb_sectors != s->cluster_sectors)
         return -EINVAL;
 
-    out_buf = qemu_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        qemu_free(out_buf);
-        return -1;
-    }
+    return qcow2_compress_cluster(bs, sector_num, buf);
+}
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+static int qcow2_flush(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    int ret;
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        qemu_free(out_buf);
-        deflateEnd(&strm);
-        return -1;
+    ret = qcow2_compress_drain(bs);
+    if (ret < 0) {
+        return ret;
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
 
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-    } else {
-        cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
-            sector_num << 9, out_len);
-        if (!cluster_offset)
-            return -1;
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        if (bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len) != out_len) {
-            qemu_free(out_buf);
-            return -1;
-        }
+    ret = qcow2_cache_flush(bs, s->metadata_cache);
+    if (ret < 0) {
+        return ret;
     }
 
-    qemu_free(out_buf);
-    return 0;
-}
-
-static int qcow2_flush(BlockDriverState *bs)
-{
     return bdrv_flush(bs->file);
 }
 
@@ -1220,6 +1231,19 @@ static BlockDriverAIOCB *qcow2_aio_flush(BlockDriverState *bs,
                                          BlockDriverCompletionFunc *cb,
                                          void *opaque)
 {
+    BDRVQcowState *s = bs->opaque;
+    int ret;
+
+    ret = qcow2_compress_drain(bs);
+    if (ret < 0) {
+        return NULL;
+    }
+
+    ret = qcow2_cache_flush(bs, s->metadata_cache);
+    if (ret < 0) {
+        return NULL;
+    }
+
     return bdrv_aio_flush(bs->file, cb, opaque);
 }
 
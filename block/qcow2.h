@@ -49,7 +49,20 @@
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
 
-#define L2_CACHE_SIZE 16
+/* default size of the metadata cache, in bytes */
+#define QCOW2_DEFAULT_METADATA_CACHE_SIZE (4 * 1024 * 1024)
+/* the cache always holds at least this many tables */
+#define QCOW2_CACHE_MIN_TABLES 16
+
+enum {
+    QCOW2_CACHE_L2,
+    QCOW2_CACHE_REFCOUNT,
+    QCOW2_CACHE_TYPES
+};
+
+typedef struct Qcow2Cache Qcow2Cache;
+typedef struct Qcow2DecompressCache Qcow2DecompressCache;
+typedef struct Qcow2CompressPool Qcow2CompressPool;
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -91,19 +104,15 @@ typedef struct BDRVQcowState {
     uint64_t cluster_offset_mask;
     uint64_t l1_table_offset;
     uint64_t *l1_table;
-    uint64_t *l2_cache;
-    uint64_t l2_cache_offsets[L2_CACHE_SIZE];
-    uint32_t l2_cache_counts[L2_CACHE_SIZE];
-    uint8_t *cluster_cache;
+    Qcow2Cache *metadata_cache; /* L2 tables and refcount blocks */
+    Qcow2DecompressCache *decompress_cache;
+    Qcow2CompressPool *compress_pool;
     uint8_t *cluster_data;
-    uint64_t cluster_cache_offset;
     QLIST_HEAD(QCowClusterAlloc, QCowL2Meta) cluster_allocs;
 
     uint64_t *refcount_table;
     uint64_t refcount_table_offset;
     uint32_t refcount_table_size;
-    uint64_t refcount_block_cache_offset;
-    uint16_t *refcount_block_cache;
     int64_t free_cluster_index;
     int64_t free_byte_offset;
 
@@ -188,8 +197,6 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res);
 
 /* qcow2-cluster.c functions */
 int qcow2_grow_l1_table(BlockDriverState *bs, int min_size, bool exact_size);
-void qcow2_l2_cache_reset(BlockDriverState *bs);
-int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t cluster_offset);
 void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
                      uint8_t *out_buf, const uint8_t *in_buf,
                      int nb_sectors, int enc,
@@ -205,6 +212,36 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 
+/* qcow2-cache.c functions */
+Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables,
+    bool writethrough);
+int qcow2_cache_destroy(BlockDriverState *bs, Qcow2Cache *c);
+bool qcow2_cache_set_writethrough(Qcow2Cache *c, bool enable);
+
+int qcow2_cache_flush(BlockDriverState *bs, Qcow2Cache *c);
+int qcow2_cache_flush_refcounts(BlockDriverState *bs, Qcow2Cache *c);
+void qcow2_cache_depends_on_flush(Qcow2Cache *c);
+void qcow2_cache_discard(Qcow2Cache *c, uint64_t offset);
+
+int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, int type,
+    uint64_t offset, void **table);
+int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, int type,
+    uint64_t offset, void **table);
+int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_entry_mark_dirty(Qcow2Cache *c, void *table, int start,
+    int end);
+
+/* qcow2-compress.c functions */
+void qcow2_compress_init(BlockDriverState *bs);
+int qcow2_compress_close(BlockDriverState *bs);
+int qcow2_decompress_cluster(BlockDriverState *bs, uint64_t offset,
+    uint64_t cluster_offset, uint8_t **data);
+void qcow2_decompress_discard(BlockDriverState *bs, uint64_t offset);
+int qcow2_compress_cluster(BlockDriverState *bs, int64_t sector_num,
+    const uint8_t *buf);
+void qcow2_compress_flush(BlockDriverState *bs);
+int qcow2_compress_drain(BlockDriverState *bs);
+
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
 int qcow2_snapshot_goto(BlockDriverState *bs, const char *snapshot_id);
@@ -125,13 +125,25 @@ void qed_find_cluster(BDRVQEDState *s, QEDRequest *request, uint64_t pos,
 {
     QEDFindClusterCB *find_cluster_cb;
     uint64_t l2_offset;
+    unsigned int l1_index = qed_l1_index(s, pos);
 
     /* Limit length to L2 boundary.  Requests are broken up at the L2 boundary
      * so that a request acts on one L2 table at a time.
      */
     len = MIN(len, (((pos >> s->l1_shift) + 1) << s->l1_shift) - pos);
 
-    l2_offset = s->l1_table->offsets[qed_l1_index(s, pos)];
+    /* Sequential access crossed into the next L2 table, read the one after it
+     * while this one is being used.
+     */
+    if (l1_index == s->l2_last_index + 1 && l1_index + 1 < s->table_nelems) {
+        l2_offset = s->l1_table->offsets[l1_index + 1];
+        if (l2_offset && qed_check_table_offset(s, l2_offset)) {
+            qed_prefetch_l2_table(s, l2_offset);
+        }
+    }
+    s->l2_last_index = l1_index;
+
+    l2_offset = s->l1_table->offsets[l1_index];
     if (!l2_offset) {
         cb(opaque, QED_CLUSTER_L1, 0, len);
         return;
@@ -48,21 +48,46 @@
  * start reading the L2 table from the image file.  The first to finish will
  * commit its L2 table into the cache.  When the second tries to commit its
  * table will be deleted in favor of the existing cache entry.
+ *
+ * Entries are looked up through a hash table on their offset.  The entries
+ * list is kept in least recently used order and the head is evicted when the
+ * cache is full.
  */
 
 #include "trace.h"
 #include "qed.h"
 
-/* Each L2 holds 2GB so this let's us fully cache a 100GB disk */
-#define MAX_L2_CACHE_SIZE 50
+static unsigned int qed_l2_cache_hash(L2TableCache *l2_cache, uint64_t offset)
+{
+    /* L2 tables are cluster aligned, so the low bits carry no information */
+    uint64_t key = (offset >> 12) * 0x9e3779b97f4a7c15ULL;
+
+    return key >> (64 - l2_cache->hash_bits);
+}
 
 /**
  * Initialize the L2 cache
+ *
+ * @max_entries:    Maximum number of L2 tables kept in the cache
  */
-void qed_init_l2_cache(L2TableCache *l2_cache)
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries)
 {
+    unsigned int i;
+
     QTAILQ_INIT(&l2_cache->entries);
     l2_cache->n_entries = 0;
+    l2_cache->max_entries = MAX(max_entries, 1);
+
+    /* A load factor of at most one keeps the chains short */
+    l2_cache->hash_bits = 1;
+    while ((1U << l2_cache->hash_bits) < l2_cache->max_entries) {
+        l2_cache->hash_bits++;
+    }
+    l2_cache->buckets = qemu_malloc(sizeof(l2_cache->buckets[0]) <<
+                                    l2_cache->hash_bits);
+    for (i = 0; i < (1U << l2_cache->hash_bits); i++) {
+        QLIST_INIT(&l2_cache->buckets[i]);
+    }
 }
 
 /**
@@ -76,6 +101,8 @@ void qed_free_l2_cache(L2TableCache *l2_cache)
         qemu_vfree(entry->table);
         qemu_free(entry);
     }
+    qemu_free(l2_cache->buckets);
+    l2_cache->buckets = NULL;
 }
 
 /**
@@ -119,17 +146,20 @@ void qed_unref_l2_cache_entry(CachedL2Table *entry)
  * Find an entry in the L2 cache.  This may return NULL and it's up to the
  * caller to satisfy the cache miss.
  *
- * For a cached entry, this function increases the reference count and returns
- * the entry.
+ * For a cached entry, this function increases the reference count, marks the
+ * entry as most recently used and returns it.
  */
 CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 {
+    unsigned int bucket = qed_l2_cache_hash(l2_cache, offset);
     CachedL2Table *entry;
 
-    QTAILQ_FOREACH(entry, &l2_cache->entries, node) {
+    QLIST_FOREACH(entry, &l2_cache->buckets[bucket], hash_node) {
         if (entry->offset == offset) {
             trace_qed_find_l2_cache_entry(l2_cache, entry, offset, entry->ref);
             entry->ref++;
+            QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+            QTAILQ_INSERT_TAIL(&l2_cache->entries, entry, node);
             return entry;
         }
     }
@@ -153,6 +183,7 @@ CachedL2Table *qed_find_l2_cache_entry(L2TableCache *l2_cache, uint64_t offset)
 void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
 {
     CachedL2Table *entry;
+    unsigned int bucket;
 
     entry = qed_find_l2_cache_entry(l2_cache, l2_table->offset);
     if (entry) {
@@ -161,13 +192,16 @@ void qed_commit_l2_cache_entry(L2TableCache *l2_cache, CachedL2Table *l2_table)
         return;
     }
 
-    if (l2_cache->n_entries >= MAX_L2_CACHE_SIZE) {
+    if (l2_cache->n_entries >= l2_cache->max_entries) {
         entry = QTAILQ_FIRST(&l2_cache->entries);
         QTAILQ_REMOVE(&l2_cache->entries, entry, node);
+        QLIST_REMOVE(entry, hash_node);
         l2_cache->n_entries--;
         qed_unref_l2_cache_entry(entry);
     }
 
+    bucket = qed_l2_cache_hash(l2_cache, l2_table->offset);
     l2_cache->n_entries++;
     QTAILQ_INSERT_TAIL(&l2_cache->entries, l2_table, node);
+    QLIST_INSERT_HEAD(&l2_cache->buckets[bucket], l2_table, hash_node);
 }
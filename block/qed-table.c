@@ -261,9 +261,11 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
     /* Check for cached L2 entry */
     request->l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
     if (request->l2_table) {
+        s->bs->metadata_cache_hits++;
         cb(opaque, 0);
         return;
     }
+    s->bs->metadata_cache_misses++;
 
     request->l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
     request->l2_table->table = qed_alloc_table(s);
@@ -298,6 +300,7 @@ void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         BlockDriverCompletionFunc *cb, void *opaque)
 {
     BLKDBG_EVENT(s->bs->file, BLKDBG_L2_UPDATE);
+    s->bs->metadata_cache_writes++;
     qed_write_table(s, request->l2_table->offset,
                     request->l2_table->table, index, n, flush, cb, opaque);
 }
@@ -317,3 +320,62 @@ int qed_write_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
     async_context_pop();
     return ret;
 }
+
+typedef struct {
+    BDRVQEDState *s;
+    CachedL2Table *l2_table;
+} QEDPrefetchL2TableCB;
+
+static void qed_prefetch_l2_table_cb(void *opaque, int ret)
+{
+    QEDPrefetchL2TableCB *prefetch_cb = opaque;
+    BDRVQEDState *s = prefetch_cb->s;
+
+    trace_qed_prefetch_l2_table_cb(s, prefetch_cb->l2_table->offset, ret);
+
+    if (ret) {
+        qed_unref_l2_cache_entry(prefetch_cb->l2_table);
+    } else {
+        /* Steals our reference, the table now only lives in the cache */
+        qed_commit_l2_cache_entry(&s->l2_cache, prefetch_cb->l2_table);
+    }
+
+    s->l2_prefetches--;
+    qemu_free(prefetch_cb);
+}
+
+/**
+ * Read an L2 table into the cache ahead of its first use
+ *
+ * @s:          QED state
+ * @offset:     Offset of the L2 table in image file, in bytes
+ *
+ * Nothing is done if the table is already cached.  Errors are ignored, the
+ * table will be read again when it is needed.
+ */
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset)
+{
+    QEDPrefetchL2TableCB *prefetch_cb;
+    CachedL2Table *l2_table;
+
+    l2_table = qed_find_l2_cache_entry(&s->l2_cache, offset);
+    if (l2_table) {
+        qed_unref_l2_cache_entry(l2_table);
+        return;
+    }
+
+    trace_qed_prefetch_l2_table(s, offset);
+
+    l2_table = qed_alloc_l2_cache_entry(&s->l2_cache);
+    l2_table->table = qed_alloc_table(s);
+    l2_table->offset = offset;
+
+    prefetch_cb = qemu_malloc(sizeof(*prefetch_cb));
+    prefetch_cb->s = s;
+    prefetch_cb->l2_table = l2_table;
+
+    s->l2_prefetches++;
+    BLKDBG_EVENT(s->bs->file, BLKDBG_L2_LOAD);
+    qed_read_table(s, offset, l2_table->table,
+                   qed_prefetch_l2_table_cb, prefetch_cb);
+}
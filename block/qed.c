@@ -15,6 +15,11 @@
 #include "trace.h"
 #include "qed.h"
 
+/* Default L2 cache size, which maps 256 GB with 64k clusters and 4-cluster
+ * tables
+ */
+#define QED_DEFAULT_L2_CACHE_SIZE (32 * 1024 * 1024)
+
 static void qed_aio_cancel(BlockDriverAIOCB *blockacb)
 {
     QEDAIOCB *acb = (QEDAIOCB *)blockacb;
@@ -290,6 +295,26 @@ static CachedL2Table *qed_new_l2_table(BDRVQEDState *s)
 
 static void qed_aio_next_io(void *opaque, int ret);
 
+/**
+ * Number of L2 tables to cache
+ *
+ * The cache gets the metadata cache size of the drive, but no more than the
+ * number of L2 tables that the image can have.
+ */
+static unsigned int qed_l2_cache_entries(BDRVQEDState *s)
+{
+    uint64_t cache_size = s->bs->metadata_cache_size;
+    uint64_t table_bytes = s->header.cluster_size * s->header.table_size;
+    uint64_t max_tables;
+
+    if (cache_size == 0) {
+        cache_size = QED_DEFAULT_L2_CACHE_SIZE;
+    }
+    max_tables = (s->header.image_size + (1ULL << s->l1_shift) - 1) >>
+                 s->l1_shift;
+    return MAX(MIN(cache_size / table_bytes, max_tables), 1);
+}
+
 static int bdrv_qed_open(BlockDriverState *bs, int flags)
 {
     BDRVQEDState *s = bs->opaque;
@@ -381,7 +406,7 @@ static int bdrv_qed_open(BlockDriverState *bs, int flags)
     }
 
     s->l1_table = qed_alloc_table(s);
-    qed_init_l2_cache(&s->l2_cache);
+    qed_init_l2_cache(&s->l2_cache, qed_l2_cache_entries(s));
 
     ret = qed_read_l1_table_sync(s);
     if (ret) {
@@ -421,6 +446,11 @@ static void bdrv_qed_close(BlockDriverState *bs)
 {
     BDRVQEDState *s = bs->opaque;
 
+    /* Prefetched L2 tables are committed to the cache on completion */
+    while (s->l2_prefetches > 0) {
+        qemu_aio_wait();
+    }
+
     /* Ensure writes reach stable storage */
     bdrv_flush(bs->file);
 
@@ -1040,6 +1070,7 @@ static void qed_aio_write_data(void *opaque, int ret,
                                uint64_t offset, size_t len)
 {
     QEDAIOCB *acb = opaque;
+    size_t zero_len;
 
     trace_qed_aio_write_data(acb_to_s(acb), acb, ret, offset, len);
 
@@ -1052,6 +1083,19 @@ static void qed_aio_write_data(void *opaque, int ret,
 
     case QED_CLUSTER_L2:
     case QED_CLUSTER_L1:
+        /* Without a backing file, zeroes need not be allocated at all */
+        zero_len = 0;
+        if (!acb->common.bs->backing_hd) {
+            zero_len = qemu_iovec_find_nonzero(acb->qiov, acb->qiov_offset,
+                                               len);
+            zero_len &= ~(BDRV_SECTOR_SIZE - 1);
+        }
+        if (zero_len > 0) {
+            qemu_iovec_copy(&acb->cur_qiov, acb->qiov, acb->qiov_offset,
+                            zero_len);
+            qed_aio_next_io(acb, 0);
+            break;
+        }
         qed_aio_write_alloc(acb, len);
         break;
 
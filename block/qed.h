@@ -108,12 +108,16 @@ typedef struct CachedL2Table {
     QEDTable *table;
     uint64_t offset;    /* offset=0 indicates an invalidate entry */
     QTAILQ_ENTRY(CachedL2Table) node;
+    QLIST_ENTRY(CachedL2Table) hash_node;
     int ref;
 } CachedL2Table;
 
 typedef struct {
-    QTAILQ_HEAD(, CachedL2Table) entries;
+    QTAILQ_HEAD(, CachedL2Table) entries;   /* least recently used first */
+    QLIST_HEAD(, CachedL2Table) *buckets;   /* 1 << hash_bits lists */
+    unsigned int hash_bits;
     unsigned int n_entries;
+    unsigned int max_entries;
 } L2TableCache;
 
 typedef struct QEDRequest {
@@ -150,6 +154,8 @@ typedef struct {
     QEDHeader header;               /* always cpu-endian */
     QEDTable *l1_table;
     L2TableCache l2_cache;          /* l2 table cache */
+    unsigned int l2_last_index;     /* L1 index of the last cluster lookup */
+    int l2_prefetches;              /* L2 tables being read ahead */
     uint32_t table_nelems;
     uint32_t l1_shift;
     uint32_t l2_shift;
@@ -200,7 +206,7 @@ void gencb_complete(void *opaque, int ret);
 /**
  * L2 cache functions
  */
-void qed_init_l2_cache(L2TableCache *l2_cache);
+void qed_init_l2_cache(L2TableCache *l2_cache, unsigned int max_entries);
 void qed_free_l2_cache(L2TableCache *l2_cache);
 CachedL2Table *qed_alloc_l2_cache_entry(L2TableCache *l2_cache);
 void qed_unref_l2_cache_entry(CachedL2Table *entry);
@@ -222,6 +228,7 @@ void qed_read_l2_table(BDRVQEDState *s, QEDRequest *request, uint64_t offset,
 void qed_write_l2_table(BDRVQEDState *s, QEDRequest *request,
                         unsigned int index, unsigned int n, bool flush,
                         BlockDriverCompletionFunc *cb, void *opaque);
+void qed_prefetch_l2_table(BDRVQEDState *s, uint64_t offset);
 int qed_write_l2_table_sync(BDRVQEDState *s, QEDRequest *request,
                             unsigned int index, unsigned int n, bool flush);
 
@@ -24,20 +24,29 @@
 /* AIO flags */
 #define QEMU_AIO_MISALIGNED   0x1000
 
+/* bounce buffers for O_DIRECT, kept per pool up to PAIO_BOUNCE_FREE_MAX */
+#define PAIO_BOUNCE_SIZE      (256 * 1024)
+#define PAIO_BOUNCE_ALIGN     4096
+#define PAIO_BOUNCE_FREE_MAX  16
 
 /* posix-aio-compat.c - thread pool based implementation */
-int paio_init(void);
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
+void *paio_init(int max_threads);
+void paio_cleanup(void *pool);
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, void *pool, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, void *pool, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque);
+void *paio_bounce_get(void *pool, size_t size);
+void paio_bounce_put(void *pool, void *buf, size_t size);
 
 /* linux-aio.c - Linux native implementation */
-void *laio_init(void);
+void *laio_init(int max_requests);
 BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type);
+void laio_io_plug(void *aio_ctx);
+void laio_io_unplug(void *aio_ctx);
 
 #endif /* QEMU_RAW_POSIX_AIO_H */
@@ -105,12 +105,11 @@
    reopen it to see if the disk has been changed */
 #define FD_OPEN_TIMEOUT (1000000000)
 
-#define MAX_BLOCKSIZE	4096
-
 typedef struct BDRVRawState {
     int fd;
     int type;
     int open_flags;
+    void *paio_pool;
 #if defined(__linux__)
     /* linux floppy specific */
     int64_t fd_open_time;
@@ -122,8 +121,6 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
-    uint8_t *aligned_buf;
-    unsigned aligned_buf_size;
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
@@ -166,41 +163,28 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
         return ret;
     }
     s->fd = fd;
-    s->aligned_buf = NULL;
-
-    if ((bdrv_flags & BDRV_O_NOCACHE)) {
-        /*
-         * Allocate a buffer for read/modify/write cycles.  Chose the size
-         * pessimistically as we don't know the block size yet.
-         */
-        s->aligned_buf_size = 32 * MAX_BLOCKSIZE;
-        s->aligned_buf = qemu_memalign(MAX_BLOCKSIZE, s->aligned_buf_size);
-        if (s->aligned_buf == NULL) {
-            goto out_close;
-        }
-    }
 
 #ifdef CONFIG_LINUX_AIO
     if ((bdrv_flags & (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) ==
                       (BDRV_O_NOCACHE|BDRV_O_NATIVE_AIO)) {
 
-        /* We're falling back to POSIX AIO in some cases */
-        paio_init();
-
-        s->aio_ctx = laio_init();
+        s->aio_ctx = laio_init(bs->aio_queue_depth);
         if (!s->aio_ctx) {
-            goto out_free_buf;
+            goto out_close;
         }
         s->use_aio = 1;
-    } else
-#endif
-    {
-        if (paio_init() < 0) {
-            goto out_free_buf;
-        }
-#ifdef CONFIG_LINUX_AIO
+    } else {
         s->use_aio = 0;
+    }
 #endif
+
+    /*
+     * Also used with linux-aio for misaligned requests, flushes and ioctls,
+     * and provides the bounce buffers for O_DIRECT
+     */
+    s->paio_pool = paio_init(bs->aio_threads);
+    if (!s->paio_pool) {
+        goto out_close;
     }
 
 #ifdef CONFIG_XFS
@@ -211,8 +195,6 @@ static int raw_open_common(BlockDriverState *bs, const char *filename,
 
     return 0;
 
-out_free_buf:
-    qemu_vfree(s->aligned_buf);
 out_close:
     close(fd);
     return -errno;
@@ -330,78 +312,58 @@ static int raw_pwrite_aligned(BlockDriverState *bs, int64_t offset,
 /*
  * offset and count are in bytes and possibly not aligned. For files opened
  * with O_DIRECT, necessary alignments are ensured before calling
- * raw_pread_aligned to do the actual read.
+ * raw_pread_aligned to do the actual read, by reading through bounce
+ * buffers of the AIO pool.
  */
 static int raw_pread(BlockDriverState *bs, int64_t offset,
                      uint8_t *buf, int count)
 {
     BDRVRawState *s = bs->opaque;
     unsigned sector_mask = bs->buffer_alignment - 1;
+    uint8_t *bounce;
     int size, ret, shift, sum;
 
-    sum = 0;
-
-    if (s->aligned_buf != NULL)  {
-
-        if (offset & sector_mask) {
-            /* align offset on a sector size bytes boundary */
-
-            shift = offset & sector_mask;
-            size = (shift + count + sector_mask) & ~sector_mask;
-            if (size > s->aligned_buf_size)
-                size = s->aligned_buf_size;
-            ret = raw_pread_aligned(bs, offset - shift, s->aligned_buf, size);
-            if (ret < 0)
-                return ret;
-
-            size = bs->buffer_alignment - shift;
-            if (size > count)
-                size = count;
-            memcpy(buf, s->aligned_buf + shift, size);
+    if (!(s->open_flags & O_DIRECT) ||
+        !((offset | count | (uintptr_t) buf) & sector_mask)) {
+        return raw_pread_aligned(bs, offset, buf, count);
+    }
 
-            buf += size;
-            offset += size;
-            count -= size;
-            sum += size;
+    bounce = paio_bounce_get(s->paio_pool, PAIO_BOUNCE_SIZE);
+    sum = 0;
 
-            if (count == 0)
-                return sum;
+    while (count) {
+        /* align offset on a sector size bytes boundary */
+        shift = offset & sector_mask;
+        size = (shift + count + sector_mask) & ~sector_mask;
+        if (size > PAIO_BOUNCE_SIZE)
+            size = PAIO_BOUNCE_SIZE;
+
+        ret = raw_pread_aligned(bs, offset - shift, bounce, size);
+        if (ret < 0) {
+            sum = ret;
+            break;
+        }
+        if (ret <= shift) {
+            /* end of file */
+            break;
         }
-        if (count & sector_mask || (uintptr_t) buf & sector_mask) {
-
-            /* read on aligned buffer */
-
-            while (count) {
-
-                size = (count + sector_mask) & ~sector_mask;
-                if (size > s->aligned_buf_size)
-                    size = s->aligned_buf_size;
-
-                ret = raw_pread_aligned(bs, offset, s->aligned_buf, size);
-                if (ret < 0) {
-                    return ret;
-                } else if (ret == 0) {
-                    fprintf(stderr, "raw_pread: read beyond end of file\n");
-                    abort();
-                }
-
-                size = ret;
-                if (size > count)
-                    size = count;
-
-                memcpy(buf, s->aligned_buf, size);
 
-                buf += size;
-                offset += size;
-                count -= size;
-                sum += size;
-            }
+        size = ret - shift;
+        if (size > count)
+            size = count;
+        memcpy(buf, bounce + shift, size);
 
-            return sum;
-        }
+        buf += size;
+        offset += size;
+        count -= size;
+        sum += size;
     }
 
-    return raw_pread_aligned(bs, offset, buf, count) + sum;
+    paio_bounce_put(s->paio_pool, bounce, PAIO_BOUNCE_SIZE);
+    if (sum > 0) {
+        bs->bounce_bytes += sum;
+    }
+    return sum;
 }
 
 static int raw_read(BlockDriverState *bs, int64_t sector_num,
@@ -419,84 +381,71 @@ static int raw_read(BlockDriverState *bs, int64_t sector_num,
 /*
  * offset and count are in bytes and possibly not aligned. For files opened
  * with O_DIRECT, necessary alignments are ensured before calling
- * raw_pwrite_aligned to do the actual write.
+ * raw_pwrite_aligned to do the actual write, by writing through bounce
+ * buffers of the AIO pool.  Partial sectors at either end are read first.
  */
 static int raw_pwrite(BlockDriverState *bs, int64_t offset,
                       const uint8_t *buf, int count)
 {
     BDRVRawState *s = bs->opaque;
     unsigned sector_mask = bs->buffer_alignment - 1;
-    int size, ret, shift, sum;
+    uint8_t *bounce, *tail;
+    int size, ret, shift, len, sum;
 
-    sum = 0;
+    if (!(s->open_flags & O_DIRECT) ||
+        !((offset | count | (uintptr_t) buf) & sector_mask)) {
+        return raw_pwrite_aligned(bs, offset, buf, count);
+    }
 
-    if (s->aligned_buf != NULL) {
+    bounce = paio_bounce_get(s->paio_pool, PAIO_BOUNCE_SIZE);
+    sum = 0;
 
-        if (offset & sector_mask) {
-            /* align offset on a sector size bytes boundary */
-            shift = offset & sector_mask;
-            ret = raw_pread_aligned(bs, offset - shift, s->aligned_buf,
+    while (count) {
+        /* align offset on a sector size bytes boundary */
+        shift = offset & sector_mask;
+        size = (shift + count + sector_mask) & ~sector_mask;
+        if (size > PAIO_BOUNCE_SIZE)
+            size = PAIO_BOUNCE_SIZE;
+        len = size - shift;
+        if (len > count)
+            len = count;
+
+        if (shift) {
+            ret = raw_pread_aligned(bs, offset - shift, bounce,
                                     bs->buffer_alignment);
             if (ret < 0)
-                return ret;
-
-            size = bs->buffer_alignment - shift;
-            if (size > count)
-                size = count;
-            memcpy(s->aligned_buf + shift, buf, size);
-
-            ret = raw_pwrite_aligned(bs, offset - shift, s->aligned_buf,
-                                     bs->buffer_alignment);
+                goto fail;
+            memset(bounce + ret, 0, bs->buffer_alignment - ret);
+        }
+        if (((shift + len) & sector_mask) &&
+            (size > bs->buffer_alignment || !shift)) {
+            tail = bounce + size - bs->buffer_alignment;
+            ret = raw_pread_aligned(bs, offset - shift + size -
+                                    bs->buffer_alignment, tail,
+                                    bs->buffer_alignment);
             if (ret < 0)
-                return ret;
-
-            buf += size;
-            offset += size;
-            count -= size;
-            sum += size;
-
-            if (count == 0)
-                return sum;
+                goto fail;
+            memset(tail + ret, 0, bs->buffer_alignment - ret);
         }
-        if (count & sector_mask || (uintptr_t) buf & sector_mask) {
-
-            while ((size = (count & ~sector_mask)) != 0) {
+        memcpy(bounce + shift, buf, len);
 
-                if (size > s->aligned_buf_size)
-                    size = s->aligned_buf_size;
+        ret = raw_pwrite_aligned(bs, offset - shift, bounce, size);
+        if (ret < 0)
+            goto fail;
 
-                memcpy(s->aligned_buf, buf, size);
+        buf += len;
+        offset += len;
+        count -= len;
+        sum += len;
+    }
 
-                ret = raw_pwrite_aligned(bs, offset, s->aligned_buf, size);
-                if (ret < 0)
-                    return ret;
+    paio_bounce_put(s->paio_pool, bounce, PAIO_BOUNCE_SIZE);
+    bs->bounce_bytes += sum;
+    return sum;
 
-                buf += ret;
-                offset += ret;
-                count -= ret;
-                sum += ret;
-            }
-            /* here, count < sector_size because (count & ~sector_mask) == 0 */
-            if (count) {
-                ret = raw_pread_aligned(bs, offset, s->aligned_buf,
-                                     bs->buffer_alignment);
-                if (ret < 0)
-                    return ret;
-                 memcpy(s->aligned_buf, buf, count);
-
-                 ret = raw_pwrite_aligned(bs, offset, s->aligned_buf,
-                                     bs->buffer_alignment);
-                 if (ret < 0)
-                     return ret;
-                 if (count < ret)
-                     ret = count;
-
-                 sum += ret;
-            }
-            return sum;
-        }
-    }
-    return raw_pwrite_aligned(bs, offset, buf, count) + sum;
+fail:
+    paio_bounce_put(s->paio_pool, bounce, PAIO_BOUNCE_SIZE);
+    return ret;
 }
 
 static int raw_write(BlockDriverState *bs, int64_t sector_num,
@@ -511,14 +460,16 @@ static int raw_write(BlockDriverState *bs, int64_t sector_num,
 }
 
 /*
- * Check if all memory in this vector is sector aligned.
+ * Check if all memory in this vector is sector aligned, both in address and
+ * in length, as O_DIRECT requires for each segment.
  */
 static int qiov_is_aligned(BlockDriverState *bs, QEMUIOVector *qiov)
 {
     int i;
 
     for (i = 0; i < qiov->niov; i++) {
-        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment) {
+        if ((uintptr_t) qiov->iov[i].iov_base % bs->buffer_alignment ||
+            qiov->iov[i].iov_len % bs->buffer_alignment) {
             return 0;
         }
     }
@@ -540,7 +491,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
      * boundary.  Check if this is the case or telll the low-level
      * driver that it needs to copy the buffer.
      */
-    if (s->aligned_buf) {
+    if (s->open_flags & O_DIRECT) {
         if (!qiov_is_aligned(bs, qiov)) {
             type |= QEMU_AIO_MISALIGNED;
 #ifdef CONFIG_LINUX_AIO
@@ -551,7 +502,7 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
-    return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
+    return paio_submit(bs, s->paio_pool, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
 
@@ -579,17 +530,43 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
-    return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
+    return paio_submit(bs, s->paio_pool, s->fd, 0, NULL, 0, cb, opaque,
+                       QEMU_AIO_FLUSH);
+}
+
+static void raw_io_plug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_plug(s->aio_ctx);
+    }
+#endif
+}
+
+static void raw_io_unplug(BlockDriverState *bs)
+{
+#ifdef CONFIG_LINUX_AIO
+    BDRVRawState *s = bs->opaque;
+
+    if (s->use_aio) {
+        laio_io_unplug(s->aio_ctx);
+    }
+#endif
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+
+    if (s->paio_pool) {
+        paio_cleanup(s->paio_pool);
+        s->paio_pool = NULL;
+    }
     if (s->fd >= 0) {
         close(s->fd);
         s->fd = -1;
-        if (s->aligned_buf != NULL)
-            qemu_vfree(s->aligned_buf);
     }
 }
 
@@ -810,6 +787,8 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
+    .bdrv_io_plug = raw_io_plug,
+    .bdrv_io_unplug = raw_io_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1005,7 +984,7 @@ static BlockDriverAIOCB *hdev_aio_ioctl(BlockDriverState *bs,
 
     if (fd_open(bs) < 0)
         return NULL;
-    return paio_ioctl(bs, s->fd, req, buf, cb, opaque);
+    return paio_ioctl(bs, s->paio_pool, s->fd, req, buf, cb, opaque);
 }
 
 #elif defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -1077,6 +1056,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_readv	= raw_aio_readv,
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1192,6 +1173,8 @@ static BlockDriver bdrv_host_floppy = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1289,6 +1272,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
@@ -1412,6 +1397,8 @@ static BlockDriver bdrv_host_cdrom = {
     .bdrv_aio_readv     = raw_aio_readv,
     .bdrv_aio_writev    = raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
+    .bdrv_io_plug       = raw_io_plug,
+    .bdrv_io_unplug     = raw_io_unplug,
 
     .bdrv_read          = raw_read,
     .bdrv_write         = raw_write,
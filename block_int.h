@@ -31,6 +31,9 @@
 #define BLOCK_FLAG_ENCRYPT	1
 #define BLOCK_FLAG_COMPAT6	4
 
+/* latency histogram buckets of host AIO requests, in powers of two of us */
+#define BDRV_AIO_LATENCY_BUCKETS 20
+
 #define BLOCK_OPT_SIZE          "size"
 #define BLOCK_OPT_ENCRYPT       "encryption"
 #define BLOCK_OPT_COMPAT6       "compat6"
@@ -78,6 +81,8 @@ struct BlockDriver {
 
     int (*bdrv_aio_multiwrite)(BlockDriverState *bs, BlockRequest *reqs,
         int num_reqs);
+    void (*bdrv_io_plug)(BlockDriverState *bs);
+    void (*bdrv_io_unplug)(BlockDriverState *bs);
     int (*bdrv_merge_requests)(BlockDriverState *bs, BlockRequest* a,
         BlockRequest *b);
 
@@ -181,6 +186,33 @@ struct BlockDriverState {
     uint64_t rd_ops;
     uint64_t wr_ops;
     uint64_t wr_highest_sector;
+    /* image metadata cache of the format driver, if it has one */
+    uint64_t metadata_cache_hits;
+    uint64_t metadata_cache_misses;
+    uint64_t metadata_cache_writes;
+
+    /* size of the metadata cache in bytes, 0 for the driver default */
+    uint64_t metadata_cache_size;
+
+    /* host AIO submission, for protocols that batch requests */
+    uint64_t aio_submits;
+    uint64_t aio_submitted_reqs;
+    uint64_t aio_max_batch;
+    /* maximum number of outstanding host AIO requests, 0 for the default */
+    int aio_queue_depth;
+    /* completed host AIO requests by latency, see bdrv_aio_account_latency */
+    uint64_t aio_latency[BDRV_AIO_LATENCY_BUCKETS];
+    /* size of the thread pool for aio=threads, 0 for the default */
+    int aio_threads;
+    /* bytes copied through bounce buffers for O_DIRECT alignment */
+    uint64_t bounce_bytes;
+
+    /* copy data read from the backing file into the image */
+    int copy_on_read;
+    uint64_t copy_on_read_sectors;
+    QLIST_HEAD(, BdrvCopyOnRead) cor_requests;
+    /* AIO writes in flight, tracked while there is a backing file */
+    QLIST_HEAD(, BdrvTrackedWrite) tracked_writes;
 
     /* Whether the disk can expand beyond total_sectors */
     int growable;
@@ -216,6 +248,10 @@ void get_tmp_filename(char *filename, int size);
 void *qemu_aio_get(AIOPool *pool, BlockDriverState *bs,
                    BlockDriverCompletionFunc *cb, void *opaque);
 void qemu_aio_release(void *p);
+void bdrv_aio_account_latency(BlockDriverState *bs, int64_t ns);
+int bdrv_aio_copy_backing(BlockDriverState *bs, int64_t sector_num,
+                          int nb_sectors, BlockDriverCompletionFunc *cb,
+                          void *opaque);
 
 void *qemu_blockalign(BlockDriverState *bs, size_t size);
 
@@ -426,6 +426,14 @@ DriveInfo *drive_init(QemuOpts *opts, int default_to_scsi, int *fatal_error)
     QTAILQ_INSERT_TAIL(&drives, dinfo, next);
 
     bdrv_set_on_error(dinfo->bdrv, on_read_error, on_write_error);
+    bdrv_set_metadata_cache_size(dinfo->bdrv,
+                                 qemu_opt_get_size(opts, "metadata-cache", 0));
+    bdrv_set_aio_queue_depth(dinfo->bdrv,
+                             qemu_opt_get_number(opts, "aio-queue-depth", 0));
+    bdrv_set_aio_threads(dinfo->bdrv,
+                         qemu_opt_get_number(opts, "aio-threads", 0));
+    bdrv_set_copy_on_read(dinfo->bdrv,
+                          qemu_opt_get_bool(opts, "copy-on-read", 0));
 
     switch(type) {
     case IF_IDE:
@@ -557,6 +565,7 @@ int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data)
         goto out;
     }
 
+    block_stream_cancel(bs);
     qemu_aio_flush();
     bdrv_flush(bs);
 
@@ -591,6 +600,7 @@ static int eject_device(Monitor *mon, BlockDriverState *bs, int force)
             return -1;
         }
     }
+    block_stream_cancel(bs);
     bdrv_close(bs);
     return 0;
 }
@@ -678,6 +688,7 @@ int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data)
     }
 
     /* quiesce block driver; prevent further io */
+    block_stream_cancel(bs);
     qemu_aio_flush();
     bdrv_flush(bs);
     bdrv_close(bs);
@@ -54,4 +54,12 @@ int do_change_block(Monitor *mon, const char *device,
 int do_drive_del(Monitor *mon, const QDict *qdict, QObject **ret_data);
 int do_snapshot_blkdev(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
+/* block-stream.c */
+void block_stream_cancel(BlockDriverState *bs);
+int do_block_stream(Monitor *mon, const QDict *qdict, QObject **ret_data);
+int do_block_stream_cancel(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data);
+void do_info_block_stream_print(Monitor *mon, const QObject *data);
+void do_info_block_stream(Monitor *mon, QObject **ret_data);
+
 #endif
@@ -68,6 +68,12 @@ static void cm_code_gen_alloc_all(void)
               "code buffer size too small");
     code_gen_buffer_max_size = code_gen_buffer_size - (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
     code_gen_max_blocks = code_gen_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+
+    /* The translator threads fill the tail of each buffer. */
+    if (cm_spec_nb_threads) {
+        cm_spec_buffer_size = code_gen_buffer_size >> CM_SPEC_BUFFER_SHIFT;
+        code_gen_buffer_max_size -= cm_spec_buffer_size;
+    }
 }
 
 /* From the allocated memory in code_gen_alloc_all, we allocate memory for each
@@ -100,6 +106,8 @@ void cm_cpu_exec_init(void)
     /* Code prologue initialization. */
     cm_code_prologue_init();
     map_exec(code_gen_prologue, sizeof(code_gen_prologue));
+
+    cm_spec_init();
 }
 
 void cm_cpu_exec_init_core(void)
@@ -108,6 +116,7 @@ void cm_cpu_exec_init_core(void)
     /* Get code cache. */
     cm_code_gen_alloc();
     code_gen_ptr = code_gen_buffer;
+    cm_spec_init_core(cpu_single_env);
 
 #if defined(TARGET_I386)
     optimize_flags_init();
@@ -26,6 +26,8 @@
 #ifndef _CM_INIT_H
 #define _CM_INIT_H
 
+#include <stdint.h>
+
 /* page_init, io_mem_init, etc. Called by hardware thread. */
 void cm_cpu_exec_init(void);
 /* Allocate code buffer for each core. Called by each core. */
@@ -34,4 +36,14 @@ void cm_cpu_exec_init_core(void);
 /* This function is defined in tcg/tcg.c */
 void cm_code_prologue_init(void);
 
+#define CM_TCACHE_DEFAULT_SIZE (256 * 1024 * 1024)
+
+/* Open (or create) the persistent translation cache file, see cm-tcache.c.
+   Called by the hardware thread. */
+int cm_tcache_init(const char *filename, int64_t size);
+
+/* Number of background translator threads, 0 disables speculation, see
+   cm-spec.c.  Set from the command line before cm_cpu_exec_init(). */
+extern int cm_spec_nb_threads;
+
 #endif /* _CM_INIT_H */
@@ -0,0 +1,611 @@
+/*
+ * COREMU Parallel Emulator Framework
+ *
+ * Background translation.
+ *
+ * Copyright (C) 2010 Parallel Processing Institute (PPI), Fudan Univ.
+ *  <http://ppi.fudan.edu.cn/system_research_group>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* We include this file in exec.c */
+
+/* When a core creates a TB, the targets of its direct jumps are queued for
+ * one of the translator threads (cores are statically spread over them).
+ * The translator runs the normal front and back end with its own TCG
+ * context on a private copy of the core's CPUState, whose TLB only holds
+ * the mappings of the pages the request was made for: it never walks the
+ * guest page tables, a TLB miss simply abandons the translation.
+ *
+ * The host code goes to the last part of the code buffer of the core and
+ * the TranslationBlock to a separate array, so the TLS tables of the core
+ * are never touched from another thread. The core itself links finished
+ * TBs into tb_phys_hash and its page lists when it misses in tb_find_slow,
+ * after checking that the guest code has not changed since it was
+ * translated. tb_flush() drops everything, under the per core lock that
+ * the translator holds while it writes into the buffer.
+ *
+ * Only x86 guests are supported: the ARM front end reads CPU state that is
+ * not part of tb->flags. */
+
+#include <pthread.h>
+#include <signal.h>
+
+#include "qemu-barrier.h"
+#include "cm-spec.h"
+
+/* Part of the code buffer of each core set aside for speculation. */
+#define CM_SPEC_BUFFER_SHIFT    3
+#define CM_SPEC_QUEUE_SIZE      256
+/* Requests served for one core before looking at the next one. */
+#define CM_SPEC_BATCH           16
+
+#define CM_SPEC_HASH_INIT       0xcbf29ce484222325ULL
+
+typedef struct CMSpecRequest {
+    target_ulong pc;
+    target_ulong cs_base;
+    uint64_t flags;
+    tb_page_addr_t phys_pc;
+    tb_page_addr_t phys_page2;  /* -1 if the next page is not mapped */
+    CPUTLBEntry tlb[2];         /* code mappings of both pages */
+} CMSpecRequest;
+
+typedef struct CMSpecThread {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    volatile int idle;
+    int index;
+} CMSpecThread;
+
+typedef struct CMSpecCore {
+    CPUState *shadow;           /* private copy the translator runs on */
+    CMSpecThread *thread;
+    /* Held by the translator while it fills the buffer, and by tb_flush. */
+    CMSpinLock lock;
+
+    /* Filled by the core, emptied by the translator. */
+    CMSpecRequest queue[CM_SPEC_QUEUE_SIZE];
+    volatile unsigned int head;
+    volatile unsigned int tail;
+
+    uint8_t *buffer;
+    uint8_t *ptr;
+    uint8_t *end;
+    TranslationBlock *tbs;
+    uint64_t *code_hash;
+    int max_tbs;
+    volatile int nb_tbs;        /* TBs finished by the translator */
+    int nb_adopted;             /* TBs looked at by the core */
+
+    uint64_t queued;
+    uint64_t translated;
+    uint64_t aborted;
+    uint64_t adopted;
+    uint64_t stale;
+    uint64_t used;
+    uint64_t ondemand;
+} CMSpecCore;
+
+int cm_spec_nb_threads;
+
+static unsigned long cm_spec_buffer_size;
+static CMSpecThread *cm_spec_threads;
+static CMSpecCore *cm_spec_cores[COREMU_MAX_CPU];
+
+static COREMU_THREAD CMSpecCore *cm_spec_core;
+static COREMU_THREAD int cm_spec_translator;
+
+static uint64_t cm_spec_hash(uint64_t h, const uint8_t *p, size_t len)
+{
+    uint64_t v;
+
+    for (; len >= sizeof(v); len -= sizeof(v), p += sizeof(v)) {
+        memcpy(&v, p, sizeof(v));
+        h = (h ^ v) * 0x100000001b3ULL;
+    }
+    while (len--) {
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    }
+    return h;
+}
+
+/* Hash the guest code of a TB whose page_addr[] is set. */
+static uint64_t cm_spec_code_hash(TranslationBlock *tb)
+{
+    target_ulong offset = tb->pc & ~TARGET_PAGE_MASK;
+    target_ulong len;
+    uint64_t h;
+
+    len = TARGET_PAGE_SIZE - offset;
+    if (len > tb->size) {
+        len = tb->size;
+    }
+    h = cm_spec_hash(CM_SPEC_HASH_INIT,
+                     qemu_safe_ram_ptr(tb->page_addr[0] + offset), len);
+    if (len < tb->size) {
+        h = cm_spec_hash(h, qemu_safe_ram_ptr(tb->page_addr[1]),
+                         tb->size - len);
+    }
+    return h;
+}
+
+/* Hash everything the translation of a request may read, to detect guest
+   stores racing with the translator. */
+static uint64_t cm_spec_window_hash(CMSpecRequest *req)
+{
+    target_ulong offset = req->pc & ~TARGET_PAGE_MASK;
+    uint64_t h;
+
+    h = cm_spec_hash(CM_SPEC_HASH_INIT, qemu_safe_ram_ptr(req->phys_pc),
+                     TARGET_PAGE_SIZE - offset);
+    if (req->phys_page2 != -1) {
+        h = cm_spec_hash(h, qemu_safe_ram_ptr(req->phys_page2),
+                         TARGET_PAGE_SIZE);
+    }
+    return h;
+}
+
+static int cm_spec_translatable(CPUState *env, TranslationBlock *tb)
+{
+#if defined(TARGET_I386)
+    return tb->cflags == 0 && !use_icount && !env->singlestep_enabled &&
+           QTAILQ_EMPTY(&env->breakpoints);
+#else
+    return 0;
+#endif
+}
+
+static TranslationBlock *cm_spec_lookup(target_ulong pc, target_ulong cs_base,
+                                        uint64_t flags, tb_page_addr_t phys_pc)
+{
+    TranslationBlock *tb;
+
+    tb = tb_phys_hash[tb_phys_hash_func(phys_pc)];
+    for (; tb != NULL; tb = tb->phys_hash_next) {
+        if (tb->pc == pc && tb->page_addr[0] == (phys_pc & TARGET_PAGE_MASK) &&
+            tb->cs_base == cs_base && tb->flags == flags) {
+            return tb;
+        }
+    }
+    return NULL;
+}
+
+/* Return the RAM address 'page' is mapped to for code fetches, or -1. */
+static tb_page_addr_t cm_spec_code_page(CPUState *env, int mmu_idx,
+                                        target_ulong page, CPUTLBEntry *te)
+{
+    int index = (page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+
+    *te = env->tlb_table[mmu_idx][index];
+    /* I/O and ROM device pages have low bits set in addr_code */
+    if (te->addr_code != page) {
+        return -1;
+    }
+    return qemu_ram_addr_from_host_nofail((void *)(unsigned long)page +
+                                          te->addend);
+}
+
+static void cm_spec_request(CMSpecCore *c, CPUState *env, TranslationBlock *tb,
+                            target_ulong pc)
+{
+    CMSpecRequest *req;
+    CMSpecThread *t;
+    target_ulong page;
+    int mmu_idx;
+
+    if (c->tail - c->head >= CM_SPEC_QUEUE_SIZE) {
+        return;
+    }
+    req = &c->queue[c->tail & (CM_SPEC_QUEUE_SIZE - 1)];
+    mmu_idx = cpu_mmu_index(env);
+    page = pc & TARGET_PAGE_MASK;
+
+    req->phys_pc = cm_spec_code_page(env, mmu_idx, page, &req->tlb[0]);
+    if (req->phys_pc == -1) {
+        return;
+    }
+    req->phys_pc += pc & ~TARGET_PAGE_MASK;
+    if (cm_spec_lookup(pc, tb->cs_base, tb->flags, req->phys_pc)) {
+        return;
+    }
+    req->phys_page2 = cm_spec_code_page(env, mmu_idx, page + TARGET_PAGE_SIZE,
+                                        &req->tlb[1]);
+    if (req->phys_page2 == -1) {
+        memset(&req->tlb[1], -1, sizeof(CPUTLBEntry));
+    }
+    req->pc = pc;
+    req->cs_base = tb->cs_base;
+    req->flags = tb->flags;
+
+    smp_wmb();
+    c->tail++;
+    c->queued++;
+
+    t = c->thread;
+    mb();
+    if (t->idle) {
+        pthread_mutex_lock(&t->lock);
+        pthread_cond_signal(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+    }
+}
+
+static void cm_spec_queue_targets(CMSpecCore *c, CPUState *env,
+                                  TranslationBlock *tb)
+{
+    int n;
+
+    if (!cm_spec_translatable(env, tb)) {
+        return;
+    }
+    for (n = 0; n < 2; n++) {
+        if (tb->jmp_pc[n] != -1) {
+            cm_spec_request(c, env, tb, tb->jmp_pc[n]);
+        }
+    }
+}
+
+void cm_spec_queue(CPUState *env, TranslationBlock *tb)
+{
+    CMSpecCore *c = cm_spec_core;
+
+    if (!c) {
+        return;
+    }
+    c->ondemand++;
+    cm_spec_queue_targets(c, env, tb);
+}
+
+void cm_spec_hit(CPUState *env, TranslationBlock *tb)
+{
+    CMSpecCore *c = cm_spec_core;
+
+    tb->spec = 0;
+    c->used++;
+    /* keep running ahead of the core */
+    cm_spec_queue_targets(c, env, tb);
+}
+
+/* Translator side: translate one request into the buffer of 'c'. */
+static void cm_spec_translate(CMSpecCore *c, CMSpecRequest *req)
+{
+    CPUState *env = c->shadow;
+    TranslationBlock *tb;
+    target_ulong page;
+    uint64_t window;
+    int i, n, index, index2, code_gen_size, ok;
+
+    n = c->nb_tbs;
+    if (n >= c->max_tbs || c->ptr >= c->end) {
+        /* full until the core flushes */
+        c->aborted++;
+        return;
+    }
+    tb = &c->tbs[n];
+    tb->pc = req->pc;
+    tb->cs_base = req->cs_base;
+    tb->flags = req->flags;
+    tb->cflags = 0;
+    tb->tc_ptr = c->ptr;
+    tb->jmp_pc[0] = tb->jmp_pc[1] = -1;
+    tb->has_invalidate = 0;
+    tb->spec = 1;
+
+    page = req->pc & TARGET_PAGE_MASK;
+    index = (page >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    index2 = ((page + TARGET_PAGE_SIZE) >> TARGET_PAGE_BITS) &
+             (CPU_TLB_SIZE - 1);
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        env->tlb_table[i][index] = req->tlb[0];
+        env->tlb_table[i][index2] = req->tlb[1];
+    }
+
+    window = cm_spec_window_hash(req);
+    cpu_single_env = env;
+    if (setjmp(env->jmp_env) == 0) {
+        cpu_gen_code(env, tb, &code_gen_size);
+        ok = 1;
+    } else {
+        ok = 0;
+    }
+    cpu_single_env = NULL;
+
+    for (i = 0; i < NB_MMU_MODES; i++) {
+        memset(&env->tlb_table[i][index], -1, sizeof(CPUTLBEntry));
+        memset(&env->tlb_table[i][index2], -1, sizeof(CPUTLBEntry));
+    }
+    if (!ok || cm_spec_window_hash(req) != window) {
+        c->aborted++;
+        return;
+    }
+
+    tb->page_addr[0] = req->phys_pc & TARGET_PAGE_MASK;
+    tb->page_addr[1] = -1;
+    if (((req->pc + tb->size - 1) & TARGET_PAGE_MASK) != page) {
+        /* the code fetch would have missed otherwise */
+        tb->page_addr[1] = req->phys_page2;
+    }
+    c->code_hash[n] = cm_spec_code_hash(tb);
+    c->ptr = (void *)(((unsigned long)c->ptr + code_gen_size +
+                       CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
+    c->translated++;
+
+    /* the TB must be complete before the core can see it */
+    smp_wmb();
+    c->nb_tbs = n + 1;
+}
+
+static int cm_spec_serve(CMSpecCore *c)
+{
+    int n;
+
+    coremu_spin_lock(&c->lock);
+    for (n = 0; n < CM_SPEC_BATCH && c->head != c->tail; n++) {
+        cm_spec_translate(c, &c->queue[c->head & (CM_SPEC_QUEUE_SIZE - 1)]);
+        barrier();
+        c->head++;
+    }
+    coremu_spin_unlock(&c->lock);
+    return n;
+}
+
+static int cm_spec_pending(CMSpecThread *t)
+{
+    CMSpecCore *c;
+    int i;
+
+    for (i = t->index; i < COREMU_MAX_CPU; i += cm_spec_nb_threads) {
+        c = cm_spec_cores[i];
+        if (c && c->head != c->tail) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void *cm_spec_thread_fn(void *arg)
+{
+    CMSpecThread *t = arg;
+    CMSpecCore *c;
+    int i, n;
+
+    cm_spec_translator = 1;
+    cpu_gen_init();
+#if defined(TARGET_I386)
+    optimize_flags_init();
+#endif
+
+    for (;;) {
+        n = 0;
+        for (i = t->index; i < COREMU_MAX_CPU; i += cm_spec_nb_threads) {
+            c = cm_spec_cores[i];
+            if (c) {
+                n += cm_spec_serve(c);
+            }
+        }
+        if (n) {
+            continue;
+        }
+
+        pthread_mutex_lock(&t->lock);
+        t->idle = 1;
+        mb();
+        if (!cm_spec_pending(t)) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        t->idle = 0;
+        pthread_mutex_unlock(&t->lock);
+    }
+    return NULL;
+}
+
+void cm_spec_init(void)
+{
+    sigset_t set, oldset;
+    CMSpecThread *t;
+    int i;
+
+    if (!cm_spec_nb_threads) {
+        return;
+    }
+#if !defined(TARGET_I386)
+    fprintf(stderr, "translate-threads: not supported for this target\n");
+    cm_spec_nb_threads = 0;
+    return;
+#endif
+
+    cm_spec_threads = qemu_mallocz(cm_spec_nb_threads * sizeof(CMSpecThread));
+
+    /* translator threads never take signals, except for faults on guest
+       code that post-copy migration has yet to fetch */
+    sigfillset(&set);
+    sigdelset(&set, SIGSEGV);
+    pthread_sigmask(SIG_SETMASK, &set, &oldset);
+    for (i = 0; i < cm_spec_nb_threads; i++) {
+        t = &cm_spec_threads[i];
+        t->index = i;
+        pthread_mutex_init(&t->lock, NULL);
+        pthread_cond_init(&t->cond, NULL);
+        if (pthread_create(&t->thread, NULL, cm_spec_thread_fn, t)) {
+            cm_assert(0, "cannot create translator thread\n");
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+void cm_spec_init_core(CPUState *env)
+{
+    CMSpecCore *c;
+    CPUState *shadow;
+
+    if (!cm_spec_nb_threads) {
+        return;
+    }
+
+    shadow = qemu_malloc(sizeof(CPUState));
+    memcpy(shadow, env, sizeof(CPUState));
+    memset(shadow->tlb_table, -1, sizeof(shadow->tlb_table));
+    memset(shadow->tlb_v_table, -1, sizeof(shadow->tlb_v_table));
+    QTAILQ_INIT(&shadow->breakpoints);
+    QTAILQ_INIT(&shadow->watchpoints);
+    shadow->singlestep_enabled = 0;
+    shadow->next_cpu = NULL;
+
+    c = qemu_mallocz(sizeof(CMSpecCore));
+    c->shadow = shadow;
+    c->thread = &cm_spec_threads[env->cpu_index % cm_spec_nb_threads];
+    CM_SPIN_LOCK_INIT(&c->lock);
+    c->buffer = code_gen_buffer + code_gen_buffer_size - cm_spec_buffer_size;
+    c->ptr = c->buffer;
+    c->end = code_gen_buffer + code_gen_buffer_size -
+             (TCG_MAX_OP_SIZE * OPC_MAX_SIZE);
+    c->max_tbs = cm_spec_buffer_size / CODE_GEN_AVG_BLOCK_SIZE;
+    c->tbs = qemu_malloc(c->max_tbs * sizeof(TranslationBlock));
+    c->code_hash = qemu_malloc(c->max_tbs * sizeof(uint64_t));
+
+    cm_spec_core = c;
+    smp_wmb();
+    cm_spec_cores[env->cpu_index] = c;
+}
+
+int cm_spec_adopt(CPUState *env)
+{
+    CMSpecCore *c = cm_spec_core;
+    TranslationBlock *tb;
+    CPUTLBEntry te;
+    int n, nb_tbs, mmu_idx, linked;
+
+    if (!c || c->nb_adopted == c->nb_tbs) {
+        return 0;
+    }
+    nb_tbs = c->nb_tbs;
+    /* x86 does not reorder loads, this only stops the compiler */
+    barrier();
+
+    mmu_idx = cpu_mmu_index(env);
+    linked = 0;
+    for (n = c->nb_adopted; n < nb_tbs; n++) {
+        tb = &c->tbs[n];
+        if (cm_spec_code_hash(tb) != c->code_hash[n] ||
+            cm_spec_lookup(tb->pc, tb->cs_base, tb->flags,
+                           tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK))) {
+            tb->spec = 0;
+            c->stale++;
+            continue;
+        }
+        tb_link_page(tb, tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK),
+                     tb->page_addr[1]);
+        /* tb_jmp_cache is virtually indexed: only fill it if the pages
+           are still mapped where they were when the request was made */
+        if (cm_spec_code_page(env, mmu_idx, tb->pc & TARGET_PAGE_MASK,
+                              &te) == tb->page_addr[0] &&
+            (tb->page_addr[1] == -1 ||
+             cm_spec_code_page(env, mmu_idx,
+                               (tb->pc & TARGET_PAGE_MASK) + TARGET_PAGE_SIZE,
+                               &te) == tb->page_addr[1])) {
+            env->tb_jmp_cache[tb_jmp_cache_hash_func(tb->pc)] = tb;
+        }
+        linked++;
+    }
+    c->nb_adopted = nb_tbs;
+    c->adopted += linked;
+    return linked;
+}
+
+void cm_spec_flush(CPUState *env)
+{
+    CMSpecCore *c = cm_spec_core;
+
+    if (!c) {
+        return;
+    }
+    coremu_spin_lock(&c->lock);
+    c->head = c->tail;
+    c->ptr = c->buffer;
+    c->nb_tbs = 0;
+    c->nb_adopted = 0;
+    coremu_spin_unlock(&c->lock);
+}
+
+TranslationBlock *cm_spec_find_pc(unsigned long tc_ptr)
+{
+    CMSpecCore *c = cm_spec_core;
+    TranslationBlock *tb;
+    int m_min, m_max, m;
+    unsigned long v;
+
+    /* only adopted TBs can be running */
+    if (!c || c->nb_adopted <= 0 ||
+        tc_ptr < (unsigned long)c->buffer || tc_ptr >= (unsigned long)c->ptr)
+        return NULL;
+    m_min = 0;
+    m_max = c->nb_adopted - 1;
+    while (m_min <= m_max) {
+        m = (m_min + m_max) >> 1;
+        tb = &c->tbs[m];
+        v = (unsigned long)tb->tc_ptr;
+        if (v == tc_ptr)
+            return tb;
+        else if (tc_ptr < v) {
+            m_max = m - 1;
+        } else {
+            m_min = m + 1;
+        }
+    }
+    return &c->tbs[m_max];
+}
+
+void cm_spec_tlb_miss(void)
+{
+    if (cm_spec_translator) {
+        longjmp(cpu_single_env->jmp_env, 1);
+    }
+}
+
+void cm_spec_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    uint64_t queued = 0, translated = 0, aborted = 0, adopted = 0;
+    uint64_t stale = 0, used = 0, ondemand = 0;
+    CMSpecCore *c;
+    int i;
+
+    if (!cm_spec_nb_threads) {
+        return;
+    }
+    for (i = 0; i < COREMU_MAX_CPU; i++) {
+        c = cm_spec_cores[i];
+        if (!c) {
+            continue;
+        }
+        queued += c->queued;
+        translated += c->translated;
+        aborted += c->aborted;
+        adopted += c->adopted;
+        stale += c->stale;
+        used += c->used;
+        ondemand += c->ondemand;
+    }
+    cpu_fprintf(f, "\nBackground translation (%d threads):\n",
+                cm_spec_nb_threads);
+    cpu_fprintf(f, "TB on demand        %" PRIu64 "\n", ondemand);
+    cpu_fprintf(f, "TB speculative      %" PRIu64 " used, %" PRIu64
+                " linked, %" PRIu64 " translated\n", used, adopted, translated);
+    cpu_fprintf(f, "TB served ahead     %" PRIu64 "%%\n",
+                used + ondemand ? used * 100 / (used + ondemand) : 0);
+    cpu_fprintf(f, "requests            %" PRIu64 " (%" PRIu64 " aborted, %"
+                PRIu64 " stale)\n", queued, aborted, stale);
+}
@@ -0,0 +1,54 @@
+/*
+ * COREMU Parallel Emulator Framework
+ *
+ * Background translation: helper threads translate the direct jump targets
+ * of new TBs ahead of time into the code buffer of the owning core.
+ *
+ * Copyright (C) 2010 Parallel Processing Institute (PPI), Fudan Univ.
+ *  <http://ppi.fudan.edu.cn/system_research_group>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CM_SPEC_H
+#define _CM_SPEC_H
+
+#include "qemu-common.h"
+#include "exec-all.h"
+#include "cm-init.h"
+
+/* Start the translator threads. Called by the hardware thread. */
+void cm_spec_init(void);
+/* Set up the speculation state of the calling core. */
+void cm_spec_init_core(CPUState *env);
+
+/* Ask for the direct jump targets of 'tb' to be translated. */
+void cm_spec_queue(CPUState *env, TranslationBlock *tb);
+/* Link the TBs finished by the translator threads into the tables of the
+   calling core. Returns the number of TBs made visible. */
+int cm_spec_adopt(CPUState *env);
+/* Account the first execution of a speculative TB. */
+void cm_spec_hit(CPUState *env, TranslationBlock *tb);
+/* Drop all speculative TBs of the calling core, from tb_flush(). */
+void cm_spec_flush(CPUState *env);
+/* tb_find_pc() for the speculative part of the code buffer. */
+TranslationBlock *cm_spec_find_pc(unsigned long tc_ptr);
+
+/* Called from tlb_fill(): a translator thread must not walk the guest page
+   tables, so a TLB miss abandons the speculative translation. */
+void cm_spec_tlb_miss(void);
+
+void cm_spec_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+#endif /* _CM_SPEC_H */
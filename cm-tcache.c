@@ -0,0 +1,641 @@
+/*
+ * COREMU Parallel Emulator Framework
+ *
+ * Persistent translation cache.
+ *
+ * Copyright (C) 2010 Parallel Processing Institute (PPI), Fudan Univ.
+ *  <http://ppi.fudan.edu.cn/system_research_group>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* The cache holds the output of the front end (the TCG op stream and the
+ * temporaries it allocated), not host code: host code embeds the address
+ * of the code buffer and of the TB in many places, while the op stream only
+ * refers to the TB in exit_tb and to helpers in calls, which are relocated
+ * here.  Helper addresses are kept relative to the text of the binary, so
+ * that they survive PIE and ASLR; the file is tied to the executable that
+ * wrote it and is reset when another one opens it.
+ *
+ * Entries are keyed by (phys_pc, pc, cs_base, flags) and validated against
+ * a hash of the guest code bytes, so stale entries are simply misses.  The
+ * code is only looked up through the TLB: the cache never faults, a page
+ * that isn't mapped is a miss.
+ *
+ * Every core, and every process using the file, looks up and fills the
+ * same mapping; the file is append only and entries are published with a
+ * barrier, so lookups do not take the lock.  Writers take the spinlock
+ * against the other cores and flock() against the other processes.  A
+ * reset by another executable bumps the generation in the header before
+ * and after it, like a seqlock, and a lookup that saw it change, or finds
+ * another build id, is a miss.  The file is not trusted: entries that
+ * don't fit the op buffers are misses. */
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <fcntl.h>
+
+#include "cpu.h"
+#include "exec-all.h"
+#include "tcg-op.h"
+#include "qemu-timer.h"
+#include "qemu-barrier.h"
+
+#include "coremu-config.h"
+#include "coremu-spinlock.h"
+#include "coremu-atomic.h"
+
+#include "cm-tcache.h"
+
+#define CM_TCACHE_MAGIC     0x434d5443  /* "CMTC" */
+#define CM_TCACHE_VERSION   4
+#define CM_TCACHE_BUCKETS   (1 << 16)
+
+typedef struct CMTCacheHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t build_id;
+    uint64_t generation;        /* odd while a reset is in progress */
+    uint64_t size;              /* size of the mapping */
+    uint64_t used;              /* first free byte */
+    uint64_t nb_entries;
+    uint64_t buckets[CM_TCACHE_BUCKETS];
+} CMTCacheHeader;
+
+typedef struct CMTCacheTemp {
+    uint8_t base_type;
+    uint8_t type;
+    uint8_t temp_local;
+    uint8_t pad;
+} CMTCacheTemp;
+
+typedef struct CMTCacheEntry {
+    uint64_t next;              /* offset of the next entry in the bucket */
+    uint64_t pc;
+    uint64_t cs_base;
+    uint64_t flags;
+    uint64_t phys_pc;
+    uint64_t phys_page2;        /* if the code crosses a page */
+    uint64_t features;
+    uint64_t code_hash;
+    uint64_t jmp_pc[2];         /* direct jump targets, for cm-spec */
+    uint32_t size;              /* guest code bytes */
+    uint32_t icount;
+    uint32_t nb_ops;
+    uint32_t nb_params;
+    uint32_t nb_temps;          /* temporaries after the globals */
+    uint32_t nb_labels;
+    /* followed by TCGArg params[nb_params], uint16_t ops[nb_ops] and
+       CMTCacheTemp temps[nb_temps] */
+} CMTCacheEntry;
+
+/* helper addresses are stored relative to this */
+#define CM_TCACHE_TEXT_BASE ((tcg_target_long)&cm_tcache_init)
+
+static CMTCacheHeader *cm_tcache;
+static int cm_tcache_fd = -1;
+static CMSpinLock cm_tcache_lock;
+static uint64_t cm_tcache_id;
+
+static uint64_t cm_tcache_hits;
+static uint64_t cm_tcache_misses;
+static uint64_t cm_tcache_stores;
+
+/* FNV-1a */
+static uint64_t cm_tcache_hash(uint64_t h, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len--) {
+        h ^= *p++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+#define CM_TCACHE_HASH_INIT 0xcbf29ce484222325ULL
+
+/* Target state that the front end looks at besides tb->flags. */
+static uint64_t cm_tcache_features(CPUState *env)
+{
+#if defined(TARGET_I386)
+    return ((uint64_t)env->cpuid_features << 32 | env->cpuid_ext_features) ^
+           ((uint64_t)env->cpuid_ext2_features << 32 |
+            env->cpuid_ext3_features) * 31;
+#elif defined(TARGET_ARM)
+    return env->features;
+#else
+    return 0;
+#endif
+}
+
+/* Identify the executable: any change to the translator, to TCG or to the
+   helpers changes the op streams, so the file is only reused by the very
+   same binary. */
+static uint64_t cm_tcache_build_id(void)
+{
+    uint64_t h = CM_TCACHE_HASH_INIT;
+    uint64_t v[5];
+    struct stat st;
+
+    if (stat("/proc/self/exe", &st) < 0) {
+        /* can't tell, so never reuse the file */
+        v[0] = getpid();
+        v[1] = get_clock();
+        h = cm_tcache_hash(h, v, 2 * sizeof(v[0]));
+    } else {
+        v[0] = CM_TCACHE_VERSION;
+        v[1] = st.st_dev;
+        v[2] = st.st_ino;
+        v[3] = st.st_size;
+        v[4] = st.st_mtime * 1000000000ULL + st.st_mtim.tv_nsec;
+        h = cm_tcache_hash(h, v, sizeof(v));
+    }
+    return h ? h : 1;
+}
+
+static void cm_tcache_lock_file(void)
+{
+    coremu_spin_lock(&cm_tcache_lock);
+    while (flock(cm_tcache_fd, LOCK_EX) < 0 && errno == EINTR) {
+    }
+}
+
+static void cm_tcache_unlock_file(void)
+{
+    flock(cm_tcache_fd, LOCK_UN);
+    coremu_spin_unlock(&cm_tcache_lock);
+}
+
+static inline void *cm_tcache_ptr(uint64_t offset)
+{
+    return (uint8_t *)cm_tcache + offset;
+}
+
+static inline unsigned int cm_tcache_bucket(tb_page_addr_t phys_pc,
+                                            target_ulong pc)
+{
+    return (phys_pc ^ (phys_pc >> 12) ^ pc) & (CM_TCACHE_BUCKETS - 1);
+}
+
+static inline size_t cm_tcache_entry_size(const CMTCacheEntry *e)
+{
+    size_t size;
+
+    size = sizeof(*e) + e->nb_params * sizeof(TCGArg) +
+           e->nb_ops * sizeof(uint16_t) + e->nb_temps * sizeof(CMTCacheTemp);
+    return (size + 7) & ~7;
+}
+
+/* Copy the header of the entry at 'offset' to 'e' and check that the entry
+   lies in the used part of the file and fits the op buffers and the TCG
+   context.  The copy is what the caller must use: the file may be written
+   by another process meanwhile. */
+static int cm_tcache_entry_valid(uint64_t offset, CMTCacheEntry *e)
+{
+    TCGContext *s = &tcg_ctx;
+    uint64_t used = cm_tcache->used;
+
+    if (offset < sizeof(CMTCacheHeader) || (offset & 7) ||
+        offset + sizeof(*e) > used) {
+        return 0;
+    }
+    *e = *(CMTCacheEntry *)cm_tcache_ptr(offset);
+    return e->nb_ops < OPC_BUF_SIZE && e->nb_params <= OPPARAM_BUF_SIZE &&
+           e->nb_temps <= TCG_MAX_TEMPS - s->nb_globals &&
+           e->nb_labels <= TCG_MAX_LABELS &&
+           (e->pc & ~TARGET_PAGE_MASK) + e->size <= 2 * TARGET_PAGE_SIZE &&
+           offset + cm_tcache_entry_size(e) <= used;
+}
+
+static int cm_tcache_is_helper(tcg_target_ulong func)
+{
+    TCGContext *s = &tcg_ctx;
+    int i;
+
+    for (i = 0; i < s->nb_helpers; i++) {
+        if (s->helpers[i].func == func) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Relocate the op stream of 'tb' between the file (load == 0) and the op
+   buffers (load != 0): exit_tb arguments are stored relative to the TB and
+   helper addresses relative to CM_TCACHE_TEXT_BASE.  Returns -1 if the ops
+   can't be relocated, or don't fit 'nb_params'. */
+static int cm_tcache_relocate(TranslationBlock *tb, uint16_t *ops,
+                              uint32_t nb_ops, TCGArg *params,
+                              uint32_t nb_params, int load)
+{
+    int movi[TCG_MAX_TEMPS];    /* param set by the last movi to a temp */
+    TCGArg *args, fn;
+    uint32_t i, p, n;
+
+    memset(movi, -1, sizeof(movi));
+    for (i = 0, p = 0; i < nb_ops; i++, p += n) {
+        if (ops[i] >= NB_OPS) {
+            return -1;
+        }
+        args = &params[p];
+        /* the argument count of these is their first argument */
+        if (ops[i] == INDEX_op_call &&
+            (p == nb_params || args[0] >= (1 << 24))) {
+            return -1;
+        }
+        if (ops[i] == INDEX_op_nopn &&
+            (p == nb_params || args[0] > nb_params - p)) {
+            return -1;
+        }
+        n = cm_tcg_op_nb_args(ops[i], args);
+        if (n > nb_params - p) {
+            return -1;
+        }
+
+        switch (ops[i]) {
+        case INDEX_op_exit_tb:
+            if (args[0] == 0) {
+                break;
+            }
+            if (load) {
+                args[0] += (tcg_target_long)tb - 1;
+            } else if (args[0] - (tcg_target_long)tb > 3) {
+                /* only exit_tb(0) and exit_tb(tb + n) are relocated */
+                return -1;
+            } else {
+                args[0] -= (tcg_target_long)tb - 1;
+            }
+            break;
+        case INDEX_op_movi_i32:
+#if TCG_TARGET_REG_BITS == 64
+        case INDEX_op_movi_i64:
+#endif
+            if (args[0] < TCG_MAX_TEMPS) {
+                movi[args[0]] = p + 1;
+            }
+            break;
+        case INDEX_op_call:
+            /* the function is the last input, loaded by tcg_const_ptr */
+            fn = args[(args[0] >> 16) + (args[0] & 0xffff)];
+            if (fn >= TCG_MAX_TEMPS || movi[fn] < 0) {
+                return -1;
+            }
+            if (load) {
+                params[movi[fn]] += CM_TCACHE_TEXT_BASE;
+            } else if (!cm_tcache_is_helper(params[movi[fn]])) {
+                return -1;
+            } else {
+                params[movi[fn]] -= CM_TCACHE_TEXT_BASE;
+            }
+            /* the temp may be loaded again for the next call */
+            movi[fn] = -1;
+            break;
+        }
+    }
+    return 0;
+}
+
+/* Like get_page_addr_code, but only looks at the TLB, so that it can't
+   fault: a page that isn't mapped to RAM there returns -1. */
+static int cm_tcache_page_addr(CPUState *env, target_ulong addr,
+                               tb_page_addr_t *paddr)
+{
+    int mmu_idx, page_index;
+    void *p;
+
+    page_index = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
+    mmu_idx = cpu_mmu_index(env);
+    if (env->tlb_table[mmu_idx][page_index].addr_code !=
+        (addr & TARGET_PAGE_MASK)) {
+        return -1;
+    }
+    p = (void *)(unsigned long)addr
+        + env->tlb_table[mmu_idx][page_index].addend;
+    *paddr = qemu_ram_addr_from_host_nofail(p);
+    return 0;
+}
+
+/* Hash the guest code covered by a TB of 'size' bytes at 'pc', the part
+   past the first page being at 'phys_page2'. */
+static uint64_t cm_tcache_code_hash(target_ulong pc, tb_page_addr_t phys_pc,
+                                    tb_page_addr_t phys_page2, uint32_t size)
+{
+    uint64_t h = CM_TCACHE_HASH_INIT;
+    target_ulong len;
+
+    len = TARGET_PAGE_SIZE - (pc & ~TARGET_PAGE_MASK);
+    if (len > size) {
+        len = size;
+    }
+    h = cm_tcache_hash(h, qemu_safe_ram_ptr(phys_pc), len);
+    if (len < size) {
+        h = cm_tcache_hash(h, qemu_safe_ram_ptr(phys_page2), size - len);
+    }
+    return h;
+}
+
+/* Make the file ours if another executable wrote it.  Lookups running in
+   other processes see the generation change and drop what they read. */
+static void cm_tcache_check_build(void)
+{
+    cm_tcache_lock_file();
+    if (cm_tcache->build_id != cm_tcache_id) {
+        cm_tcache->generation++;
+        smp_wmb();
+        memset(cm_tcache->buckets, 0, sizeof(cm_tcache->buckets));
+        cm_tcache->used = sizeof(CMTCacheHeader);
+        cm_tcache->nb_entries = 0;
+        cm_tcache->build_id = cm_tcache_id;
+        smp_wmb();
+        cm_tcache->generation++;
+    }
+    cm_tcache_unlock_file();
+}
+
+int cm_tcache_init(const char *filename, int64_t size)
+{
+    struct stat st;
+    void *p;
+    int fd;
+
+    if (size < (int64_t)sizeof(CMTCacheHeader) * 2) {
+        fprintf(stderr, "tcache: size too small\n");
+        return -1;
+    }
+    fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "tcache: cannot open %s: %s\n", filename,
+                strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || (st.st_size != size && ftruncate(fd, size) < 0)) {
+        fprintf(stderr, "tcache: cannot resize %s: %s\n", filename,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "tcache: cannot map %s: %s\n", filename,
+                strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    /* the fd stays open for flock */
+    cm_tcache = p;
+    cm_tcache_fd = fd;
+    cm_tcache_id = cm_tcache_build_id();
+    CM_SPIN_LOCK_INIT(&cm_tcache_lock);
+
+    cm_tcache_lock_file();
+    if (cm_tcache->magic != CM_TCACHE_MAGIC ||
+        cm_tcache->version != CM_TCACHE_VERSION ||
+        cm_tcache->size != size) {
+        memset(cm_tcache, 0, sizeof(CMTCacheHeader));
+        cm_tcache->magic = CM_TCACHE_MAGIC;
+        cm_tcache->version = CM_TCACHE_VERSION;
+        cm_tcache->size = size;
+        cm_tcache->used = sizeof(CMTCacheHeader);
+    }
+    cm_tcache_unlock_file();
+
+    cm_tcache_check_build();
+    return 0;
+}
+
+/* The TB can only be replayed if the front end output depends on nothing
+   but the key. */
+static int cm_tcache_cacheable(CPUState *env, TranslationBlock *tb)
+{
+    return cm_tcache && tb->cflags == 0 && !use_icount &&
+           !env->singlestep_enabled && QTAILQ_EMPTY(&env->breakpoints);
+}
+
+/* Returns the offset of the entry for 'tb', with a copy of its header in
+   'e', or 0 on a miss. */
+static uint64_t cm_tcache_find(CPUState *env, TranslationBlock *tb,
+                               tb_page_addr_t phys_pc, uint64_t features,
+                               CMTCacheEntry *e)
+{
+    tb_page_addr_t phys_page2 = -1;
+    target_ulong len;
+    uint64_t offset;
+    int page2 = 0;      /* 1 if phys_page2 is mapped, -1 if not */
+
+    len = TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK);
+    offset = cm_tcache->buckets[cm_tcache_bucket(phys_pc, tb->pc)];
+    while (offset) {
+        if (!cm_tcache_entry_valid(offset, e)) {
+            return 0;
+        }
+        if (e->pc == tb->pc && e->cs_base == tb->cs_base &&
+            e->flags == tb->flags && e->phys_pc == phys_pc &&
+            e->features == features) {
+            /* the code of the entry goes on in the next page, which may
+               not even be mapped for this one */
+            if (e->size > len && !page2) {
+                page2 = cm_tcache_page_addr(env, tb->pc + len,
+                                            &phys_page2) < 0 ? -1 : 1;
+            }
+            if ((e->size <= len ||
+                 (page2 > 0 && e->phys_page2 == phys_page2)) &&
+                e->code_hash == cm_tcache_code_hash(tb->pc, phys_pc,
+                                                    phys_page2, e->size)) {
+                return offset;
+            }
+        }
+        offset = e->next;
+    }
+    return 0;
+}
+
+int cm_tcache_load(CPUState *env, TranslationBlock *tb)
+{
+    TCGContext *s = &tcg_ctx;
+    CMTCacheTemp temps[TCG_MAX_TEMPS];
+    CMTCacheEntry hdr, *e;
+    CMTCacheTemp *t;
+    TCGArg *params;
+    uint16_t *ops;
+    tb_page_addr_t phys_pc;
+    uint64_t generation, offset;
+    uint32_t i, n;
+
+    if (!cm_tcache_cacheable(env, tb)) {
+        return 0;
+    }
+
+    generation = cm_tcache->generation;
+    smp_rmb();
+    if ((generation & 1) || cm_tcache->build_id != cm_tcache_id ||
+        cm_tcache_page_addr(env, tb->pc, &phys_pc) < 0) {
+        atomic_incq(&cm_tcache_misses);
+        return 0;
+    }
+    offset = cm_tcache_find(env, tb, phys_pc, cm_tcache_features(env), &hdr);
+    if (!offset) {
+        atomic_incq(&cm_tcache_misses);
+        return 0;
+    }
+
+    e = cm_tcache_ptr(offset);
+    params = (TCGArg *)(e + 1);
+    ops = (uint16_t *)(params + hdr.nb_params);
+    t = (CMTCacheTemp *)(ops + hdr.nb_ops);
+
+    /* cm_tcache_find checked that the counts fit the buffers */
+    memcpy(gen_opparam_buf, params, hdr.nb_params * sizeof(TCGArg));
+    memcpy(gen_opc_buf, ops, hdr.nb_ops * sizeof(uint16_t));
+    memcpy(temps, t, hdr.nb_temps * sizeof(CMTCacheTemp));
+
+    /* the entry may have been overwritten after a reset */
+    smp_rmb();
+    if (cm_tcache->generation != generation ||
+        cm_tcache_relocate(tb, gen_opc_buf, hdr.nb_ops, gen_opparam_buf,
+                           hdr.nb_params, 1) < 0) {
+        atomic_incq(&cm_tcache_misses);
+        return 0;
+    }
+    gen_opparam_ptr = gen_opparam_buf + hdr.nb_params;
+    gen_opc_ptr = gen_opc_buf + hdr.nb_ops;
+    *gen_opc_ptr = INDEX_op_end;
+
+    for (i = 0; i < hdr.nb_temps; i++) {
+        TCGTemp *ts = &s->temps[s->nb_globals + i];
+
+        ts->base_type = temps[i].base_type;
+        ts->type = temps[i].type;
+        ts->temp_local = temps[i].temp_local;
+        ts->temp_allocated = 1;
+        ts->name = NULL;
+    }
+    s->nb_temps = s->nb_globals + hdr.nb_temps;
+
+    for (n = 0; n < hdr.nb_labels; n++) {
+        gen_new_label();
+    }
+
+    tb->size = hdr.size;
+    tb->icount = hdr.icount;
+    tb->jmp_pc[0] = hdr.jmp_pc[0];
+    tb->jmp_pc[1] = hdr.jmp_pc[1];
+    atomic_incq(&cm_tcache_hits);
+    return 1;
+}
+
+void cm_tcache_store(CPUState *env, TranslationBlock *tb)
+{
+    TCGContext *s = &tcg_ctx;
+    CMTCacheEntry tmp, found, *e;
+    CMTCacheTemp *t;
+    TCGArg *params;
+    uint16_t *ops;
+    tb_page_addr_t phys_pc, phys_page2 = -1;
+    target_ulong len;
+    unsigned int bucket;
+    uint64_t offset;
+    size_t size;
+    uint32_t i;
+
+    /* the front end just read the code, so its pages are in the TLB */
+    len = TARGET_PAGE_SIZE - (tb->pc & ~TARGET_PAGE_MASK);
+    if (!cm_tcache_cacheable(env, tb) ||
+        cm_tcache_page_addr(env, tb->pc, &phys_pc) < 0 ||
+        (tb->size > len &&
+         cm_tcache_page_addr(env, tb->pc + len, &phys_page2) < 0)) {
+        return;
+    }
+
+    memset(&tmp, 0, sizeof(tmp));
+    tmp.pc = tb->pc;
+    tmp.cs_base = tb->cs_base;
+    tmp.flags = tb->flags;
+    tmp.phys_pc = phys_pc;
+    tmp.phys_page2 = phys_page2;
+    tmp.features = cm_tcache_features(env);
+    tmp.size = tb->size;
+    tmp.icount = tb->icount;
+    tmp.jmp_pc[0] = tb->jmp_pc[0];
+    tmp.jmp_pc[1] = tb->jmp_pc[1];
+    tmp.nb_ops = gen_opc_ptr - gen_opc_buf;
+    tmp.nb_params = gen_opparam_ptr - gen_opparam_buf;
+    tmp.nb_temps = s->nb_temps - s->nb_globals;
+    tmp.nb_labels = s->nb_labels;
+
+    tmp.code_hash = cm_tcache_code_hash(tb->pc, phys_pc, phys_page2,
+                                        tmp.size);
+    size = cm_tcache_entry_size(&tmp);
+
+    cm_tcache_lock_file();
+    /* another executable may have taken the file over, and another core
+       may have translated the same block meanwhile */
+    if (cm_tcache->build_id != cm_tcache_id ||
+        cm_tcache_find(env, tb, phys_pc, tmp.features, &found) ||
+        cm_tcache->used + size > cm_tcache->size) {
+        cm_tcache_unlock_file();
+        return;
+    }
+    offset = cm_tcache->used;
+    e = cm_tcache_ptr(offset);
+    *e = tmp;
+
+    params = (TCGArg *)(e + 1);
+    ops = (uint16_t *)(params + e->nb_params);
+    t = (CMTCacheTemp *)(ops + e->nb_ops);
+    memcpy(params, gen_opparam_buf, e->nb_params * sizeof(TCGArg));
+    memcpy(ops, gen_opc_buf, e->nb_ops * sizeof(uint16_t));
+    if (cm_tcache_relocate(tb, ops, e->nb_ops, params, e->nb_params, 0) < 0) {
+        /* the space isn't used yet, the next store overwrites it */
+        cm_tcache_unlock_file();
+        return;
+    }
+    for (i = 0; i < e->nb_temps; i++) {
+        TCGTemp *ts = &s->temps[s->nb_globals + i];
+
+        t[i].base_type = ts->base_type;
+        t[i].type = ts->type;
+        t[i].temp_local = ts->temp_local;
+        t[i].pad = 0;
+    }
+
+    bucket = cm_tcache_bucket(phys_pc, tb->pc);
+    e->next = cm_tcache->buckets[bucket];
+    cm_tcache->used += size;
+    cm_tcache->nb_entries++;
+    /* the entry must be complete, and in the used part of the file that
+       lookups check, before it becomes visible */
+    smp_wmb();
+    cm_tcache->buckets[bucket] = offset;
+    cm_tcache_unlock_file();
+
+    atomic_incq(&cm_tcache_stores);
+}
+
+void cm_tcache_dump_info(FILE *f, fprintf_function cpu_fprintf)
+{
+    if (!cm_tcache) {
+        return;
+    }
+    cpu_fprintf(f, "\nTranslation cache:\n");
+    cpu_fprintf(f, "entries             %" PRIu64 " (%" PRIu64 "/%" PRIu64
+                " bytes)\n", cm_tcache->nb_entries, cm_tcache->used,
+                cm_tcache->size);
+    cpu_fprintf(f, "hits                %" PRIu64 "\n", cm_tcache_hits);
+    cpu_fprintf(f, "misses              %" PRIu64 "\n", cm_tcache_misses);
+    cpu_fprintf(f, "stores              %" PRIu64 "\n", cm_tcache_stores);
+}
@@ -0,0 +1,39 @@
+/*
+ * COREMU Parallel Emulator Framework
+ *
+ * Persistent translation cache: TCG op streams produced by the front end
+ * are kept in a memory mapped file shared by all cores and across runs.
+ *
+ * Copyright (C) 2010 Parallel Processing Institute (PPI), Fudan Univ.
+ *  <http://ppi.fudan.edu.cn/system_research_group>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _CM_TCACHE_H
+#define _CM_TCACHE_H
+
+#include "qemu-common.h"
+#include "exec-all.h"
+#include "cm-init.h"
+
+/* Fill the op buffers of the current TCG context for 'tb' from the cache.
+   Returns non zero on a hit, in which case the front end must not run. */
+int cm_tcache_load(CPUState *env, TranslationBlock *tb);
+/* Record the op buffers just produced by the front end for 'tb'. */
+void cm_tcache_store(CPUState *env, TranslationBlock *tb);
+
+void cm_tcache_dump_info(FILE *f, fprintf_function cpu_fprintf);
+
+#endif /* _CM_TCACHE_H */
@@ -21,6 +21,7 @@
 
 #include "qemu-common.h"
 #include "cpu-common.h"
+#include "bitops.h"
 
 #include "coremu-config.h"
 
@@ -874,12 +875,24 @@ typedef struct RAMBlock {
 #endif
 } RAMBlock;
 
+/* Clients of the dirty memory bitmaps */
+enum {
+    DIRTY_MEMORY_VGA,
+    DIRTY_MEMORY_CODE,
+    DIRTY_MEMORY_MIGRATION,
+    DIRTY_MEMORY_NUM
+};
+
 typedef struct RAMList {
-    uint8_t *phys_dirty;
+    /* one bit per page for each client, see cpu_physical_memory_*dirty* */
+    unsigned long *dirty_memory[DIRTY_MEMORY_NUM];
     QLIST_HEAD(ram, RAMBlock) blocks;
 } RAMList;
 extern RAMList ram_list;
 
+/* set while guest pages are still coming from a post-copy migration */
+extern int ram_postcopy_active;
+
 extern const char *mem_path;
 extern int mem_prealloc;
 
@@ -901,53 +914,129 @@ extern int mem_prealloc;
 /* Set if TLB entry is an IO callback.  */
 #define TLB_MMIO        (1 << 5)
 
-#define VGA_DIRTY_FLAG       0x01
-#define CODE_DIRTY_FLAG      0x02
-#define MIGRATION_DIRTY_FLAG 0x08
+#define VGA_DIRTY_FLAG       (1 << DIRTY_MEMORY_VGA)
+#define CODE_DIRTY_FLAG      (1 << DIRTY_MEMORY_CODE)
+#define MIGRATION_DIRTY_FLAG (1 << DIRTY_MEMORY_MIGRATION)
+#define DIRTY_FLAGS_ALL      ((1 << DIRTY_MEMORY_NUM) - 1)
+
+/*
+ * Each client has a bitmap of its own, so that a client scans words of
+ * its own bits only.  Bits are set and cleared with atomic operations,
+ * as COREMU core threads dirty pages concurrently without any lock.
+ */
 
 /* read dirty bit (return 0 or 1) */
 static inline int cpu_physical_memory_is_dirty(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] == 0xff;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+
+    return test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_VGA]) &&
+           test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_CODE]) &&
+           test_bit(page, ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
 }
 
 static inline int cpu_physical_memory_get_dirty_flags(ram_addr_t addr)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int i, flags = 0;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (test_bit(page, ram_list.dirty_memory[i])) {
+            flags |= 1 << i;
+        }
+    }
+    return flags;
 }
 
 static inline int cpu_physical_memory_get_dirty(ram_addr_t addr,
                                                 int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] & dirty_flags;
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int i;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if ((dirty_flags & (1 << i)) &&
+            test_bit(page, ram_list.dirty_memory[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
+                                                      int dirty_flags)
+{
+    unsigned long page = addr >> TARGET_PAGE_BITS;
+    int i;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (dirty_flags & (1 << i)) {
+            set_bit_atomic(page, ram_list.dirty_memory[i]);
+        }
+    }
+    return cpu_physical_memory_get_dirty_flags(addr);
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
 {
-    ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] = 0xff;
+    cpu_physical_memory_set_dirty_flags(addr, DIRTY_FLAGS_ALL);
 }
 
-static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
-                                                      int dirty_flags)
+static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
+                                                       ram_addr_t length,
+                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    int i;
+
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (dirty_flags & (1 << i)) {
+            bitmap_set_atomic(ram_list.dirty_memory[i],
+                              start >> TARGET_PAGE_BITS,
+                              length >> TARGET_PAGE_BITS);
+        }
+    }
 }
 
 static inline void cpu_physical_memory_mask_dirty_range(ram_addr_t start,
-                                                        int length,
+                                                        ram_addr_t length,
                                                         int dirty_flags)
 {
-    int i, mask, len;
-    uint8_t *p;
+    int i;
 
-    len = length >> TARGET_PAGE_BITS;
-    mask = ~dirty_flags;
-    p = ram_list.phys_dirty + (start >> TARGET_PAGE_BITS);
-    for (i = 0; i < len; i++) {
-        p[i] &= mask;
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        if (dirty_flags & (1 << i)) {
+            bitmap_clear_atomic(ram_list.dirty_memory[i],
+                                start >> TARGET_PAGE_BITS,
+                                length >> TARGET_PAGE_BITS);
+        }
     }
 }
 
+/*
+ * Returns the address of the first page of [start, end) that is dirty for
+ * the client of 'dirty_flag' (a single flag), or end if there is none.
+ */
+static inline ram_addr_t cpu_physical_memory_find_dirty(ram_addr_t start,
+                                                        ram_addr_t end,
+                                                        int dirty_flag)
+{
+    unsigned long page;
+
+    page = find_next_bit(ram_list.dirty_memory[ffs(dirty_flag) - 1],
+                         end >> TARGET_PAGE_BITS, start >> TARGET_PAGE_BITS);
+    return MIN((ram_addr_t)page << TARGET_PAGE_BITS, end);
+}
+
+/* Number of pages of [start, start + length) dirty for 'dirty_flag' */
+static inline ram_addr_t cpu_physical_memory_count_dirty(ram_addr_t start,
+                                                         ram_addr_t length,
+                                                         int dirty_flag)
+{
+    return bitmap_count(ram_list.dirty_memory[ffs(dirty_flag) - 1],
+                        start >> TARGET_PAGE_BITS,
+                        length >> TARGET_PAGE_BITS);
+}
+
 void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
                                      int dirty_flags);
 void cpu_tlb_update_dirty(CPUState *env);
@@ -75,6 +75,8 @@ typedef uint64_t target_ulong;
 #if !defined(CONFIG_USER_ONLY)
 #define CPU_TLB_BITS 8
 #define CPU_TLB_SIZE (1 << CPU_TLB_BITS)
+/* fully associative victim TLB, checked before walking the page tables */
+#define CPU_VTLB_SIZE 8
 
 #if HOST_LONG_BITS == 32 && TARGET_LONG_BITS == 32
 #define CPU_TLB_ENTRY_BITS 4
@@ -109,7 +111,15 @@ extern int CPUTLBEntry_wrong_size[sizeof(CPUTLBEntry) == (1 << CPU_TLB_ENTRY_BIT
     CPUTLBEntry tlb_table[NB_MMU_MODES][CPU_TLB_SIZE];                  \
     target_phys_addr_t iotlb[NB_MMU_MODES][CPU_TLB_SIZE];               \
     target_ulong tlb_flush_addr;                                        \
-    target_ulong tlb_flush_mask;
+    target_ulong tlb_flush_mask;                                        \
+    CPUTLBEntry tlb_v_table[NB_MMU_MODES][CPU_VTLB_SIZE];               \
+    target_phys_addr_t iotlb_v[NB_MMU_MODES][CPU_VTLB_SIZE];            \
+    /* ~(size - 1) of the guest page each entry was filled from */      \
+    target_ulong tlb_page_mask[NB_MMU_MODES][CPU_TLB_SIZE];             \
+    target_ulong tlb_v_page_mask[NB_MMU_MODES][CPU_VTLB_SIZE];          \
+    unsigned int vtlb_index;                                            \
+    uint64_t tlb_miss_count;    /* main TLB misses */                   \
+    uint64_t tlb_victim_hits;   /* misses served by the victim TLB */
 
 #else
 
@@ -25,6 +25,7 @@
 
 #include "coremu-config.h"
 #include "coremu-intr.h"
+#include "cm-spec.h"
 
 #if !defined(CONFIG_SOFTMMU)
 #undef EAX
@@ -135,6 +136,9 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     unsigned int h;
     tb_page_addr_t phys_pc, phys_page1, phys_page2;
     target_ulong virt_page2;
+#ifdef CONFIG_COREMU
+    int adopted = 0;
+#endif
 
     tb_invalidated_flag = 0;
 
@@ -143,6 +147,9 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
     phys_page1 = phys_pc & TARGET_PAGE_MASK;
     phys_page2 = -1;
     h = tb_phys_hash_func(phys_pc);
+#ifdef CONFIG_COREMU
+ retry:
+#endif
     ptb1 = &tb_phys_hash[h];
     for(;;) {
         tb = *ptb1;
@@ -166,6 +173,13 @@ static TranslationBlock *tb_find_slow(target_ulong pc,
         ptb1 = &tb->phys_hash_next;
     }
  not_found:
+#ifdef CONFIG_COREMU
+    /* the translator threads may have done it already */
+    if (!adopted && cm_spec_adopt(env)) {
+        adopted = 1;
+        goto retry;
+    }
+#endif
    /* if no translated code available, then translate it now */
     tb = tb_gen_code(env, pc, cs_base, flags, 0);
 
@@ -582,6 +596,11 @@ int cpu_exec(CPUState *env1)
 #endif /* DEBUG_DISAS || CONFIG_DEBUG_EXEC */
                 spin_lock(&tb_lock);
                 tb = tb_find_fast();
+#ifdef CONFIG_COREMU
+                if (unlikely(tb->spec)) {
+                    cm_spec_hit(env, tb);
+                }
+#endif
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
                 if (tb_invalidated_flag) {
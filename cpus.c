@@ -684,8 +684,10 @@ static void tcg_init_ipi(void)
     sigact.sa_handler = cpu_signal;
     sigaction(SIG_IPI, &sigact, NULL);
 
+    /* faults on guest memory fetch the pages post-copy migration misses */
     sigemptyset(&set);
     sigaddset(&set, SIG_IPI);
+    sigaddset(&set, SIGSEGV);
     pthread_sigmask(SIG_UNBLOCK, &set, NULL);
 }
 
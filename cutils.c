@@ -24,6 +24,12 @@
 #include "qemu-common.h"
 #include "host-utils.h"
 #include <math.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef CONFIG_AVX2_OPT
+#include <immintrin.h>
+#endif
 
 #include "coremu-config.h"
 
@@ -272,6 +278,32 @@ void qemu_iovec_memset(QEMUIOVector *qiov, int c, size_t count)
     }
 }
 
+/*
+ * Returns the offset of the first non-zero byte in the 'size' bytes of
+ * 'qiov' that start at 'skip', relative to 'skip'; 'size' if they are all
+ * zero.
+ */
+size_t qemu_iovec_find_nonzero(QEMUIOVector *qiov, uint64_t skip, size_t size)
+{
+    size_t done = 0, n, off;
+    int i;
+
+    for (i = 0; i < qiov->niov && done < size; i++) {
+        if (skip >= qiov->iov[i].iov_len) {
+            skip -= qiov->iov[i].iov_len;
+            continue;
+        }
+        n = MIN(qiov->iov[i].iov_len - skip, size - done);
+        off = buffer_find_nonzero((uint8_t *)qiov->iov[i].iov_base + skip, n);
+        if (off < n) {
+            return done + off;
+        }
+        done += n;
+        skip = 0;
+    }
+    return size;
+}
+
 #ifndef _WIN32
 /* Sets a specific flag */
 int fcntl_setfl(int fd, int flag)
@@ -387,3 +419,150 @@ ssize_t strtosz(const char *nptr, char **end)
 {
     return strtosz_suffix(nptr, end, STRTOSZ_DEFSUFFIX_MB);
 }
+
+/*
+ * Zero detection, used to skip empty sectors and pages. The vector kernels
+ * OR together a block of aligned loads and test the result once, so the
+ * common all-zero case costs one compare per block; the exact position of a
+ * non-zero byte is then found by the generic code. The best kernel for the
+ * host CPU is selected at startup.
+ */
+
+static size_t find_nonzero_generic(const uint8_t *buf, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && ((uintptr_t)(buf + i) & (sizeof(long) - 1))) {
+        if (buf[i]) {
+            return i;
+        }
+        i++;
+    }
+    for (; i + 4 * sizeof(long) <= len; i += 4 * sizeof(long)) {
+        const unsigned long *p = (const unsigned long *)(buf + i);
+        if (p[0] | p[1] | p[2] | p[3]) {
+            break;
+        }
+    }
+    for (; i < len; i++) {
+        if (buf[i]) {
+            return i;
+        }
+    }
+    return len;
+}
+
+#ifdef __SSE2__
+/* Below this size, the generic loop is faster, so single sectors stay on it */
+#define FIND_NONZERO_SSE2_MIN 2048
+
+static size_t find_nonzero_sse2(const uint8_t *buf, size_t len)
+{
+    const __m128i zero = _mm_setzero_si128();
+    size_t head = -(uintptr_t)buf & 15;
+    size_t i;
+
+    if (len < FIND_NONZERO_SSE2_MIN) {
+        return find_nonzero_generic(buf, len);
+    }
+    i = find_nonzero_generic(buf, head);
+    if (i < head) {
+        return i;
+    }
+    for (; i + 64 <= len; i += 64) {
+        const __m128i *p = (const __m128i *)(buf + i);
+        __m128i t = _mm_or_si128(_mm_or_si128(p[0], p[1]),
+                                 _mm_or_si128(p[2], p[3]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, zero)) != 0xffff) {
+            break;
+        }
+    }
+    return i + find_nonzero_generic(buf + i, len - i);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+/* Below this size, the cost of switching to 256 bit code is not recovered */
+#define FIND_NONZERO_AVX2_MIN 4096
+
+static size_t __attribute__((target("avx2")))
+find_nonzero_avx2(const uint8_t *buf, size_t len)
+{
+    size_t head = -(uintptr_t)buf & 31;
+    size_t i;
+
+    if (len < FIND_NONZERO_AVX2_MIN) {
+#ifdef __SSE2__
+        return find_nonzero_sse2(buf, len);
+#else
+        return find_nonzero_generic(buf, len);
+#endif
+    }
+    i = find_nonzero_generic(buf, head);
+    if (i < head) {
+        return i;
+    }
+    for (; i + 128 <= len; i += 128) {
+        const __m256i *p = (const __m256i *)(buf + i);
+        __m256i t = _mm256_or_si256(_mm256_or_si256(p[0], p[1]),
+                                    _mm256_or_si256(p[2], p[3]));
+        if (!_mm256_testz_si256(t, t)) {
+            break;
+        }
+    }
+    return i + find_nonzero_generic(buf + i, len - i);
+}
+#endif
+
+static size_t (*find_nonzero_fn)(const uint8_t *buf, size_t len) =
+#ifdef __SSE2__
+    find_nonzero_sse2;
+#else
+    find_nonzero_generic;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+static void __attribute__((constructor)) init_find_nonzero(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find_nonzero_fn = find_nonzero_avx2;
+    }
+}
+#endif
+
+/*
+ * Returns the offset of the first non-zero byte of 'buf', or 'len' if the
+ * buffer only contains zeroes.
+ */
+size_t buffer_find_nonzero(const void *buf, size_t len)
+{
+#ifdef __SSE2__
+    /* single sectors are scanned faster without the indirect call */
+    if (len < FIND_NONZERO_SSE2_MIN) {
+        return find_nonzero_generic(buf, len);
+    }
+#endif
+    return find_nonzero_fn(buf, len);
+}
+
+bool buffer_is_zero(const void *buf, size_t len)
+{
+    return buffer_find_nonzero(buf, len) == len;
+}
+
+/*
+ * Reads one byte of every page of [buf, buf + len), so that pages that are
+ * only brought in by a fault, e.g. by post-copy migration, are present when
+ * the range is handed to a syscall, which would fail on them instead.
+ */
+void fault_in_pages(const void *buf, size_t len, size_t page_size)
+{
+    uintptr_t start = (uintptr_t)buf & ~(uintptr_t)(page_size - 1);
+    uintptr_t end = (uintptr_t)buf + len;
+    uintptr_t p;
+
+    for (p = start; p < end; p += page_size) {
+        (void)*(volatile const uint8_t *)p;
+    }
+}
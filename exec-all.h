@@ -105,6 +105,8 @@ void tlb_flush(CPUState *env, int flush_global);
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size);
+int tlb_victim_hit(CPUState *env, int mmu_idx, int index,
+                   size_t elt_ofs, target_ulong page);
 #endif
 
 #define CODE_GEN_ALIGN           16 /* must be >= of the size of a icache line */
@@ -162,6 +164,8 @@ struct TranslationBlock {
     uint32_t icount;
 #ifdef CONFIG_COREMU
     uint16_t has_invalidate; /* if this TB has been invalidated */
+    uint16_t spec;      /* translated ahead of time and not yet executed */
+    target_ulong jmp_pc[2]; /* targets of the direct jumps, -1 if none */
 #endif
 };
 
@@ -71,6 +71,8 @@
 #include "coremu-atomic.h"
 #include "coremu-hw.h"
 #include "cm-tbinval.h"
+#include "cm-tcache.h"
+#include "cm-spec.h"
 
 #if !defined(CONFIG_USER_ONLY)
 /* TB consistency checks only implemented for usermode emulation.  */
@@ -763,6 +765,9 @@ void tb_flush(CPUState *env1)
 
     memset (tb_phys_hash, 0, CODE_GEN_PHYS_HASH_SIZE * sizeof (void *));
     page_flush_tb();
+#ifdef CONFIG_COREMU
+    cm_spec_flush(env1);
+#endif
 
     code_gen_ptr = code_gen_buffer;
     /* XXX: flush processor icache at this point if cache flush is
@@ -1057,6 +1062,9 @@ TranslationBlock *tb_gen_code(CPUState *env,
     tb->cs_base = cs_base;
     tb->flags = flags;
     tb->cflags = cflags;
+#ifdef CONFIG_COREMU
+    tb->jmp_pc[0] = tb->jmp_pc[1] = -1;
+#endif
     cpu_gen_code(env, tb, &code_gen_size);
     code_gen_ptr = (void *)(((unsigned long)code_gen_ptr + code_gen_size + CODE_GEN_ALIGN - 1) & ~(CODE_GEN_ALIGN - 1));
 
@@ -1067,6 +1075,9 @@ TranslationBlock *tb_gen_code(CPUState *env,
         phys_page2 = get_page_addr_code(env, virt_page2);
     }
     tb_link_page(tb, phys_pc, phys_page2);
+#ifdef CONFIG_COREMU
+    cm_spec_queue(env, tb);
+#endif
     return tb;
 }
 
@@ -1395,6 +1406,9 @@ TranslationBlock *tb_alloc(target_ulong pc)
     tb = &tbs[nb_tbs++];
     tb->pc = pc;
     tb->cflags = 0;
+#ifdef CONFIG_COREMU
+    tb->spec = 0;
+#endif
     return tb;
 }
 
@@ -1457,6 +1471,10 @@ TranslationBlock *tb_find_pc(unsigned long tc_ptr)
     unsigned long v;
     TranslationBlock *tb;
 
+#ifdef CONFIG_COREMU
+    if (cm_spec_nb_threads && (tb = cm_spec_find_pc(tc_ptr)) != NULL)
+        return tb;
+#endif
     if (nb_tbs <= 0)
         return NULL;
     if (tc_ptr < (unsigned long)code_gen_buffer ||
@@ -2109,6 +2127,18 @@ void tlb_flush(CPUState *env, int flush_global)
 #endif
         }
     }
+    for(i = 0; i < CPU_VTLB_SIZE; i++) {
+        int mmu_idx;
+        for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+#ifdef CONFIG_COREMU
+            env->tlb_v_table[mmu_idx][i].addr_read = -1;
+            env->tlb_v_table[mmu_idx][i].addr_write = -1;
+            env->tlb_v_table[mmu_idx][i].addr_code = -1;
+#else
+            env->tlb_v_table[mmu_idx][i] = s_cputlb_empty_entry;
+#endif
+        }
+    }
 
     memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
 
@@ -2129,22 +2159,116 @@ static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
     }
 }
 
+/* Same as tlb_flush_entry, but for an entry that was filled from a guest
+   page covering ~mask + 1 bytes.  */
+static inline void tlb_flush_entry_mask(CPUTLBEntry *tlb_entry,
+                                        target_ulong addr, target_ulong mask)
+{
+    addr &= mask;
+    mask |= TLB_INVALID_MASK;
+    if (addr == (tlb_entry->addr_read & mask) ||
+        addr == (tlb_entry->addr_write & mask) ||
+        addr == (tlb_entry->addr_code & mask)) {
+        *tlb_entry = s_cputlb_empty_entry;
+    }
+}
+
+static inline int tlb_entry_is_empty(const CPUTLBEntry *tlb_entry)
+{
+    return tlb_entry->addr_read == -1 && tlb_entry->addr_write == -1 &&
+           tlb_entry->addr_code == -1;
+}
+
+/* Remember the area covered by large pages, so that tlb_flush_page knows
+   when it must look for entries filled from a large page.  */
+static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
+                               target_ulong size)
+{
+    target_ulong mask = ~(size - 1);
+
+    if (env->tlb_flush_addr == (target_ulong)-1) {
+        env->tlb_flush_addr = vaddr & mask;
+        env->tlb_flush_mask = mask;
+        return;
+    }
+    /* Extend the existing region to include the new page.
+       This is a compromise between unnecessary flushes and the cost
+       of maintaining a full variable size TLB.  */
+    mask &= env->tlb_flush_mask;
+    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
+        mask <<= 1;
+    }
+    env->tlb_flush_addr &= mask;
+    env->tlb_flush_mask = mask;
+}
+
+/* Keeps a live entry filled from a large page in the large page area */
+static void tlb_readd_large_page(CPUState *env, const CPUTLBEntry *tlb_entry,
+                                 target_ulong mask)
+{
+    target_ulong vaddr;
+
+    if (mask == TARGET_PAGE_MASK || tlb_entry_is_empty(tlb_entry)) {
+        return;
+    }
+    if (tlb_entry->addr_read != -1) {
+        vaddr = tlb_entry->addr_read;
+    } else if (tlb_entry->addr_write != -1) {
+        vaddr = tlb_entry->addr_write;
+    } else {
+        vaddr = tlb_entry->addr_code;
+    }
+    tlb_add_large_page(env, vaddr & TARGET_PAGE_MASK, ~mask + 1);
+}
+
+/* Invalidate every entry that maps part of the large page containing
+   'addr'.  Only the entries of that page are dropped, the rest of the TLB
+   survives.  The large page area is rebuilt from the large pages that are
+   left, or it would only ever grow until the next tlb_flush.  */
+static void tlb_flush_large_page(CPUState *env, target_ulong addr)
+{
+    int i, mmu_idx;
+
+#if defined(DEBUG_TLB)
+    printf("tlb_flush_large_page: " TARGET_FMT_lx "\n", addr);
+#endif
+    /* must reset current TB so that interrupts cannot modify the
+       links while we are modifying them */
+    env->current_tb = NULL;
+
+    env->tlb_flush_addr = -1;
+    env->tlb_flush_mask = 0;
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
+        for (i = 0; i < CPU_TLB_SIZE; i++) {
+            tlb_flush_entry_mask(&env->tlb_table[mmu_idx][i], addr,
+                                 env->tlb_page_mask[mmu_idx][i]);
+            tlb_readd_large_page(env, &env->tlb_table[mmu_idx][i],
+                                 env->tlb_page_mask[mmu_idx][i]);
+        }
+        for (i = 0; i < CPU_VTLB_SIZE; i++) {
+            tlb_flush_entry_mask(&env->tlb_v_table[mmu_idx][i], addr,
+                                 env->tlb_v_page_mask[mmu_idx][i]);
+            tlb_readd_large_page(env, &env->tlb_v_table[mmu_idx][i],
+                                 env->tlb_v_page_mask[mmu_idx][i]);
+        }
+    }
+
+    /* The jump cache is not tagged with the page size; it is cheap to
+       refill from tb_phys_hash, so drop it entirely.  */
+    memset (env->tb_jmp_cache, 0, TB_JMP_CACHE_SIZE * sizeof (void *));
+}
+
 void tlb_flush_page(CPUState *env, target_ulong addr)
 {
-    int i;
+    int i, vidx;
     int mmu_idx;
 
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
-    /* Check if we need to flush due to large pages.  */
+    /* Check if the page may be part of a large page.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
-#if defined(DEBUG_TLB)
-        printf("tlb_flush_page: forced full flush ("
-               TARGET_FMT_lx "/" TARGET_FMT_lx ")\n",
-               env->tlb_flush_addr, env->tlb_flush_mask);
-#endif
-        tlb_flush(env, 1);
+        tlb_flush_large_page(env, addr & TARGET_PAGE_MASK);
         return;
     }
     /* must reset current TB so that interrupts cannot modify the
@@ -2153,8 +2277,11 @@ void tlb_flush_page(CPUState *env, target_ulong addr)
 
     addr &= TARGET_PAGE_MASK;
     i = (addr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_flush_entry(&env->tlb_table[mmu_idx][i], addr);
+        for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+            tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], addr);
+    }
 
     tlb_flush_jmp_cache(env, addr);
 }
@@ -2224,6 +2351,14 @@ void cpu_physical_memory_reset_dirty(ram_addr_t start, ram_addr_t end,
 #else
                 tlb_reset_dirty_range(&env->tlb_table[mmu_idx][i],
                                       start1, length);
+#endif
+            for(i = 0; i < CPU_VTLB_SIZE; i++)
+#ifdef CONFIG_COREMU
+                cm_tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                        start1, length);
+#else
+                tlb_reset_dirty_range(&env->tlb_v_table[mmu_idx][i],
+                                      start1, length);
 #endif
         }
     }
@@ -2274,6 +2409,8 @@ void cpu_tlb_update_dirty(CPUState *env)
     for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         for(i = 0; i < CPU_TLB_SIZE; i++)
             tlb_update_dirty(&env->tlb_table[mmu_idx][i]);
+        for(i = 0; i < CPU_VTLB_SIZE; i++)
+            tlb_update_dirty(&env->tlb_v_table[mmu_idx][i]);
     }
 }
 
@@ -2287,41 +2424,22 @@ static inline void tlb_set_dirty1(CPUTLBEntry *tlb_entry, target_ulong vaddr)
    so that it is no longer dirty */
 static inline void tlb_set_dirty(CPUState *env, target_ulong vaddr)
 {
-    int i;
+    int i, vidx;
     int mmu_idx;
 
     vaddr &= TARGET_PAGE_MASK;
     i = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++)
+    for (mmu_idx = 0; mmu_idx < NB_MMU_MODES; mmu_idx++) {
         tlb_set_dirty1(&env->tlb_table[mmu_idx][i], vaddr);
-}
-
-/* Our TLB does not support large pages, so remember the area covered by
-   large pages and trigger a full TLB flush if these are invalidated.  */
-static void tlb_add_large_page(CPUState *env, target_ulong vaddr,
-                               target_ulong size)
-{
-    target_ulong mask = ~(size - 1);
-
-    if (env->tlb_flush_addr == (target_ulong)-1) {
-        env->tlb_flush_addr = vaddr & mask;
-        env->tlb_flush_mask = mask;
-        return;
+        for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+            tlb_set_dirty1(&env->tlb_v_table[mmu_idx][vidx], vaddr);
     }
-    /* Extend the existing region to include the new page.
-       This is a compromise between unnecessary flushes and the cost
-       of maintaining a full variable size TLB.  */
-    mask &= env->tlb_flush_mask;
-    while (((env->tlb_flush_addr ^ vaddr) & mask) != 0) {
-        mask <<= 1;
-    }
-    env->tlb_flush_addr &= mask;
-    env->tlb_flush_mask = mask;
 }
 
 /* Add a new TLB entry. At most one entry for a given virtual address
    is permitted. Only a single TARGET_PAGE_SIZE region is mapped, the
-   supplied size is only used by tlb_flush_page.  */
+   supplied size is recorded so that tlb_flush_page can invalidate all
+   entries of a large page.  */
 void tlb_set_page(CPUState *env, target_ulong vaddr,
                   target_phys_addr_t paddr, int prot,
                   int mmu_idx, target_ulong size)
@@ -2335,6 +2453,7 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     CPUTLBEntry *te;
     CPUWatchpoint *wp;
     target_phys_addr_t iotlb;
+    unsigned int vidx;
 
     assert(size >= TARGET_PAGE_SIZE);
     if (size != TARGET_PAGE_SIZE) {
@@ -2395,8 +2514,26 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 
     index = (vaddr >> TARGET_PAGE_BITS) & (CPU_TLB_SIZE - 1);
-    env->iotlb[mmu_idx][index] = iotlb - vaddr;
     te = &env->tlb_table[mmu_idx][index];
+
+    /* A stale copy of this page in the victim TLB would break the one
+       entry per virtual address rule.  */
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++)
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], vaddr);
+
+    /* Keep the entry we are about to replace in the victim TLB, unless
+       it maps this very page.  */
+    if (!tlb_entry_is_empty(te)) {
+        vidx = env->vtlb_index++ % CPU_VTLB_SIZE;
+        env->tlb_v_table[mmu_idx][vidx] = *te;
+        env->iotlb_v[mmu_idx][vidx] = env->iotlb[mmu_idx][index];
+        env->tlb_v_page_mask[mmu_idx][vidx] =
+            env->tlb_page_mask[mmu_idx][index];
+        tlb_flush_entry(&env->tlb_v_table[mmu_idx][vidx], vaddr);
+    }
+
+    env->iotlb[mmu_idx][index] = iotlb - vaddr;
+    env->tlb_page_mask[mmu_idx][index] = ~(size - 1);
     te->addend = addend - vaddr;
     if (prot & PAGE_READ) {
         te->addr_read = address;
@@ -2425,6 +2562,48 @@ void tlb_set_page(CPUState *env, target_ulong vaddr,
     }
 }
 
+/* Called by the softmmu helpers when 'page' misses in the main TLB.
+   If the victim TLB holds a matching entry for the access at offset
+   'elt_ofs' in CPUTLBEntry, swap it with the entry at 'index' and
+   return non zero; otherwise the caller must call tlb_fill().  */
+int tlb_victim_hit(CPUState *env, int mmu_idx, int index,
+                   size_t elt_ofs, target_ulong page)
+{
+    CPUTLBEntry *te, *vte, tmp;
+    target_phys_addr_t iotlb;
+    target_ulong cmp, mask;
+    int vidx;
+
+    env->tlb_miss_count++;
+    for (vidx = 0; vidx < CPU_VTLB_SIZE; vidx++) {
+        vte = &env->tlb_v_table[mmu_idx][vidx];
+        cmp = *(target_ulong *)((uint8_t *)vte + elt_ofs);
+        if ((cmp & (TARGET_PAGE_MASK | TLB_INVALID_MASK)) != page) {
+            continue;
+        }
+        te = &env->tlb_table[mmu_idx][index];
+        tmp = *te;
+        *te = *vte;
+        *vte = tmp;
+        iotlb = env->iotlb[mmu_idx][index];
+        env->iotlb[mmu_idx][index] = env->iotlb_v[mmu_idx][vidx];
+        env->iotlb_v[mmu_idx][vidx] = iotlb;
+        mask = env->tlb_page_mask[mmu_idx][index];
+        env->tlb_page_mask[mmu_idx][index] =
+            env->tlb_v_page_mask[mmu_idx][vidx];
+        env->tlb_v_page_mask[mmu_idx][vidx] = mask;
+#ifdef CONFIG_COREMU
+        /* Another core may have cleared the dirty bits of this page while
+           the entry was being moved; recheck it like tlb_set_page does. */
+        mb();
+        tlb_update_dirty(te);
+#endif
+        env->tlb_victim_hits++;
+        return 1;
+    }
+    return 0;
+}
+
 #else
 
 void tlb_flush(CPUState *env, int flush_global)
@@ -2997,6 +3176,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
                                    ram_addr_t size, void *host)
 {
     RAMBlock *new_block, *block;
+    ram_addr_t old_ram_size = last_ram_offset();
+    int i;
 
     size = TARGET_PAGE_ALIGN(size);
     new_block = qemu_mallocz(sizeof(*new_block));
@@ -3050,10 +3231,19 @@ ram_addr_t qemu_ram_alloc_from_ptr(DeviceState *dev, const char *name,
 
     QLIST_INSERT_HEAD(&ram_list.blocks, new_block, next);
 
-    ram_list.phys_dirty = qemu_realloc(ram_list.phys_dirty,
-                                       last_ram_offset() >> TARGET_PAGE_BITS);
-    memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
-           0xff, size >> TARGET_PAGE_BITS);
+    for (i = 0; i < DIRTY_MEMORY_NUM; i++) {
+        ram_addr_t old_pages = BITS_TO_LONGS(old_ram_size >> TARGET_PAGE_BITS);
+        ram_addr_t new_pages = BITS_TO_LONGS(last_ram_offset() >>
+                                             TARGET_PAGE_BITS);
+
+        ram_list.dirty_memory[i] =
+            qemu_realloc(ram_list.dirty_memory[i],
+                         new_pages * sizeof(unsigned long));
+        memset(ram_list.dirty_memory[i] + old_pages, 0,
+               (new_pages - old_pages) * sizeof(unsigned long));
+    }
+    cpu_physical_memory_set_dirty_range(new_block->offset, size,
+                                        DIRTY_FLAGS_ALL);
 
 #ifdef CONFIG_COREMU
     coremu_assert_hw_thr("qemu_ram_alloc should only called by hw thr");
@@ -3268,11 +3458,11 @@ static void notdirty_mem_writeb(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stb_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == DIRTY_FLAGS_ALL)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3292,11 +3482,11 @@ static void notdirty_mem_writew(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stw_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == DIRTY_FLAGS_ALL)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3316,11 +3506,11 @@ static void notdirty_mem_writel(void *opaque, target_phys_addr_t ram_addr,
 #endif
     }
     stl_p(qemu_get_ram_ptr(ram_addr), val);
-    dirty_flags |= (0xff & ~CODE_DIRTY_FLAG);
+    dirty_flags |= (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG);
     cpu_physical_memory_set_dirty_flags(ram_addr, dirty_flags);
     /* we remove the notdirty callback only if the code has been
        flushed */
-    if (dirty_flags == 0xff)
+    if (dirty_flags == DIRTY_FLAGS_ALL)
         tlb_set_dirty(cpu_single_env, cpu_single_env->mem_io_vaddr);
 }
 
@@ -3869,7 +4059,7 @@ void cpu_physical_memory_rw(target_phys_addr_t addr, uint8_t *buf,
 #endif
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG));
                 }
             }
         } else {
@@ -4052,6 +4242,11 @@ void *cpu_physical_memory_map(target_phys_addr_t addr,
         addr += l;
         done += l;
     }
+    if (unlikely(ram_postcopy_active) && ret != bounce.buffer) {
+        /* syscalls on pages that are still missing would fail rather than
+           fault them in, so every page of the mapping is brought in now */
+        fault_in_pages(ret, done, qemu_real_host_page_size);
+    }
     *plen = done;
     return ret;
 }
@@ -4080,7 +4275,7 @@ void cpu_physical_memory_unmap(void *buffer, target_phys_addr_t len,
 #endif
                     /* set dirty bit */
                     cpu_physical_memory_set_dirty_flags(
-                        addr1, (0xff & ~CODE_DIRTY_FLAG));
+                        addr1, (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG));
                 }
                 addr1 += l;
                 access_len -= l;
@@ -4243,7 +4438,7 @@ void stl_phys_notdirty(target_phys_addr_t addr, uint32_t val)
  #endif
                 /* set dirty bit */
                 cpu_physical_memory_set_dirty_flags(
-                    addr1, (0xff & ~CODE_DIRTY_FLAG));
+                    addr1, (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG));
             }
         }
     }
@@ -4316,7 +4511,7 @@ void stl_phys(target_phys_addr_t addr, uint32_t val)
  #endif
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4359,7 +4554,7 @@ void stw_phys(target_phys_addr_t addr, uint32_t val)
             tb_invalidate_phys_page_range(addr1, addr1 + 2, 0);
             /* set dirty bit */
             cpu_physical_memory_set_dirty_flags(addr1,
-                (0xff & ~CODE_DIRTY_FLAG));
+                (DIRTY_FLAGS_ALL & ~CODE_DIRTY_FLAG));
         }
     }
 }
@@ -4467,6 +4662,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     int i, target_code_size, max_target_code_size;
     int direct_jmp_count, direct_jmp2_count, cross_page;
     TranslationBlock *tb;
+    CPUState *env;
 
     target_code_size = 0;
     max_target_code_size = 0;
@@ -4511,7 +4707,18 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
     cpu_fprintf(f, "TB flush count      %d\n", tb_flush_count);
     cpu_fprintf(f, "TB invalidate count %d\n", tb_phys_invalidate_count);
     cpu_fprintf(f, "TLB flush count     %d\n", tlb_flush_count);
+    for(env = first_cpu; env != NULL; env = env->next_cpu) {
+        cpu_fprintf(f, "CPU #%d TLB misses  %" PRIu64 " (victim hits %"
+                    PRIu64 ", %" PRIu64 "%%)\n", env->cpu_index,
+                    env->tlb_miss_count, env->tlb_victim_hits,
+                    env->tlb_miss_count ?
+                    env->tlb_victim_hits * 100 / env->tlb_miss_count : 0);
+    }
     tcg_dump_info(f, cpu_fprintf);
+#ifdef CONFIG_COREMU
+    cm_tcache_dump_info(f, cpu_fprintf);
+    cm_spec_dump_info(f, cpu_fprintf);
+#endif
 }
 
 #define MMUSUFFIX _cmmu
@@ -4536,6 +4743,7 @@ void dump_exec_info(FILE *f, fprintf_function cpu_fprintf)
 #endif
 
 #ifdef CONFIG_COREMU
+#include "cm-spec.c"
 #include "cm-init.c"
 #include "cm-tbinval.c"
 #endif
@@ -735,24 +735,30 @@ ETEXI
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,postcopy:-p,uri:s",
+        .params     = "[-d] [-b] [-i] [-p] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -p for post-copy migration, the guest runs "
+		      "on the destination before its memory is copied",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
 
 
 STEXI
-@item migrate [-d] [-b] [-i] @var{uri}
+@item migrate [-d] [-b] [-i] [-p] @var{uri}
 @findex migrate
 Migrate to @var{uri} (using -d to not wait for completion).
 	-b for migration with full copy of disk
 	-i for migration with incremental copy of disk (base image is shared)
+	-p for post-copy migration: the guest is stopped after one pass over
+	   its memory and resumed on the destination, which fetches the pages
+	   it touches on demand.  Only for tcp: and unix: URIs, and without
+	   KVM; the migration can't be cancelled once the guest is resumed.
 ETEXI
 
     {
@@ -767,7 +773,8 @@ ETEXI
 STEXI
 @item migrate_cancel
 @findex migrate_cancel
-Cancel the current VM migration.
+Cancel the current VM migration.  A post-copy migration can't be cancelled
+once the guest runs on the destination.
 ETEXI
 
     {
@@ -799,6 +806,64 @@ STEXI
 @item migrate_set_downtime @var{second}
 @findex migrate_set_downtime
 Set maximum tolerated downtime (in seconds) for migration.
+ETEXI
+
+    {
+        .name       = "migrate_set_compression",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "compress the pages of the next migrations with 'threads'\n\t\t\t"
+                      "threads (0 to disable) at zlib 'level' (1 to 9, default 1)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compression,
+    },
+
+STEXI
+@item migrate_set_compression @var{threads} [@var{level}]
+@findex migrate_set_compression
+Compress the RAM pages of the next migrations with @var{threads} threads
+(0, the default, disables compression) at zlib @var{level} (1 to 9, default
+1).  The destination must support compressed pages.
+ETEXI
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set the size of the cache of sent pages used to delta\n\t\t\t"
+                      "encode pages sent again (0 to disable)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+STEXI
+@item migrate_set_cache_size @var{value}
+@findex migrate_set_cache_size
+Keep the last @var{value} bytes of RAM pages sent by the next migrations in a
+cache, and send pages that are found there as their differences with the
+cached copy.  0, the default, disables delta encoding.  The destination must
+support delta encoded pages.
+ETEXI
+
+    {
+        .name       = "migrate_set_streams",
+        .args_type  = "count:i",
+        .params     = "count",
+        .help       = "send the RAM pages of the next migrations over 'count'\n\t\t\t"
+                      "connections (1 to 16, default 1)",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_streams,
+    },
+
+STEXI
+@item migrate_set_streams @var{count}
+@findex migrate_set_streams
+Send the RAM pages of the next migrations over @var{count} connections of
+their own, each written by a thread of its own (1, the default, sends them
+with the rest of the migration).  Only for tcp: and unix: migrations, the
+destination accepting the connections on the socket it listens to.  The
+bandwidth limit is shared between the connections, and pages are neither
+compressed nor delta encoded.
 ETEXI
 
     {
@@ -818,6 +883,41 @@ STEXI
 @item snapshot_blkdev
 @findex snapshot_blkdev
 Snapshot device, using snapshot file as target if provided
+ETEXI
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy the data of the backing files into device\n\t\t\t"
+                      "in the background, at most speed bytes per\n\t\t\t"
+                      "second, and remove the backing file afterwards",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+STEXI
+@item block_stream @var{device} [@var{speed}]
+@findex block_stream
+Copy all data that @var{device} reads from its backing files into the image
+in the background, limited to @var{speed} bytes per second if given. The
+backing file is removed from the image once everything has been copied.
+ETEXI
+
+    {
+        .name       = "block_stream_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop streaming the backing files into device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_cancel,
+    },
+
+STEXI
+@item block_stream_cancel @var{device}
+@findex block_stream_cancel
+Stop the stream started by @code{block_stream}. Data copied so far stays in
+the image, which keeps its backing file.
 ETEXI
 
 #if defined(TARGET_I386)
@@ -1256,6 +1356,8 @@ show the character devices
 show the block devices
 @item info blockstats
 show block device statistics
+@item info block-stream
+show the progress of backing file streams
 @item info registers
 show the cpu registers
 @item info cpus
@@ -31,6 +31,7 @@
 #include "net/checksum.h"
 #include "loader.h"
 #include "sysemu.h"
+#include "qemu-timer.h"
 
 #include "e1000_hw.h"
 
@@ -57,6 +58,11 @@ static int debugflags = DBGBIT(TXERR) | DBGBIT(GENERAL);
 #define IOPORT_SIZE       0x40
 #define PNPMMIO_SIZE      0x20000
 #define MIN_BUF_SIZE      60 /* Min. octets in an ethernet frame sans FCS */
+#define TX_BATCH          32 /* TX descriptors fetched at once */
+
+/* flags */
+#define E1000_FLAG_MIT_BIT 0 /* interrupt mitigation */
+#define E1000_FLAG_MIT    (1 << E1000_FLAG_MIT_BIT)
 
 /*
  * HW models:
@@ -123,6 +129,17 @@ typedef struct E1000State_st {
         uint16_t reading;
         uint32_t old_eecd;
     } eecd_state;
+
+    /* interrupt mitigation */
+    QEMUTimer *mit_timer;
+    int mit_timer_on;           /* the irq is held back until it fires */
+    int mit_irq_level;          /* current level of the irq line */
+    int mit_ide;                /* a descriptor with IDE set was sent */
+
+    int rx_burst;               /* the peer is sending a burst */
+    uint32_t rx_cause;          /* interrupt causes held back by the burst */
+
+    uint32_t flags;
 } E1000State;
 
 #define	defreg(x)	x = (E1000_##x>>2)
@@ -137,7 +154,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TIDV),	defreg(TADV),
 };
 
 enum { PHY_R = 1, PHY_W = 2, PHY_RW = PHY_R | PHY_W };
@@ -158,14 +176,73 @@ ioport_map(PCIDevice *pci_dev, int region_num, pcibus_t addr,
            " size=0x%08"FMT_PCIBUS"\n", addr, size);
 }
 
+/* Keeps the shortest non-zero delay */
+static void
+mit_update_delay(uint32_t *curr, uint32_t value)
+{
+    if (value && (*curr == 0 || value < *curr))
+        *curr = value;
+}
+
+/*
+ * With mitigation, a rising edge of the irq line opens a window during
+ * which further causes only accumulate in ICR.  The window is the
+ * shortest of ITR (256ns units) and of the delays that apply to the
+ * pending causes (1.024us units): TADV, or TIDV without it, for
+ * descriptors sent with IDE, and RADV, or RDTR without it, for received
+ * packets when RDTR is set.  The line is raised when the window closes,
+ * so the guest sees at most one interrupt per window.
+ */
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    uint32_t pending_ints, mit_delay;
+
     if (val)
         val |= E1000_ICR_INT_ASSERTED;
     s->mac_reg[ICR] = val;
     s->mac_reg[ICS] = val;
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+
+    pending_ints = s->mac_reg[IMS] & s->mac_reg[ICR];
+    if (!s->mit_irq_level && pending_ints) {
+        if (s->mit_timer_on)
+            return;
+        if (s->flags & E1000_FLAG_MIT) {
+            mit_delay = 0;
+            if (s->mit_ide &&
+                (pending_ints & (E1000_ICR_TXQE | E1000_ICR_TXDW))) {
+                mit_update_delay(&mit_delay, (s->mac_reg[TADV] ?
+                                              s->mac_reg[TADV] :
+                                              s->mac_reg[TIDV]) * 4);
+            }
+            if (s->mac_reg[RDTR] && (pending_ints & E1000_ICS_RXT0)) {
+                mit_update_delay(&mit_delay, (s->mac_reg[RADV] ?
+                                              s->mac_reg[RADV] :
+                                              s->mac_reg[RDTR]) * 4);
+            }
+            mit_update_delay(&mit_delay, s->mac_reg[ITR]);
+
+            if (mit_delay) {
+                s->mit_timer_on = 1;
+                qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) +
+                               mit_delay * 256);
+            }
+            s->mit_ide = 0;
+        }
+    }
+
+    s->mit_irq_level = (pending_ints != 0);
+    qemu_set_irq(s->dev.irq[0], s->mit_irq_level);
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+
+    s->mit_timer_on = 0;
+    /* raise the line for the causes that came in during the window */
+    set_interrupt_cause(s, 0, s->mac_reg[ICR]);
 }
 
 static void
@@ -515,12 +592,18 @@ txdesc_writeback(target_phys_addr_t base, struct e1000_tx_desc *dp)
     return E1000_ICR_TXDW;
 }
 
+/*
+ * Descriptors between TDH and TDT belong to the device, so they are
+ * fetched up to TX_BATCH at a time, and all of the packets are
+ * completed with a single update of the interrupt causes.
+ */
 static void
 start_xmit(E1000State *s)
 {
     target_phys_addr_t base;
-    struct e1000_tx_desc desc;
+    struct e1000_tx_desc descs[TX_BATCH], *desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    unsigned int i, n, ring;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -528,30 +611,43 @@ start_xmit(E1000State *s)
     }
 
     while (s->mac_reg[TDH] != s->mac_reg[TDT]) {
+        /* contiguous descriptors up to TDT or the end of the ring */
+        ring = s->mac_reg[TDLEN] / sizeof(descs[0]);
+        n = TX_BATCH;
+        if (s->mac_reg[TDT] > s->mac_reg[TDH])
+            n = MIN(n, s->mac_reg[TDT] - s->mac_reg[TDH]);
+        n = ring > s->mac_reg[TDH] ? MIN(n, ring - s->mac_reg[TDH]) : 1;
+
         base = ((uint64_t)s->mac_reg[TDBAH] << 32) + s->mac_reg[TDBAL] +
                sizeof(struct e1000_tx_desc) * s->mac_reg[TDH];
-        cpu_physical_memory_read(base, (void *)&desc, sizeof(desc));
-
-        DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
-               (void *)(intptr_t)desc.buffer_addr, desc.lower.data,
-               desc.upper.data);
-
-        process_tx_desc(s, &desc);
-        cause |= txdesc_writeback(base, &desc);
-
-        if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
-            s->mac_reg[TDH] = 0;
-        /*
-         * the following could happen only if guest sw assigns
-         * bogus values to TDT/TDLEN.
-         * there's nothing too intelligent we could do about this.
-         */
-        if (s->mac_reg[TDH] == tdh_start) {
-            DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
-                   tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
-            break;
+        cpu_physical_memory_read(base, (void *)descs, n * sizeof(descs[0]));
+
+        for (i = 0; i < n; i++, base += sizeof(*desc)) {
+            desc = &descs[i];
+            DBGOUT(TX, "index %d: %p : %x %x\n", s->mac_reg[TDH],
+                   (void *)(intptr_t)desc->buffer_addr, desc->lower.data,
+                   desc->upper.data);
+
+            process_tx_desc(s, desc);
+            cause |= txdesc_writeback(base, desc);
+            if (le32_to_cpu(desc->lower.data) & E1000_TXD_CMD_IDE)
+                s->mit_ide = 1;
+
+            if (++s->mac_reg[TDH] * sizeof(*desc) >= s->mac_reg[TDLEN])
+                s->mac_reg[TDH] = 0;
+            /*
+             * the following could happen only if guest sw assigns
+             * bogus values to TDT/TDLEN.
+             * there's nothing too intelligent we could do about this.
+             */
+            if (s->mac_reg[TDH] == tdh_start) {
+                DBGOUT(TXERR, "TDH wraparound @%x, TDT %x, TDLEN %x\n",
+                       tdh_start, s->mac_reg[TDT], s->mac_reg[TDLEN]);
+                goto out;
+            }
         }
     }
+out:
     set_ics(s, 0, cause);
 }
 
@@ -722,11 +818,27 @@ e1000_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
-    set_ics(s, 0, n);
+    if (s->rx_burst)
+        s->rx_cause |= n;
+    else
+        set_ics(s, 0, n);
 
     return size;
 }
 
+/* Packets of a burst from the peer raise a single interrupt */
+static void
+e1000_receive_burst(VLANClientState *nc, bool begin)
+{
+    E1000State *s = DO_UPCAST(NICState, nc, nc)->opaque;
+
+    s->rx_burst = begin;
+    if (!begin && s->rx_cause) {
+        set_ics(s, 0, s->rx_cause);
+        s->rx_cause = 0;
+    }
+}
+
 static uint32_t
 mac_readreg(E1000State *s, int index)
 {
@@ -829,7 +941,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(ITR),	getreg(RDTR),
+    getreg(RADV),	getreg(TIDV),	getreg(TADV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -851,6 +964,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [ITR] = set_16bit,	[RDTR] = set_16bit,	[RADV] = set_16bit,
+    [TIDV] = set_16bit,	[TADV] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -922,11 +1037,24 @@ static bool is_version_1(void *opaque, int version_id)
     return version_id == 1;
 }
 
+static int e1000_post_load(void *opaque, int version_id)
+{
+    E1000State *s = opaque;
+
+    /* the window in flight is not migrated, open a short one instead */
+    s->mit_ide = 0;
+    s->mit_irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    s->mit_timer_on = 1;
+    qemu_mod_timer(s->mit_timer, qemu_get_clock_ns(vm_clock) + 1);
+    return 0;
+}
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
-    .version_id = 2,
+    .version_id = 3,
     .minimum_version_id = 1,
     .minimum_version_id_old = 1,
+    .post_load = e1000_post_load,
     .fields      = (VMStateField []) {
         VMSTATE_PCI_DEVICE(dev, E1000State),
         VMSTATE_UNUSED_TEST(is_version_1, 4), /* was instance id */
@@ -996,6 +1124,11 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, RA, 32),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
+        VMSTATE_UINT32_V(mac_reg[ITR], E1000State, 3),
+        VMSTATE_UINT32_V(mac_reg[RDTR], E1000State, 3),
+        VMSTATE_UINT32_V(mac_reg[RADV], E1000State, 3),
+        VMSTATE_UINT32_V(mac_reg[TIDV], E1000State, 3),
+        VMSTATE_UINT32_V(mac_reg[TADV], E1000State, 3),
         VMSTATE_END_OF_LIST()
     }
 };
@@ -1081,6 +1214,8 @@ pci_e1000_uninit(PCIDevice *dev)
 {
     E1000State *d = DO_UPCAST(E1000State, dev, dev);
 
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     cpu_unregister_io_memory(d->mmio_index);
     qemu_del_vlan_client(&d->nic->nc);
     return 0;
@@ -1096,6 +1231,12 @@ static void e1000_reset(void *opaque)
     memmove(d->mac_reg, mac_reg_init, sizeof mac_reg_init);
     d->rxbuf_min_shift = 1;
     memset(&d->tx, 0, sizeof d->tx);
+
+    qemu_del_timer(d->mit_timer);
+    d->mit_timer_on = 0;
+    d->mit_irq_level = 0;
+    d->mit_ide = 0;
+    d->rx_cause = 0;
 }
 
 static NetClientInfo net_e1000_info = {
@@ -1105,6 +1246,7 @@ static NetClientInfo net_e1000_info = {
     .receive = e1000_receive,
     .cleanup = e1000_cleanup,
     .link_status_changed = e1000_set_link_status,
+    .receive_burst = e1000_receive_burst,
 };
 
 static int pci_e1000_init(PCIDevice *pci_dev)
@@ -1154,6 +1296,8 @@ static int pci_e1000_init(PCIDevice *pci_dev)
 
     qemu_format_nic_info_str(&d->nic->nc, macaddr);
 
+    d->mit_timer = qemu_new_timer(vm_clock, e1000_mit_timer, d);
+
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     return 0;
@@ -1176,6 +1320,8 @@ static PCIDeviceInfo e1000_info = {
     .romfile    = "pxe-e1000.bin",
     .qdev.props = (Property[]) {
         DEFINE_NIC_PROPERTIES(E1000State, conf),
+        DEFINE_PROP_BIT("mitigation", E1000State, flags,
+                        E1000_FLAG_MIT_BIT, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
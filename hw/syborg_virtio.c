@@ -302,6 +302,8 @@ static SysBusDeviceInfo syborg_virtio_net_info = {
         DEFINE_PROP_INT32("x-txburst", SyborgVirtIOProxy,
                           net.txburst, TX_BURST),
         DEFINE_PROP_STRING("tx", SyborgVirtIOProxy, net.tx),
+        DEFINE_PROP_BIT("x-txzerocopy", SyborgVirtIOProxy, net.flags,
+                        VIRTIO_NET_FLAG_TX_ZEROCOPY_BIT, true),
         DEFINE_PROP_END_OF_LIST(),
     }
 };
@@ -18,34 +18,94 @@
 #include "net/tap.h"
 #include "qemu-error.h"
 #include "qemu-timer.h"
+#include "qemu-thread.h"
+#include "monitor.h"
+#include "event_notifier.h"
 #include "virtio-net.h"
 #include "vhost_net.h"
 
-#define VIRTIO_NET_VM_VERSION    11
+#define VIRTIO_NET_VM_VERSION    12
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
-typedef struct VirtIONet
+/* tx=thread: packets handed to the TX thread at a time */
+#define TX_THREAD_BATCH 16
+
+struct VirtIONet;
+
+typedef struct VirtIONetTxPacket {
+    VirtQueueElement elem;
+    struct iovec *iov;          /* into elem.out_sg */
+    int iovcnt;
+    ssize_t len;                /* header bytes that are not sent */
+    ssize_t ret;                /* of the tap write */
+} VirtIONetTxPacket;
+
+/*
+ * One RX/TX queue pair.  Each pair has a NIC client of its own, peered with
+ * one queue of a multiqueue tap, so that each pair also has its own send
+ * queue and its own tap fd.
+ */
+typedef struct VirtIONetQueue
 {
-    VirtIODevice vdev;
-    uint8_t mac[ETH_ALEN];
-    uint16_t status;
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
-    VirtQueue *ctrl_vq;
-    NICState *nic;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
-    uint32_t tx_timeout;
-    int32_t tx_burst;
     int tx_waiting;
-    uint32_t has_vnet_hdr;
-    uint8_t has_ufo;
     struct {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    NICConf conf;
+    NICState *nic;
+    struct VirtIONet *n;
+
+    /*
+     * tx=thread: the ring is only touched by the I/O thread, which pops a
+     * batch of packets and hands it to a thread of its own.  The thread
+     * writes them to the tap and gives them back through tx_notifier.
+     */
+    QemuThread tx_thread;
+    QemuMutex tx_lock;
+    QemuCond tx_cond;
+    EventNotifier tx_notifier;  /* the batch has been written */
+    EventNotifier tx_cancel;    /* stop waiting for a full tap */
+    VLANClientState *tx_peer;   /* the batch goes to */
+    VirtIONetTxPacket *tx_batch;
+    int tx_batch_count;         /* packets handed to the thread */
+    int tx_batch_done;
+    int tx_exit;
+
+    /* RX completions are flushed once per burst of packets from the peer */
+    int rx_burst;
+    unsigned int rx_pending;    /* filled but not yet flushed */
+
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t tx_zerocopy;       /* queued packets that were not copied */
+} VirtIONetQueue;
+
+typedef struct VirtIONet
+{
+    VirtIODevice vdev;
+    uint8_t mac[ETH_ALEN];
+    uint16_t status;
+    VirtIONetQueue vqs[VIRTIO_NET_MAX_QUEUES];
+    int max_queues;             /* queue pairs offered to the guest */
+    int nb_vq_pairs;            /* queue pairs with virtqueues */
+    int curr_queues;            /* queue pairs in use by the guest */
+    VirtQueue *ctrl_vq;
+    NICState *nic;              /* the NIC client of queue pair 0 */
+    uint32_t tx_timeout;
+    int32_t tx_burst;
+    int tx_thread;
+    int tx_zerocopy;
+    uint32_t has_vnet_hdr;
+    uint8_t has_ufo;
     int mergeable_rx_bufs;
     uint8_t promisc;
     uint8_t allmulti;
@@ -76,12 +136,38 @@ static VirtIONet *to_virtio_net(VirtIODevice *vdev)
     return (VirtIONet *)vdev;
 }
 
+static VirtIONetQueue *virtio_net_get_queue(VLANClientState *nc)
+{
+    NICState *nic = DO_UPCAST(NICState, nc, nc);
+    VirtIONet *n = nic->opaque;
+    int i;
+
+    for (i = 1; i < n->max_queues; i++) {
+        if (n->vqs[i].nic == nic) {
+            return &n->vqs[i];
+        }
+    }
+    return &n->vqs[0];
+}
+
+/* Packets arriving on a queue pair that the guest doesn't use go to pair 0 */
+static VirtIONetQueue *virtio_net_rx_queue(VLANClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    if (q - q->n->vqs >= q->n->curr_queues) {
+        return &q->n->vqs[0];
+    }
+    return q;
+}
+
 static void virtio_net_get_config(VirtIODevice *vdev, uint8_t *config)
 {
     VirtIONet *n = to_virtio_net(vdev);
     struct virtio_net_config netcfg;
 
     netcfg.status = n->status;
+    netcfg.max_virtqueue_pairs = n->max_queues;
     memcpy(netcfg.mac, n->mac, ETH_ALEN);
     memcpy(config, &netcfg, sizeof(netcfg));
 }
@@ -134,28 +220,99 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/*
+ * tx=thread: returns the batch written by the thread to the guest.  Returns
+ * 0 if there is none, or the thread isn't done with it.
+ */
+static int virtio_net_tx_thread_complete(VirtIONetQueue *q)
+{
+    VirtIONetTxPacket *p;
+    int i, count;
+
+    qemu_mutex_lock(&q->tx_lock);
+    count = q->tx_batch_done ? q->tx_batch_count : 0;
+    qemu_mutex_unlock(&q->tx_lock);
+    if (!count) {
+        return 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        p = &q->tx_batch[i];
+        if (p->ret > 0) {
+            p->len += p->ret;
+            q->tx_packets++;
+            q->tx_bytes += p->ret;
+        }
+        virtqueue_fill(q->tx_vq, &p->elem, p->len, i);
+    }
+    virtqueue_flush(q->tx_vq, count);
+    virtio_notify(&q->n->vdev, q->tx_vq);
+
+    qemu_mutex_lock(&q->tx_lock);
+    q->tx_batch_count = 0;
+    q->tx_batch_done = 0;
+    qemu_mutex_unlock(&q->tx_lock);
+    return 1;
+}
+
+/*
+ * tx=thread: makes the thread give up on a full tap, and waits for it to be
+ * done with the batch in flight.  Afterwards the tap isn't accessed until
+ * the next flush; the packets that were not written are dropped.
+ */
+static void virtio_net_tx_thread_stop(VirtIONetQueue *q)
+{
+    event_notifier_set(&q->tx_cancel);
+
+    qemu_mutex_lock(&q->tx_lock);
+    while (q->tx_batch_count && !q->tx_batch_done) {
+        qemu_cond_wait(&q->tx_cond, &q->tx_lock);
+    }
+    qemu_mutex_unlock(&q->tx_lock);
+
+    event_notifier_test_and_clear(&q->tx_cancel);
+    if (virtio_net_tx_thread_complete(q)) {
+        /* the notification is still off, look at the ring again later */
+        q->tx_waiting = 1;
+        if (q->n->vm_running) {
+            qemu_bh_schedule(q->tx_bh);
+        }
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int started, i;
 
     virtio_net_vhost_status(n, status);
 
-    if (!n->tx_waiting) {
-        return;
-    }
+    started = virtio_net_started(n, status) && !n->vhost_started;
 
-    if (virtio_net_started(n, status) && !n->vhost_started) {
-        if (n->tx_timer) {
-            qemu_mod_timer(n->tx_timer,
-                           qemu_get_clock(vm_clock) + n->tx_timeout);
-        } else {
-            qemu_bh_schedule(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (n->tx_thread && !started) {
+            virtio_net_tx_thread_stop(q);
         }
-    } else {
-        if (n->tx_timer) {
-            qemu_del_timer(n->tx_timer);
+
+        if (!q->tx_waiting) {
+            continue;
+        }
+
+        if (started) {
+            if (q->tx_timer) {
+                qemu_mod_timer(q->tx_timer,
+                               qemu_get_clock(vm_clock) + n->tx_timeout);
+            } else {
+                qemu_bh_schedule(q->tx_bh);
+            }
         } else {
-            qemu_bh_cancel(n->tx_bh);
+            if (q->tx_timer) {
+                qemu_del_timer(q->tx_timer);
+            } else {
+                qemu_bh_cancel(q->tx_bh);
+            }
         }
     }
 }
@@ -165,6 +322,16 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
     uint16_t old_status = n->status;
 
+    /* the peer may be going away, the TX thread must be done with it */
+    if (n->tx_thread && nc->link_down) {
+        virtio_net_tx_thread_stop(virtio_net_get_queue(nc));
+    }
+
+    /* the link follows queue pair 0 */
+    if (nc != &n->nic->nc) {
+        return;
+    }
+
     if (nc->link_down)
         n->status &= ~VIRTIO_NET_S_LINK_UP;
     else
@@ -176,11 +343,37 @@ static void virtio_net_set_link_status(VLANClientState *nc)
     virtio_net_set_status(&n->vdev, n->vdev.status);
 }
 
+/*
+ * Forgets the packets of the queue that the peer hasn't sent yet.  Those
+ * queued without a copy point into guest buffers, which the guest owns
+ * again once the rings are gone.
+ */
+static void virtio_net_drop_tx(VirtIONetQueue *q)
+{
+    if (q->nic) {
+        qemu_purge_queued_packets(&q->nic->nc);
+    }
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
+    q->tx_waiting = 0;
+    if (q->tx_timer) {
+        qemu_del_timer(q->tx_timer);
+    } else if (q->tx_bh) {
+        qemu_bh_cancel(q->tx_bh);
+    }
+}
+
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i;
+
+    /* the rings are reset next, nothing can complete into them */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_drop_tx(&n->vqs[i]);
+    }
 
     /* Reset back to compatibility mode */
+    n->curr_queues = 1;
     n->promisc = 1;
     n->allmulti = 0;
     n->alluni = 0;
@@ -226,6 +419,11 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
 
     features |= (1 << VIRTIO_NET_F_MAC);
 
+    /* VQ_PAIRS_SET goes through the control virtqueue */
+    if (n->max_queues == 1 || !(features & (1 << VIRTIO_NET_F_CTRL_VQ))) {
+        features &= ~(0x1 << VIRTIO_NET_F_MQ);
+    }
+
     if (peer_has_vnet_hdr(n)) {
         tap_using_vnet_hdr(n->nic->nc.peer, 1);
     } else {
@@ -270,12 +468,19 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
     return features;
 }
 
+static void virtio_net_set_queue_pairs(VirtIONet *n, int pairs);
+
 static void virtio_net_set_features(VirtIODevice *vdev, uint32_t features)
 {
     VirtIONet *n = to_virtio_net(vdev);
 
     n->mergeable_rx_bufs = !!(features & (1 << VIRTIO_NET_F_MRG_RXBUF));
 
+    /* without VIRTIO_NET_F_MQ the control virtqueue is queue 2 */
+    virtio_net_set_queue_pairs(n, (features & (1 << VIRTIO_NET_F_MQ)) ?
+                                  n->max_queues : 1);
+    n->curr_queues = 1;
+
     if (n->has_vnet_hdr) {
         tap_set_offload(n->nic->nc.peer,
                         (features >> VIRTIO_NET_F_GUEST_CSUM) & 1,
@@ -401,6 +606,28 @@ static int virtio_net_handle_vlan_table(VirtIONet *n, uint8_t cmd,
     return VIRTIO_NET_OK;
 }
 
+static int virtio_net_handle_mq(VirtIONet *n, uint8_t cmd,
+                                VirtQueueElement *elem)
+{
+    uint16_t queues;
+
+    if (cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET || elem->out_num != 2 ||
+        elem->out_sg[1].iov_len != sizeof(queues)) {
+        error_report("virtio-net ctrl invalid multiqueue command");
+        return VIRTIO_NET_ERR;
+    }
+
+    queues = lduw_p(elem->out_sg[1].iov_base);
+
+    if (!(n->vdev.guest_features & (1 << VIRTIO_NET_F_MQ)) ||
+        queues < VIRTIO_NET_CTRL_MQ_VQ_PAIRS_MIN || queues > n->max_queues) {
+        return VIRTIO_NET_ERR;
+    }
+
+    n->curr_queues = queues;
+    return VIRTIO_NET_OK;
+}
+
 static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
@@ -429,6 +656,8 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
             status = virtio_net_handle_mac(n, ctrl.cmd, &elem);
         else if (ctrl.class == VIRTIO_NET_CTRL_VLAN)
             status = virtio_net_handle_vlan_table(n, ctrl.cmd, &elem);
+        else if (ctrl.class == VIRTIO_NET_CTRL_MQ)
+            status = virtio_net_handle_mq(n, ctrl.cmd, &elem);
 
         stb_p(elem.in_sg[elem.in_num - 1].iov_base, status);
 
@@ -439,11 +668,50 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
 
 /* RX */
 
+/* Hands the packets received during a burst to the guest all at once */
+static void virtio_net_rx_done(VirtIONetQueue *q)
+{
+    if (q->rx_pending && q->rx_vq) {
+        virtqueue_flush(q->rx_vq, q->rx_pending);
+        virtio_notify(&q->n->vdev, q->rx_vq);
+    }
+    q->rx_pending = 0;
+}
+
+static void virtio_net_receive_burst(VLANClientState *nc, bool begin)
+{
+    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    q->rx_burst = begin;
+    if (!begin) {
+        /* inactive pairs receive through queue pair 0 */
+        virtio_net_rx_done(q);
+        virtio_net_rx_done(&n->vqs[0]);
+    }
+}
+
+static void virtio_net_flush_rx(VirtIONetQueue *q)
+{
+    if (q->nic) {
+        virtio_net_receive_burst(&q->nic->nc, true);
+        qemu_flush_queued_packets(&q->nic->nc);
+        virtio_net_receive_burst(&q->nic->nc, false);
+    }
+}
+
 static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    int i, index = virtio_get_queue_index(vq) / 2;
 
-    qemu_flush_queued_packets(&n->nic->nc);
+    virtio_net_flush_rx(&n->vqs[index]);
+    if (index == 0) {
+        /* queue pair 0 also receives for the pairs that are not in use */
+        for (i = n->curr_queues; i < n->max_queues; i++) {
+            virtio_net_flush_rx(&n->vqs[i]);
+        }
+    }
 
     /* We now have RX buffers, signal to the IO thread to break out of the
      * select to re-poll the tap file descriptor */
@@ -453,35 +721,39 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 static int virtio_net_can_receive(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_rx_queue(nc);
+
     if (!n->vm_running) {
         return 0;
     }
 
-    if (!virtio_queue_ready(n->rx_vq) ||
+    if (!virtio_queue_ready(q->rx_vq) ||
         !(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return 0;
 
     return 1;
 }
 
-static int virtio_net_has_buffers(VirtIONet *n, int bufsize)
+static int virtio_net_has_buffers(VirtIONetQueue *q, int bufsize)
 {
-    if (virtio_queue_empty(n->rx_vq) ||
+    VirtIONet *n = q->n;
+
+    if (virtio_queue_empty(q->rx_vq) ||
         (n->mergeable_rx_bufs &&
-         !virtqueue_avail_bytes(n->rx_vq, bufsize, 0))) {
-        virtio_queue_set_notification(n->rx_vq, 1);
+         !virtqueue_avail_bytes(q->rx_vq, bufsize, 0))) {
+        virtio_queue_set_notification(q->rx_vq, 1);
 
         /* To avoid a race condition where the guest has made some buffers
          * available after the above check but before notification was
          * enabled, check for available buffers again.
          */
-        if (virtio_queue_empty(n->rx_vq) ||
+        if (virtio_queue_empty(q->rx_vq) ||
             (n->mergeable_rx_bufs &&
-             !virtqueue_avail_bytes(n->rx_vq, bufsize, 0)))
+             !virtqueue_avail_bytes(q->rx_vq, bufsize, 0)))
             return 0;
     }
 
-    virtio_queue_set_notification(n->rx_vq, 0);
+    virtio_queue_set_notification(q->rx_vq, 0);
     return 1;
 }
 
@@ -593,10 +865,11 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
 static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_t size)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_rx_queue(nc);
     struct virtio_net_hdr_mrg_rxbuf *mhdr = NULL;
     size_t guest_hdr_len, offset, i, host_hdr_len;
 
-    if (!virtio_net_can_receive(&n->nic->nc))
+    if (!virtio_net_can_receive(nc))
         return -1;
 
     /* hdr_len refers to the header we supply to the guest */
@@ -605,7 +878,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
 
     host_hdr_len = n->has_vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
-    if (!virtio_net_has_buffers(n, size + guest_hdr_len - host_hdr_len))
+    if (!virtio_net_has_buffers(q, size + guest_hdr_len - host_hdr_len))
         return 0;
 
     if (!receive_filter(n, buf, size))
@@ -620,7 +893,7 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
 
         total = 0;
 
-        if (virtqueue_pop(n->rx_vq, &elem) == 0) {
+        if (virtqueue_pop(q->rx_vq, &elem) == 0) {
             if (i == 0)
                 return -1;
             error_report("virtio-net unexpected empty queue: "
@@ -672,55 +945,96 @@ static ssize_t virtio_net_receive(VLANClientState *nc, const uint8_t *buf, size_
         }
 
         /* signal other side */
-        virtqueue_fill(n->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, q->rx_pending + i++);
     }
 
     if (mhdr)
         mhdr->num_buffers = i;
 
-    virtqueue_flush(n->rx_vq, i);
-    virtio_notify(&n->vdev, n->rx_vq);
+    q->rx_pending += i;
+    if (!virtio_net_get_queue(nc)->rx_burst) {
+        virtio_net_rx_done(q);
+    }
 
+    q->rx_packets++;
+    q->rx_bytes += size - host_hdr_len;
     return size;
 }
 
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq);
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(VLANClientState *nc, ssize_t len)
 {
-    VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+    VirtIONet *n = q->n;
+
+    virtqueue_push(q->tx_vq, &q->async_tx.elem, q->async_tx.len);
+    virtio_notify(&n->vdev, q->tx_vq);
+
+    q->async_tx.elem.out_num = q->async_tx.len = 0;
+
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
+}
 
-    virtqueue_push(n->tx_vq, &n->async_tx.elem, n->async_tx.len);
-    virtio_notify(&n->vdev, n->tx_vq);
+/* Hands the packets sent by a flush back to the guest all at once */
+static void virtio_net_tx_done(VirtIONetQueue *q, unsigned int count)
+{
+    if (count) {
+        virtqueue_flush(q->tx_vq, count);
+        virtio_notify(&q->n->vdev, q->tx_vq);
+    }
+}
 
-    n->async_tx.elem.out_num = n->async_tx.len = 0;
+/* tx=thread: hands the packets popped by a flush to the TX thread */
+static void virtio_net_tx_thread_submit(VirtIONetQueue *q, int count)
+{
+    q->tx_peer = q->nic->nc.peer;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    qemu_mutex_lock(&q->tx_lock);
+    q->tx_batch_count = count;
+    q->tx_batch_done = 0;
+    qemu_cond_broadcast(&q->tx_cond);
+    qemu_mutex_unlock(&q->tx_lock);
 }
 
 /* TX */
-static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
+static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
-    VirtQueueElement elem;
+    VirtIONet *n = q->n;
+    VirtQueue *vq = q->tx_vq;
+    VirtQueueElement local_elem, *elem;
     int32_t num_packets = 0;
+    unsigned int done = 0;
+    int batch = 0, use_thread;
+
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)) {
         return num_packets;
     }
 
     assert(n->vm_running);
 
-    if (n->async_tx.elem.out_num) {
-        virtio_queue_set_notification(n->tx_vq, 0);
+    if (q->async_tx.elem.out_num || q->tx_batch_count) {
+        virtio_queue_set_notification(vq, 0);
         return num_packets;
     }
 
-    while (virtqueue_pop(vq, &elem)) {
+    /* with the link down, packets are dropped right here */
+    use_thread = n->tx_thread && !q->nic->nc.link_down && q->nic->nc.peer;
+
+    for (;;) {
         ssize_t ret, len = 0;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+        unsigned int out_num;
+        struct iovec *out_sg;
         unsigned hdr_len;
 
+        elem = use_thread ? &q->tx_batch[batch].elem : &local_elem;
+        if (!virtqueue_pop(vq, elem)) {
+            break;
+        }
+        out_num = elem->out_num;
+        out_sg = &elem->out_sg[0];
+
         /* hdr_len refers to the header received from the guest */
         hdr_len = n->mergeable_rx_bufs ?
             sizeof(struct virtio_net_hdr_mrg_rxbuf) :
@@ -743,46 +1057,88 @@ static int32_t virtio_net_flush_tx(VirtIONet *n, VirtQueue *vq)
             len += hdr_len;
         }
 
-        ret = qemu_sendv_packet_async(&n->nic->nc, out_sg, out_num,
-                                      virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(n->tx_vq, 0);
-            n->async_tx.elem = elem;
-            n->async_tx.len  = len;
-            return -EBUSY;
+        if (use_thread) {
+            VirtIONetTxPacket *p = &q->tx_batch[batch];
+
+            p->iov = out_sg;
+            p->iovcnt = out_num;
+            p->len = len;
+            p->ret = 0;
+            num_packets++;
+            if (++batch == TX_THREAD_BATCH || num_packets >= n->tx_burst) {
+                break;
+            }
+            continue;
+        }
+
+        if (n->tx_thread) {
+            ret = iov_size(out_sg, out_num);
+        } else {
+            /* elem stays mapped until the packet is out, no need to copy */
+            if (n->tx_zerocopy) {
+                ret = qemu_sendv_packet_zerocopy(&q->nic->nc, out_sg, out_num,
+                                                 virtio_net_tx_complete);
+            } else {
+                ret = qemu_sendv_packet_async(&q->nic->nc, out_sg, out_num,
+                                              virtio_net_tx_complete);
+            }
+            if (ret == 0) {
+                virtio_queue_set_notification(vq, 0);
+                q->async_tx.elem = *elem;
+                q->async_tx.len  = len;
+                if (n->tx_zerocopy) {
+                    q->tx_zerocopy++;
+                }
+                virtio_net_tx_done(q, done);
+                return -EBUSY;
+            }
         }
 
         len += ret;
 
-        virtqueue_push(vq, &elem, len);
-        virtio_notify(&n->vdev, vq);
+        virtqueue_fill(vq, elem, len, done++);
+
+        if (ret > 0) {
+            q->tx_packets++;
+            q->tx_bytes += ret;
+        }
 
         if (++num_packets >= n->tx_burst) {
             break;
         }
     }
+
+    if (batch) {
+        /* completed by virtio_net_tx_thread_read(), like an async send */
+        virtio_queue_set_notification(vq, 0);
+        virtio_net_tx_thread_submit(q, batch);
+        return -EBUSY;
+    }
+
+    virtio_net_tx_done(q, done);
     return num_packets;
 }
 
 static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[virtio_get_queue_index(vq) / 2];
 
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vm_running) {
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         return;
     }
 
-    if (n->tx_waiting) {
+    if (q->tx_waiting) {
         virtio_queue_set_notification(vq, 1);
-        qemu_del_timer(n->tx_timer);
-        n->tx_waiting = 0;
-        virtio_net_flush_tx(n, vq);
+        qemu_del_timer(q->tx_timer);
+        q->tx_waiting = 0;
+        virtio_net_flush_tx(q);
     } else {
-        qemu_mod_timer(n->tx_timer,
+        qemu_mod_timer(q->tx_timer,
                        qemu_get_clock(vm_clock) + n->tx_timeout);
-        n->tx_waiting = 1;
+        q->tx_waiting = 1;
         virtio_queue_set_notification(vq, 0);
     }
 }
@@ -790,48 +1146,51 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
 static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = to_virtio_net(vdev);
+    VirtIONetQueue *q = &n->vqs[virtio_get_queue_index(vq) / 2];
 
-    if (unlikely(n->tx_waiting)) {
+    if (unlikely(q->tx_waiting)) {
         return;
     }
-    n->tx_waiting = 1;
+    q->tx_waiting = 1;
     /* This happens when device was stopped but VCPU wasn't. */
     if (!n->vm_running) {
         return;
     }
     virtio_queue_set_notification(vq, 0);
-    qemu_bh_schedule(n->tx_bh);
+    qemu_bh_schedule(q->tx_bh);
 }
 
 static void virtio_net_tx_timer(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     assert(n->vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK))
         return;
 
-    virtio_queue_set_notification(n->tx_vq, 1);
-    virtio_net_flush_tx(n, n->tx_vq);
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
 }
 
 static void virtio_net_tx_bh(void *opaque)
 {
-    VirtIONet *n = opaque;
+    VirtIONetQueue *q = opaque;
+    VirtIONet *n = q->n;
     int32_t ret;
 
     assert(n->vm_running);
 
-    n->tx_waiting = 0;
+    q->tx_waiting = 0;
 
     /* Just in case the driver is not ready on more */
     if (unlikely(!(n->vdev.status & VIRTIO_CONFIG_S_DRIVER_OK)))
         return;
 
-    ret = virtio_net_flush_tx(n, n->tx_vq);
+    ret = virtio_net_flush_tx(q);
     if (ret == -EBUSY) {
         return; /* Notification re-enable handled by tx_complete */
     }
@@ -839,25 +1198,126 @@ static void virtio_net_tx_bh(void *opaque)
     /* If we flush a full burst of packets, assume there are
      * more coming and immediately reschedule */
     if (ret >= n->tx_burst) {
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
         return;
     }
 
     /* If less than a full burst, re-enable notification and flush
      * anything that may have come in while we weren't looking.  If
      * we find something, assume the guest is still active and reschedule */
-    virtio_queue_set_notification(n->tx_vq, 1);
-    if (virtio_net_flush_tx(n, n->tx_vq) > 0) {
-        virtio_queue_set_notification(n->tx_vq, 0);
-        qemu_bh_schedule(n->tx_bh);
-        n->tx_waiting = 1;
+    virtio_queue_set_notification(q->tx_vq, 1);
+    if (virtio_net_flush_tx(q) > 0) {
+        virtio_queue_set_notification(q->tx_vq, 0);
+        qemu_bh_schedule(q->tx_bh);
+        q->tx_waiting = 1;
+    }
+}
+
+/*
+ * tx=thread: writes the batches of packets handed over by the I/O thread to
+ * the tap.  A full tap blocks this thread, not the vcpu that kicked the
+ * queue; the ring and the device state are left to the I/O thread.
+ */
+static void *virtio_net_tx_thread(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    VirtIONetTxPacket *p;
+    int i, count;
+
+    qemu_mutex_lock(&q->tx_lock);
+    for (;;) {
+        while (!q->tx_exit && !(q->tx_batch_count && !q->tx_batch_done)) {
+            qemu_cond_wait(&q->tx_cond, &q->tx_lock);
+        }
+        if (q->tx_exit) {
+            break;
+        }
+        count = q->tx_batch_count;
+        qemu_mutex_unlock(&q->tx_lock);
+
+        for (i = 0; i < count; i++) {
+            p = &q->tx_batch[i];
+            p->ret = tap_sendv_wait(q->tx_peer, p->iov, p->iovcnt,
+                                    event_notifier_get_fd(&q->tx_cancel));
+        }
+
+        qemu_mutex_lock(&q->tx_lock);
+        q->tx_batch_done = 1;
+        qemu_cond_broadcast(&q->tx_cond);
+        event_notifier_set(&q->tx_notifier);
     }
+    qemu_mutex_unlock(&q->tx_lock);
+    return NULL;
+}
+
+/* tx=thread: the batch is back, carry on like virtio_net_tx_complete() */
+static void virtio_net_tx_thread_read(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    event_notifier_test_and_clear(&q->tx_notifier);
+    if (!virtio_net_tx_thread_complete(q) || !q->n->vm_running) {
+        return;
+    }
+    virtio_queue_set_notification(q->tx_vq, 1);
+    virtio_net_flush_tx(q);
+}
+
+static void virtio_net_add_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    q->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
+    if (q->tx_timer) {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
+    } else {
+        q->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
+    }
+}
+
+static void virtio_net_del_queue(VirtIONet *n, int index)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+
+    if (n->tx_thread) {
+        virtio_net_tx_thread_stop(q);
+    }
+    virtio_net_drop_tx(q);
+    q->rx_pending = 0;
+
+    virtio_del_queue(&n->vdev, index * 2 + 1);
+    virtio_del_queue(&n->vdev, index * 2);
+    q->rx_vq = q->tx_vq = NULL;
+}
+
+/*
+ * Sets up the virtqueues for the given number of queue pairs.  The control
+ * virtqueue always follows the last pair, so it is recreated as well.
+ */
+static void virtio_net_set_queue_pairs(VirtIONet *n, int pairs)
+{
+    int i;
+
+    if (pairs == n->nb_vq_pairs) {
+        return;
+    }
+
+    virtio_del_queue(&n->vdev, n->nb_vq_pairs * 2);
+    for (i = n->nb_vq_pairs - 1; i >= pairs; i--) {
+        virtio_net_del_queue(n, i);
+    }
+    for (i = n->nb_vq_pairs; i < pairs; i++) {
+        virtio_net_add_queue(n, i);
+    }
+    n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
+    n->nb_vq_pairs = pairs;
 }
 
 static void virtio_net_save(QEMUFile *f, void *opaque)
 {
     VirtIONet *n = opaque;
+    int i;
 
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
@@ -865,7 +1325,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     virtio_save(&n->vdev, f);
 
     qemu_put_buffer(f, n->mac, ETH_ALEN);
-    qemu_put_be32(f, n->tx_waiting);
+    qemu_put_be32(f, n->vqs[0].tx_waiting);
     qemu_put_be32(f, n->mergeable_rx_bufs);
     qemu_put_be16(f, n->status);
     qemu_put_byte(f, n->promisc);
@@ -881,6 +1341,11 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     qemu_put_byte(f, n->nouni);
     qemu_put_byte(f, n->nobcast);
     qemu_put_byte(f, n->has_ufo);
+    qemu_put_be16(f, n->max_queues);
+    qemu_put_be16(f, n->curr_queues);
+    for (i = 1; i < n->max_queues; i++) {
+        qemu_put_be32(f, n->vqs[i].tx_waiting);
+    }
 }
 
 static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
@@ -894,7 +1359,7 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
     virtio_load(&n->vdev, f);
 
     qemu_get_buffer(f, n->mac, ETH_ALEN);
-    n->tx_waiting = qemu_get_be32(f);
+    n->vqs[0].tx_waiting = qemu_get_be32(f);
     n->mergeable_rx_bufs = qemu_get_be32(f);
 
     if (version_id >= 3)
@@ -962,6 +1427,23 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    if (version_id >= 12) {
+        if (qemu_get_be16(f) != n->max_queues) {
+            error_report("virtio-net: saved image has a different number "
+                         "of queues");
+            return -1;
+        }
+        n->curr_queues = qemu_get_be16(f);
+        if (n->curr_queues < 1 || n->curr_queues > n->max_queues) {
+            error_report("virtio-net: invalid number of queues in use %d",
+                         n->curr_queues);
+            return -1;
+        }
+        for (i = 1; i < n->max_queues; i++) {
+            n->vqs[i].tx_waiting = qemu_get_be32(f);
+        }
+    }
+
     /* Find the first multicast entry in the saved MAC filter */
     for (i = 0; i < n->mac_table.in_use; i++) {
         if (n->mac_table.macs[i * ETH_ALEN] & 1) {
@@ -975,8 +1457,23 @@ static int virtio_net_load(QEMUFile *f, void *opaque, int version_id)
 static void virtio_net_cleanup(VLANClientState *nc)
 {
     VirtIONet *n = DO_UPCAST(NICState, nc, nc)->opaque;
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
 
-    n->nic = NULL;
+    if (q == &n->vqs[0]) {
+        n->nic = NULL;
+    }
+    q->nic = NULL;
+}
+
+static void virtio_net_print_info(VLANClientState *nc, Monitor *mon)
+{
+    VirtIONetQueue *q = virtio_net_get_queue(nc);
+
+    monitor_printf(mon, " queue=%d rx_packets=%" PRIu64 " rx_bytes=%" PRIu64
+                   " tx_packets=%" PRIu64 " tx_bytes=%" PRIu64
+                   " tx_zerocopy=%" PRIu64,
+                   (int)(q - q->n->vqs), q->rx_packets, q->rx_bytes,
+                   q->tx_packets, q->tx_bytes, q->tx_zerocopy);
 }
 
 static NetClientInfo net_virtio_info = {
@@ -986,11 +1483,14 @@ static NetClientInfo net_virtio_info = {
     .receive = virtio_net_receive,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
+    .print_info = virtio_net_print_info,
+    .receive_burst = virtio_net_receive_burst,
 };
 
 static void virtio_net_vmstate_change(void *opaque, int running, int reason)
 {
     VirtIONet *n = opaque;
+
     n->vm_running = running;
     /* This is called when vm is started/stopped,
      * it will start/stop vhost backend if appropriate
@@ -1002,6 +1502,7 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
                               virtio_net_conf *net)
 {
     VirtIONet *n;
+    int i;
 
     n = (VirtIONet *)virtio_common_init("virtio-net", VIRTIO_ID_NET,
                                         sizeof(struct virtio_net_config),
@@ -1014,34 +1515,95 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
     n->vdev.bad_features = virtio_net_bad_features;
     n->vdev.reset = virtio_net_reset;
     n->vdev.set_status = virtio_net_set_status;
-    n->rx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_rx);
 
-    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh")) {
-        error_report("virtio-net: "
-                     "Unknown option tx=%s, valid options: \"timer\" \"bh\"",
+    if (net->tx && strcmp(net->tx, "timer") && strcmp(net->tx, "bh") &&
+        strcmp(net->tx, "thread")) {
+        error_report("virtio-net: Unknown option tx=%s, "
+                     "valid options: \"timer\" \"bh\" \"thread\"",
                      net->tx);
         error_report("Defaulting to \"bh\"");
     }
 
-    if (net->tx && !strcmp(net->tx, "timer")) {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_timer);
-        n->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, n);
-        n->tx_timeout = net->txtimer;
-    } else {
-        n->tx_vq = virtio_add_queue(&n->vdev, 256, virtio_net_handle_tx_bh);
-        n->tx_bh = qemu_bh_new(virtio_net_tx_bh, n);
+    /* one queue pair per queue of the tap, unless one is already taken */
+    n->max_queues = 1;
+    if (conf->peer && conf->peer->info->type == NET_CLIENT_TYPE_TAP) {
+        while (n->max_queues < MIN(tap_get_queues(conf->peer),
+                                   VIRTIO_NET_MAX_QUEUES)) {
+            VLANClientState *peer = tap_get_queue(conf->peer, n->max_queues);
+
+            if (!peer || peer->peer) {
+                error_report("virtio-net: tap queue %d is not available, "
+                             "using %d queues", n->max_queues, n->max_queues);
+                break;
+            }
+            n->max_queues++;
+        }
+    }
+
+    if (net->tx && !strcmp(net->tx, "thread")) {
+        if (conf->peer && conf->peer->info->type == NET_CLIENT_TYPE_TAP) {
+            n->tx_thread = 1;
+        } else {
+            error_report("virtio-net: tx=thread requires a tap backend, "
+                         "defaulting to \"bh\"");
+        }
     }
+
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        q->n = n;
+        if (n->tx_thread) {
+            if (event_notifier_init(&q->tx_notifier, 0) < 0 ||
+                event_notifier_init(&q->tx_cancel, 0) < 0) {
+                error_report("virtio-net: tx=thread requires eventfd");
+                exit(1);
+            }
+            qemu_set_fd_handler(event_notifier_get_fd(&q->tx_notifier),
+                                virtio_net_tx_thread_read, NULL, q);
+            q->tx_batch = qemu_mallocz(TX_THREAD_BATCH * sizeof(*q->tx_batch));
+            qemu_mutex_init(&q->tx_lock);
+            qemu_cond_init(&q->tx_cond);
+            qemu_thread_create(&q->tx_thread, virtio_net_tx_thread, q);
+        }
+        if (net->tx && !strcmp(net->tx, "timer")) {
+            q->tx_timer = qemu_new_timer(vm_clock, virtio_net_tx_timer, q);
+        } else {
+            q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        }
+        virtio_net_add_queue(n, i);
+    }
+    n->nb_vq_pairs = n->max_queues;
+    n->curr_queues = 1;
+    n->tx_timeout = net->txtimer;
+
     n->ctrl_vq = virtio_add_queue(&n->vdev, 64, virtio_net_handle_ctrl);
     qemu_macaddr_default_if_unset(&conf->macaddr);
     memcpy(&n->mac[0], &conf->macaddr, sizeof(n->mac));
     n->status = VIRTIO_NET_S_LINK_UP;
 
     n->nic = qemu_new_nic(&net_virtio_info, conf, dev->info->name, dev->id, n);
+    n->vqs[0].nic = n->nic;
 
     qemu_format_nic_info_str(&n->nic->nc, conf->macaddr.a);
 
-    n->tx_waiting = 0;
+    /* queue pair i is peered with tap queue i and named <id>.i */
+    for (i = 1; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+        char name[128];
+
+        q->conf = *conf;
+        q->conf.peer = tap_get_queue(conf->peer, i);
+        if (dev->id) {
+            snprintf(name, sizeof(name), "%s.%d", dev->id, i);
+        }
+        q->nic = qemu_new_nic(&net_virtio_info, &q->conf, dev->info->name,
+                              dev->id ? name : NULL, n);
+        qemu_format_nic_info_str(&q->nic->nc, conf->macaddr.a);
+    }
+
     n->tx_burst = net->txburst;
+    n->tx_zerocopy = !!(net->flags & (1 << VIRTIO_NET_FLAG_TX_ZEROCOPY_BIT));
     n->mergeable_rx_bufs = 0;
     n->promisc = 1; /* for compatibility */
 
@@ -1062,25 +1624,54 @@ VirtIODevice *virtio_net_init(DeviceState *dev, NICConf *conf,
 void virtio_net_exit(VirtIODevice *vdev)
 {
     VirtIONet *n = DO_UPCAST(VirtIONet, vdev, vdev);
+    int i;
+
     qemu_del_vm_change_state_handler(n->vmstate);
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
 
-    qemu_purge_queued_packets(&n->nic->nc);
-
     unregister_savevm(n->qdev, "virtio-net", n);
 
     qemu_free(n->mac_table.macs);
     qemu_free(n->vlans);
 
-    if (n->tx_timer) {
-        qemu_del_timer(n->tx_timer);
-        qemu_free_timer(n->tx_timer);
-    } else {
-        qemu_bh_delete(n->tx_bh);
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        if (q->nic) {
+            qemu_purge_queued_packets(&q->nic->nc);
+        }
+
+        if (n->tx_thread) {
+            virtio_net_tx_thread_stop(q);
+            qemu_mutex_lock(&q->tx_lock);
+            q->tx_exit = 1;
+            qemu_cond_broadcast(&q->tx_cond);
+            qemu_mutex_unlock(&q->tx_lock);
+            qemu_thread_join(&q->tx_thread);
+            qemu_cond_destroy(&q->tx_cond);
+            qemu_mutex_destroy(&q->tx_lock);
+            qemu_set_fd_handler(event_notifier_get_fd(&q->tx_notifier),
+                                NULL, NULL, NULL);
+            event_notifier_cleanup(&q->tx_notifier);
+            event_notifier_cleanup(&q->tx_cancel);
+            qemu_free(q->tx_batch);
+        }
+        if (q->tx_timer) {
+            qemu_del_timer(q->tx_timer);
+            qemu_free_timer(q->tx_timer);
+        } else {
+            qemu_bh_delete(q->tx_bh);
+        }
     }
 
     virtio_cleanup(&n->vdev);
+
+    for (i = n->max_queues - 1; i > 0; i--) {
+        if (n->vqs[i].nic) {
+            qemu_del_vlan_client(&n->vqs[i].nic->nc);
+        }
+    }
     qemu_del_vlan_client(&n->nic->nc);
 }
@@ -726,6 +726,8 @@ static PCIDeviceInfo virtio_info[] = {
             DEFINE_PROP_INT32("x-txburst", VirtIOPCIProxy,
                               net.txburst, TX_BURST),
             DEFINE_PROP_STRING("tx", VirtIOPCIProxy, net.tx),
+            DEFINE_PROP_BIT("x-txzerocopy", VirtIOPCIProxy, net.flags,
+                            VIRTIO_NET_FLAG_TX_ZEROCOPY_BIT, true),
             DEFINE_PROP_END_OF_LIST(),
         },
         .qdev.reset = virtio_pci_reset,
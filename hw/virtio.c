@@ -15,6 +15,7 @@
 
 #include "trace.h"
 #include "qemu-error.h"
+#include "qemu-barrier.h"
 #include "virtio.h"
 #include "sysemu.h"
 
@@ -22,15 +23,6 @@
  * x86 pagesize again. */
 #define VIRTIO_PCI_VRING_ALIGN         4096
 
-/* QEMU doesn't strictly need write barriers since everything runs in
- * lock-step.  We'll leave the calls to wmb() in though to make it obvious for
- * KVM or if kqemu gets SMP support.
- * In any case, we must prevent the compiler from reordering the code.
- * TODO: we likely need some rmb()/mb() as well.
- */
-
-#define wmb() __asm__ __volatile__("": : :"memory")
-
 typedef struct VRingDesc
 {
     uint64_t addr;
@@ -71,6 +63,14 @@ struct VirtQueue
 {
     VRing vring;
     target_phys_addr_t pa;
+    /*
+     * Host mappings of the rings, NULL where a ring isn't in contiguous RAM.
+     * They are redone when the guest memory map has changed since map_gen.
+     */
+    VRingDesc *desc;
+    VRingAvail *avail;
+    VRingUsed *used;
+    unsigned int map_gen;
     uint16_t last_avail_idx;
     int inuse;
     uint16_t vector;
@@ -80,6 +80,96 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+/* bumped whenever the guest memory map changes */
+static unsigned int virtio_map_gen = 1;
+
+static void virtio_set_memory(CPUPhysMemoryClient *client,
+                              target_phys_addr_t start_addr,
+                              ram_addr_t size, ram_addr_t phys_offset)
+{
+    virtio_map_gen++;
+}
+
+static int virtio_sync_dirty_bitmap(CPUPhysMemoryClient *client,
+                                    target_phys_addr_t start_addr,
+                                    target_phys_addr_t end_addr)
+{
+    return 0;
+}
+
+static int virtio_migration_log(CPUPhysMemoryClient *client, int enable)
+{
+    return 0;
+}
+
+static CPUPhysMemoryClient virtio_memory_client = {
+    .set_memory = virtio_set_memory,
+    .sync_dirty_bitmap = virtio_sync_dirty_bitmap,
+    .migration_log = virtio_migration_log,
+};
+
+/*
+ * Maps len bytes of guest memory at pa for reading, or returns NULL if they
+ * are not contiguous RAM.
+ */
+static void *vring_map(target_phys_addr_t pa, target_phys_addr_t len)
+{
+    target_phys_addr_t mapped = len;
+    ram_addr_t ram_addr;
+    void *ptr;
+
+    ptr = cpu_physical_memory_map(pa, &mapped, 0);
+    if (!ptr) {
+        return NULL;
+    }
+    /* MMIO is mapped through a bounce buffer, which can't be kept */
+    if (mapped != len || qemu_ram_addr_from_host(ptr, &ram_addr)) {
+        cpu_physical_memory_unmap(ptr, mapped, 0, 0);
+        return NULL;
+    }
+    return ptr;
+}
+
+static void vring_unmap(void *ptr, target_phys_addr_t len)
+{
+    if (ptr) {
+        cpu_physical_memory_unmap(ptr, len, 0, 0);
+    }
+}
+
+static void virtqueue_unmap(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    vring_unmap(vq->desc, sizeof(VRingDesc) * num);
+    vring_unmap(vq->avail, offsetof(VRingAvail, ring[num]));
+    vring_unmap(vq->used, offsetof(VRingUsed, ring[num]));
+    vq->desc = NULL;
+    vq->avail = NULL;
+    vq->used = NULL;
+}
+
+static void virtqueue_map(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    virtqueue_unmap(vq);
+    vq->map_gen = virtio_map_gen;
+    if (!vq->pa) {
+        return;
+    }
+    vq->desc = vring_map(vq->vring.desc, sizeof(VRingDesc) * num);
+    vq->avail = vring_map(vq->vring.avail, offsetof(VRingAvail, ring[num]));
+    vq->used = vring_map(vq->vring.used, offsetof(VRingUsed, ring[num]));
+}
+
+static inline void virtqueue_check_map(VirtQueue *vq)
+{
+    if (unlikely(vq->map_gen != virtio_map_gen)) {
+        virtqueue_map(vq);
+    }
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
@@ -90,39 +180,42 @@ static void virtqueue_init(VirtQueue *vq)
     vq->vring.used = vring_align(vq->vring.avail +
                                  offsetof(VRingAvail, ring[vq->vring.num]),
                                  VIRTIO_PCI_VRING_ALIGN);
+    virtqueue_map(vq);
 }
 
-static inline uint64_t vring_desc_addr(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return ldq_phys(pa);
-}
-
-static inline uint32_t vring_desc_len(target_phys_addr_t desc_pa, int i)
+/*
+ * Reads descriptor i of the table at desc_pa, through its host mapping
+ * table if there is one.
+ */
+static inline void vring_desc_read(const VRingDesc *table,
+                                   target_phys_addr_t desc_pa, int i,
+                                   VRingDesc *desc)
 {
     target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return ldl_phys(pa);
-}
 
-static inline uint16_t vring_desc_flags(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return lduw_phys(pa);
-}
+    if (table) {
+        desc->addr = ldq_p(&table[i].addr);
+        desc->len = ldl_p(&table[i].len);
+        desc->flags = lduw_p(&table[i].flags);
+        desc->next = lduw_p(&table[i].next);
+        return;
+    }
 
-static inline uint16_t vring_desc_next(target_phys_addr_t desc_pa, int i)
-{
-    target_phys_addr_t pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return lduw_phys(pa);
+    pa = desc_pa + sizeof(VRingDesc) * i;
+    desc->addr = ldq_phys(pa + offsetof(VRingDesc, addr));
+    desc->len = ldl_phys(pa + offsetof(VRingDesc, len));
+    desc->flags = lduw_phys(pa + offsetof(VRingDesc, flags));
+    desc->next = lduw_phys(pa + offsetof(VRingDesc, next));
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->flags);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, flags);
     return lduw_phys(pa);
 }
@@ -130,6 +223,11 @@ static inline uint16_t vring_avail_flags(VirtQueue *vq)
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->idx);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, idx);
     return lduw_phys(pa);
 }
@@ -137,10 +235,19 @@ static inline uint16_t vring_avail_idx(VirtQueue *vq)
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
     target_phys_addr_t pa;
+
+    virtqueue_check_map(vq);
+    if (vq->avail) {
+        return lduw_p(&vq->avail->ring[i]);
+    }
     pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
     return lduw_phys(pa);
 }
 
+/*
+ * Stores to the used ring still go through st*_phys, so that dirty logging
+ * and the invalidation of translated code see them.
+ */
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
     target_phys_addr_t pa;
@@ -158,6 +265,11 @@ static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
     target_phys_addr_t pa;
+
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        return lduw_p(&vq->used->idx);
+    }
     pa = vq->vring.used + offsetof(VRingUsed, idx);
     return lduw_phys(pa);
 }
@@ -169,18 +281,30 @@ static inline void vring_used_idx_increment(VirtQueue *vq, uint16_t val)
     stw_phys(pa, vring_used_idx(vq) + val);
 }
 
+static inline uint16_t vring_used_flags(VirtQueue *vq)
+{
+    target_phys_addr_t pa;
+
+    virtqueue_check_map(vq);
+    if (vq->used) {
+        return lduw_p(&vq->used->flags);
+    }
+    pa = vq->vring.used + offsetof(VRingUsed, flags);
+    return lduw_phys(pa);
+}
+
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) | mask);
+    stw_phys(pa, vring_used_flags(vq) | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
     target_phys_addr_t pa;
     pa = vq->vring.used + offsetof(VRingUsed, flags);
-    stw_phys(pa, lduw_phys(pa) & ~mask);
+    stw_phys(pa, vring_used_flags(vq) & ~mask);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
@@ -189,6 +313,8 @@ void virtio_queue_set_notification(VirtQueue *vq, int enable)
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
     else
         vring_used_flags_set_bit(vq, VRING_USED_F_NO_NOTIFY);
+    /* Buffers added after this are seen by the guest's next check. */
+    smp_mb();
 }
 
 int virtio_queue_ready(VirtQueue *vq)
@@ -235,7 +361,7 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     /* Make sure buffer is written before we update index. */
-    wmb();
+    smp_wmb();
     trace_virtqueue_flush(vq, count);
     vring_used_idx_increment(vq, count);
     vq->inuse -= count;
@@ -259,6 +385,11 @@ static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
         exit(1);
     }
 
+    /* The ring entries and descriptors must be read after the index. */
+    if (num_heads) {
+        smp_rmb();
+    }
+
     return num_heads;
 }
 
@@ -279,19 +410,16 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(const VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(desc_pa, i) & VRING_DESC_F_NEXT))
+    if (!(desc->flags & VRING_DESC_F_NEXT))
         return max;
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    wmb();
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -301,6 +429,27 @@ static unsigned virtqueue_next_desc(target_phys_addr_t desc_pa,
     return next;
 }
 
+/*
+ * Switches from the ring's descriptor table to the indirect table that
+ * desc points to, mapping it if possible.  *table_len is set to the length
+ * to pass to vring_unmap().
+ */
+static unsigned int vring_desc_indirect(const VRingDesc *desc,
+                                        VRingDesc **table,
+                                        target_phys_addr_t *desc_pa,
+                                        target_phys_addr_t *table_len)
+{
+    if (desc->len % sizeof(VRingDesc)) {
+        error_report("Invalid size for indirect buffer table");
+        exit(1);
+    }
+
+    *desc_pa = desc->addr;
+    *table_len = desc->len;
+    *table = vring_map(desc->addr, desc->len);
+    return desc->len / sizeof(VRingDesc);
+}
+
 int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 {
     unsigned int idx;
@@ -311,20 +460,18 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         unsigned int max, num_bufs, indirect = 0;
-        target_phys_addr_t desc_pa;
+        target_phys_addr_t desc_pa, table_len = 0;
+        VRingDesc *table, desc;
         int i;
 
         max = vq->vring.num;
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        table = vq->desc;
+        vring_desc_read(table, desc_pa, i, &desc);
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-                error_report("Invalid size for indirect buffer table");
-                exit(1);
-            }
-
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
             /* If we've got too many, that implies a descriptor loop. */
             if (num_bufs >= max) {
                 error_report("Looped descriptor");
@@ -333,9 +480,9 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
+            max = vring_desc_indirect(&desc, &table, &desc_pa, &table_len);
             num_bufs = i = 0;
-            desc_pa = vring_desc_addr(desc_pa, i);
+            vring_desc_read(table, desc_pa, i, &desc);
         }
 
         do {
@@ -345,16 +492,28 @@ int virtqueue_avail_bytes(VirtQueue *vq, int in_bytes, int out_bytes)
                 exit(1);
             }
 
-            if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
                 if (in_bytes > 0 &&
-                    (in_total += vring_desc_len(desc_pa, i)) >= in_bytes)
-                    return 1;
+                    (in_total += desc.len) >= in_bytes)
+                    break;
             } else {
                 if (out_bytes > 0 &&
-                    (out_total += vring_desc_len(desc_pa, i)) >= out_bytes)
-                    return 1;
+                    (out_total += desc.len) >= out_bytes)
+                    break;
+            }
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(table, desc_pa, i, &desc);
             }
-        } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+        } while (i != max);
+
+        if (indirect) {
+            vring_unmap(table, table_len);
+        }
+        if ((in_bytes > 0 && in_total >= in_bytes) ||
+            (out_bytes > 0 && out_total >= out_bytes)) {
+            return 1;
+        }
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -383,8 +542,9 @@ void virtqueue_map_sg(struct iovec *sg, target_phys_addr_t *addr,
 
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
-    unsigned int i, head, max;
-    target_phys_addr_t desc_pa = vq->vring.desc;
+    unsigned int i, head, max, indirect = 0;
+    target_phys_addr_t desc_pa = vq->vring.desc, table_len = 0;
+    VRingDesc *table, desc;
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -395,39 +555,46 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
     max = vq->vring.num;
 
     i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    table = vq->desc;
+    vring_desc_read(table, desc_pa, i, &desc);
 
-    if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(desc_pa, i) % sizeof(VRingDesc)) {
-            error_report("Invalid size for indirect buffer table");
-            exit(1);
-        }
-
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(desc_pa, i);
+        indirect = 1;
+        max = vring_desc_indirect(&desc, &table, &desc_pa, &table_len);
         i = 0;
+        vring_desc_read(table, desc_pa, i, &desc);
     }
 
     /* Collect all the descriptors */
     do {
         struct iovec *sg;
 
-        if (vring_desc_flags(desc_pa, i) & VRING_DESC_F_WRITE) {
-            elem->in_addr[elem->in_num] = vring_desc_addr(desc_pa, i);
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            elem->in_addr[elem->in_num] = desc.addr;
             sg = &elem->in_sg[elem->in_num++];
         } else {
-            elem->out_addr[elem->out_num] = vring_desc_addr(desc_pa, i);
+            elem->out_addr[elem->out_num] = desc.addr;
             sg = &elem->out_sg[elem->out_num++];
         }
 
-        sg->iov_len = vring_desc_len(desc_pa, i);
+        sg->iov_len = desc.len;
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(table, desc_pa, i, &desc);
+        }
+    } while (i != max);
+
+    if (indirect) {
+        vring_unmap(table, table_len);
+    }
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -472,6 +639,7 @@ void virtio_reset(void *opaque)
     virtio_notify_vector(vdev, vdev->config_vector);
 
     for(i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap(&vdev->vq[i]);
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
@@ -614,6 +782,32 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     return &vdev->vq[i];
 }
 
+/* Frees queue n; virtio_add_queue hands out the lowest free queue first */
+void virtio_del_queue(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq;
+
+    if (n < 0 || n >= VIRTIO_PCI_QUEUE_MAX) {
+        abort();
+    }
+
+    vq = &vdev->vq[n];
+    virtqueue_unmap(vq);
+    vq->vring.num = 0;
+    vq->vring.desc = 0;
+    vq->vring.avail = 0;
+    vq->vring.used = 0;
+    vq->last_avail_idx = 0;
+    vq->pa = 0;
+    vq->vector = VIRTIO_NO_VECTOR;
+    vq->handle_output = NULL;
+}
+
+int virtio_get_queue_index(VirtQueue *vq)
+{
+    return vq - vq->vdev->vq;
+}
+
 void virtio_irq(VirtQueue *vq)
 {
     trace_virtio_irq(vq);
@@ -623,6 +817,9 @@ void virtio_irq(VirtQueue *vq)
 
 void virtio_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
+    /* The used index must be visible before we look at the flags. */
+    smp_mb();
+
     /* Always notify when queue is empty (when feature acknowledge) */
     if ((vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT) &&
         (!(vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) ||
@@ -743,6 +940,11 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_unmap(&vdev->vq[i]);
+    }
     if (vdev->config)
         qemu_free(vdev->config);
     qemu_free(vdev->vq);
@@ -751,9 +953,15 @@ void virtio_cleanup(VirtIODevice *vdev)
 VirtIODevice *virtio_common_init(const char *name, uint16_t device_id,
                                  size_t config_size, size_t struct_size)
 {
+    static int memory_client_registered;
     VirtIODevice *vdev;
     int i;
 
+    if (!memory_client_registered) {
+        cpu_register_phys_memory_client(&virtio_memory_client);
+        memory_client_registered = 1;
+    }
+
     vdev = qemu_mallocz(struct_size);
 
     vdev->device_id = device_id;
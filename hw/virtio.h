@@ -136,6 +136,8 @@ static inline void virtio_set_status(VirtIODevice *vdev, uint8_t val)
 VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
                             void (*handle_output)(VirtIODevice *,
                                                   VirtQueue *));
+void virtio_del_queue(VirtIODevice *vdev, int n);
+int virtio_get_queue_index(VirtQueue *vq);
 
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len);
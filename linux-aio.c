@@ -16,12 +16,12 @@
 #include <libaio.h>
 
 /*
- * Queue size (per-device).
+ * Default queue size (per-device), see the aio-queue-depth drive option.
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
  *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      than this, io_submit fails with EAGAIN and the requests are kept back
+ *      until some of the outstanding ones complete.
  */
 #define MAX_EVENTS 128
 
@@ -32,6 +32,7 @@ struct qemu_laiocb {
     ssize_t ret;
     size_t nbytes;
     int async_context_id;
+    bool queued;        /* in the plug queue, not yet submitted */
     QLIST_ENTRY(qemu_laiocb) node;
 };
 
@@ -40,6 +41,13 @@ struct qemu_laio_state {
     int efd;
     int count;
     QLIST_HEAD(, qemu_laiocb) completed_reqs;
+
+    /* Requests are held back while plugged and submitted in one batch */
+    int plugged;
+    int max_requests;
+    int nb_pending;
+    int pending_size;
+    struct iocb **pending;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -110,6 +118,65 @@ static void qemu_laio_enqueue_completed(struct qemu_laio_state *s,
     }
 }
 
+/*
+ * Submits the requests of the plug queue with as few io_submit calls as
+ * possible. If the ring is full, the remaining requests stay queued until
+ * some of the outstanding ones complete.
+ */
+static void laio_submit_pending(struct qemu_laio_state *s)
+{
+    QLIST_HEAD(, qemu_laiocb) failed_reqs = QLIST_HEAD_INITIALIZER(failed_reqs);
+    BlockDriverState *bs;
+    struct qemu_laiocb *laiocb, *next;
+    int done = 0, ret, i;
+
+    while (done < s->nb_pending) {
+        ret = io_submit(s->ctx, s->nb_pending - done, &s->pending[done]);
+        if (ret == -EINTR) {
+            continue;
+        }
+        if (ret == -EAGAIN && s->count > s->nb_pending - done) {
+            break;
+        }
+        if (ret <= 0) {
+            /* Fail everything that could not be submitted */
+            if (ret == 0) {
+                ret = -EIO;
+            }
+            for (i = done; i < s->nb_pending; i++) {
+                laiocb = container_of(s->pending[i], struct qemu_laiocb, iocb);
+                laiocb->queued = false;
+                laiocb->ret = ret;
+                QLIST_INSERT_HEAD(&failed_reqs, laiocb, node);
+            }
+            done = s->nb_pending;
+            break;
+        }
+
+        laiocb = container_of(s->pending[done], struct qemu_laiocb, iocb);
+        bs = laiocb->common.bs;
+        bs->aio_submits++;
+        bs->aio_submitted_reqs += ret;
+        if (ret > bs->aio_max_batch) {
+            bs->aio_max_batch = ret;
+        }
+        for (i = done; i < done + ret; i++) {
+            laiocb = container_of(s->pending[i], struct qemu_laiocb, iocb);
+            laiocb->queued = false;
+        }
+        done += ret;
+    }
+
+    s->nb_pending -= done;
+    memmove(s->pending, s->pending + done, s->nb_pending * sizeof(*s->pending));
+
+    /* The callbacks may submit new requests, so the queue must be consistent */
+    QLIST_FOREACH_SAFE(laiocb, &failed_reqs, node, next) {
+        QLIST_REMOVE(laiocb, node);
+        qemu_laio_enqueue_completed(s, laiocb);
+    }
+}
+
 static void qemu_laio_completion_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
@@ -131,25 +198,44 @@ static void qemu_laio_completion_cb(void *opaque)
         if (ret != 8)
             break;
 
-        do {
-            nevents = io_getevents(s->ctx, val, MAX_EVENTS, events, &ts);
-        } while (nevents == -EINTR);
-
-        for (i = 0; i < nevents; i++) {
-            struct iocb *iocb = events[i].obj;
-            struct qemu_laiocb *laiocb =
-                    container_of(iocb, struct qemu_laiocb, iocb);
-
-            laiocb->ret = io_event_ret(&events[i]);
-            qemu_laio_enqueue_completed(s, laiocb);
+        /* the queue may be deeper than what is reaped in one call */
+        while (val > 0) {
+            do {
+                nevents = io_getevents(s->ctx, MIN(val, MAX_EVENTS),
+                                       MAX_EVENTS, events, &ts);
+            } while (nevents == -EINTR);
+
+            if (nevents <= 0) {
+                break;
+            }
+
+            for (i = 0; i < nevents; i++) {
+                struct iocb *iocb = events[i].obj;
+                struct qemu_laiocb *laiocb =
+                        container_of(iocb, struct qemu_laiocb, iocb);
+
+                laiocb->ret = io_event_ret(&events[i]);
+                qemu_laio_enqueue_completed(s, laiocb);
+            }
+            val -= MIN(val, nevents);
         }
     }
+
+    /* Requests that did not fit in the ring before may go now */
+    if (s->nb_pending > 0 && !s->plugged) {
+        laio_submit_pending(s);
+    }
 }
 
 static int qemu_laio_flush_cb(void *opaque)
 {
     struct qemu_laio_state *s = opaque;
 
+    /* Somebody waits for completions: don't keep requests back any more */
+    if (s->nb_pending > 0) {
+        laio_submit_pending(s);
+    }
+
     return (s->count > 0) ? 1 : 0;
 }
 
@@ -162,6 +248,21 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    if (laiocb->queued) {
+        struct qemu_laio_state *s = laiocb->ctx;
+        int i;
+
+        for (i = 0; s->pending[i] != &laiocb->iocb; i++) {
+            /* nothing */
+        }
+        s->nb_pending--;
+        memmove(&s->pending[i], &s->pending[i + 1],
+                (s->nb_pending - i) * sizeof(*s->pending));
+        s->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -223,29 +324,74 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, s->efd);
     s->count++;
 
+    /* Requests kept back because the ring was full go first */
+    if (s->plugged || s->nb_pending > 0) {
+        if (s->nb_pending == s->pending_size) {
+            s->pending_size *= 2;
+            s->pending = qemu_realloc(s->pending,
+                                      s->pending_size * sizeof(*s->pending));
+        }
+        laiocb->queued = true;
+        s->pending[s->nb_pending++] = iocbs;
+        if (!s->plugged || s->nb_pending >= s->max_requests) {
+            laio_submit_pending(s);
+        }
+        return &laiocb->common;
+    }
+
     if (io_submit(s->ctx, 1, &iocbs) < 0)
         goto out_dec_count;
+    bs->aio_submits++;
+    bs->aio_submitted_reqs++;
+    if (bs->aio_max_batch == 0) {
+        bs->aio_max_batch = 1;
+    }
     return &laiocb->common;
 
-out_free_aiocb:
-    qemu_aio_release(laiocb);
 out_dec_count:
     s->count--;
+out_free_aiocb:
+    qemu_aio_release(laiocb);
     return NULL;
 }
 
-void *laio_init(void)
+/*
+ * While plugged, requests are only queued; they are submitted together when
+ * the last user unplugs, or earlier if the queue fills up or somebody waits
+ * for AIO completion.
+ */
+void laio_io_plug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->plugged++;
+}
+
+void laio_io_unplug(void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->plugged > 0);
+    if (--s->plugged == 0 && s->nb_pending > 0) {
+        laio_submit_pending(s);
+    }
+}
+
+void *laio_init(int max_requests)
 {
     struct qemu_laio_state *s;
 
     s = qemu_mallocz(sizeof(*s));
     QLIST_INIT(&s->completed_reqs);
+    s->max_requests = max_requests > 0 ? max_requests : MAX_EVENTS;
+    s->pending_size = s->max_requests;
+    s->pending = qemu_mallocz(s->pending_size * sizeof(*s->pending));
     s->efd = eventfd(0, 0);
     if (s->efd == -1)
         goto out_free_state;
     fcntl(s->efd, F_SETFL, O_NONBLOCK);
 
-    if (io_setup(MAX_EVENTS, &s->ctx) != 0)
+    if (io_setup(s->max_requests, &s->ctx) != 0)
         goto out_close_efd;
 
     qemu_aio_set_fd_handler(s->efd, qemu_laio_completion_cb, NULL,
@@ -256,6 +402,7 @@ void *laio_init(void)
 out_close_efd:
     close(s->efd);
 out_free_state:
+    qemu_free(s->pending);
     qemu_free(s);
     return NULL;
 }
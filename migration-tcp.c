@@ -105,8 +105,12 @@ MigrationState *tcp_start_outgoing_migration(Monitor *mon,
     s->state = MIG_STATE_ACTIVE;
     s->mon = NULL;
     s->bandwidth_limit = bandwidth_limit;
+    s->stream_addr = qemu_malloc(sizeof(addr));
+    memcpy(s->stream_addr, &addr, sizeof(addr));
+    s->stream_addrlen = sizeof(addr);
     s->fd = qemu_socket(PF_INET, SOCK_STREAM, 0);
     if (s->fd == -1) {
+        qemu_free(s->stream_addr);
         qemu_free(s);
         return NULL;
     }
@@ -141,7 +145,7 @@ static void tcp_accept_incoming_migration(void *opaque)
     socklen_t addrlen = sizeof(addr);
     int s = (unsigned long)opaque;
     QEMUFile *f;
-    int c;
+    int c, ret;
 
     do {
         c = qemu_accept(s, (struct sockaddr *)&addr, &addrlen);
@@ -160,7 +164,14 @@ static void tcp_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
+    /* more streams may connect to the same socket */
+    migrate_incoming_set_listener(s);
+    ret = process_incoming_migration(f, c);
+    migrate_incoming_set_listener(-1);
+    if (ret) {
+        /* post-copy: the stream is read in the background */
+        goto out2;
+    }
     qemu_fclose(f);
 out:
     close(c);
@@ -190,7 +201,7 @@ int tcp_start_incoming_migration(const char *host_port)
     if (bind(s, (struct sockaddr *)&addr, sizeof(addr)) == -1)
         goto err;
 
-    if (listen(s, 1) == -1)
+    if (listen(s, MIGRATE_MAX_STREAMS) == -1)
         goto err;
 
     qemu_set_fd_handler2(s, NULL, tcp_accept_incoming_migration, NULL,
@@ -104,6 +104,9 @@ MigrationState *unix_start_outgoing_migration(Monitor *mon,
     s->state = MIG_STATE_ACTIVE;
     s->mon = NULL;
     s->bandwidth_limit = bandwidth_limit;
+    s->stream_addr = qemu_malloc(sizeof(addr));
+    memcpy(s->stream_addr, &addr, sizeof(addr));
+    s->stream_addrlen = sizeof(addr);
     s->fd = qemu_socket(PF_UNIX, SOCK_STREAM, 0);
     if (s->fd < 0) {
         DPRINTF("Unable to open socket");
@@ -139,6 +142,7 @@ err_after_open:
     close(s->fd);
 
 err_after_alloc:
+    qemu_free(s->stream_addr);
     qemu_free(s);
     return NULL;
 }
@@ -168,12 +172,21 @@ static void unix_accept_incoming_migration(void *opaque)
         goto out;
     }
 
-    process_incoming_migration(f);
-    qemu_fclose(f);
+    /* more streams may connect to the same socket */
+    migrate_incoming_set_listener(s);
+    if (process_incoming_migration(f, c)) {
+        /* post-copy: the stream is read in the background */
+        c = -1;
+    } else {
+        qemu_fclose(f);
+    }
+    migrate_incoming_set_listener(-1);
 out:
     qemu_set_fd_handler2(s, NULL, NULL, NULL, NULL);
     close(s);
-    close(c);
+    if (c != -1) {
+        close(c);
+    }
 }
 
 int unix_start_incoming_migration(const char *path)
@@ -198,7 +211,7 @@ int unix_start_incoming_migration(const char *path)
         fprintf(stderr, "bind(unix:%s): %s\n", un.sun_path, strerror(errno));
         goto err;
     }
-    if (listen(sock, 1) < 0) {
+    if (listen(sock, MIGRATE_MAX_STREAMS) < 0) {
         fprintf(stderr, "listen(unix:%s): %s\n", un.sun_path, strerror(errno));
         goto err;
     }
@@ -20,6 +20,7 @@
 #include "qemu_socket.h"
 #include "block-migration.h"
 #include "qemu-objects.h"
+#include "qerror.h"
 
 //#define DEBUG_MIGRATION
 
@@ -36,6 +37,9 @@ static int64_t max_throttle = (32 << 20);
 
 static MigrationState *current_migration;
 
+/* the migration in progress is a post-copy one */
+static int postcopy;
+
 int qemu_start_incoming_migration(const char *uri)
 {
     const char *p;
@@ -58,12 +62,31 @@ int qemu_start_incoming_migration(const char *uri)
     return ret;
 }
 
-void process_incoming_migration(QEMUFile *f)
+/*
+ * Returns 1 for a post-copy migration, whose pages keep coming from f in
+ * the background: f and fd, the socket it reads from, are not to be
+ * closed by the caller.
+ */
+int process_incoming_migration(QEMUFile *f, int fd)
 {
+    int ret = 0;
+
     if (qemu_loadvm_state(f) < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(0);
     }
+
+    if (ram_postcopy_incoming()) {
+        if (ram_postcopy_incoming_start(f, fd) < 0) {
+            fprintf(stderr, "load of migration failed\n");
+            exit(0);
+        }
+        ret = 1;
+    }
+    if (qemu_loadvm_state_deferred() < 0) {
+        fprintf(stderr, "load of migration failed\n");
+        exit(0);
+    }
     qemu_announce_self();
     DPRINTF("successfully loaded vm state\n");
 
@@ -71,6 +94,7 @@ void process_incoming_migration(QEMUFile *f)
 
     if (autostart)
         vm_start();
+    return ret;
 }
 
 int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
@@ -80,6 +104,7 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
     int detach = qdict_get_try_bool(qdict, "detach", 0);
     int blk = qdict_get_try_bool(qdict, "blk", 0);
     int inc = qdict_get_try_bool(qdict, "inc", 0);
+    int pc = qdict_get_try_bool(qdict, "postcopy", 0);
     const char *uri = qdict_get_str(qdict, "uri");
 
     if (current_migration &&
@@ -88,6 +113,17 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
         return -1;
     }
 
+    if (pc && (blk || inc)) {
+        monitor_printf(mon, "post-copy migration can't copy disks\n");
+        return -1;
+    }
+    if (pc && !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        monitor_printf(mon, "post-copy migration needs a tcp or unix "
+                       "socket\n");
+        return -1;
+    }
+    postcopy = pc;
+
     if (strstart(uri, "tcp:", &p)) {
         s = tcp_start_outgoing_migration(mon, p, max_throttle, detach,
                                          blk, inc);
@@ -109,6 +145,7 @@ int do_migrate(Monitor *mon, const QDict *qdict, QObject **ret_data)
 
     if (s == NULL) {
         monitor_printf(mon, "migration failed\n");
+        postcopy = 0;
         return -1;
     }
 
@@ -124,12 +161,20 @@ int do_migrate_cancel(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     MigrationState *s = current_migration;
 
-    if (s)
-        s->cancel(s);
+    if (s && s->cancel(s) < 0) {
+        monitor_printf(mon, "the guest runs on the destination already, "
+                       "post-copy migration can't be cancelled\n");
+        return -1;
+    }
 
     return 0;
 }
 
+int migrate_postcopy(void)
+{
+    return postcopy;
+}
+
 int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data)
 {
     int64_t d;
@@ -172,6 +217,151 @@ int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
     return 0;
 }
 
+/* pages are compressed by this many threads, none by default */
+static int compress_threads;
+static int compress_level = 1;
+
+int migrate_compress_threads(void)
+{
+    return compress_threads;
+}
+
+int migrate_compress_level(void)
+{
+    return compress_level;
+}
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data)
+{
+    int64_t threads = qdict_get_int(qdict, "threads");
+    int64_t level = qdict_get_try_int(qdict, "level", 1);
+
+    if (threads < 0 || threads > MIGRATE_MAX_COMPRESS_THREADS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "threads",
+                      "a number of threads between 0 and 64");
+        return -1;
+    }
+    if (level < 1 || level > 9) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "level",
+                      "a compression level between 1 and 9");
+        return -1;
+    }
+
+    compress_threads = threads;
+    compress_level = level;
+    return 0;
+}
+
+/* size in bytes of the cache of sent pages, 0 disables delta encoding */
+static int64_t xbzrle_cache_size;
+
+int64_t migrate_xbzrle_cache_size(void)
+{
+    return xbzrle_cache_size;
+}
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data)
+{
+    int64_t value = qdict_get_int(qdict, "value");
+
+    if (value < 0) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "value",
+                      "a positive cache size");
+        return -1;
+    }
+
+    xbzrle_cache_size = value;
+    return 0;
+}
+
+/* number of connections that RAM pages are sent over */
+static int migration_streams = 1;
+
+int migrate_streams(void)
+{
+    return migration_streams;
+}
+
+int do_migrate_set_streams(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data)
+{
+    int64_t count = qdict_get_int(qdict, "count");
+
+    if (count < 1 || count > MIGRATE_MAX_STREAMS) {
+        qerror_report(QERR_INVALID_PARAMETER_VALUE, "count",
+                      "a number of streams between 1 and 16");
+        return -1;
+    }
+
+    migration_streams = count;
+    return 0;
+}
+
+/* the last migration started, which may not be current_migration yet */
+static FdMigrationState *connected_migration;
+
+/*
+ * Copies the address that the migration writing to f is connected to, so
+ * that more streams can be opened.  Returns -1 if there is none.
+ */
+int migrate_stream_address(QEMUFile *f, void *addr, int *addrlen)
+{
+    FdMigrationState *s = connected_migration;
+
+    if (!s || s->file != f || !s->stream_addr ||
+        *addrlen < s->stream_addrlen) {
+        return -1;
+    }
+
+    memcpy(addr, s->stream_addr, s->stream_addrlen);
+    *addrlen = s->stream_addrlen;
+    return 0;
+}
+
+/* the socket that the incoming migration came from, -1 if none */
+static int incoming_listen_fd = -1;
+
+void migrate_incoming_set_listener(int fd)
+{
+    incoming_listen_fd = fd;
+}
+
+/* how long the source gets to open each of its other streams */
+#define STREAM_ACCEPT_TIMEOUT   10      /* seconds */
+
+/*
+ * Waits for another stream of the incoming migration.  Returns -1 if none
+ * comes within STREAM_ACCEPT_TIMEOUT.
+ */
+int migrate_incoming_accept_stream(void)
+{
+    struct timeval tv;
+    fd_set rfds;
+    int fd, ret;
+
+    if (incoming_listen_fd == -1) {
+        return -1;
+    }
+
+    tv.tv_sec = STREAM_ACCEPT_TIMEOUT;
+    tv.tv_usec = 0;
+    do {
+        FD_ZERO(&rfds);
+        FD_SET(incoming_listen_fd, &rfds);
+        ret = select(incoming_listen_fd + 1, &rfds, NULL, NULL, &tv);
+    } while (ret == -1 && socket_error() == EINTR);
+    if (ret <= 0) {
+        return -1;
+    }
+
+    do {
+        fd = qemu_accept(incoming_listen_fd, NULL, NULL);
+    } while (fd == -1 && socket_error() == EINTR);
+    return fd;
+}
+
 static void migrate_print_status(Monitor *mon, const char *name,
                                  const QDict *status_dict)
 {
@@ -203,6 +393,43 @@ void do_info_migrate_print(Monitor *mon, const QObject *data)
     if (qdict_haskey(qdict, "disk")) {
         migrate_print_status(mon, "disk", qdict);
     }
+
+    if (qdict_haskey(qdict, "compression")) {
+        QDict *comp = qobject_to_qdict(qdict_get(qdict, "compression"));
+
+        monitor_printf(mon, "compressed pages: %" PRIu64 "\n",
+                       qdict_get_int(comp, "pages"));
+        monitor_printf(mon, "compression ratio: %" PRIu64 "%%\n",
+                       qdict_get_int(comp, "ratio"));
+        monitor_printf(mon, "compression throughput: %" PRIu64
+                       " kbytes/s\n", qdict_get_int(comp, "throughput") >> 10);
+    }
+
+    if (qdict_haskey(qdict, "postcopy")) {
+        QDict *pc = qobject_to_qdict(qdict_get(qdict, "postcopy"));
+
+        monitor_printf(mon, "post-copy: %s\n",
+                       qdict_get_bool(pc, "active") ? "active" : "waiting");
+        monitor_printf(mon, "post-copy requested pages: %" PRIu64 "\n",
+                       qdict_get_int(pc, "requested"));
+        monitor_printf(mon, "post-copy pushed pages: %" PRIu64 "\n",
+                       qdict_get_int(pc, "pushed"));
+    }
+
+    if (qdict_haskey(qdict, "xbzrle")) {
+        QDict *xbzrle = qobject_to_qdict(qdict_get(qdict, "xbzrle"));
+
+        monitor_printf(mon, "delta encoded pages: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "pages"));
+        monitor_printf(mon, "page cache hits: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "cache-hits"));
+        monitor_printf(mon, "page cache misses: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "cache-misses"));
+        monitor_printf(mon, "delta encoding overflows: %" PRIu64 "\n",
+                       qdict_get_int(xbzrle, "overflows"));
+        monitor_printf(mon, "delta encoding saved: %" PRIu64 " kbytes\n",
+                       qdict_get_int(xbzrle, "saved") >> 10);
+    }
 }
 
 static void migrate_put_status(QDict *qdict, const char *name,
@@ -236,6 +463,44 @@ void do_info_migrate(Monitor *mon, QObject **ret_data)
                                    blk_mig_bytes_total());
             }
 
+            if (compress_threads) {
+                uint64_t pages, ratio, throughput;
+
+                ram_compress_stats(&pages, &ratio, &throughput);
+                qdict_put_obj(qdict, "compression",
+                              qobject_from_jsonf("{ 'pages': %" PRId64 ", "
+                                                 "'ratio': %" PRId64 ", "
+                                                 "'throughput': %" PRId64 " }",
+                                                 pages, ratio, throughput));
+            }
+
+            if (postcopy) {
+                FdMigrationState *fms = migrate_to_fms(s);
+                uint64_t requested, pushed;
+
+                ram_postcopy_stats(&requested, &pushed);
+                qdict_put_obj(qdict, "postcopy",
+                              qobject_from_jsonf("{ 'active': %i, "
+                                                 "'requested': %" PRId64 ", "
+                                                 "'pushed': %" PRId64 " }",
+                                                 fms->postcopy_active,
+                                                 requested, pushed));
+            }
+
+            if (xbzrle_cache_size) {
+                uint64_t pages, hits, misses, overflows, saved;
+
+                ram_xbzrle_stats(&pages, &hits, &misses, &overflows, &saved);
+                qdict_put_obj(qdict, "xbzrle",
+                              qobject_from_jsonf("{ 'pages': %" PRId64 ", "
+                                                 "'cache-hits': %" PRId64 ", "
+                                                 "'cache-misses': %" PRId64 ", "
+                                                 "'overflows': %" PRId64 ", "
+                                                 "'saved': %" PRId64 " }",
+                                                 pages, hits, misses,
+                                                 overflows, saved));
+            }
+
             *ret_data = QOBJECT(qdict);
             break;
         case MIG_STATE_COMPLETED:
@@ -276,6 +541,7 @@ int migrate_fd_cleanup(FdMigrationState *s)
     int ret = 0;
 
     qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    postcopy = 0;
 
     if (s->file) {
         DPRINTF("closing file\n");
@@ -298,11 +564,22 @@ int migrate_fd_cleanup(FdMigrationState *s)
     return ret;
 }
 
+static void migrate_fd_postcopy_read(void *opaque);
+
+/* Page requests are read while the stream waits to be writable */
+static void migrate_fd_set_handlers(FdMigrationState *s)
+{
+    qemu_set_fd_handler2(s->fd, NULL,
+                         s->postcopy_active ? migrate_fd_postcopy_read : NULL,
+                         s->write_blocked ? migrate_fd_put_notify : NULL, s);
+}
+
 void migrate_fd_put_notify(void *opaque)
 {
     FdMigrationState *s = opaque;
 
-    qemu_set_fd_handler2(s->fd, NULL, NULL, NULL, NULL);
+    s->write_blocked = 0;
+    migrate_fd_set_handlers(s);
     qemu_file_put_notify(s->file);
 }
 
@@ -319,7 +596,8 @@ ssize_t migrate_fd_put_buffer(void *opaque, const void *data, size_t size)
         ret = -(s->get_error(s));
 
     if (ret == -EAGAIN) {
-        qemu_set_fd_handler2(s->fd, NULL, NULL, migrate_fd_put_notify, s);
+        s->write_blocked = 1;
+        migrate_fd_set_handlers(s);
     } else if (ret < 0) {
         if (s->mon) {
             monitor_resume(s->mon);
@@ -340,6 +618,7 @@ void migrate_fd_connect(FdMigrationState *s)
                                       migrate_fd_put_ready,
                                       migrate_fd_wait_for_unfreeze,
                                       migrate_fd_close);
+    connected_migration = s;
 
     DPRINTF("beginning savevm\n");
     ret = qemu_savevm_state_begin(s->mon, s->file, s->mig_state.blk,
@@ -353,6 +632,77 @@ void migrate_fd_connect(FdMigrationState *s)
     migrate_fd_put_ready(s);
 }
 
+/*
+ * Post-copy: the guest is stopped as soon as the first stage is out, and
+ * its devices sent to the destination which then runs it.  The pages
+ * that it asks for are sent as the requests come, the others within the
+ * rate limit.
+ */
+static void migrate_fd_postcopy_start(FdMigrationState *s)
+{
+    int old_vm_running = vm_running;
+
+    DPRINTF("starting post-copy\n");
+    vm_stop(0);
+
+    if (qemu_savevm_state_complete_deferred(s->mon, s->file) < 0) {
+        if (old_vm_running) {
+            vm_start();
+        }
+        migrate_fd_error(s);
+        return;
+    }
+
+    s->postcopy_active = 1;
+    migrate_fd_set_handlers(s);
+}
+
+static void migrate_fd_postcopy_read(void *opaque)
+{
+    FdMigrationState *s = opaque;
+    ssize_t len;
+    int used;
+
+    do {
+        len = recv(s->fd, s->postcopy_req + s->postcopy_req_len,
+                   sizeof(s->postcopy_req) - s->postcopy_req_len, 0);
+    } while (len == -1 && socket_error() == EINTR);
+
+    if (len == -1 && socket_error() == EAGAIN) {
+        return;
+    }
+    if (len <= 0) {
+        DPRINTF("destination went away during post-copy\n");
+        migrate_fd_error(s);
+        return;
+    }
+
+    s->postcopy_req_len += len;
+    used = ram_postcopy_handle_requests(s->file, s->postcopy_req,
+                                        s->postcopy_req_len);
+    if (used < 0) {
+        DPRINTF("invalid page request\n");
+        migrate_fd_error(s);
+        return;
+    }
+    s->postcopy_req_len -= used;
+    memmove(s->postcopy_req, s->postcopy_req + used, s->postcopy_req_len);
+
+    /* the destination is waiting for these pages */
+    qemu_fflush(s->file);
+}
+
+static void migrate_fd_postcopy_push(FdMigrationState *s)
+{
+    if (ram_postcopy_push(s->file) == 0) {
+        return;
+    }
+
+    DPRINTF("post-copy done\n");
+    s->state = migrate_fd_cleanup(s) < 0 ? MIG_STATE_ERROR :
+                                            MIG_STATE_COMPLETED;
+}
+
 void migrate_fd_put_ready(void *opaque)
 {
     FdMigrationState *s = opaque;
@@ -362,6 +712,15 @@ void migrate_fd_put_ready(void *opaque)
         return;
     }
 
+    if (s->postcopy_active) {
+        migrate_fd_postcopy_push(s);
+        return;
+    }
+    if (postcopy) {
+        migrate_fd_postcopy_start(s);
+        return;
+    }
+
     DPRINTF("iterate\n");
     if (qemu_savevm_state_iterate(s->mon, s->file) == 1) {
         int state;
@@ -394,12 +753,17 @@ int migrate_fd_get_status(MigrationState *mig_state)
     return s->state;
 }
 
-void migrate_fd_cancel(MigrationState *mig_state)
+int migrate_fd_cancel(MigrationState *mig_state)
 {
     FdMigrationState *s = migrate_to_fms(mig_state);
 
     if (s->state != MIG_STATE_ACTIVE)
-        return;
+        return 0;
+
+    /* the guest is running on the destination already */
+    if (s->postcopy_active) {
+        return -EBUSY;
+    }
 
     DPRINTF("cancelling migration\n");
 
@@ -407,6 +771,7 @@ void migrate_fd_cancel(MigrationState *mig_state)
     qemu_savevm_state_cancel(s->mon, s->file);
 
     migrate_fd_cleanup(s);
+    return 0;
 }
 
 void migrate_fd_release(MigrationState *mig_state)
@@ -419,6 +784,10 @@ void migrate_fd_release(MigrationState *mig_state)
         s->state = MIG_STATE_CANCELLED;
         migrate_fd_cleanup(s);
     }
+    if (connected_migration == s) {
+        connected_migration = NULL;
+    }
+    qemu_free(s->stream_addr);
     qemu_free(s);
 }
 
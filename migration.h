@@ -27,7 +27,7 @@ typedef struct MigrationState MigrationState;
 struct MigrationState
 {
     /* FIXME: add more accessors to print migration info */
-    void (*cancel)(MigrationState *s);
+    int (*cancel)(MigrationState *s);
     int (*get_status)(MigrationState *s);
     void (*release)(MigrationState *s);
     int blk;
@@ -44,13 +44,19 @@ struct FdMigrationState
     int fd;
     Monitor *mon;
     int state;
+    int write_blocked;
+    int postcopy_active;            /* the destination runs the guest */
+    uint8_t postcopy_req[512];      /* page requests read so far */
+    int postcopy_req_len;
+    void *stream_addr;              /* to connect more streams to */
+    int stream_addrlen;
     int (*get_error)(struct FdMigrationState*);
     int (*close)(struct FdMigrationState*);
     int (*write)(struct FdMigrationState*, const void *, size_t);
     void *opaque;
 };
 
-void process_incoming_migration(QEMUFile *f);
+int process_incoming_migration(QEMUFile *f, int fd);
 
 int qemu_start_incoming_migration(const char *uri);
 
@@ -62,6 +68,35 @@ int do_migrate_set_speed(Monitor *mon, const QDict *qdict, QObject **ret_data);
 
 uint64_t migrate_max_downtime(void);
 
+int migrate_postcopy(void);
+
+#define MIGRATE_MAX_COMPRESS_THREADS 64
+
+int migrate_compress_threads(void);
+
+int migrate_compress_level(void);
+
+int do_migrate_set_compression(Monitor *mon, const QDict *qdict,
+                               QObject **ret_data);
+
+int64_t migrate_xbzrle_cache_size(void);
+
+#define MIGRATE_MAX_STREAMS 16
+
+int migrate_streams(void);
+
+int migrate_stream_address(QEMUFile *f, void *addr, int *addrlen);
+
+void migrate_incoming_set_listener(int fd);
+
+int migrate_incoming_accept_stream(void);
+
+int do_migrate_set_streams(Monitor *mon, const QDict *qdict,
+                           QObject **ret_data);
+
+int do_migrate_set_cache_size(Monitor *mon, const QDict *qdict,
+                              QObject **ret_data);
+
 int do_migrate_set_downtime(Monitor *mon, const QDict *qdict,
                             QObject **ret_data);
 
@@ -121,7 +156,7 @@ void migrate_fd_put_ready(void *opaque);
 
 int migrate_fd_get_status(MigrationState *mig_state);
 
-void migrate_fd_cancel(MigrationState *mig_state);
+int migrate_fd_cancel(MigrationState *mig_state);
 
 void migrate_fd_release(MigrationState *mig_state);
 
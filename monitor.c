@@ -468,6 +468,9 @@ void monitor_protocol_event(MonitorEvent event, QObject *data)
         case QEVENT_SPICE_DISCONNECTED:
             event_name = "SPICE_DISCONNECTED";
             break;
+        case QEVENT_BLOCK_STREAM_COMPLETED:
+            event_name = "BLOCK_STREAM_COMPLETED";
+            break;
         default:
             abort();
             break;
@@ -2819,6 +2822,14 @@ static const mon_cmd_t info_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-stream",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show active block streams",
+        .user_print = do_info_block_stream_print,
+        .mhandler.info_new = do_info_block_stream,
+    },
     {
         .name       = "registers",
         .args_type  = "",
@@ -3118,6 +3129,14 @@ static const mon_cmd_t qmp_query_cmds[] = {
         .user_print = bdrv_stats_print,
         .mhandler.info_new = bdrv_info_stats,
     },
+    {
+        .name       = "block-stream",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show active block streams",
+        .user_print = do_info_block_stream_print,
+        .mhandler.info_new = do_info_block_stream,
+    },
     {
         .name       = "cpus",
         .args_type  = "",
@@ -524,6 +524,31 @@ void qemu_flush_queued_packets(VLANClientState *vc)
     qemu_net_queue_flush(queue);
 }
 
+/*
+ * Brackets a burst of packets sent by 'sender'.  Receivers that implement
+ * receive_burst can hold back the guest notification until the end of
+ * the burst.
+ */
+void qemu_net_receive_burst(VLANClientState *sender, bool begin)
+{
+    VLANClientState *vc;
+
+    if (sender->peer) {
+        if (sender->peer->info->receive_burst) {
+            sender->peer->info->receive_burst(sender->peer, begin);
+        }
+        return;
+    }
+    if (!sender->vlan) {
+        return;
+    }
+    QTAILQ_FOREACH(vc, &sender->vlan->clients, next) {
+        if (vc != sender && vc->info->receive_burst) {
+            vc->info->receive_burst(vc, begin);
+        }
+    }
+}
+
 static ssize_t qemu_send_packet_async_with_flags(VLANClientState *sender,
                                                  unsigned flags,
                                                  const uint8_t *buf, int size,
@@ -651,9 +676,11 @@ static ssize_t qemu_vlan_deliver_packet_iov(VLANClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(VLANClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(VLANClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
 
@@ -667,9 +694,29 @@ ssize_t qemu_sendv_packet_async(VLANClientState *sender,
         queue = sender->vlan->send_queue;
     }
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
-                                   iov, iovcnt, sent_cb);
+    return qemu_net_queue_send_iov(queue, sender, flags, iov, iovcnt, sent_cb);
+}
+
+ssize_t qemu_sendv_packet_async(VLANClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender, QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/*
+ * Like qemu_sendv_packet_async, but the buffers must stay valid until
+ * sent_cb runs: a packet that can't be delivered right away is queued
+ * without copying it.
+ */
+ssize_t qemu_sendv_packet_zerocopy(VLANClientState *sender,
+                                   const struct iovec *iov, int iovcnt,
+                                   NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
 }
 
 ssize_t
@@ -1017,6 +1064,14 @@ static const struct {
                 .name = "vnet_hdr",
                 .type = QEMU_OPT_BOOL,
                 .help = "enable the IFF_VNET_HDR flag on the tap interface"
+            }, {
+                .name = "queues",
+                .type = QEMU_OPT_NUMBER,
+                .help = "number of queues of a multiqueue tap interface"
+            }, {
+                .name = "rx_burst",
+                .type = QEMU_OPT_NUMBER,
+                .help = "maximum number of packets read per wakeup"
             }, {
                 .name = "vhost",
                 .type = QEMU_OPT_BOOL,
@@ -1284,7 +1339,11 @@ void do_info_network(Monitor *mon)
         monitor_printf(mon, "VLAN %d devices:\n", vlan->id);
 
         QTAILQ_FOREACH(vc, &vlan->clients, next) {
-            monitor_printf(mon, "  %s: %s\n", vc->name, vc->info_str);
+            monitor_printf(mon, "  %s: %s", vc->name, vc->info_str);
+            if (vc->info->print_info) {
+                vc->info->print_info(vc, mon);
+            }
+            monitor_printf(mon, "\n");
         }
     }
     monitor_printf(mon, "Devices not on any VLAN:\n");
@@ -1293,6 +1352,9 @@ void do_info_network(Monitor *mon)
         if (vc->peer) {
             monitor_printf(mon, " peer=%s", vc->peer->name);
         }
+        if (vc->info->print_info) {
+            vc->info->print_info(vc, mon);
+        }
         monitor_printf(mon, "\n");
     }
 }
@@ -20,17 +20,30 @@
 #define PROTO_TCP  6
 #define PROTO_UDP 17
 
+/*
+ * Adds big-endian 32-bit words: as 2^16 == 1 modulo 0xffff, their sum
+ * folds to the same ones' complement sum as the 16-bit words.  The
+ * result is folded to 16 bits (plus carry), so that callers can keep
+ * adding partial sums in 32 bits.
+ */
 uint32_t net_checksum_add(int len, uint8_t *buf)
 {
-    uint32_t sum = 0;
+    uint64_t sum = 0;
     int i;
 
-    for (i = 0; i < len; i++) {
+    for (i = 0; i + 4 <= len; i += 4) {
+        sum += ((uint32_t)buf[i] << 24) | ((uint32_t)buf[i + 1] << 16) |
+               ((uint32_t)buf[i + 2] << 8) | buf[i + 3];
+    }
+    for (; i < len; i++) {
 	if (i & 1)
 	    sum += (uint32_t)buf[i];
 	else
 	    sum += (uint32_t)buf[i] << 8;
     }
+
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
     return sum;
 }
 
@@ -40,6 +40,10 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * A packet queued with a sent callback and QEMU_NET_PACKET_FLAG_ZEROCOPY
+ * only keeps a copy of the iovec; the data is read from the sender's
+ * buffers when the packet is finally delivered.
  */
 
 struct NetPacket {
@@ -48,6 +52,8 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    struct iovec *iov;          /* zero-copy packets only */
+    int iovcnt;
     uint8_t data[0];
 };
 
@@ -64,6 +70,7 @@ struct NetQueue {
 #else
     unsigned delivering : 1;
 #endif
+    unsigned flushing : 1;
 };
 
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
@@ -86,6 +93,12 @@ NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
     return queue;
 }
 
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    qemu_free(packet->iov);
+    qemu_free(packet);
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
@@ -94,7 +107,7 @@ void qemu_del_net_queue(NetQueue *queue)
 #endif
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        qemu_free(packet);
+        qemu_net_packet_free(packet);
     }
 #ifdef CONFIG_COREMU
     coremu_spin_unlock(&queue->nqlock);
@@ -117,6 +130,7 @@ static ssize_t qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
     memcpy(packet->data, buf, size);
 
 #ifdef CONFIG_COREMU
@@ -145,18 +159,27 @@ static ssize_t qemu_net_queue_append_iov(NetQueue *queue,
         max_len += iov[i].iov_len;
     }
 
-    packet = qemu_malloc(sizeof(NetPacket) + max_len);
+    if (sent_cb && (flags & QEMU_NET_PACKET_FLAG_ZEROCOPY)) {
+        packet = qemu_malloc(sizeof(NetPacket));
+        packet->iov = qemu_malloc(iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+        packet->size = max_len;
+    } else {
+        packet = qemu_malloc(sizeof(NetPacket) + max_len);
+        packet->iov = NULL;
+        packet->size = 0;
+
+        for (i = 0; i < iovcnt; i++) {
+            size_t len = iov[i].iov_len;
+
+            memcpy(packet->data + packet->size, iov[i].iov_base, len);
+            packet->size += len;
+        }
+    }
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
 
 #ifdef CONFIG_COREMU
     coremu_spin_lock(&queue->nqlock);
@@ -227,7 +250,9 @@ ssize_t qemu_net_queue_send(NetQueue *queue,
         return 0;
     }
 
-    qemu_net_queue_flush(queue);
+    if (!queue->flushing) {
+        qemu_net_queue_flush(queue);
+    }
 
     return ret;
 }
@@ -251,7 +276,9 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
         return 0;
     }
 
-    qemu_net_queue_flush(queue);
+    if (!queue->flushing) {
+        qemu_net_queue_flush(queue);
+    }
 
     return ret;
 }
@@ -267,7 +294,7 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
-            qemu_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 
@@ -277,8 +304,18 @@ void qemu_net_queue_purge(NetQueue *queue, VLANClientState *from)
 
 }
 
+/*
+ * A sent callback usually sends the sender's next packet.  The loop below
+ * picks up whatever is queued meanwhile, so that send doesn't start a
+ * nested flush for every packet.
+ */
 void qemu_net_queue_flush(NetQueue *queue)
 {
+    if (queue->flushing) {
+        return;
+    }
+    queue->flushing = 1;
+
     while (!QTAILQ_EMPTY(&queue->packets)) {
         NetPacket *packet;
         int ret;
@@ -288,11 +325,19 @@ void qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         coremu_spin_unlock(&queue->nqlock);
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             coremu_spin_lock(&queue->nqlock);
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -305,6 +350,8 @@ void qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        qemu_free(packet);
+        qemu_net_packet_free(packet);
     }
+
+    queue->flushing = 0;
 }
@@ -45,6 +45,9 @@ typedef ssize_t (NetPacketDeliverIOV) (VLANClientState *sender,
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The sender keeps the buffers alive until its sent callback runs, so a
+ * packet that has to wait in the queue is queued by reference */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(NetPacketDeliver *deliver,
                              NetPacketDeliverIOV *deliver_iov,
@@ -37,7 +37,8 @@
 #include <util.h>
 #endif
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     int fd;
     char *dev;
@@ -97,6 +98,12 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
             return -1;
         }
     }
+
+    if (mq_required) {
+        error_report("multiqueue tap is not supported on this host");
+        close(fd);
+        return -1;
+    }
     fcntl(fd, F_SETFL, O_NONBLOCK);
     return fd;
 }
@@ -35,6 +35,7 @@
 /* TUNSETIFF ifr flags */
 #define IFF_TAP		0x0002
 #define IFF_NO_PI	0x1000
+#define IFF_MULTI_QUEUE	0x0100
 #define IFF_VNET_HDR	0x4000
 
 /* Features for GSO (TUNSETOFFLOAD). */
@@ -173,7 +173,8 @@ static int tap_alloc(char *dev, size_t dev_size)
     return tap_fd;
 }
 
-int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required)
+int tap_open(char *ifname, int ifname_size, int *vnet_hdr,
+             int vnet_hdr_required, int mq_required)
 {
     char  dev[10]="";
     int fd;
@@ -193,6 +194,12 @@ int tap_open(char *ifname, int ifname_size, int *vnet_hdr, int vnet_hdr_required
             return -1;
         }
     }
+
+    if (mq_required) {
+        error_report("multiqueue tap is not supported on this host");
+        close(fd);
+        return -1;
+    }
     fcntl(fd, F_SETFL, O_NONBLOCK);
     return fd;
 }
@@ -749,3 +749,19 @@ struct vhost_net *tap_get_vhost_net(VLANClientState *nc)
 {
     return NULL;
 }
+
+int tap_get_queues(VLANClientState *vc)
+{
+    return 1;
+}
+
+VLANClientState *tap_get_queue(VLANClientState *vc, int index)
+{
+    return index == 0 ? vc : NULL;
+}
+
+ssize_t tap_sendv_wait(VLANClientState *vc, const struct iovec *iov,
+                       int iovcnt, int cancel_fd)
+{
+    return -1;
+}
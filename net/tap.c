@@ -30,6 +30,7 @@
 #include "config-host.h"
 
 #include <signal.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
@@ -41,6 +42,7 @@
 #include "qemu-char.h"
 #include "qemu-common.h"
 #include "qemu-error.h"
+#include "monitor.h"
 
 #include "net/tap-linux.h"
 
@@ -51,6 +53,9 @@
  */
 #define TAP_BUFSIZE (4096 + 65536)
 
+/* Bursts of 1, 2-3, 4-7, ..., 32-63 and 64 or more packets */
+#define TAP_BURST_BUCKETS 7
+
 typedef struct TAPState {
     VLANClientState nc;
     pthread_mutex_t lock;
@@ -64,10 +69,62 @@ typedef struct TAPState {
     unsigned int has_ufo: 1;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    /* with queues=N, queue 0 owns the other queues of the interface */
+    struct TAPState *queue0;
+    struct TAPState *queues[TAP_MAX_QUEUES];
+    int nb_queues;
+    int queue_index;
+    int rx_burst;               /* packets read per wakeup */
+    uint64_t rx_burst_hist[TAP_BURST_BUCKETS];
 } TAPState;
 
 static int launch_script(const char *setup_script, const char *ifname, int fd);
 
+/*
+ * Sends a packet from a thread other than the I/O thread.  The packet does
+ * not go through the send queue; while the device is full the caller waits,
+ * until cancel_fd becomes readable.  The caller must make sure that the
+ * device isn't cleaned up meanwhile, e.g. by waiting for the send to return
+ * when its peer's link goes down.
+ */
+ssize_t tap_sendv_wait(VLANClientState *nc, const struct iovec *iov,
+                       int iovcnt, int cancel_fd)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    const struct iovec *iovp = iov;
+    struct iovec iov_copy[iovcnt + 1];
+    struct virtio_net_hdr_mrg_rxbuf hdr = { };
+    struct pollfd pfd[2];
+    ssize_t len;
+
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+
+    if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
+        iov_copy[0].iov_base = &hdr;
+        iov_copy[0].iov_len =  s->host_vnet_hdr_len;
+        memcpy(&iov_copy[1], iov, iovcnt * sizeof(*iov));
+        iovp = iov_copy;
+        iovcnt++;
+    }
+
+    for (;;) {
+        len = writev(s->fd, iovp, iovcnt);
+        if (len >= 0 || (errno != EINTR && errno != EAGAIN)) {
+            return len;
+        }
+        if (errno == EAGAIN) {
+            pfd[0].fd = s->fd;
+            pfd[0].events = POLLOUT;
+            pfd[1].fd = cancel_fd;
+            pfd[1].events = POLLIN;
+            if (poll(pfd, 2, -1) > 0 && (pfd[1].revents & POLLIN)) {
+                errno = ECANCELED;
+                return -1;
+            }
+        }
+    }
+}
+
 static int tap_can_send(void *opaque);
 static void tap_send(void *opaque);
 static void tap_writable(void *opaque);
@@ -194,11 +251,27 @@ static void tap_send_completed(VLANClientState *nc, ssize_t len)
     tap_read_poll(s, 1);
 }
 
+static void tap_account_burst(TAPState *s, int packets)
+{
+    int bucket = 0;
+
+    while (packets > 1 && bucket < TAP_BURST_BUCKETS - 1) {
+        packets >>= 1;
+        bucket++;
+    }
+    s->rx_burst_hist[bucket]++;
+}
+
+/*
+ * Reads up to rx_burst packets per wakeup.  The receiver is told about
+ * the burst, so that e.g. virtio-net interrupts the guest once for all.
+ */
 static void tap_send(void *opaque)
 {
     TAPState *s = opaque;
-    int size;
+    int size, packets = 0;
 
+    qemu_net_receive_burst(&s->nc, true);
     do {
         uint8_t *buf = s->buf;
 
@@ -212,11 +285,18 @@ static void tap_send(void *opaque)
             size -= s->host_vnet_hdr_len;
         }
 
+        packets++;
         size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
         if (size == 0) {
             tap_read_poll(s, 0);
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (size > 0 && packets < s->rx_burst &&
+             qemu_can_send_packet(&s->nc));
+    qemu_net_receive_burst(&s->nc, false);
+
+    if (packets) {
+        tap_account_burst(s, packets);
+    }
 }
 
 int tap_has_ufo(VLANClientState *nc)
@@ -246,28 +326,39 @@ int tap_has_vnet_hdr_len(VLANClientState *nc, int len)
     return tap_probe_vnet_hdr_len(s->fd, len);
 }
 
+/* The header length is a property of each queue's fd */
 void tap_set_vnet_hdr_len(VLANClientState *nc, int len)
 {
-    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    TAPState *s = DO_UPCAST(TAPState, nc, nc)->queue0;
+    int i;
 
     assert(nc->info->type == NET_CLIENT_TYPE_TAP);
     assert(len == sizeof(struct virtio_net_hdr_mrg_rxbuf) ||
            len == sizeof(struct virtio_net_hdr));
 
-    tap_fd_set_vnet_hdr_len(s->fd, len);
-    s->host_vnet_hdr_len = len;
+    for (i = 0; i < s->nb_queues; i++) {
+        if (s->queues[i]) {
+            tap_fd_set_vnet_hdr_len(s->queues[i]->fd, len);
+            s->queues[i]->host_vnet_hdr_len = len;
+        }
+    }
 }
 
 void tap_using_vnet_hdr(VLANClientState *nc, int using_vnet_hdr)
 {
-    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    TAPState *s = DO_UPCAST(TAPState, nc, nc)->queue0;
+    int i;
 
     using_vnet_hdr = using_vnet_hdr != 0;
 
     assert(nc->info->type == NET_CLIENT_TYPE_TAP);
     assert(!!s->host_vnet_hdr_len == using_vnet_hdr);
 
-    s->using_vnet_hdr = using_vnet_hdr;
+    for (i = 0; i < s->nb_queues; i++) {
+        if (s->queues[i]) {
+            s->queues[i]->using_vnet_hdr = using_vnet_hdr;
+        }
+    }
 }
 
 void tap_set_offload(VLANClientState *nc, int csum, int tso4,
@@ -284,6 +375,22 @@ void tap_set_offload(VLANClientState *nc, int csum, int tso4,
 static void tap_cleanup(VLANClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
+
+    if (s->queue0 != s) {
+        s->queue0->queues[s->queue_index] = NULL;
+    } else {
+        /* the other queues go away with queue 0 */
+        for (i = 1; i < s->nb_queues; i++) {
+            TAPState *q = s->queues[i];
+
+            if (q) {
+                s->queues[i] = NULL;
+                q->queue0 = q;
+                qemu_del_vlan_client(&q->nc);
+            }
+        }
+    }
 
     if (s->vhost_net) {
         vhost_net_cleanup(s->vhost_net);
@@ -301,6 +408,18 @@ static void tap_cleanup(VLANClientState *nc)
     s->fd = -1;
 }
 
+static void tap_print_info(VLANClientState *nc, Monitor *mon)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    int i;
+
+    monitor_printf(mon, " rx_bursts=");
+    for (i = 0; i < TAP_BURST_BUCKETS; i++) {
+        monitor_printf(mon, "%s%d:%" PRIu64, i ? "," : "", 1 << i,
+                       s->rx_burst_hist[i]);
+    }
+}
+
 static void tap_poll(VLANClientState *nc, bool enable)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -315,6 +434,25 @@ int tap_get_fd(VLANClientState *nc)
     return s->fd;
 }
 
+/* Returns the number of queues of a tap opened with queues=N */
+int tap_get_queues(VLANClientState *nc)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    return s->queue0 == s ? s->nb_queues : 1;
+}
+
+/* Returns queue 'index' of a multiqueue tap, or NULL if it is gone */
+VLANClientState *tap_get_queue(VLANClientState *nc, int index)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_TYPE_TAP);
+    if (s->queue0 != s || index >= s->nb_queues || !s->queues[index]) {
+        return NULL;
+    }
+    return &s->queues[index]->nc;
+}
+
 /* fd support */
 
 static NetClientInfo net_tap_info = {
@@ -325,6 +463,7 @@ static NetClientInfo net_tap_info = {
     .receive_iov = tap_receive_iov,
     .poll = tap_poll,
     .cleanup = tap_cleanup,
+    .print_info = tap_print_info,
 };
 
 static TAPState *net_tap_fd_init(VLANState *vlan,
@@ -348,6 +487,10 @@ static TAPState *net_tap_fd_init(VLANState *vlan,
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     tap_read_poll(s, 1);
     s->vhost_net = NULL;
+    s->queue0 = s;
+    s->queues[0] = s;
+    s->nb_queues = 1;
+    s->rx_burst = TAP_RX_BURST;
     return s;
 }
 
@@ -395,9 +538,9 @@ static int launch_script(const char *setup_script, const char *ifname, int fd)
     return -1;
 }
 
-static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
+static int net_tap_init(QemuOpts *opts, int *vnet_hdr, int *fds, int queues)
 {
-    int fd, vnet_hdr_required;
+    int i, vnet_hdr_required;
     char ifname[128] = {0,};
     const char *setup_script;
 
@@ -412,36 +555,71 @@ static int net_tap_init(QemuOpts *opts, int *vnet_hdr)
         vnet_hdr_required = 0;
     }
 
-    TFR(fd = tap_open(ifname, sizeof(ifname), vnet_hdr, vnet_hdr_required));
-    if (fd < 0) {
-        return -1;
+    /* the first open names the interface, the others attach to it */
+    for (i = 0; i < queues; i++) {
+        TFR(fds[i] = tap_open(ifname, sizeof(ifname), vnet_hdr,
+                              vnet_hdr_required, queues > 1));
+        if (fds[i] < 0) {
+            goto fail;
+        }
+        vnet_hdr_required = *vnet_hdr;
     }
 
     setup_script = qemu_opt_get(opts, "script");
     if (setup_script &&
         setup_script[0] != '\0' &&
         strcmp(setup_script, "no") != 0 &&
-        launch_script(setup_script, ifname, fd)) {
-        close(fd);
-        return -1;
+        launch_script(setup_script, ifname, fds[0])) {
+        goto fail;
     }
 
     qemu_opt_set(opts, "ifname", ifname);
 
-    return fd;
+    return 0;
+
+fail:
+    while (--i >= 0) {
+        close(fds[i]);
+    }
+    return -1;
 }
 
 int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan)
 {
     TAPState *s;
     int fd, vnet_hdr = 0;
+    int i, queues, fds[TAP_MAX_QUEUES];
+    int rx_burst;
+
+    rx_burst = qemu_opt_get_number(opts, "rx_burst", TAP_RX_BURST);
+    if (rx_burst < 1) {
+        error_report("rx_burst= must be at least 1");
+        return -1;
+    }
+
+    queues = qemu_opt_get_number(opts, "queues", 1);
+    if (queues < 1 || queues > TAP_MAX_QUEUES) {
+        error_report("queues= must be between 1 and %d", TAP_MAX_QUEUES);
+        return -1;
+    }
+    if (queues > 1 && vlan) {
+        error_report("queues= is only valid with -netdev");
+        return -1;
+    }
+    if (queues > 1 &&
+        qemu_opt_get_bool(opts, "vhost", !!qemu_opt_get(opts, "vhostfd"))) {
+        error_report("queues= is invalid with vhost");
+        return -1;
+    }
 
     if (qemu_opt_get(opts, "fd")) {
         if (qemu_opt_get(opts, "ifname") ||
             qemu_opt_get(opts, "script") ||
             qemu_opt_get(opts, "downscript") ||
-            qemu_opt_get(opts, "vnet_hdr")) {
-            error_report("ifname=, script=, downscript= and vnet_hdr= is invalid with fd=");
+            qemu_opt_get(opts, "vnet_hdr") ||
+            qemu_opt_get(opts, "queues")) {
+            error_report("ifname=, script=, downscript=, vnet_hdr= "
+                         "and queues= is invalid with fd=");
             return -1;
         }
 
@@ -462,10 +640,10 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
             qemu_opt_set(opts, "downscript", DEFAULT_NETWORK_DOWN_SCRIPT);
         }
 
-        fd = net_tap_init(opts, &vnet_hdr);
-        if (fd == -1) {
+        if (net_tap_init(opts, &vnet_hdr, fds, queues) < 0) {
             return -1;
         }
+        fd = fds[0];
     }
 
     s = net_tap_fd_init(vlan, "tap", name, fd, vnet_hdr);
@@ -477,6 +655,7 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
     if (tap_set_sndbuf(s->fd, opts) < 0) {
         return -1;
     }
+    s->rx_burst = rx_burst;
 
     if (qemu_opt_get(opts, "fd")) {
         snprintf(s->nc.info_str, sizeof(s->nc.info_str), "fd=%d", fd);
@@ -497,6 +676,27 @@ int net_init_tap(QemuOpts *opts, Monitor *mon, const char *name, VLANState *vlan
         }
     }
 
+    /* queue i is a netdev of its own, named <id>.i */
+    for (i = 1; i < queues; i++) {
+        char qname[128];
+        TAPState *q;
+
+        snprintf(qname, sizeof(qname), "%s.%d", name, i);
+        q = net_tap_fd_init(NULL, "tap", qname, fds[i], vnet_hdr);
+        q->queue0 = s;
+        q->queue_index = i;
+        q->rx_burst = rx_burst;
+        s->queues[i] = q;
+        s->nb_queues++;
+
+        snprintf(q->nc.info_str, sizeof(q->nc.info_str), "ifname=%s,queue=%d",
+                 qemu_opt_get(opts, "ifname"), i);
+
+        if (tap_set_sndbuf(q->fd, opts) < 0) {
+            return -1;
+        }
+    }
+
     if (qemu_opt_get_bool(opts, "vhost", !!qemu_opt_get(opts, "vhostfd"))) {
         int vhostfd, r;
         if (qemu_opt_get(opts, "vhostfd")) {
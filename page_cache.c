@@ -0,0 +1,151 @@
+/*
+ * LRU cache of guest pages sent by migration
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A fixed number of page buffers, allocated up front, keyed by the address
+ * of the page.  Lookups go through a hash table of lists; every hit moves
+ * the entry to the tail of the LRU list, and a new page takes the buffer at
+ * its head once all of them are in use.  The cache is only used by the
+ * migration code, so there is no locking.
+ */
+
+#include "qemu-common.h"
+#include "qemu-queue.h"
+#include "page_cache.h"
+
+typedef struct CacheEntry {
+    uint64_t addr;
+    int valid;                      /* on a hash list */
+    uint8_t *data;
+    QLIST_ENTRY(CacheEntry) hash;
+    QTAILQ_ENTRY(CacheEntry) lru;
+} CacheEntry;
+
+struct PageCache {
+    CacheEntry *entries;
+    uint8_t *data;
+    int64_t num_pages;
+    int64_t num_used;
+    int page_size;
+    int64_t hash_size;
+    QLIST_HEAD(, CacheEntry) *buckets;
+    QTAILQ_HEAD(, CacheEntry) lru;
+};
+
+static unsigned int cache_hash(PageCache *cache, uint64_t addr)
+{
+    addr /= cache->page_size;
+    return (addr ^ (addr >> 17)) & (cache->hash_size - 1);
+}
+
+static CacheEntry *cache_find(PageCache *cache, uint64_t addr)
+{
+    CacheEntry *e;
+
+    QLIST_FOREACH(e, &cache->buckets[cache_hash(cache, addr)], hash) {
+        if (e->addr == addr) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* Returns NULL if num_pages buffers can't be allocated */
+PageCache *cache_init(int64_t num_pages, int page_size)
+{
+    PageCache *cache;
+
+    if (num_pages <= 0 || page_size <= 0) {
+        return NULL;
+    }
+
+    cache = qemu_mallocz(sizeof(*cache));
+    cache->data = malloc(num_pages * page_size);
+    if (!cache->data) {
+        qemu_free(cache);
+        return NULL;
+    }
+    cache->entries = qemu_mallocz(num_pages * sizeof(CacheEntry));
+    cache->num_pages = num_pages;
+    cache->page_size = page_size;
+    for (cache->hash_size = 1; cache->hash_size < num_pages;
+         cache->hash_size <<= 1) {
+    }
+    cache->buckets = qemu_mallocz(cache->hash_size * sizeof(*cache->buckets));
+    QTAILQ_INIT(&cache->lru);
+    return cache;
+}
+
+void cache_fini(PageCache *cache)
+{
+    if (!cache) {
+        return;
+    }
+    qemu_free(cache->buckets);
+    qemu_free(cache->entries);
+    free(cache->data);
+    qemu_free(cache);
+}
+
+/* Returns the copy of the page at addr, or NULL if it is not cached */
+uint8_t *cache_get(PageCache *cache, uint64_t addr)
+{
+    CacheEntry *e = cache_find(cache, addr);
+
+    if (!e) {
+        return NULL;
+    }
+    QTAILQ_REMOVE(&cache->lru, e, lru);
+    QTAILQ_INSERT_TAIL(&cache->lru, e, lru);
+    return e->data;
+}
+
+/*
+ * Returns the buffer for the page at addr, to be filled by the caller.
+ * The least recently used page is evicted when the cache is full.
+ */
+uint8_t *cache_insert(PageCache *cache, uint64_t addr)
+{
+    CacheEntry *e = cache_find(cache, addr);
+
+    if (e) {
+        QTAILQ_REMOVE(&cache->lru, e, lru);
+    } else {
+        if (cache->num_used < cache->num_pages) {
+            e = &cache->entries[cache->num_used];
+            e->data = cache->data + cache->num_used * cache->page_size;
+            cache->num_used++;
+        } else {
+            e = QTAILQ_FIRST(&cache->lru);
+            QTAILQ_REMOVE(&cache->lru, e, lru);
+            if (e->valid) {
+                QLIST_REMOVE(e, hash);
+            }
+        }
+        e->addr = addr;
+        e->valid = 1;
+        QLIST_INSERT_HEAD(&cache->buckets[cache_hash(cache, addr)], e, hash);
+    }
+    QTAILQ_INSERT_TAIL(&cache->lru, e, lru);
+    return e->data;
+}
+
+/* The buffer goes to the head of the LRU list, to be taken first */
+void cache_remove(PageCache *cache, uint64_t addr)
+{
+    CacheEntry *e = cache_find(cache, addr);
+
+    if (!e) {
+        return;
+    }
+    QLIST_REMOVE(e, hash);
+    e->valid = 0;
+    QTAILQ_REMOVE(&cache->lru, e, lru);
+    QTAILQ_INSERT_HEAD(&cache->lru, e, lru);
+}
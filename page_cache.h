@@ -0,0 +1,23 @@
+/*
+ * LRU cache of guest pages sent by migration
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_PAGE_CACHE_H
+#define QEMU_PAGE_CACHE_H
+
+#include <stdint.h>
+
+typedef struct PageCache PageCache;
+
+PageCache *cache_init(int64_t num_pages, int page_size);
+void cache_fini(PageCache *cache);
+uint8_t *cache_get(PageCache *cache, uint64_t addr);
+uint8_t *cache_insert(PageCache *cache, uint64_t addr);
+void cache_remove(PageCache *cache, uint64_t addr);
+
+#endif /* QEMU_PAGE_CACHE_H */
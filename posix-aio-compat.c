@@ -21,6 +21,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sched.h>
 
 #include "qemu-queue.h"
 #include "osdep.h"
@@ -28,16 +29,24 @@
 #include "qemu-common.h"
 #include "trace.h"
 #include "block_int.h"
+#include "qemu-timer.h"
 
 #include "block/raw-posix-aio.h"
 
+#ifdef CONFIG_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
 #include "coremu-config.h"
 #include "coremu-hw.h"
 #include "coremu-thread.h"
 
 
+typedef struct PaioPool PaioPool;
+
 struct qemu_paiocb {
     BlockDriverAIOCB common;
+    PaioPool *pool;
     int aio_fildes;
     union {
         struct iovec *aio_iov;
@@ -46,8 +55,9 @@ struct qemu_paiocb {
     int aio_niov;
     size_t aio_nbytes;
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
-    int ev_signo;
     off_t aio_offset;
+    int64_t submit_time;
+    size_t bounce_bytes;
 
     QTAILQ_ENTRY(qemu_paiocb) node;
     int aio_type;
@@ -58,20 +68,38 @@ struct qemu_paiocb {
     int async_context_id;
 };
 
-typedef struct PosixAioState {
+/*
+ * Each raw-posix BlockDriverState has its own pool of worker threads, so a
+ * slow device does not hold up requests to the others.  Workers are spawned
+ * on demand up to max_threads and exit after 10 seconds of idleness.
+ *
+ * Completions are reported through an eventfd (a pipe on hosts without
+ * eventfd).  Only the first completion after the main thread last looked
+ * writes to it; later ones are picked up by the same wakeup.
+ */
+struct PaioPool {
     int rfd, wfd;
     struct qemu_paiocb *first_aio;
-} PosixAioState;
 
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_cond_t exit_cond;
+    pthread_attr_t attr;
+    QTAILQ_HEAD(, qemu_paiocb) request_list;
+    int nb_queued;
+    int max_threads;
+    int cur_threads;
+    int idle_threads;
+    /* completions since the last wakeup of the main thread */
+    int completed;
+    int stopping;
+
+    /* free bounce buffers of PAIO_BOUNCE_SIZE bytes */
+    void *bounce_free[PAIO_BOUNCE_FREE_MAX];
+    int nb_bounce_free;
+};
 
-static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
-static pthread_t thread_id;
-static pthread_attr_t attr;
-static int max_threads = 64;
-static int cur_threads = 0;
-static int idle_threads = 0;
-static QTAILQ_HEAD(, qemu_paiocb) request_list;
+#define PAIO_DEFAULT_THREADS 64
 
 #ifdef CONFIG_PREADV
 static int preadv_present = 1;
@@ -110,12 +138,24 @@ static int cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex,
     return ret;
 }
 
+static void cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    int ret = pthread_cond_wait(cond, mutex);
+    if (ret) die2(ret, "pthread_cond_wait");
+}
+
 static void cond_signal(pthread_cond_t *cond)
 {
     int ret = pthread_cond_signal(cond);
     if (ret) die2(ret, "pthread_cond_signal");
 }
 
+static void cond_broadcast(pthread_cond_t *cond)
+{
+    int ret = pthread_cond_broadcast(cond);
+    if (ret) die2(ret, "pthread_cond_broadcast");
+}
+
 static void thread_create(pthread_t *thread, pthread_attr_t *attr,
                           void *(*start_routine)(void*), void *arg)
 {
@@ -236,6 +276,153 @@ static ssize_t handle_aiocb_rw_linear(struct qemu_paiocb *aiocb, char *buf)
     return offset;
 }
 
+/*
+ * Returns an aligned buffer of at least size bytes, taken from the free
+ * list of the pool when size is at most PAIO_BOUNCE_SIZE.
+ */
+void *paio_bounce_get(void *opaque, size_t size)
+{
+    PaioPool *pool = opaque;
+    void *buf = NULL;
+
+    if (size > PAIO_BOUNCE_SIZE) {
+        return qemu_memalign(PAIO_BOUNCE_ALIGN, size);
+    }
+
+    mutex_lock(&pool->lock);
+    if (pool->nb_bounce_free) {
+        buf = pool->bounce_free[--pool->nb_bounce_free];
+    }
+    mutex_unlock(&pool->lock);
+
+    if (!buf) {
+        buf = qemu_memalign(PAIO_BOUNCE_ALIGN, PAIO_BOUNCE_SIZE);
+    }
+    return buf;
+}
+
+void paio_bounce_put(void *opaque, void *buf, size_t size)
+{
+    PaioPool *pool = opaque;
+
+    if (size <= PAIO_BOUNCE_SIZE) {
+        mutex_lock(&pool->lock);
+        if (pool->nb_bounce_free < PAIO_BOUNCE_FREE_MAX) {
+            pool->bounce_free[pool->nb_bounce_free++] = buf;
+            buf = NULL;
+        }
+        mutex_unlock(&pool->lock);
+    }
+    qemu_vfree(buf);
+}
+
+/* Copies between niov segments and a buffer of their total length */
+static void paio_copy_iov(struct iovec *iov, int niov, char *buf, int to_buf)
+{
+    int i;
+
+    for (i = 0; i < niov; i++) {
+        if (to_buf) {
+            memcpy(buf, iov[i].iov_base, iov[i].iov_len);
+        } else {
+            memcpy(iov[i].iov_base, buf, iov[i].iov_len);
+        }
+        buf += iov[i].iov_len;
+    }
+}
+
+/*
+ * Misaligned request with O_DIRECT: only the segments that the kernel
+ * can't take are copied.  Aligned segments are passed through, and each
+ * run of misaligned ones goes through one bounce buffer, which is ended
+ * only at an aligned length so that every segment is aligned.
+ *
+ * Returns -ENOSYS without doing any I/O if the vector can't be passed to
+ * the kernel as a whole.
+ */
+static ssize_t handle_aiocb_rw_bounce(struct qemu_paiocb *aiocb)
+{
+    struct iovec *orig_iov = aiocb->aio_iov;
+    int orig_niov = aiocb->aio_niov;
+    size_t mask = aiocb->common.bs->buffer_alignment - 1;
+    struct iovec *iov;
+    int *first, *count;
+    int i, n, in_run;
+    ssize_t nbytes;
+
+    iov = qemu_malloc(orig_niov * sizeof(*iov));
+    first = qemu_malloc(orig_niov * sizeof(*first));
+    count = qemu_malloc(orig_niov * sizeof(*count));
+
+    n = 0;
+    in_run = 0;
+    for (i = 0; i < orig_niov; i++) {
+        if (!in_run && !((uintptr_t) orig_iov[i].iov_base & mask) &&
+            !(orig_iov[i].iov_len & mask)) {
+            iov[n] = orig_iov[i];
+            count[n++] = 0;
+            continue;
+        }
+        if (!in_run) {
+            in_run = 1;
+            iov[n].iov_len = 0;
+            first[n] = i;
+            count[n] = 0;
+        }
+        iov[n].iov_len += orig_iov[i].iov_len;
+        count[n]++;
+        if (!(iov[n].iov_len & mask)) {
+            in_run = 0;
+            n++;
+        }
+    }
+    if (in_run) {
+        n++;
+    }
+
+    if (n > 1 && !preadv_present) {
+        nbytes = -ENOSYS;
+        goto out;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (count[i]) {
+            iov[i].iov_base = paio_bounce_get(aiocb->pool, iov[i].iov_len);
+            if (aiocb->aio_type & QEMU_AIO_WRITE) {
+                paio_copy_iov(&orig_iov[first[i]], count[i],
+                              iov[i].iov_base, 1);
+            }
+            aiocb->bounce_bytes += iov[i].iov_len;
+        }
+    }
+
+    if (n == 1) {
+        nbytes = handle_aiocb_rw_linear(aiocb, iov[0].iov_base);
+    } else {
+        aiocb->aio_iov = iov;
+        aiocb->aio_niov = n;
+        nbytes = handle_aiocb_rw_vector(aiocb);
+        aiocb->aio_iov = orig_iov;
+        aiocb->aio_niov = orig_niov;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (count[i]) {
+            if (!(aiocb->aio_type & QEMU_AIO_WRITE)) {
+                paio_copy_iov(&orig_iov[first[i]], count[i],
+                              iov[i].iov_base, 0);
+            }
+            paio_bounce_put(aiocb->pool, iov[i].iov_base, iov[i].iov_len);
+        }
+    }
+
+out:
+    qemu_free(count);
+    qemu_free(first);
+    qemu_free(iov);
+    return nbytes;
+}
+
 static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
 {
     ssize_t nbytes;
@@ -269,13 +456,24 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
          * using these interfaces.  For now retry using plain
          * pread/pwrite?
          */
+    } else {
+        nbytes = handle_aiocb_rw_bounce(aiocb);
+        if (nbytes == aiocb->aio_nbytes)
+            return nbytes;
+        if (nbytes < 0 && nbytes != -ENOSYS)
+            return nbytes;
+        if (nbytes == -ENOSYS && aiocb->aio_niov > 1)
+            preadv_present = 0;
+        /* short read/write: retry with a single buffer, as above */
+        aiocb->bounce_bytes = 0;
     }
 
     /*
      * Ok, we have to do it the hard way, copy all segments into
      * a single aligned buffer.
      */
-    buf = qemu_blockalign(aiocb->common.bs, aiocb->aio_nbytes);
+    buf = paio_bounce_get(aiocb->pool, aiocb->aio_nbytes);
+    aiocb->bounce_bytes += aiocb->aio_nbytes;
     if (aiocb->aio_type & QEMU_AIO_WRITE) {
         char *p = buf;
         int i;
@@ -301,45 +499,61 @@ static ssize_t handle_aiocb_rw(struct qemu_paiocb *aiocb)
             count -= copy;
         }
     }
-    qemu_vfree(buf);
+    paio_bounce_put(aiocb->pool, buf, aiocb->aio_nbytes);
 
     return nbytes;
 }
 
-static void *aio_thread(void *unused)
+static void paio_notify(PaioPool *pool)
+{
+    uint64_t value = 1;
+    ssize_t ret;
+
+    do {
+        ret = write(pool->wfd, &value, sizeof(value));
+    } while (ret < 0 && errno == EINTR);
+    if (ret < 0 && errno != EAGAIN)
+        die("write()");
+
+#ifndef CONFIG_COREMU
+    /* kick the CPU loop so that the main loop polls the event */
+    if (kill(getpid(), SIGUSR2)) die("kill failed");
+#endif
+}
+
+static void *aio_thread(void *opaque)
 {
+    PaioPool *pool = opaque;
 
 #ifdef CONFIG_COREMU
     coremu_thread_setpriority(PRIO_PROCESS, 0, -21);
-#else
-    pid_t pid;
-    pid = getpid();
 #endif
+    mutex_lock(&pool->lock);
     while (1) {
         struct qemu_paiocb *aiocb;
         ssize_t ret = 0;
         qemu_timeval tv;
         struct timespec ts;
+        int notify;
 
         qemu_gettimeofday(&tv);
         ts.tv_sec = tv.tv_sec + 10;
         ts.tv_nsec = 0;
 
-        mutex_lock(&lock);
-
-        while (QTAILQ_EMPTY(&request_list) &&
-               !(ret == ETIMEDOUT)) {
-            ret = cond_timedwait(&cond, &lock, &ts);
+        while (QTAILQ_EMPTY(&pool->request_list) &&
+               !pool->stopping && !(ret == ETIMEDOUT)) {
+            ret = cond_timedwait(&pool->cond, &pool->lock, &ts);
         }
 
-        if (QTAILQ_EMPTY(&request_list))
+        if (QTAILQ_EMPTY(&pool->request_list))
             break;
 
-        aiocb = QTAILQ_FIRST(&request_list);
-        QTAILQ_REMOVE(&request_list, aiocb, node);
+        aiocb = QTAILQ_FIRST(&pool->request_list);
+        QTAILQ_REMOVE(&pool->request_list, aiocb, node);
+        pool->nb_queued--;
         aiocb->active = 1;
-        idle_threads--;
-        mutex_unlock(&lock);
+        pool->idle_threads--;
+        mutex_unlock(&pool->lock);
 
         switch (aiocb->aio_type & QEMU_AIO_TYPE_MASK) {
         case QEMU_AIO_READ:
@@ -358,59 +572,73 @@ static void *aio_thread(void *unused)
             break;
         }
 
-        mutex_lock(&lock);
+        mutex_lock(&pool->lock);
         aiocb->ret = ret;
-        idle_threads++;
-        mutex_unlock(&lock);
-#ifdef CONFIG_COREMU
-        coremu_signal_hw_thr(aiocb->ev_signo);
-#else
-        if (kill(pid, aiocb->ev_signo)) die("kill failed");
-#endif
+        pool->idle_threads++;
+        notify = !pool->completed++;
+        if (notify) {
+            mutex_unlock(&pool->lock);
+            paio_notify(pool);
+            mutex_lock(&pool->lock);
+        }
     }
 
-    idle_threads--;
-    cur_threads--;
-    mutex_unlock(&lock);
+    pool->idle_threads--;
+    pool->cur_threads--;
+    if (pool->cur_threads == 0 && pool->stopping) {
+        cond_signal(&pool->exit_cond);
+    }
+    mutex_unlock(&pool->lock);
 
     return NULL;
 }
 
-static void spawn_thread(void)
+static void spawn_thread(PaioPool *pool)
 {
+    pthread_t thread_id;
     sigset_t set, oldset;
 
-    cur_threads++;
-    idle_threads++;
+    pool->cur_threads++;
+    pool->idle_threads++;
 
     /* block all signals */
     if (sigfillset(&set)) die("sigfillset");
     if (sigprocmask(SIG_SETMASK, &set, &oldset)) die("sigprocmask");
 
-    thread_create(&thread_id, &attr, aio_thread, NULL);
+    thread_create(&thread_id, &pool->attr, aio_thread, pool);
 
     if (sigprocmask(SIG_SETMASK, &oldset, NULL)) die("sigprocmask restore");
 }
 
 static void qemu_paio_submit(struct qemu_paiocb *aiocb)
 {
+    PaioPool *pool = aiocb->pool;
+    int wakeup;
+
     aiocb->ret = -EINPROGRESS;
     aiocb->active = 0;
-    mutex_lock(&lock);
-    if (idle_threads == 0 && cur_threads < max_threads)
-        spawn_thread();
-    QTAILQ_INSERT_TAIL(&request_list, aiocb, node);
-    mutex_unlock(&lock);
-    cond_signal(&cond);
+    aiocb->submit_time = get_clock();
+    mutex_lock(&pool->lock);
+    QTAILQ_INSERT_TAIL(&pool->request_list, aiocb, node);
+    pool->nb_queued++;
+    if (pool->nb_queued > pool->idle_threads &&
+        pool->cur_threads < pool->max_threads) {
+        spawn_thread(pool);
+    }
+    /* busy workers pick up the request when they are done */
+    wakeup = pool->idle_threads > 0;
+    mutex_unlock(&pool->lock);
+    if (wakeup)
+        cond_signal(&pool->cond);
 }
 
 static ssize_t qemu_paio_return(struct qemu_paiocb *aiocb)
 {
     ssize_t ret;
 
-    mutex_lock(&lock);
+    mutex_lock(&aiocb->pool->lock);
     ret = aiocb->ret;
-    mutex_unlock(&lock);
+    mutex_unlock(&aiocb->pool->lock);
 
     return ret;
 }
@@ -427,55 +655,55 @@ static int qemu_paio_error(struct qemu_paiocb *aiocb)
     return ret;
 }
 
-static int posix_aio_process_queue(void *opaque)
+/*
+ * Unlinks the first finished request of the current async context from the
+ * pool, checking all of them with a single acquisition of the lock.
+ */
+static struct qemu_paiocb *paio_next_done(PaioPool *pool)
 {
-    PosixAioState *s = opaque;
     struct qemu_paiocb *acb, **pacb;
-    int ret;
-    int result = 0;
     int async_context_id = get_async_context_id();
 
-    for(;;) {
-        pacb = &s->first_aio;
-        for(;;) {
-            acb = *pacb;
-            if (!acb)
-                return result;
-
-            /* we're only interested in requests in the right context */
-            if (acb->async_context_id != async_context_id) {
-                pacb = &acb->next;
-                continue;
-            }
+    mutex_lock(&pool->lock);
+    for (pacb = &pool->first_aio; (acb = *pacb) != NULL; pacb = &acb->next) {
+        /* we're only interested in requests in the right context */
+        if (acb->async_context_id == async_context_id &&
+            acb->ret != -EINPROGRESS) {
+            *pacb = acb->next;
+            break;
+        }
+    }
+    mutex_unlock(&pool->lock);
 
-            ret = qemu_paio_error(acb);
-            if (ret == ECANCELED) {
-                /* remove the request */
-                *pacb = acb->next;
-                qemu_aio_release(acb);
-                result = 1;
-            } else if (ret != EINPROGRESS) {
-                /* end of aio */
-                if (ret == 0) {
-                    ret = qemu_paio_return(acb);
-                    if (ret == acb->aio_nbytes)
-                        ret = 0;
-                    else
-                        ret = -EINVAL;
-                } else {
-                    ret = -ret;
-                }
-                /* remove the request */
-                *pacb = acb->next;
-                /* call the callback */
-                acb->common.cb(acb->common.opaque, ret);
-                qemu_aio_release(acb);
-                result = 1;
-                break;
-            } else {
-                pacb = &acb->next;
-            }
+    return acb;
+}
+
+static int posix_aio_process_queue(void *opaque)
+{
+    PaioPool *pool = opaque;
+    struct qemu_paiocb *acb;
+    ssize_t ret;
+    int result = 0;
+
+    while ((acb = paio_next_done(pool)) != NULL) {
+        ret = acb->ret;
+        if (ret == -ECANCELED) {
+            qemu_aio_release(acb);
+            result = 1;
+            continue;
+        }
+
+        /* end of aio */
+        if (ret >= 0) {
+            ret = (ret == acb->aio_nbytes) ? 0 : -EINVAL;
         }
+        bdrv_aio_account_latency(acb->common.bs,
+                                 get_clock() - acb->submit_time);
+        acb->common.bs->bounce_bytes += acb->bounce_bytes;
+        /* call the callback */
+        acb->common.cb(acb->common.opaque, ret);
+        qemu_aio_release(acb);
+        result = 1;
     }
 
     return result;
@@ -483,14 +711,14 @@ static int posix_aio_process_queue(void *opaque)
 
 static void posix_aio_read(void *opaque)
 {
-    PosixAioState *s = opaque;
+    PaioPool *pool = opaque;
     ssize_t len;
 
-    /* read all bytes from signal pipe */
+    /* read all bytes from the event fd */
     for (;;) {
         char bytes[16];
 
-        len = read(s->rfd, bytes, sizeof(bytes));
+        len = read(pool->rfd, bytes, sizeof(bytes));
         if (len == -1 && errno == EINTR)
             continue; /* try again */
         if (len == sizeof(bytes))
@@ -498,42 +726,33 @@ static void posix_aio_read(void *opaque)
         break;
     }
 
-    posix_aio_process_queue(s);
+    /* workers finishing from now on must wake us up again */
+    mutex_lock(&pool->lock);
+    pool->completed = 0;
+    mutex_unlock(&pool->lock);
+
+    posix_aio_process_queue(pool);
 }
 
 static int posix_aio_flush(void *opaque)
 {
-    PosixAioState *s = opaque;
-    return !!s->first_aio;
+    PaioPool *pool = opaque;
+    return !!pool->first_aio;
 }
 
-static PosixAioState *posix_aio_state;
-
+#ifndef CONFIG_COREMU
 static void aio_signal_handler(int signum)
 {
-#ifdef CONFIG_COREMU
-    coremu_assert_hw_thr("aio_signal_handler should only called by hw thr\n");
-#endif
-
-    if (posix_aio_state) {
-        char byte = 0;
-        ssize_t ret;
-
-        ret = write(posix_aio_state->wfd, &byte, sizeof(byte));
-        if (ret < 0 && errno != EAGAIN)
-            die("write()");
-    }
-#ifndef CONFIG_COREMU
     qemu_service_io();
-#endif
 }
+#endif
 
 static void paio_remove(struct qemu_paiocb *acb)
 {
     struct qemu_paiocb **pacb;
 
     /* remove the callback from the queue */
-    pacb = &posix_aio_state->first_aio;
+    pacb = &acb->pool->first_aio;
     for(;;) {
         if (*pacb == NULL) {
             fprintf(stderr, "paio_remove: aio request not found!\n");
@@ -550,16 +769,18 @@ static void paio_remove(struct qemu_paiocb *acb)
 static void paio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_paiocb *acb = (struct qemu_paiocb *)blockacb;
+    PaioPool *pool = acb->pool;
     int active = 0;
 
-    mutex_lock(&lock);
+    mutex_lock(&pool->lock);
     if (!acb->active) {
-        QTAILQ_REMOVE(&request_list, acb, node);
+        QTAILQ_REMOVE(&pool->request_list, acb, node);
+        pool->nb_queued--;
         acb->ret = -ECANCELED;
     } else if (acb->ret == -EINPROGRESS) {
         active = 1;
     }
-    mutex_unlock(&lock);
+    mutex_unlock(&pool->lock);
 
     if (active) {
         /* fail safe: if the aio could not be canceled, we wait for
@@ -576,7 +797,7 @@ static AIOPool raw_aio_pool = {
     .cancel             = paio_cancel,
 };
 
-BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_submit(BlockDriverState *bs, void *pool, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
 {
@@ -585,14 +806,11 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->pool = pool;
     acb->aio_type = type;
     acb->aio_fildes = fd;
-#ifdef CONFIG_COREMU
-    acb->ev_signo = COREMU_AIO_SIG;
-#else
-    acb->ev_signo = SIGUSR2;
-#endif
     acb->async_context_id = get_async_context_id();
+    acb->bounce_bytes = 0;
 
     if (qiov) {
         acb->aio_iov = qiov->iov;
@@ -601,15 +819,15 @@ BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
     acb->aio_nbytes = nb_sectors * 512;
     acb->aio_offset = sector_num * 512;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    acb->next = acb->pool->first_aio;
+    acb->pool->first_aio = acb;
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
-BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
+BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, void *pool, int fd,
         unsigned long int req, void *buf,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -618,71 +836,146 @@ BlockDriverAIOCB *paio_ioctl(BlockDriverState *bs, int fd,
     acb = qemu_aio_get(&raw_aio_pool, bs, cb, opaque);
     if (!acb)
         return NULL;
+    acb->pool = pool;
     acb->aio_type = QEMU_AIO_IOCTL;
     acb->aio_fildes = fd;
-#ifdef CONFIG_COREMU
-    acb->ev_signo = COREMU_AIO_SIG;
-#else
-    acb->ev_signo = SIGUSR2;
-#endif
     acb->async_context_id = get_async_context_id();
+    acb->bounce_bytes = 0;
     acb->aio_offset = 0;
     acb->aio_ioctl_buf = buf;
     acb->aio_ioctl_cmd = req;
 
-    acb->next = posix_aio_state->first_aio;
-    posix_aio_state->first_aio = acb;
+    acb->next = acb->pool->first_aio;
+    acb->pool->first_aio = acb;
 
     qemu_paio_submit(acb);
     return &acb->common;
 }
 
-int paio_init(void)
+static int paio_event_init(PaioPool *pool)
 {
-    struct sigaction act;
-    PosixAioState *s;
     int fds[2];
-    int ret;
 
-    if (posix_aio_state)
-        return 0;
+#ifdef CONFIG_EVENTFD
+    fds[0] = eventfd(0, 0);
+    if (fds[0] >= 0) {
+        fds[1] = fds[0];
+    } else
+#endif
+    if (qemu_pipe(fds) == -1) {
+        return -1;
+    }
 
-    s = qemu_malloc(sizeof(PosixAioState));
+    pool->rfd = fds[0];
+    pool->wfd = fds[1];
 
-    sigfillset(&act.sa_mask);
-    act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
-    act.sa_handler = aio_signal_handler;
-#ifdef CONFIG_COREMU
-    sigaction(COREMU_AIO_SIG, &act, NULL);
-#else
-    sigaction(SIGUSR2, &act, NULL);
+    fcntl(pool->rfd, F_SETFL, O_NONBLOCK);
+    fcntl(pool->wfd, F_SETFL, O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * Creates a pool of at most max_threads workers (0 for the default) for the
+ * requests of one BlockDriverState.
+ */
+void *paio_init(int max_threads)
+{
+#ifndef CONFIG_COREMU
+    static int signal_installed;
 #endif
+    PaioPool *pool;
+    int ret;
 
-    s->first_aio = NULL;
-    if (qemu_pipe(fds) == -1) {
-        fprintf(stderr, "failed to create pipe\n");
-        return -1;
+#ifndef CONFIG_COREMU
+    if (!signal_installed) {
+        struct sigaction act;
+
+        sigfillset(&act.sa_mask);
+        act.sa_flags = 0; /* do not restart syscalls to interrupt select() */
+        act.sa_handler = aio_signal_handler;
+        sigaction(SIGUSR2, &act, NULL);
+        signal_installed = 1;
     }
+#endif
 
-    s->rfd = fds[0];
-    s->wfd = fds[1];
+    pool = qemu_mallocz(sizeof(PaioPool));
+    pool->max_threads = max_threads > 0 ? max_threads : PAIO_DEFAULT_THREADS;
 
-    fcntl(s->rfd, F_SETFL, O_NONBLOCK);
-    fcntl(s->wfd, F_SETFL, O_NONBLOCK);
+    if (paio_event_init(pool) < 0) {
+        fprintf(stderr, "failed to create event fd\n");
+        qemu_free(pool);
+        return NULL;
+    }
 
-    qemu_aio_set_fd_handler(s->rfd, posix_aio_read, NULL, posix_aio_flush,
-        posix_aio_process_queue, s);
+    ret = pthread_mutex_init(&pool->lock, NULL);
+    if (ret) die2(ret, "pthread_mutex_init");
+    ret = pthread_cond_init(&pool->cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
+    ret = pthread_cond_init(&pool->exit_cond, NULL);
+    if (ret) die2(ret, "pthread_cond_init");
 
-    ret = pthread_attr_init(&attr);
+    ret = pthread_attr_init(&pool->attr);
     if (ret)
         die2(ret, "pthread_attr_init");
 
-    ret = pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    ret = pthread_attr_setdetachstate(&pool->attr, PTHREAD_CREATE_DETACHED);
     if (ret)
         die2(ret, "pthread_attr_setdetachstate");
 
-    QTAILQ_INIT(&request_list);
+#ifdef CONFIG_LINUX
+    {
+        cpu_set_t cpus;
 
-    posix_aio_state = s;
-    return 0;
+        /*
+         * Workers are spawned by whichever thread submits a request, which
+         * can be a vcpu thread pinned to its own host CPU.  Give them the
+         * CPUs of the thread opening the image instead, so that they don't
+         * compete with that vcpu.
+         */
+        if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+            pthread_attr_setaffinity_np(&pool->attr, sizeof(cpus), &cpus);
+        }
+    }
+#endif
+
+    QTAILQ_INIT(&pool->request_list);
+
+    qemu_aio_set_fd_handler(pool->rfd, posix_aio_read, NULL, posix_aio_flush,
+        posix_aio_process_queue, pool);
+
+    return pool;
+}
+
+/* Completes the outstanding requests and stops the workers of a pool */
+void paio_cleanup(void *opaque)
+{
+    PaioPool *pool = opaque;
+
+    while (pool->first_aio) {
+        qemu_aio_wait();
+    }
+
+    mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    cond_broadcast(&pool->cond);
+    while (pool->cur_threads > 0) {
+        cond_wait(&pool->exit_cond, &pool->lock);
+    }
+    mutex_unlock(&pool->lock);
+
+    qemu_aio_set_fd_handler(pool->rfd, NULL, NULL, NULL, NULL, NULL);
+    if (pool->wfd != pool->rfd) {
+        close(pool->wfd);
+    }
+    close(pool->rfd);
+
+    while (pool->nb_bounce_free) {
+        qemu_vfree(pool->bounce_free[--pool->nb_bounce_free]);
+    }
+
+    pthread_attr_destroy(&pool->attr);
+    pthread_cond_destroy(&pool->exit_cond);
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->lock);
+    qemu_free(pool);
 }
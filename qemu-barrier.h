@@ -1,10 +1,26 @@
 #ifndef __QEMU_BARRIER_H
 #define __QEMU_BARRIER_H 1
 
-/* FIXME: arch dependant, x86 version */
-#define smp_wmb()   asm volatile("" ::: "memory")
-
 /* Compiler barrier */
 #define barrier()   asm volatile("" ::: "memory")
 
+#if defined(__i386__) || defined(__x86_64__)
+
+/* x86 only reorders loads with older stores to other locations */
+#define smp_wmb()   barrier()
+#define smp_rmb()   barrier()
+#ifdef __x86_64__
+#define smp_mb()    asm volatile("mfence" ::: "memory")
+#else
+#define smp_mb()    asm volatile("lock; addl $0,0(%%esp)" ::: "memory")
+#endif
+
+#else
+
+#define smp_wmb()   __sync_synchronize()
+#define smp_rmb()   __sync_synchronize()
+#define smp_mb()    __sync_synchronize()
+
+#endif
+
 #endif
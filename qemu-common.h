@@ -162,6 +162,9 @@ int fcntl_setfl(int fd, int flag);
 #define STRTOSZ_DEFSUFFIX_B	'B'
 ssize_t strtosz(const char *nptr, char **end);
 ssize_t strtosz_suffix(const char *nptr, char **end, const char default_suffix);
+size_t buffer_find_nonzero(const void *buf, size_t len);
+bool buffer_is_zero(const void *buf, size_t len);
+void fault_in_pages(const void *buf, size_t len, size_t page_size);
 
 /* path.c */
 void init_paths(const char *prefix);
@@ -328,6 +331,7 @@ void qemu_iovec_reset(QEMUIOVector *qiov);
 void qemu_iovec_to_buffer(QEMUIOVector *qiov, void *buf);
 void qemu_iovec_from_buffer(QEMUIOVector *qiov, const void *buf, size_t count);
 void qemu_iovec_memset(QEMUIOVector *qiov, int c, size_t count);
+size_t qemu_iovec_find_nonzero(QEMUIOVector *qiov, uint64_t skip, size_t size);
 
 struct Monitor;
 typedef struct Monitor Monitor;
@@ -79,6 +79,22 @@ static QemuOptsList qemu_drive_opts = {
         },{
             .name = "readonly",
             .type = QEMU_OPT_BOOL,
+        },{
+            .name = "metadata-cache",
+            .type = QEMU_OPT_SIZE,
+            .help = "size of the image metadata cache (qcow2, qed)",
+        },{
+            .name = "aio-queue-depth",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of outstanding requests (aio=native)",
+        },{
+            .name = "aio-threads",
+            .type = QEMU_OPT_NUMBER,
+            .help = "maximum number of I/O threads (aio=threads)",
+        },{
+            .name = "copy-on-read",
+            .type = QEMU_OPT_BOOL,
+            .help = "copy read backing file data into the image",
         },
         { /* end of list */ }
     },
@@ -31,6 +31,8 @@
 
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include "qemu-thread.h"
 #endif
 
 typedef struct img_cmd_t {
@@ -73,6 +75,9 @@ static void help(void)
            "    name=value format. Use -o ? for an overview of the options supported by the\n"
            "    used format\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-m' is the number of chunks converted in parallel (default 1)\n"
+           "  '-W' allows writes to complete out of order; the target may be less\n"
+           "       sequential, e.g. qcow2 clusters are not allocated in image order\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -493,13 +498,7 @@ static int img_commit(int argc, char **argv)
 
 static int is_not_zero(const uint8_t *sector, int len)
 {
-    int i;
-    len >>= 2;
-    for(i = 0;i < len; i++) {
-        if (((uint32_t *)sector)[i] != 0)
-            return 1;
-    }
-    return 0;
+    return !buffer_is_zero(sector, len);
 }
 
 /*
@@ -518,6 +517,11 @@ static int is_allocated_sectors(const uint8_t *buf, int n, int *pnum)
         return 0;
     }
     v = is_not_zero(buf, 512);
+    if (!v) {
+        /* a run of zero sectors ends at the first non-zero byte */
+        *pnum = buffer_find_nonzero(buf, n * 512) / 512;
+        return 0;
+    }
     for(i = 1; i < n; i++) {
         buf += 512;
         if (v != is_not_zero(buf, 512))
@@ -560,16 +564,511 @@ static int compare_sectors(const uint8_t *buf1, const uint8_t *buf2, int n,
 
 #define IO_BUF_SIZE (2 * 1024 * 1024)
 
+/*
+ * Pipelined conversion: up to 'nb_requests' chunks of IO_BUF_SIZE are in
+ * flight at any time. Each chunk is read with AIO, scanned for zero sectors
+ * (by a pool of threads when there is more than one request) and written
+ * back with AIO. Writes are issued in input order unless out of order
+ * writes were requested, so that allocating formats keep a linear layout.
+ */
+
+#define CONVERT_MAX_REQUESTS 64
+
+enum {
+    CONVERT_IDLE,
+    CONVERT_READING,
+    CONVERT_SCANNING,
+    CONVERT_READY,
+    CONVERT_WRITING,
+};
+
+typedef struct ImgConvertState ImgConvertState;
+
+typedef struct ImgConvertRequest {
+    ImgConvertState *s;
+    int state;
+    int64_t seq;
+    int64_t sector_num;
+    int nb_sectors;
+    BlockDriverState *bs;
+    int64_t bs_sector;
+    uint8_t *buf;
+    struct iovec iov;
+    QEMUIOVector qiov;
+    uint8_t *nonzero;   /* one byte per sector, filled by the scan */
+    int pending_writes;
+    QTAILQ_ENTRY(ImgConvertRequest) next;
+} ImgConvertRequest;
+
+typedef struct ImgConvertWrite {
+    ImgConvertRequest *req;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} ImgConvertWrite;
+
+struct ImgConvertState {
+    BlockDriverState **bs;
+    int bs_n;
+    int bs_i;
+    int64_t bs_offset;
+    uint64_t bs_sectors;
+    BlockDriverState *out_bs;
+    const char *out_baseimg;
+    int has_zero_init;
+    int need_scan;
+    int out_of_order;
+
+    int64_t total_sectors;
+    int64_t sector_num;     /* next sector to be read */
+    int64_t next_seq;       /* sequence number of the next chunk */
+    int64_t write_seq;      /* next chunk to be written in order */
+    int ret;
+
+    int nb_requests;
+    ImgConvertRequest *reqs;
+
+#ifndef _WIN32
+    /* zero detection thread pool */
+    int nb_threads;
+    QemuThread *threads;
+    QemuMutex lock;
+    QemuCond cond;
+    int quit;
+    int notify_fds[2];
+    QTAILQ_HEAD(, ImgConvertRequest) scan_queue;
+    QTAILQ_HEAD(, ImgConvertRequest) scan_done;
+#endif
+    int nb_scanning;
+};
+
+static void convert_scan(ImgConvertRequest *req)
+{
+    int i, v, n;
+
+    for (i = 0; i < req->nb_sectors; i += n) {
+        v = is_allocated_sectors(req->buf + i * 512, req->nb_sectors - i, &n);
+        memset(req->nonzero + i, v, n);
+    }
+}
+
+#ifndef _WIN32
+static void *convert_scan_thread(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    ImgConvertRequest *req;
+    char byte = 0;
+    ssize_t len;
+
+    qemu_mutex_lock(&s->lock);
+    for (;;) {
+        while (QTAILQ_EMPTY(&s->scan_queue) && !s->quit) {
+            qemu_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->quit) {
+            break;
+        }
+        req = QTAILQ_FIRST(&s->scan_queue);
+        QTAILQ_REMOVE(&s->scan_queue, req, next);
+        qemu_mutex_unlock(&s->lock);
+
+        convert_scan(req);
+
+        qemu_mutex_lock(&s->lock);
+        QTAILQ_INSERT_TAIL(&s->scan_done, req, next);
+        do {
+            len = write(s->notify_fds[1], &byte, 1);
+        } while (len == -1 && errno == EINTR);
+    }
+    qemu_mutex_unlock(&s->lock);
+
+    return NULL;
+}
+
+static void convert_scan_notify(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    char buf[64];
+    ssize_t len;
+
+    do {
+        len = read(s->notify_fds[0], buf, sizeof(buf));
+    } while ((len == -1 && errno == EINTR) || len == sizeof(buf));
+}
+
+static int convert_scan_flush(void *opaque)
+{
+    ImgConvertState *s = opaque;
+
+    return s->nb_scanning > 0;
+}
+
+static void convert_collect_scans(ImgConvertState *s)
+{
+    ImgConvertRequest *req;
+
+    if (s->nb_threads == 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    while ((req = QTAILQ_FIRST(&s->scan_done)) != NULL) {
+        QTAILQ_REMOVE(&s->scan_done, req, next);
+        req->state = CONVERT_READY;
+        s->nb_scanning--;
+    }
+    qemu_mutex_unlock(&s->lock);
+}
+
+static int convert_start_threads(ImgConvertState *s, int nb_threads)
+{
+    int i;
+
+    s->nb_threads = 0;
+    if (nb_threads <= 0) {
+        return 0;
+    }
+
+    if (qemu_pipe(s->notify_fds) < 0) {
+        return -errno;
+    }
+    fcntl(s->notify_fds[0], F_SETFL, O_NONBLOCK);
+    qemu_aio_set_fd_handler(s->notify_fds[0], convert_scan_notify, NULL,
+                            convert_scan_flush, NULL, s);
+
+    qemu_mutex_init(&s->lock);
+    qemu_cond_init(&s->cond);
+    QTAILQ_INIT(&s->scan_queue);
+    QTAILQ_INIT(&s->scan_done);
+
+    s->threads = qemu_mallocz(nb_threads * sizeof(QemuThread));
+    for (i = 0; i < nb_threads; i++) {
+        qemu_thread_create(&s->threads[i], convert_scan_thread, s);
+    }
+    s->nb_threads = nb_threads;
+
+    return 0;
+}
+
+static void convert_stop_threads(ImgConvertState *s)
+{
+    int i;
+
+    if (s->nb_threads == 0) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->lock);
+    s->quit = 1;
+    qemu_cond_broadcast(&s->cond);
+    qemu_mutex_unlock(&s->lock);
+
+    for (i = 0; i < s->nb_threads; i++) {
+        qemu_thread_join(&s->threads[i]);
+    }
+    qemu_free(s->threads);
+
+    qemu_aio_set_fd_handler(s->notify_fds[0], NULL, NULL, NULL, NULL, NULL);
+    close(s->notify_fds[0]);
+    close(s->notify_fds[1]);
+    s->nb_threads = 0;
+}
+#else
+static void convert_collect_scans(ImgConvertState *s)
+{
+}
+#endif
+
+static void convert_queue_scan(ImgConvertState *s, ImgConvertRequest *req)
+{
+#ifndef _WIN32
+    if (s->nb_threads > 0) {
+        req->state = CONVERT_SCANNING;
+        s->nb_scanning++;
+        qemu_mutex_lock(&s->lock);
+        QTAILQ_INSERT_TAIL(&s->scan_queue, req, next);
+        qemu_cond_signal(&s->cond);
+        qemu_mutex_unlock(&s->lock);
+        return;
+    }
+#endif
+    convert_scan(req);
+    req->state = CONVERT_READY;
+}
+
+static void convert_read_cb(void *opaque, int ret)
+{
+    ImgConvertRequest *req = opaque;
+    ImgConvertState *s = req->s;
+
+    if (ret < 0) {
+        if (s->ret == 0) {
+            error_report("error while reading");
+            s->ret = ret;
+        }
+        req->state = CONVERT_IDLE;
+        return;
+    }
+
+    if (s->need_scan) {
+        convert_queue_scan(s, req);
+    } else {
+        req->state = CONVERT_READY;
+    }
+}
+
+static void convert_write_cb(void *opaque, int ret)
+{
+    ImgConvertWrite *w = opaque;
+    ImgConvertRequest *req = w->req;
+    ImgConvertState *s = req->s;
+
+    if (ret < 0 && s->ret == 0) {
+        error_report("error while writing");
+        s->ret = ret;
+    }
+    qemu_free(w);
+
+    if (--req->pending_writes == 0) {
+        req->state = CONVERT_IDLE;
+    }
+}
+
+/* Picks the next chunk of the input. Returns 0 once everything was read. */
+static int convert_next_chunk(ImgConvertState *s, ImgConvertRequest *req)
+{
+    int64_t nb_sectors;
+    int n, n1;
+
+    for (;;) {
+        nb_sectors = s->total_sectors - s->sector_num;
+        if (nb_sectors <= 0) {
+            return 0;
+        }
+        n = MIN(nb_sectors, IO_BUF_SIZE / 512);
+
+        while (s->sector_num - s->bs_offset >= s->bs_sectors) {
+            s->bs_i++;
+            assert(s->bs_i < s->bs_n);
+            s->bs_offset += s->bs_sectors;
+            bdrv_get_geometry(s->bs[s->bs_i], &s->bs_sectors);
+        }
+
+        if (n > s->bs_offset + s->bs_sectors - s->sector_num) {
+            n = s->bs_offset + s->bs_sectors - s->sector_num;
+        }
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (s->has_zero_init && s->out_baseimg) {
+            if (!bdrv_is_allocated(s->bs[s->bs_i], s->sector_num - s->bs_offset,
+                                   n, &n1)) {
+                s->sector_num += n1;
+                continue;
+            }
+            /* The next 'n1' sectors are allocated in the input image. Copy
+               only those as they may be followed by unallocated sectors. */
+            n = n1;
+        }
+        break;
+    }
+
+    req->seq = s->next_seq++;
+    req->sector_num = s->sector_num;
+    req->nb_sectors = n;
+    req->bs = s->bs[s->bs_i];
+    req->bs_sector = s->sector_num - s->bs_offset;
+    s->sector_num += n;
+
+    return 1;
+}
+
+static int convert_start_read(ImgConvertState *s, ImgConvertRequest *req)
+{
+    BlockDriverAIOCB *acb;
+
+    if (!convert_next_chunk(s, req)) {
+        return 0;
+    }
+
+    req->state = CONVERT_READING;
+    req->iov.iov_base = req->buf;
+    req->iov.iov_len = req->nb_sectors * 512;
+    qemu_iovec_init_external(&req->qiov, &req->iov, 1);
+
+    acb = bdrv_aio_readv(req->bs, req->bs_sector, &req->qiov, req->nb_sectors,
+                         convert_read_cb, req);
+    if (!acb) {
+        error_report("error while reading");
+        s->ret = -EIO;
+        req->state = CONVERT_IDLE;
+        return 0;
+    }
+
+    return 1;
+}
+
+static void convert_write_run(ImgConvertState *s, ImgConvertRequest *req,
+                              int start, int n)
+{
+    ImgConvertWrite *w;
+    BlockDriverAIOCB *acb;
+
+    w = qemu_malloc(sizeof(*w));
+    w->req = req;
+    w->iov.iov_base = req->buf + start * 512;
+    w->iov.iov_len = n * 512;
+    qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+
+    req->pending_writes++;
+    acb = bdrv_aio_writev(s->out_bs, req->sector_num + start, &w->qiov, n,
+                          convert_write_cb, w);
+    if (!acb) {
+        convert_write_cb(w, -EIO);
+    }
+}
+
+static void convert_start_write(ImgConvertState *s, ImgConvertRequest *req)
+{
+    int i, n;
+
+    req->state = CONVERT_WRITING;
+    req->pending_writes = 1;
+
+    /* If the output image is being created as a copy on write image,
+       copy all sectors even the ones containing only NUL bytes,
+       because they may differ from the sectors in the base image.
+
+       If the output is to a host device, we also write out
+       sectors that are entirely 0, since whatever data was
+       already there is garbage, not 0s. */
+    if (!s->need_scan) {
+        convert_write_run(s, req, 0, req->nb_sectors);
+    } else {
+        for (i = 0; i < req->nb_sectors; i += n) {
+            for (n = 1; i + n < req->nb_sectors &&
+                 req->nonzero[i + n] == req->nonzero[i]; n++) {
+                /* nothing */
+            }
+            if (req->nonzero[i]) {
+                convert_write_run(s, req, i, n);
+            }
+        }
+    }
+
+    /* drop the reference that covered the submission loop */
+    if (--req->pending_writes == 0) {
+        req->state = CONVERT_IDLE;
+    }
+}
+
+/* Issues the writes of finished reads and refills idle slots */
+static void convert_schedule(ImgConvertState *s)
+{
+    ImgConvertRequest *req;
+    int i, progress;
+
+    convert_collect_scans(s);
+
+    do {
+        progress = 0;
+        for (i = 0; i < s->nb_requests; i++) {
+            req = &s->reqs[i];
+            if (req->state != CONVERT_READY) {
+                continue;
+            }
+            if (s->ret < 0) {
+                /* drop the data, nothing more is written after an error */
+                req->state = CONVERT_IDLE;
+                continue;
+            }
+            if (!s->out_of_order && req->seq != s->write_seq) {
+                continue;
+            }
+            s->write_seq++;
+            convert_start_write(s, req);
+            progress = 1;
+        }
+    } while (progress && !s->out_of_order);
+
+    for (i = 0; i < s->nb_requests && s->ret == 0; i++) {
+        req = &s->reqs[i];
+        if (req->state == CONVERT_IDLE) {
+            if (!convert_start_read(s, req)) {
+                break;
+            }
+        }
+    }
+}
+
+static int convert_busy(ImgConvertState *s)
+{
+    int i;
+
+    for (i = 0; i < s->nb_requests; i++) {
+        if (s->reqs[i].state != CONVERT_IDLE) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int convert_pipelined(ImgConvertState *s, int nb_requests)
+{
+    int i;
+
+    s->nb_requests = nb_requests;
+    s->reqs = qemu_mallocz(nb_requests * sizeof(ImgConvertRequest));
+    for (i = 0; i < nb_requests; i++) {
+        s->reqs[i].s = s;
+        s->reqs[i].buf = qemu_blockalign(s->out_bs, IO_BUF_SIZE);
+        s->reqs[i].nonzero = qemu_malloc(IO_BUF_SIZE / 512);
+    }
+
+#ifndef _WIN32
+    if (s->need_scan && nb_requests > 1) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (convert_start_threads(s, MIN(nb_requests, MAX(ncpus, 1))) < 0) {
+            s->nb_threads = 0;
+        }
+    }
+#endif
+
+    for (;;) {
+        convert_schedule(s);
+        if (!convert_busy(s)) {
+            break;
+        }
+        qemu_aio_wait();
+    }
+
+    /* on errors, wait for whatever is still in flight */
+    qemu_aio_flush();
+
+#ifndef _WIN32
+    convert_stop_threads(s);
+#endif
+
+    for (i = 0; i < nb_requests; i++) {
+        qemu_vfree(s->reqs[i].buf);
+        qemu_free(s->reqs[i].nonzero);
+    }
+    qemu_free(s->reqs);
+
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, n, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int nb_requests = 1, out_of_order = 0;
     const char *fmt, *out_fmt, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
     int64_t total_sectors, nb_sectors, sector_num, bs_offset;
     uint64_t bs_sectors;
     uint8_t * buf = NULL;
-    const uint8_t *buf1;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
@@ -581,7 +1080,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:m:W");
         if (c == -1) {
             break;
         }
@@ -616,6 +1115,17 @@ static int img_convert(int argc, char **argv)
         case 's':
             snapshot_name = optarg;
             break;
+        case 'm':
+            nb_requests = atoi(optarg);
+            if (nb_requests < 1 || nb_requests > CONVERT_MAX_REQUESTS) {
+                error_report("Invalid number of parallel requests '%s' "
+                             "(1 to %d)", optarg, CONVERT_MAX_REQUESTS);
+                return 1;
+            }
+            break;
+        case 'W':
+            out_of_order = 1;
+            break;
         }
     }
 
@@ -829,85 +1339,32 @@ static int img_convert(int argc, char **argv)
             }
             sector_num += n;
         }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
+        /* signal EOF to align, and write the clusters still queued */
+        ret = bdrv_write_compressed(out_bs, 0, NULL, 0);
+        if (ret < 0) {
+            error_report("error while compressing: %s", strerror(-ret));
+            goto out;
+        }
     } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
-
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
-
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading");
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors(buf1, n, &n1)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing");
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
+        ImgConvertState cs;
+
+        memset(&cs, 0, sizeof(cs));
+        cs.bs = bs;
+        cs.bs_n = bs_n;
+        cs.bs_sectors = bs_sectors;
+        cs.out_bs = out_bs;
+        cs.out_baseimg = out_baseimg;
+        cs.has_zero_init = bdrv_has_zero_init(out_bs);
+        /* NOTE: at the same time we convert, we do not write zero
+           sectors to have a chance to compress the image. Ideally, we
+           should add a specific call to have the info to go faster */
+        cs.need_scan = cs.has_zero_init && !out_baseimg;
+        cs.out_of_order = out_of_order;
+        cs.total_sectors = total_sectors;
+
+        ret = convert_pipelined(&cs, nb_requests);
+        if (ret < 0) {
+            goto out;
         }
     }
 out:
@@ -120,7 +120,8 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|unsafe][,format=f]\n"
     "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
-    "       [,readonly=on|off]\n"
+    "       [,readonly=on|off][,metadata-cache=size][,aio-queue-depth=n]\n"
+    "       [,aio-threads=n][,copy-on-read=on|off]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -160,6 +161,25 @@ an untrusted format header.
 This option specifies the serial number to assign to the device.
 @item addr=@var{addr}
 Specify the controller's PCI address (if=virtio only).
+@item metadata-cache=@var{size}
+Size of the cache the image format keeps for its own metadata (L2 tables and
+refcount blocks for qcow2), with an optional k, M or G suffix. The default is
+4M, which maps 32 GB of a qcow2 image with 64k clusters. QED caches its L2
+tables in it, with a default of 32M (256 GB with the default cluster and table
+sizes), but never more than the whole image needs.
+@item aio-queue-depth=@var{n}
+Number of requests that may be outstanding on the host with @option{aio=native}
+(default 128). Requests that virtio-blk takes from the guest in one
+notification are passed to the host with a single system call.
+@item aio-threads=@var{n}
+Maximum number of threads that perform the I/O of this drive with
+@option{aio=threads} (default 64). Each drive has its own threads, which
+are started on demand and run on the host CPUs that QEMU was started on.
+@item copy-on-read=@var{copy-on-read}
+@var{copy-on-read} is "on" or "off" (default). When on, data that the guest
+reads from the backing file is also written into the image, so later reads
+of the same range don't go to the backing file. See also the
+@code{block_stream} monitor command.
 @end table
 
 By default, writethrough caching is used for all block device.  This means that
@@ -1050,7 +1070,7 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "-net tap[,vlan=n][,name=str],ifname=name\n"
     "                connect the host TAP network interface to VLAN 'n'\n"
 #else
-    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h]\n"
+    "-net tap[,vlan=n][,name=str][,fd=h][,ifname=name][,script=file][,downscript=dfile][,sndbuf=nbytes][,vnet_hdr=on|off][,vhost=on|off][,vhostfd=h][,queues=n][,rx_burst=n]\n"
     "                connect the host TAP network interface to VLAN 'n' and use the\n"
     "                network scripts 'file' (default=" DEFAULT_NETWORK_SCRIPT ")\n"
     "                and 'dfile' (default=" DEFAULT_NETWORK_DOWN_SCRIPT ")\n"
@@ -1062,6 +1082,8 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                use vnet_hdr=on to make the lack of IFF_VNET_HDR support an error condition\n"
     "                use vhost=on to enable experimental in kernel accelerator\n"
     "                use 'vhostfd=h' to connect to an already opened vhost net device\n"
+    "                use 'queues=n' to open a multiqueue TAP interface with n queues (-netdev only)\n"
+    "                use 'rx_burst=n' to read at most n packets per wakeup (default=64)\n"
 #endif
     "-net socket[,vlan=n][,name=str][,fd=h][,listen=[host]:port][,connect=host:port]\n"
     "                connect the vlan 'n' to another VLAN using a socket connection\n"
@@ -1241,6 +1263,14 @@ qemu linux.img -net nic,vlan=0 -net tap,vlan=0,ifname=tap0 \
                -net nic,vlan=1 -net tap,vlan=1,ifname=tap1
 @end example
 
+With @option{-netdev}, @option{queues}=@var{n} opens @var{n} queues of a
+multiqueue TAP interface.  Queue @var{i} is a netdev of its own named
+@var{id}.@var{i}; virtio-net uses all of them as separate queue pairs:
+@example
+qemu linux.img -netdev tap,id=net0,queues=4 \
+               -device virtio-net-pci,netdev=net0
+@end example
+
 @item -net socket[,vlan=@var{n}][,name=@var{name}][,fd=@var{h}] [,listen=[@var{host}]:@var{port}][,connect=@var{host}:@var{port}]
 
 Connect the VLAN @var{n} to a remote VLAN in another QEMU virtual
@@ -2221,6 +2251,32 @@ STEXI
 Set TB size.
 ETEXI
 
+DEF("tcache", HAS_ARG, QEMU_OPTION_tcache, \
+    "-tcache file    keep translated code in a persistent cache file\n",
+    QEMU_ARCH_ALL)
+STEXI
+@item -tcache @var{file}
+@findex -tcache
+Keep the output of the translator front end in @var{file}, which is created
+if needed and shared by all emulated cores. Blocks whose guest code is
+unchanged are not decoded again, neither by other cores nor by later runs
+of the same executable. The file is reset when another executable opens it.
+ETEXI
+
+DEF("translate-threads", HAS_ARG, QEMU_OPTION_translate_threads, \
+    "-translate-threads n\n"
+    "                translate jump targets ahead of time in n threads\n",
+    QEMU_ARCH_I386)
+STEXI
+@item -translate-threads @var{n}
+@findex -translate-threads
+Start @var{n} translator threads that translate the targets of direct jumps
+of new blocks before the emulated cores reach them, using spare host cores.
+The emulated cores are spread over the threads. An eighth of the code buffer
+of each core is reserved for these blocks. @code{info jit} shows how many
+blocks were served ahead of time and how many were translated on demand.
+ETEXI
+
 DEF("incoming", HAS_ARG, QEMU_OPTION_incoming, \
     "-incoming p     prepare for incoming migration, listen on port p\n",
     QEMU_ARCH_ALL)
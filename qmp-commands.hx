@@ -431,13 +431,15 @@ EQMP
 
     {
         .name       = "migrate",
-        .args_type  = "detach:-d,blk:-b,inc:-i,uri:s",
-        .params     = "[-d] [-b] [-i] uri",
+        .args_type  = "detach:-d,blk:-b,inc:-i,postcopy:-p,uri:s",
+        .params     = "[-d] [-b] [-i] [-p] uri",
         .help       = "migrate to URI (using -d to not wait for completion)"
 		      "\n\t\t\t -b for migration without shared storage with"
 		      " full copy of disk\n\t\t\t -i for migration without "
 		      "shared storage with incremental copy of disk "
-		      "(base image shared between src and destination)",
+		      "(base image shared between src and destination)"
+		      "\n\t\t\t -p for post-copy migration, the guest runs "
+		      "on the destination before its memory is copied",
         .user_print = monitor_user_noop,	
 	.mhandler.cmd_new = do_migrate,
     },
@@ -452,6 +454,9 @@ Arguments:
 
 - "blk": block migration, full disk copy (json-bool, optional)
 - "inc": incremental disk copy (json-bool, optional)
+- "postcopy": post-copy migration, the guest is resumed on the destination
+  after one pass over its memory and its pages are fetched on demand; only
+  for tcp: and unix: URIs, and not with "blk" or "inc" (json-bool, optional)
 - "uri": Destination URI (json-string)
 
 Example:
@@ -482,7 +487,8 @@ SQMP
 migrate_cancel
 --------------
 
-Cancel the current migration.
+Cancel the current migration.  Fails for a post-copy migration once the
+guest runs on the destination.
 
 Arguments: None.
 
@@ -543,6 +549,91 @@ Example:
 -> { "execute": "migrate_set_downtime", "arguments": { "value": 0.1 } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "migrate_set_compression",
+        .args_type  = "threads:i,level:i?",
+        .params     = "threads [level]",
+        .help       = "set the number of threads compressing migrated pages",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_compression,
+    },
+
+SQMP
+migrate_set_compression
+-----------------------
+
+Compress the RAM pages of the next migrations.  The destination must support
+compressed pages.
+
+Arguments:
+
+- "threads": number of compression threads, 0 to disable (json-int)
+- "level": zlib compression level, 1 to 9, default 1 (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate_set_compression", "arguments": { "threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_cache_size",
+        .args_type  = "value:o",
+        .params     = "value",
+        .help       = "set the size of the cache of sent pages",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_cache_size,
+    },
+
+SQMP
+migrate_set_cache_size
+----------------------
+
+Set the size of the cache of RAM pages sent by the next migrations.  Pages
+found in the cache are sent as their differences with the cached copy.  The
+destination must support delta encoded pages.
+
+Arguments:
+
+- "value": cache size in bytes, 0 to disable (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_cache_size", "arguments": { "value": 67108864 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "migrate_set_streams",
+        .args_type  = "count:i",
+        .params     = "count",
+        .help       = "set the number of connections for migrated pages",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_migrate_set_streams,
+    },
+
+SQMP
+migrate_set_streams
+-------------------
+
+Send the RAM pages of the next migrations over parallel connections of their
+own.  Only for tcp: and unix: migrations; the bandwidth limit is shared
+between the connections, and pages are neither compressed nor delta encoded.
+
+Arguments:
+
+- "count": number of connections, 1 to 16, 1 to send the pages with the
+  rest of the migration (json-int)
+
+Example:
+
+-> { "execute": "migrate_set_streams", "arguments": { "count": 4 } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -735,6 +826,66 @@ Example:
                                                "password": "12345" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "block_stream",
+        .args_type  = "device:B,speed:o?",
+        .params     = "device [speed]",
+        .help       = "copy the backing files into device in the background",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream,
+    },
+
+SQMP
+block_stream
+------------
+
+Copy all data that a device reads from its backing files into its image in
+the background. Once everything has been copied, the backing file is removed
+from the image and the BLOCK_STREAM_COMPLETED event is emitted.
+
+Arguments:
+
+- "device": device name (json-string)
+- "speed": maximum copy rate in bytes per second (json-int, optional)
+
+Example:
+
+-> { "execute": "block_stream", "arguments": { "device": "virtio0",
+                                               "speed": 10485760 } }
+<- { "return": {} }
+
+Note: a device can only have one stream at a time.
+
+EQMP
+
+    {
+        .name       = "block_stream_cancel",
+        .args_type  = "device:B",
+        .params     = "device",
+        .help       = "stop streaming the backing files into device",
+        .user_print = monitor_user_noop,
+        .mhandler.cmd_new = do_block_stream_cancel,
+    },
+
+SQMP
+block_stream_cancel
+-------------------
+
+Stop the stream of a device. Data copied so far stays in the image, which
+keeps its backing file. The BLOCK_STREAM_COMPLETED event is emitted with
+"cancelled" set.
+
+Arguments:
+
+- "device": device name (json-string)
+
+Example:
+
+-> { "execute": "block_stream_cancel", "arguments": { "device": "virtio0" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1051,6 +1202,28 @@ Each json-object contain the following:
     - "wr_operations": write operations (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "metadata_cache_hits": image metadata lookups served from the format
+                             driver's cache (json-int, optional)
+    - "metadata_cache_misses": image metadata lookups that had to read the
+                               image file (json-int, optional)
+    - "metadata_cache_writes": cached metadata writes to the image file
+                               (json-int, optional)
+    - "aio_submits": number of host AIO submission calls, with aio=native
+                     (json-int, optional)
+    - "aio_submitted_requests": requests passed in these calls
+                                (json-int, optional)
+    - "aio_max_batch": largest number of requests passed in one call
+                       (json-int, optional)
+    - "aio_latency_us": host I/O requests by completion time, with
+                        aio=threads; element i counts the requests that
+                        took 2^i to 2^(i+1) microseconds, the first and
+                        last elements also count shorter and longer ones
+                        (json-array of json-int, optional)
+    - "copy_on_read_bytes": bytes copied from backing files into the image
+                            by copy-on-read and streaming (json-int, optional)
+    - "bounce_bytes": bytes copied through bounce buffers because a request
+                      was not aligned as cache=none requires
+                      (json-int, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -1115,6 +1288,36 @@ Example:
 
 EQMP
 
+SQMP
+query-block-stream
+------------------
+
+Show the backing file streams in progress.
+
+Return a json-array. Each stream is represented by a json-object, which
+contains:
+
+- "device": device name (json-string)
+- "offset": bytes of the image looked at so far (json-int)
+- "len": image size in bytes (json-int)
+- "speed": maximum copy rate in bytes per second, 0 if unlimited (json-int)
+
+Example:
+
+-> { "execute": "query-block-stream" }
+<- {
+      "return":[
+         {
+            "device":"virtio0",
+            "offset":536870912,
+            "len":10737418240,
+            "speed":10485760
+         }
+      ]
+   }
+
+EQMP
+
 SQMP
 query-cpus
 ----------
@@ -1623,6 +1826,26 @@ The main json-object contains the following:
          - "transferred": amount transferred (json-int)
          - "remaining": amount remaining (json-int)
          - "total": total (json-int)
+- "compression": only present if "status" is "active" and pages are
+  compressed, it is a json-object with the following information:
+         - "pages": number of pages sent compressed (json-int)
+         - "ratio": compressed size in percent of the original size, in the
+           last iteration (json-int)
+         - "throughput": bytes compressed per second in the last
+           iteration (json-int)
+- "xbzrle": only present if "status" is "active" and the page cache is
+  enabled, it is a json-object with the following information:
+         - "pages": number of pages sent as a delta (json-int)
+         - "cache-hits": number of pages found in the cache (json-int)
+         - "cache-misses": number of pages not found in the cache (json-int)
+         - "overflows": number of pages whose delta was too large
+           (json-int)
+         - "saved": bytes saved by the delta encoding (json-int)
+- "postcopy": only present if "status" is "active" and it is a post-copy
+  migration, it is a json-object with the following information:
+         - "active": true once the guest runs on the destination (json-bool)
+         - "requested": number of pages sent on demand (json-int)
+         - "pushed": number of pages sent in the background (json-int)
 
 Examples:
 
@@ -333,6 +333,60 @@ QEMUFile *qemu_fopen_socket(int fd)
     return s->file;
 }
 
+/* Memory buffer, for state that is sent and read as a whole */
+typedef struct QEMUFileBuffer
+{
+    uint8_t *data;
+    int64_t size;
+    QEMUFile *file;
+} QEMUFileBuffer;
+
+static int buffer_put_buffer(void *opaque, const uint8_t *buf,
+                             int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    s->data = qemu_realloc(s->data, pos + size);
+    memcpy(s->data + pos, buf, size);
+    s->size = pos + size;
+    return size;
+}
+
+static int buffer_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *s = opaque;
+
+    size = MIN(size, s->size - pos);
+    memcpy(buf, s->data + pos, size);
+    return size;
+}
+
+static int buffer_close(void *opaque)
+{
+    QEMUFileBuffer *s = opaque;
+
+    qemu_free(s->data);
+    qemu_free(s);
+    return 0;
+}
+
+/* Opens data for reading, the file takes ownership of it */
+static QEMUFileBuffer *qemu_fopen_buffer(uint8_t *data, int64_t size)
+{
+    QEMUFileBuffer *s = qemu_mallocz(sizeof(QEMUFileBuffer));
+
+    s->data = data;
+    s->size = size;
+    if (data) {
+        s->file = qemu_fopen_ops(s, NULL, buffer_get_buffer, buffer_close,
+                                 NULL, NULL, NULL);
+    } else {
+        s->file = qemu_fopen_ops(s, buffer_put_buffer, NULL, buffer_close,
+                                 NULL, NULL, NULL);
+    }
+    return s;
+}
+
 static int file_put_buffer(void *opaque, const uint8_t *buf,
                             int64_t pos, int size)
 {
@@ -1426,6 +1480,7 @@ static int vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_DEFERRED             0x06
 
 int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared)
@@ -1505,12 +1560,9 @@ int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f)
     return 0;
 }
 
-int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+static void qemu_savevm_state_live_end(Monitor *mon, QEMUFile *f)
 {
     SaveStateEntry *se;
-    int r;
-
-    cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (se->save_live_state == NULL)
@@ -1522,6 +1574,12 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
 
         se->save_live_state(mon, f, QEMU_VM_SECTION_END, se->opaque);
     }
+}
+
+static int qemu_savevm_state_devices(Monitor *mon, QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int r;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1549,6 +1607,58 @@ int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
     }
 
     qemu_put_byte(f, QEMU_VM_EOF);
+    return 0;
+}
+
+int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f)
+{
+    int r;
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+
+    r = qemu_savevm_state_devices(mon, f);
+    if (r < 0) {
+        return r;
+    }
+
+    if (qemu_file_has_error(f))
+        return -EIO;
+
+    return 0;
+}
+
+/*
+ * Same as qemu_savevm_state_complete, for live sections that go on once
+ * the destination is running (post-copy migration).  The device sections
+ * are sent as a single block, which the destination reads as a whole and
+ * loads with qemu_loadvm_state_deferred once the live sections are ready
+ * to serve it: loading a device may need guest memory that has yet to
+ * come over the same stream.
+ */
+int qemu_savevm_state_complete_deferred(Monitor *mon, QEMUFile *f)
+{
+    QEMUFileBuffer *b;
+    int r;
+
+    cpu_synchronize_all_states();
+
+    qemu_savevm_state_live_end(mon, f);
+
+    b = qemu_fopen_buffer(NULL, 0);
+    r = qemu_savevm_state_devices(mon, b->file);
+    qemu_fflush(b->file);
+    if (r == 0) {
+        qemu_put_byte(f, QEMU_VM_DEFERRED);
+        qemu_put_be32(f, b->size);
+        qemu_put_buffer(f, b->data, b->size);
+        qemu_put_byte(f, QEMU_VM_EOF);
+    }
+    qemu_fclose(b->file);
+    if (r < 0) {
+        return r;
+    }
 
     if (qemu_file_has_error(f))
         return -EIO;
@@ -1683,27 +1793,19 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+typedef QLIST_HEAD(, LoadStateEntry) LoadStateList;
+
+/* device sections of a post-copy migration, see qemu_loadvm_state_deferred */
+static uint8_t *loadvm_deferred;
+static uint32_t loadvm_deferred_size;
+
+/* Loads sections up to the end of the stream */
+static int qemu_loadvm_sections(QEMUFile *f, LoadStateList *handlers)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
-    LoadStateEntry *le, *new_le;
+    LoadStateEntry *le;
     uint8_t section_type;
-    unsigned int v;
     int ret;
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
-
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
-    }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
-
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
         SaveStateEntry *se;
@@ -1725,16 +1827,14 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Add entry */
@@ -1743,53 +1843,90 @@ int qemu_loadvm_state(QEMUFile *f)
             le->se = se;
             le->section_id = section_id;
             le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            QLIST_INSERT_HEAD(handlers, le, entry);
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
             section_id = qemu_get_be32(f);
 
-            QLIST_FOREACH(le, &loadvm_handlers, entry) {
+            QLIST_FOREACH(le, handlers, entry) {
                 if (le->section_id == section_id) {
                     break;
                 }
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_DEFERRED:
+            if (loadvm_deferred) {
+                fprintf(stderr, "Duplicate deferred savevm sections\n");
+                return -EINVAL;
             }
+            loadvm_deferred_size = qemu_get_be32(f);
+            loadvm_deferred = qemu_malloc(loadvm_deferred_size);
+            qemu_get_buffer(f, loadvm_deferred, loadvm_deferred_size);
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
+    return 0;
+}
 
-    cpu_synchronize_all_post_init();
-
-    ret = 0;
+static void qemu_loadvm_free_handlers(LoadStateList *handlers)
+{
+    LoadStateEntry *le, *new_le;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+    QLIST_FOREACH_SAFE(le, handlers, entry, new_le) {
         QLIST_REMOVE(le, entry);
         qemu_free(le);
     }
+}
+
+int qemu_loadvm_state(QEMUFile *f)
+{
+    LoadStateList loadvm_handlers = QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    unsigned int v;
+    int ret;
+
+    qemu_free(loadvm_deferred);
+    loadvm_deferred = NULL;
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_sections(f, &loadvm_handlers);
+    if (ret == 0 && !loadvm_deferred) {
+        cpu_synchronize_all_post_init();
+    }
+
+    qemu_loadvm_free_handlers(&loadvm_handlers);
 
     if (qemu_file_has_error(f))
         ret = -EIO;
@@ -1797,6 +1934,42 @@ out:
     return ret;
 }
 
+/*
+ * Loads the device sections that qemu_loadvm_state left aside, if any.
+ * Returns 0 when there were none.
+ */
+int qemu_loadvm_state_deferred(void)
+{
+    LoadStateList loadvm_handlers = QLIST_HEAD_INITIALIZER(loadvm_handlers);
+    QEMUFileBuffer *b;
+    int ret;
+
+    if (!loadvm_deferred) {
+        return 0;
+    }
+
+    b = qemu_fopen_buffer(loadvm_deferred, loadvm_deferred_size);
+    loadvm_deferred = NULL;
+
+    ret = qemu_loadvm_sections(b->file, &loadvm_handlers);
+    if (ret == 0) {
+        cpu_synchronize_all_post_init();
+    }
+
+    qemu_loadvm_free_handlers(&loadvm_handlers);
+    if (qemu_file_has_error(b->file)) {
+        ret = -EIO;
+    }
+    qemu_fclose(b->file);
+    return ret;
+}
+
+/* Whether the stream loaded last carries deferred device sections */
+int qemu_loadvm_has_deferred(void)
+{
+    return loadvm_deferred != NULL;
+}
+
 static int bdrv_snapshot_find(BlockDriverState *bs, QEMUSnapshotInfo *sn_info,
                               const char *name)
 {
@@ -137,13 +137,16 @@ DATA_TYPE REGPARM glue(glue(__ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
             res = glue(glue(ld, USUFFIX), _raw)((uint8_t *)(long)(addr+addend));
         }
     } else {
-        /* the page is not in the TLB : fill it */
+        /* the page is not in the TLB : try the victim TLB, then fill it */
         retaddr = GETPC();
 #ifdef ALIGNED_ONLY
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
 #endif
-        tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ),
+                            addr & TARGET_PAGE_MASK))
+            tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         goto redo;
     }
     return res;
@@ -192,8 +195,11 @@ static DATA_TYPE glue(glue(slow_ld, SUFFIX), MMUSUFFIX)(target_ulong addr,
             res = glue(glue(ld, USUFFIX), _raw)((uint8_t *)(long)(addr+addend));
         }
     } else {
-        /* the page is not in the TLB : fill it */
-        tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
+        /* the page is not in the TLB : try the victim TLB, then fill it */
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, ADDR_READ),
+                            addr & TARGET_PAGE_MASK))
+            tlb_fill(addr, READ_ACCESS_TYPE, mmu_idx, retaddr);
         goto redo;
     }
     return res;
@@ -282,13 +288,16 @@ void REGPARM glue(glue(__st, SUFFIX), MMUSUFFIX)(target_ulong addr,
             glue(glue(st, SUFFIX), _raw)((uint8_t *)(long)(addr+addend), val);
         }
     } else {
-        /* the page is not in the TLB : fill it */
+        /* the page is not in the TLB : try the victim TLB, then fill it */
         retaddr = GETPC();
 #ifdef ALIGNED_ONLY
         if ((addr & (DATA_SIZE - 1)) != 0)
             do_unaligned_access(addr, 1, mmu_idx, retaddr);
 #endif
-        tlb_fill(addr, 1, mmu_idx, retaddr);
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write),
+                            addr & TARGET_PAGE_MASK))
+            tlb_fill(addr, 1, mmu_idx, retaddr);
         goto redo;
     }
 }
@@ -334,8 +343,11 @@ static void glue(glue(slow_st, SUFFIX), MMUSUFFIX)(target_ulong addr,
             glue(glue(st, SUFFIX), _raw)((uint8_t *)(long)(addr+addend), val);
         }
     } else {
-        /* the page is not in the TLB : fill it */
-        tlb_fill(addr, 1, mmu_idx, retaddr);
+        /* the page is not in the TLB : try the victim TLB, then fill it */
+        if (!tlb_victim_hit(env, mmu_idx, index,
+                            offsetof(CPUTLBEntry, addr_write),
+                            addr & TARGET_PAGE_MASK))
+            tlb_fill(addr, 1, mmu_idx, retaddr);
         goto redo;
     }
 }
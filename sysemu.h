@@ -43,6 +43,15 @@ void vm_stop(int reason);
 uint64_t ram_bytes_remaining(void);
 uint64_t ram_bytes_transferred(void);
 uint64_t ram_bytes_total(void);
+void ram_compress_stats(uint64_t *pages, uint64_t *ratio,
+                        uint64_t *throughput);
+void ram_xbzrle_stats(uint64_t *pages, uint64_t *hits, uint64_t *misses,
+                      uint64_t *overflows, uint64_t *saved);
+int ram_postcopy_handle_requests(QEMUFile *f, const uint8_t *buf, int len);
+int ram_postcopy_push(QEMUFile *f);
+void ram_postcopy_stats(uint64_t *requested, uint64_t *pushed);
+int ram_postcopy_incoming(void);
+int ram_postcopy_incoming_start(QEMUFile *f, int fd);
 
 int64_t cpu_get_ticks(void);
 void cpu_enable_ticks(void);
@@ -79,8 +88,11 @@ int qemu_savevm_state_begin(Monitor *mon, QEMUFile *f, int blk_enable,
                             int shared);
 int qemu_savevm_state_iterate(Monitor *mon, QEMUFile *f);
 int qemu_savevm_state_complete(Monitor *mon, QEMUFile *f);
+int qemu_savevm_state_complete_deferred(Monitor *mon, QEMUFile *f);
 void qemu_savevm_state_cancel(Monitor *mon, QEMUFile *f);
 int qemu_loadvm_state(QEMUFile *f);
+int qemu_loadvm_state_deferred(void);
+int qemu_loadvm_has_deferred(void);
 
 /* SLIRP */
 void do_info_slirp(Monitor *mon);
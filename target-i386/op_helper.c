@@ -21,6 +21,9 @@
 #include "exec-all.h"
 #include "host-utils.h"
 #include "ioport.h"
+#ifdef CONFIG_COREMU
+#include "cm-spec.h"
+#endif
 
 //#define DEBUG_PCALL
 
@@ -4823,6 +4826,9 @@ void tlb_fill(target_ulong addr, int is_write, int mmu_idx, void *retaddr)
     unsigned long pc;
     CPUX86State *saved_env;
 
+#ifdef CONFIG_COREMU
+    cm_spec_tlb_miss();
+#endif
     /* XXX: hack to restore env in all cases, even if not called from
        generated code */
     saved_env = env;
@@ -2215,4 +2215,17 @@ void cm_inject_invalidate_code(TranslationBlock *tb)
     tcg_out_op(s, INDEX_op_exit_tb, args, NULL);
 }
 
+/* Number of TCGArg used by op 'opc' whose arguments start at 'args'. */
+int cm_tcg_op_nb_args(int opc, const TCGArg *args)
+{
+    const TCGOpDef *def = &tcg_op_defs[opc];
+
+    if (opc == INDEX_op_call) {
+        return 1 + (args[0] >> 16) + (args[0] & 0xffff) + def->nb_cargs;
+    } else if (opc == INDEX_op_nopn) {
+        return args[0];
+    }
+    return def->nb_args;
+}
+
 #endif /* CONFIG_COREMU */
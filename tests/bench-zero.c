@@ -0,0 +1,169 @@
+/* Zero detection microbenchmark */
+#include "../config-host.h"
+#include "../qemu-malloc.c"
+#include "../cutils.c"
+#include "../oslib-posix.c"
+#include "../trace.c"
+#ifdef CONFIG_SIMPLE_TRACE
+#include "../simpletrace.c"
+#endif
+
+#include <sys/time.h>
+
+#define BUF_SIZE (16 * 1024 * 1024)
+
+typedef size_t FindNonzeroFunc(const uint8_t *buf, size_t len);
+
+static struct {
+    const char *name;
+    FindNonzeroFunc *fn;
+} kernels[] = {
+    { "generic", find_nonzero_generic },
+#ifdef __SSE2__
+    { "sse2", find_nonzero_sse2 },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", find_nonzero_avx2 },
+#endif
+};
+static int nb_kernels = ARRAY_SIZE(kernels);
+
+/* The entry point, with the kernel picked for the host and the length */
+static size_t find_nonzero_selected(const uint8_t *buf, size_t len)
+{
+    return buffer_find_nonzero(buf, len);
+}
+
+static const size_t sizes[] = { 512, 1024, 2048, 4096, 65536, 2 * 1024 * 1024 };
+
+static double now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Returns the throughput of 'fn' over zeroed buffers of 'size' bytes */
+static double bench(FindNonzeroFunc *fn, const uint8_t *buf, size_t size)
+{
+    size_t total = 0, off;
+    double start, elapsed;
+    int rounds = 0;
+
+    start = now();
+    do {
+        for (off = 0; off + size <= BUF_SIZE; off += size) {
+            if (fn(buf + off, size) != size) {
+                fprintf(stderr, "FATAL: non-zero byte in a zero buffer\n");
+                exit(1);
+            }
+            total += size;
+        }
+        rounds++;
+        elapsed = now() - start;
+    } while (elapsed < 0.5 || rounds < 2);
+
+    return total / elapsed / (1024 * 1024);
+}
+
+/* All kernels must find the byte at 'pos', or none if it is 'len' */
+static int check_one(uint8_t *buf, size_t off, size_t len, size_t pos)
+{
+    int i, ret = 0;
+
+    if (pos < len) {
+        buf[off + pos] = 0x80;
+    }
+    for (i = 0; i < nb_kernels && !ret; i++) {
+        size_t found = kernels[i].fn(buf + off, len);
+        if (found != pos) {
+            fprintf(stderr, "%s: offset %zd length %zd: "
+                    "found %zd instead of %zd\n", kernels[i].name,
+                    off, len, found, pos);
+            ret = 1;
+        }
+    }
+    if (pos < len) {
+        buf[off + pos] = 0;
+    }
+    return ret;
+}
+
+/* Lengths around and well past FIND_NONZERO_SSE2_MIN and
+   FIND_NONZERO_AVX2_MIN, so that the vector loops run and leave every kind
+   of tail */
+static const size_t long_lens[] = {
+    2047, 2048, 2049, 2111, 3000, 4095, 4096, 4097, 4159, 6000, 8191, 8192, 8193, 8255, 12345, 16447,
+};
+
+static int check(uint8_t *buf)
+{
+    size_t off, len, pos;
+    int i;
+
+    for (off = 0; off < 64; off += 3) {
+        for (len = 0; len < 1024; len += 37) {
+            for (pos = 0; pos <= len; pos += 5) {
+                if (check_one(buf, off, len, MIN(pos, len))) {
+                    return 1;
+                }
+            }
+        }
+    }
+
+    for (off = 0; off < 64; off += 7) {
+        for (i = 0; i < ARRAY_SIZE(long_lens); i++) {
+            len = long_lens[i];
+            /* the start, one in each 4K, and every byte of the tail */
+            for (pos = 0; pos < len - 160; pos += pos < 64 ? 1 : 4093) {
+                if (check_one(buf, off, len, pos)) {
+                    return 1;
+                }
+            }
+            for (pos = len - 160; pos <= len; pos++) {
+                if (check_one(buf, off, len, pos)) {
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *buf;
+    int i, j;
+
+#ifdef CONFIG_AVX2_OPT
+    /* the last kernel cannot run on this host */
+    if (find_nonzero_fn != find_nonzero_avx2) {
+        nb_kernels--;
+    }
+#endif
+
+    buf = qemu_mallocz(BUF_SIZE);
+
+    if (check(buf)) {
+        return 1;
+    }
+
+    printf("%-10s", "size");
+    for (i = 0; i < nb_kernels; i++) {
+        printf("%12s", kernels[i].name);
+    }
+    printf("%12s\n", "selected");
+
+    for (j = 0; j < ARRAY_SIZE(sizes); j++) {
+        printf("%-10zd", sizes[j]);
+        for (i = 0; i < nb_kernels; i++) {
+            printf("%10.0f/s", bench(kernels[i].fn, buf, sizes[j]));
+        }
+        printf("%10.0f/s\n", bench(find_nonzero_selected, buf, sizes[j]));
+    }
+    printf("(MB/s)\n");
+
+    qemu_free(buf);
+    return 0;
+}
@@ -0,0 +1,70 @@
+#!/bin/sh
+#
+# qcow2 metadata written back in batches: allocating writes, snapshot
+# creation over them, copy on write and reverting must leave a consistent
+# image with the data where it was written.
+#
+# Usage: qcow2-writeback.sh [qemu-img [qemu-io]]
+
+QEMU_IMG=${1:-../qemu-img}
+QEMU_IO=${2:-../qemu-io}
+img=$(mktemp /tmp/qcow2-writeback.XXXXXX)
+out=$img.out
+trap 'rm -f $img $out' EXIT
+
+fail()
+{
+    echo "qcow2-writeback: $*"
+    cat $out
+    exit 1
+}
+
+check()
+{
+    $QEMU_IMG check $img > $out 2>&1 || fail "check $*"
+}
+
+# io [-w] cmd... runs the aio commands and waits for them
+io()
+{
+    opt=
+    if [ "$1" = "-w" ]; then
+        opt=-w
+        shift
+    fi
+    set -- "$@" -c aio_flush
+    $QEMU_IO $opt "$@" $img > $out 2>&1
+    if grep -q "failed\|error" $out; then
+        fail "qemu-io $*"
+    fi
+}
+
+$QEMU_IMG create -f qcow2 $img 128M > /dev/null || exit 1
+
+# one allocation per command, so that the metadata of each is batched
+cmds=
+i=0
+while [ $i -lt 256 ]; do
+    cmds="$cmds -c \"aio_write -q -P 1 $((i * 64))k 64k\""
+    i=$((i + 1))
+done
+eval io -w $cmds -c \"aio_write -q -P 2 64M 1M\"
+check "after the first writes"
+
+$QEMU_IMG snapshot -c s1 $img > $out 2>&1 || fail "snapshot -c"
+check "after snapshot -c"
+
+# copy on write of clusters shared with the snapshot
+io -w -c "aio_write -q -P 3 0 8M" -c "aio_write -q -P 4 64M 64k"
+check "after the copy on write"
+io -c "aio_read -q -P 3 0 8M" -c "aio_read -q -P 1 8M 8M" \
+   -c "aio_read -q -P 4 64M 64k" -c "aio_read -q -P 2 65600k 960k"
+
+$QEMU_IMG snapshot -a s1 $img > $out 2>&1 || fail "snapshot -a"
+check "after snapshot -a"
+io -c "aio_read -q -P 1 0 16M" -c "aio_read -q -P 2 64M 1M"
+
+$QEMU_IMG snapshot -d s1 $img > $out 2>&1 || fail "snapshot -d"
+check "after snapshot -d"
+
+echo "qcow2-writeback: OK"
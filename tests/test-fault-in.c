@@ -0,0 +1,139 @@
+/*
+ * Faulting in a multi-page DMA mapping before it goes to a syscall, the way
+ * cpu_physical_memory_map() does while post-copy migration runs
+ */
+#include "../config-host.h"
+#include "../qemu-malloc.c"
+#include "../cutils.c"
+#include "../oslib-posix.c"
+#include "../trace.c"
+#ifdef CONFIG_SIMPLE_TRACE
+#include "../simpletrace.c"
+#endif
+
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#define NB_PAGES 8
+
+static uint8_t *guest;
+static size_t page_size;
+static int faults;
+
+/* Opens the page like the post-copy receive thread, with its contents */
+static void sigsegv(int sig, siginfo_t *info, void *ctx)
+{
+    uint8_t *page = (uint8_t *)((uintptr_t)info->si_addr & ~(page_size - 1));
+
+    if (page < guest || page >= guest + NB_PAGES * page_size) {
+        abort();
+    }
+    mprotect(page, page_size, PROT_READ | PROT_WRITE);
+    memset(page, (page - guest) / page_size + 1, page_size);
+    faults++;
+}
+
+static void reset(void)
+{
+    mprotect(guest, NB_PAGES * page_size, PROT_NONE);
+    faults = 0;
+}
+
+/* Writes [off, off + len) of guest memory to a pipe, like a DMA read */
+static int check_writev(size_t off, size_t len, int fault_in)
+{
+    struct iovec iov = { guest + off, len };
+    uint8_t *out = qemu_malloc(len);
+    int fds[2], first, last;
+    ssize_t ret;
+    size_t i;
+
+    reset();
+    if (fault_in) {
+        fault_in_pages(guest + off, len, page_size);
+    }
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        exit(1);
+    }
+    ret = writev(fds[1], &iov, 1);
+    if (!fault_in) {
+        close(fds[0]);
+        close(fds[1]);
+        qemu_free(out);
+        /* the first page isn't there, so nothing is written */
+        return ret == -1 && errno == EFAULT ? 0 : 1;
+    }
+    if (ret != len || read(fds[0], out, len) != len) {
+        fprintf(stderr, "writev of %zd bytes at %zd: %zd\n", len, off, ret);
+        return 1;
+    }
+    close(fds[0]);
+    close(fds[1]);
+
+    first = off / page_size;
+    last = (off + len - 1) / page_size;
+    if (faults != last - first + 1) {
+        fprintf(stderr, "%d faults for pages %d-%d\n", faults, first, last);
+        return 1;
+    }
+    for (i = 0; i < len; i++) {
+        if (out[i] != (off + i) / page_size + 1) {
+            fprintf(stderr, "byte %zd: %d\n", off + i, out[i]);
+            return 1;
+        }
+    }
+    qemu_free(out);
+    return 0;
+}
+
+/* Reads a file into [off, off + len) of guest memory, like a DMA write */
+static int check_read(size_t off, size_t len)
+{
+    int fd = open("/dev/zero", O_RDONLY);
+    ssize_t ret;
+
+    reset();
+    fault_in_pages(guest + off, len, page_size);
+    ret = read(fd, guest + off, len);
+    close(fd);
+    if (ret != len) {
+        fprintf(stderr, "read of %zd bytes at %zd: %zd\n", len, off, ret);
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    struct sigaction act;
+
+    page_size = getpagesize();
+    guest = mmap(NULL, NB_PAGES * page_size, PROT_NONE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (guest == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    memset(&act, 0, sizeof(act));
+    act.sa_sigaction = sigsegv;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSEGV, &act, NULL);
+
+    if (check_writev(0, 3 * page_size, 0) ||
+        check_writev(0, page_size, 1) ||
+        check_writev(0, NB_PAGES * page_size, 1) ||
+        check_writev(page_size / 2, 3 * page_size, 1) ||
+        check_writev(page_size - 1, 2, 1) ||
+        check_writev(3 * page_size + 17, 4 * page_size - 100, 1) ||
+        check_read(0, NB_PAGES * page_size) ||
+        check_read(page_size + 512, 5 * page_size)) {
+        return 1;
+    }
+
+    printf("fault-in: OK\n");
+    return 0;
+}
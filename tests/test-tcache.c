@@ -0,0 +1,230 @@
+/*
+ * Translation cache shared by processes: blocks stored by one process are
+ * hits in the next, and once another executable has reset the file, a
+ * process that opened it before must miss instead of loading its entries
+ */
+#include "../cm-tcache.c"
+
+#include <sys/wait.h>
+
+#define RAM_PAGES   4
+#define NB_BLOCKS   32
+
+/* what the cache uses from the rest of the emulator */
+COREMU_THREAD TCGContext tcg_ctx;
+COREMU_THREAD uint16_t gen_opc_buf[OPC_BUF_SIZE];
+COREMU_THREAD TCGArg gen_opparam_buf[OPPARAM_BUF_SIZE];
+COREMU_THREAD uint16_t *gen_opc_ptr;
+COREMU_THREAD TCGArg *gen_opparam_ptr;
+int use_icount;
+
+static TCGTemp temps[TCG_MAX_TEMPS];
+static uint8_t ram[RAM_PAGES * TARGET_PAGE_SIZE];
+static CPUState env;
+
+int gen_new_label(void)
+{
+    return tcg_ctx.nb_labels++;
+}
+
+int cm_tcg_op_nb_args(int opc, const TCGArg *args)
+{
+    switch (opc) {
+    case INDEX_op_movi_i64:
+        return 2;
+    case INDEX_op_exit_tb:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+void *qemu_safe_ram_ptr(ram_addr_t addr)
+{
+    return ram + addr;
+}
+
+ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
+{
+    return (uint8_t *)ptr - ram;
+}
+
+/* Guest virtual addresses are RAM offsets, all mapped for code */
+static void map_ram(void)
+{
+    target_ulong addr;
+    int i;
+
+    QTAILQ_INIT(&env.breakpoints);
+    for (i = 0; i < RAM_PAGES; i++) {
+        addr = i * TARGET_PAGE_SIZE;
+        env.tlb_table[0][i].addr_code = addr;
+        env.tlb_table[0][i].addend = (unsigned long)ram - addr;
+    }
+    for (i = 0; i < sizeof(ram); i++) {
+        ram[i] = i * 7;
+    }
+}
+
+/* The front end of 'binary': a block loads a constant and exits */
+static void translate(TranslationBlock *tb, int binary)
+{
+    TCGContext *s = &tcg_ctx;
+
+    gen_opc_ptr = gen_opc_buf;
+    gen_opparam_ptr = gen_opparam_buf;
+    *gen_opc_ptr++ = INDEX_op_movi_i64;
+    *gen_opparam_ptr++ = s->nb_globals;
+    *gen_opparam_ptr++ = tb->pc * 16 + binary;
+    *gen_opc_ptr++ = INDEX_op_exit_tb;
+    *gen_opparam_ptr++ = 0;
+    s->temps[s->nb_globals].base_type = TCG_TYPE_I64;
+    s->temps[s->nb_globals].type = TCG_TYPE_I64;
+    s->nb_temps = s->nb_globals + 1;
+    tb->size = 16;
+    tb->icount = 1;
+}
+
+/* Runs every block once like cpu_gen_code; returns -1 if a block loaded
+   from the cache isn't the one 'binary' translates */
+static int run(int binary)
+{
+    TranslationBlock tb;
+    int i;
+
+    for (i = 0; i < NB_BLOCKS; i++) {
+        memset(&tb, 0, sizeof(tb));
+        /* the first ones cross into the next page */
+        if (i < RAM_PAGES - 1) {
+            tb.pc = (i + 1) * TARGET_PAGE_SIZE - 8;
+        } else {
+            tb.pc = i * 64;
+        }
+        tb.jmp_pc[0] = tb.jmp_pc[1] = -1;
+        tcg_ctx.nb_temps = tcg_ctx.nb_globals;
+        tcg_ctx.nb_labels = 0;
+        if (!cm_tcache_load(&env, &tb)) {
+            translate(&tb, binary);
+            cm_tcache_store(&env, &tb);
+        } else if (gen_opparam_buf[1] != tb.pc * 16 + binary ||
+                   tb.size != 16) {
+            fprintf(stderr, "binary %d: block %d comes from binary %d\n",
+                    binary, i, (int)(gen_opparam_buf[1] & 15));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int check(const char *what, int binary, uint64_t hits,
+                 uint64_t misses, uint64_t stores)
+{
+    cm_tcache_hits = cm_tcache_misses = cm_tcache_stores = 0;
+    if (run(binary) < 0) {
+        return 1;
+    }
+    if (cm_tcache_hits != hits || cm_tcache_misses != misses ||
+        cm_tcache_stores != stores) {
+        fprintf(stderr, "%s: %" PRIu64 " hits, %" PRIu64 " misses, %"
+                PRIu64 " stores instead of %" PRIu64 ", %" PRIu64 ", %"
+                PRIu64 "\n", what, cm_tcache_hits, cm_tcache_misses,
+                cm_tcache_stores, hits, misses, stores);
+        return 1;
+    }
+    return 0;
+}
+
+static const char *filename;
+static int unmapped_page = -1;
+
+/* Opens the file in a new process; binary 1 is this executable, binary 2
+   stands for another one */
+static void open_cache(int binary)
+{
+    if (cm_tcache_init(filename, 4 * 1024 * 1024) < 0) {
+        exit(1);
+    }
+    if (binary == 2) {
+        cm_tcache_id ^= 1;
+        cm_tcache_check_build();
+    }
+}
+
+static int wait_child(pid_t pid)
+{
+    int status;
+
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+static pid_t child(int binary, const char *what, uint64_t hits,
+                   uint64_t misses, uint64_t stores)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        if (unmapped_page >= 0) {
+            env.tlb_table[0][unmapped_page].addr_code = -1;
+        }
+        open_cache(binary);
+        exit(check(what, binary, hits, misses, stores));
+    }
+    return pid;
+}
+
+int main(int argc, char **argv)
+{
+    char path[] = "/tmp/test-tcache.XXXXXX";
+    int ready[2], resume[2], ret = 1;
+    pid_t first;
+    char c;
+
+    tcg_ctx.temps = temps;
+    tcg_ctx.nb_globals = 1;
+    map_ram();
+    filename = path;
+    close(mkstemp(path));
+    if (pipe(ready) < 0 || pipe(resume) < 0) {
+        perror("pipe");
+        return 1;
+    }
+
+    /* the first process stays around while another executable takes the
+       file over, then runs the blocks again */
+    first = fork();
+    if (first == 0) {
+        open_cache(1);
+        if (check("first run", 1, 0, NB_BLOCKS, NB_BLOCKS)) {
+            exit(1);
+        }
+        if (write(ready[1], "x", 1) != 1 || read(resume[0], &c, 1) != 1) {
+            exit(1);
+        }
+        exit(check("after the reset", 1, 0, NB_BLOCKS, 0));
+    }
+    /* so that the read fails if the first process exits */
+    close(ready[1]);
+    if (read(ready[0], &c, 1) != 1 ||
+        wait_child(child(1, "second process", NB_BLOCKS, 0, 0)) ||
+        wait_child(child(2, "other executable", 0, NB_BLOCKS, NB_BLOCKS)) ||
+        write(resume[1], "x", 1) != 1 ||
+        wait_child(first) ||
+        wait_child(child(1, "back to the first executable",
+                         0, NB_BLOCKS, NB_BLOCKS)) ||
+        wait_child(child(1, "and again", NB_BLOCKS, 0, 0))) {
+        goto out;
+    }
+
+    /* the block that goes on in page 2 and the one in it are misses, the
+       cache doesn't fault the page in */
+    unmapped_page = 2;
+    if (wait_child(child(1, "page not mapped", NB_BLOCKS - 2, 2, 0))) {
+        goto out;
+    }
+    printf("tcache: OK\n");
+    ret = 0;
+out:
+    unlink(path);
+    return ret;
+}
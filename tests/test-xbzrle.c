@@ -0,0 +1,173 @@
+/*
+ * Delta encoding round trips: xbzrle_decode of the output of xbzrle_encode
+ * must turn the old page into the new one, and an encoding that doesn't
+ * fit its buffer must fail rather than be cut short
+ */
+#include "../config-host.h"
+#include "../xbzrle.c"
+
+#define PAGE_SIZE 4096
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void)
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 16;
+}
+
+/* Encodes new against old, with buffers offset by 'align', and decodes it */
+static int check(const uint8_t *old_page, const uint8_t *new_page,
+                 int align, const char *what)
+{
+    static uint8_t old_buf[PAGE_SIZE + 8], new_buf[PAGE_SIZE + 8];
+    static uint8_t enc[PAGE_SIZE * 2], dst[PAGE_SIZE];
+    uint8_t *o = old_buf + align, *n = new_buf + (align * 3) % 8;
+    int len, ret;
+
+    memcpy(o, old_page, PAGE_SIZE);
+    memcpy(n, new_page, PAGE_SIZE);
+
+    len = xbzrle_encode(o, n, PAGE_SIZE, enc, sizeof(enc));
+    if (len < 0) {
+        fprintf(stderr, "%s: encoding failed\n", what);
+        return 1;
+    }
+    if (!memcmp(old_page, new_page, PAGE_SIZE) != !len) {
+        fprintf(stderr, "%s: %d bytes for %s pages\n", what, len,
+                len ? "equal" : "different");
+        return 1;
+    }
+
+    memcpy(dst, old_page, PAGE_SIZE);
+    ret = xbzrle_decode(enc, len, dst, PAGE_SIZE);
+    if (ret < 0 || memcmp(dst, new_page, PAGE_SIZE)) {
+        fprintf(stderr, "%s: decoding failed (%d)\n", what, ret);
+        return 1;
+    }
+
+    /* exactly len bytes are enough, one less is not */
+    if (len && (xbzrle_encode(o, n, PAGE_SIZE, enc, len) != len ||
+                xbzrle_encode(o, n, PAGE_SIZE, enc, len - 1) != -1)) {
+        fprintf(stderr, "%s: wrong length limit\n", what);
+        return 1;
+    }
+
+    /* a truncated encoding never writes past the page */
+    for (ret = 1; ret < len; ret++) {
+        memcpy(dst, old_page, PAGE_SIZE);
+        if (xbzrle_decode(enc, ret, dst, PAGE_SIZE) > PAGE_SIZE) {
+            fprintf(stderr, "%s: prefix of %d bytes overflows\n", what, ret);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int check_overflow(void)
+{
+    uint8_t old_page[PAGE_SIZE], new_page[PAGE_SIZE], enc[PAGE_SIZE];
+    int i;
+
+    /* every byte changed: the encoding can't fit in a page */
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_page[i] = rnd();
+        new_page[i] = ~old_page[i];
+    }
+    if (xbzrle_encode(old_page, new_page, PAGE_SIZE, enc, PAGE_SIZE) != -1) {
+        fprintf(stderr, "overflow: a full page change fits in a page\n");
+        return 1;
+    }
+    if (xbzrle_encode(old_page, new_page, PAGE_SIZE, enc, 0) != -1) {
+        fprintf(stderr, "overflow: empty buffer\n");
+        return 1;
+    }
+
+    /* a byte changed at 200 takes four: two for the unchanged length, one
+       for the changed length and the byte itself */
+    memcpy(new_page, old_page, PAGE_SIZE);
+    new_page[200] ^= 1;
+    if (xbzrle_encode(old_page, new_page, PAGE_SIZE, enc, 2) != -1 ||
+        xbzrle_encode(old_page, new_page, PAGE_SIZE, enc, 3) != -1 ||
+        xbzrle_encode(old_page, new_page, PAGE_SIZE, enc, 4) != 4) {
+        fprintf(stderr, "overflow: single byte change\n");
+        return 1;
+    }
+    return 0;
+}
+
+static int check_corrupted(void)
+{
+    uint8_t dst[PAGE_SIZE];
+    /* unchanged run past the end of the page */
+    static const uint8_t past_end[] = { 0x80, 0x40, 0x01, 0xaa };
+    /* empty changed run */
+    static const uint8_t empty_run[] = { 0x00, 0x00 };
+    /* changed run longer than the data */
+    static const uint8_t short_data[] = { 0x00, 0x04, 0xaa, 0xbb };
+    /* length that doesn't end */
+    static const uint8_t long_len[] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0x01 };
+
+    if (xbzrle_decode(past_end, sizeof(past_end), dst, PAGE_SIZE) != -1 ||
+        xbzrle_decode(empty_run, sizeof(empty_run), dst, PAGE_SIZE) != -1 ||
+        xbzrle_decode(short_data, sizeof(short_data), dst, PAGE_SIZE) != -1 ||
+        xbzrle_decode(long_len, sizeof(long_len), dst, PAGE_SIZE) != -1) {
+        fprintf(stderr, "corrupted encodings are accepted\n");
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t old_page[PAGE_SIZE], new_page[PAGE_SIZE];
+    char what[64];
+    int i, j, align;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old_page[i] = rnd();
+    }
+
+    memcpy(new_page, old_page, PAGE_SIZE);
+    if (check(old_page, new_page, 0, "equal")) {
+        return 1;
+    }
+
+    /* first and last bytes, runs across words, one byte gaps, and runs
+       whose lengths take more than one ULEB128 byte */
+    new_page[0] ^= 0xff;
+    new_page[PAGE_SIZE - 1] ^= 0xff;
+    new_page[7] ^= 1;
+    new_page[9] ^= 1;
+    memset(new_page + 1000, 0x5a, 300);
+    new_page[3000] ^= 0x10;
+    for (align = 0; align < 8; align++) {
+        snprintf(what, sizeof(what), "edges, alignment %d", align);
+        if (check(old_page, new_page, align, what)) {
+            return 1;
+        }
+    }
+
+    for (i = 0; i < 1000; i++) {
+        memcpy(new_page, old_page, PAGE_SIZE);
+        for (j = rnd() % 64; j > 0; j--) {
+            int start = rnd() % PAGE_SIZE;
+            int len = rnd() % 64 + 1;
+
+            while (len-- && start < PAGE_SIZE) {
+                new_page[start++] = rnd();
+            }
+        }
+        snprintf(what, sizeof(what), "random %d", i);
+        if (check(old_page, new_page, i % 8, what)) {
+            return 1;
+        }
+    }
+
+    if (check_overflow() || check_corrupted()) {
+        return 1;
+    }
+
+    printf("xbzrle: OK\n");
+    return 0;
+}
@@ -32,6 +32,7 @@
 #include "qemu-timer.h"
 
 #include "coremu-config.h"
+#include "cm-tcache.h"
 
 /* code generation context */
 COREMU_THREAD TCGContext tcg_ctx;
@@ -72,7 +73,14 @@ int cpu_gen_code(CPUState *env, TranslationBlock *tb, int *gen_code_size_ptr)
 #endif
     tcg_func_start(s);
 
+#ifdef CONFIG_COREMU
+    if (!cm_tcache_load(env, tb)) {
+        gen_intermediate_code(env, tb);
+        cm_tcache_store(env, tb);
+    }
+#else
     gen_intermediate_code(env, tb);
+#endif
 
     /* generate machine code */
     gen_code_buf = tb->tc_ptr;
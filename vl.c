@@ -1964,6 +1964,7 @@ int main(int argc, char **argv, char **envp)
     QEMUMachine *machine;
     const char *cpu_model;
     int tb_size;
+    const char *tcache_file = NULL;
     const char *pid_file = NULL;
     const char *incoming = NULL;
     int show_vnc_port = 0;
@@ -2699,6 +2700,17 @@ int main(int argc, char **argv, char **envp)
                 if (tb_size < 0)
                     tb_size = 0;
                 break;
+            case QEMU_OPTION_tcache:
+                tcache_file = optarg;
+                break;
+#ifdef CONFIG_COREMU
+            case QEMU_OPTION_translate_threads:
+                cm_spec_nb_threads = strtol(optarg, NULL, 0);
+                if (cm_spec_nb_threads < 0) {
+                    cm_spec_nb_threads = 0;
+                }
+                break;
+#endif
             case QEMU_OPTION_icount:
                 icount_option = optarg;
                 break;
@@ -2953,6 +2965,10 @@ int main(int argc, char **argv, char **envp)
     /* init the dynamic translator */
 #ifdef CONFIG_COREMU
     cm_cpu_exec_init();
+    if (tcache_file &&
+        cm_tcache_init(tcache_file, CM_TCACHE_DEFAULT_SIZE) < 0) {
+        exit(1);
+    }
 #else
     cpu_exec_init_all(tb_size * 1024 * 1024);
 #endif
@@ -0,0 +1,133 @@
+/*
+ * Delta encoding of RAM pages for migration
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+/*
+ * A page is encoded against the copy that was sent before as a list of
+ *
+ *     <unchanged run length> <changed run length> <changed bytes>
+ *
+ * with both lengths in ULEB128 form.  The unchanged bytes after the last
+ * changed run are not encoded.  Equal parts are skipped a word at a time,
+ * and a single unchanged byte inside a changed run doesn't end it, as two
+ * length bytes would cost more than the byte itself.
+ */
+
+#include "qemu-common.h"
+#include "xbzrle.h"
+
+static int uleb128_encode(uint8_t *dst, int dlen, uint32_t val)
+{
+    int n = 0;
+
+    do {
+        if (n >= dlen) {
+            return -1;
+        }
+        dst[n] = (val & 0x7f) | (val >= 0x80 ? 0x80 : 0);
+        val >>= 7;
+        n++;
+    } while (val);
+    return n;
+}
+
+static int uleb128_decode(const uint8_t *src, int slen, uint32_t *val)
+{
+    int n = 0;
+
+    *val = 0;
+    do {
+        if (n >= slen || n >= 5) {
+            return -1;
+        }
+        *val |= (uint32_t)(src[n] & 0x7f) << (7 * n);
+    } while (src[n++] & 0x80);
+    return n;
+}
+
+/*
+ * Returns the length of the encoding of new_buf against old_buf, 0 if they
+ * are equal, or -1 if it would take more than dlen bytes.
+ */
+int xbzrle_encode(const uint8_t *old_buf, const uint8_t *new_buf, int len,
+                  uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0, n, start, zrun;
+
+    while (i < len) {
+        /* unchanged run */
+        start = i;
+        while (i < len && old_buf[i] == new_buf[i] &&
+               ((uintptr_t)(old_buf + i) | (uintptr_t)(new_buf + i)) %
+               sizeof(long)) {
+            i++;
+        }
+        if (!(((uintptr_t)(old_buf + i) | (uintptr_t)(new_buf + i)) %
+              sizeof(long))) {
+            while (i + sizeof(long) <= len &&
+                   *(const long *)(old_buf + i) ==
+                   *(const long *)(new_buf + i)) {
+                i += sizeof(long);
+            }
+        }
+        while (i < len && old_buf[i] == new_buf[i]) {
+            i++;
+        }
+        if (i == len) {
+            break;
+        }
+        zrun = i - start;
+
+        /* changed run */
+        start = i;
+        while (i < len && (old_buf[i] != new_buf[i] ||
+                           (i + 1 < len && old_buf[i + 1] != new_buf[i + 1]))) {
+            i++;
+        }
+
+        n = uleb128_encode(dst + d, dlen - d, zrun);
+        if (n < 0) {
+            return -1;
+        }
+        d += n;
+        n = uleb128_encode(dst + d, dlen - d, i - start);
+        if (n < 0 || d + n + i - start > dlen) {
+            return -1;
+        }
+        d += n;
+        memcpy(dst + d, new_buf + start, i - start);
+        d += i - start;
+    }
+    return d;
+}
+
+/* Applies an encoding to dst, returns -1 if it is corrupted */
+int xbzrle_decode(const uint8_t *src, int slen, uint8_t *dst, int dlen)
+{
+    int i = 0, d = 0, n;
+    uint32_t zrun, nzrun;
+
+    while (i < slen) {
+        n = uleb128_decode(src + i, slen - i, &zrun);
+        if (n < 0 || zrun > dlen - d) {
+            return -1;
+        }
+        i += n;
+        d += zrun;
+
+        n = uleb128_decode(src + i, slen - i, &nzrun);
+        if (n < 0 || nzrun == 0 || nzrun > dlen - d || nzrun > slen - i - n) {
+            return -1;
+        }
+        i += n;
+        memcpy(dst + d, src + i, nzrun);
+        i += nzrun;
+        d += nzrun;
+    }
+    return d;
+}
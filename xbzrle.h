@@ -0,0 +1,19 @@
+/*
+ * Delta encoding of RAM pages for migration
+ *
+ * Copyright (c) 2026 COREMU-QEMU contributors
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_XBZRLE_H
+#define QEMU_XBZRLE_H
+
+#include <stdint.h>
+
+int xbzrle_encode(const uint8_t *old_buf, const uint8_t *new_buf, int len,
+                  uint8_t *dst, int dlen);
+int xbzrle_decode(const uint8_t *src, int slen, uint8_t *dst, int dlen);
+
+#endif /* QEMU_XBZRLE_H */